@@ -0,0 +1,124 @@
+// Counts heap allocations on the thread running a Service while it serves
+// keep-alive requests over loopback. Once a connection is established the
+// request path should not allocate; the exit status is 1 if it does.
+//
+// Usage: alloc_bench [connections] [port] [io_uring]
+//
+// With a third argument of 1 the Service uses io_uring, see IoUring.
+
+#include "apee.hpp"
+
+#include <boost/asio.hpp>
+
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <thread>
+#include <vector>
+
+namespace {
+
+thread_local std::uint64_t allocations = 0;
+
+}  // namespace
+
+void *operator new(std::size_t size) {
+  ++allocations;
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+using namespace apee;
+using tcp = boost::asio::ip::tcp;
+
+namespace {
+
+// Requests per connection, below the limit after which the server closes.
+constexpr unsigned int requests_per_connection = 90;
+
+// Records the allocation count of the server thread at every request.
+struct Handler : public AbstractRequestHandler {
+  std::vector<std::uint64_t> counts;
+
+  Response on_request(Request const &) override {
+    counts.push_back(allocations);
+    return Response(StatusCode::OK, MessageBody("Hello from Handler!\n"));
+  }
+};
+
+void send_requests(unsigned short port, unsigned int count) {
+  boost::asio::io_context ioc;
+  tcp::socket socket{ioc};
+  socket.connect({boost::asio::ip::make_address("127.0.0.1"), port});
+  std::string const request = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  std::string response;
+  for (unsigned int i = 0; i < count; ++i) {
+    boost::asio::write(socket, boost::asio::buffer(request));
+    // The body is the last thing in every response.
+    while (response.find("Handler!\n") == std::string::npos) {
+      char data[1024];
+      response.append(data, socket.read_some(boost::asio::buffer(data)));
+    }
+    response.clear();
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  unsigned int connections = argc > 1 ? std::atoi(argv[1]) : 4;
+  unsigned short port = argc > 2 ? std::atoi(argv[2]) : 18280;
+  bool io_uring = argc > 3 && std::atoi(argv[3]) != 0;
+
+  setenv("LOG", "critical", 1);
+  auto handler = std::make_shared<Handler>();
+  handler->counts.reserve(connections * requests_per_connection + 1);
+  std::thread server([&] {
+    Config config;
+    config.address = "127.0.0.1";
+    config.port = port;
+    config.io_uring.enabled = io_uring;
+    Service service(config, handler);
+    service.run();
+  });
+  server.detach();
+  for (int attempt = 0; attempt < 500; ++attempt) {
+    try {
+      send_requests(port, 1);
+      break;
+    } catch (std::exception const &) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+  handler->counts.clear();
+  for (unsigned int i = 0; i < connections; ++i) {
+    send_requests(port, requests_per_connection);
+  }
+
+  // Counts are taken when a request reaches the handler, so the difference
+  // between two requests covers one full read, dispatch and write cycle.
+  auto const &counts = handler->counts;
+  std::uint64_t steady = 0, setup = 0;
+  for (unsigned int c = 0; c < connections; ++c) {
+    auto first = c * requests_per_connection;
+    steady += counts[first + requests_per_connection - 1] - counts[first + 1];
+    if (c > 0) {
+      setup += counts[first] - counts[first - 1];
+    }
+  }
+  double per_request =
+      double(steady) / (connections * (requests_per_connection - 2));
+  std::cout << "allocations per request:    " << per_request << '\n';
+  if (connections > 1) {
+    std::cout << "allocations per connection: "
+              << double(setup) / (connections - 1) << '\n';
+  }
+  std::cout.flush();
+  std::_Exit(steady == 0 ? 0 : 1);
+}
@@ -0,0 +1,116 @@
+// CPU cost against bytes saved of the response encodings at different
+// levels. Each benchmark reports the input throughput and, as counters, the
+// compressed size relative to the input ("ratio") and the bytes saved per
+// response.
+
+#include "compression.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+using namespace apee;
+
+namespace {
+
+// A JSON array of records, typical of API responses.
+std::string json_body(std::size_t size) {
+  std::string body = "[";
+  for (int i = 0; body.size() < size; ++i) {
+    body += "{\"id\":" + std::to_string(i) + ",\"name\":\"item " +
+            std::to_string(i * 7919 % 1000) +
+            "\",\"active\":" + (i % 3 ? "true" : "false") +
+            ",\"tags\":[\"a\",\"b\"],\"score\":" +
+            std::to_string(i * 31 % 97) + "." + std::to_string(i % 10) + "},";
+  }
+  body.back() = ']';
+  return body;
+}
+
+void report(benchmark::State &state, std::size_t input, std::size_t output) {
+  state.SetBytesProcessed(
+      static_cast<std::int64_t>(state.iterations() * input));
+  state.counters["ratio"] =
+      static_cast<double>(output) / static_cast<double>(input);
+  state.counters["saved"] = static_cast<double>(input - output);
+}
+
+// One response body compressed at once, as for string payloads.
+void BM_Compress(benchmark::State &state, Encoding encoding) {
+  auto body = json_body(static_cast<std::size_t>(state.range(1)));
+  auto level = static_cast<int>(state.range(0));
+  std::string out;
+  for (auto _ : state) {
+    out.clear();
+    Compressor::acquire(encoding, level, body.size())
+        ->compress(body, true, out);
+    benchmark::DoNotOptimize(out.data());
+  }
+  report(state, body.size(), out.size());
+}
+
+// The same body produced in 1 KiB chunks, each flushed as for StreamBody
+// payloads.
+void BM_CompressStream(benchmark::State &state, Encoding encoding) {
+  auto body = json_body(static_cast<std::size_t>(state.range(1)));
+  auto level = static_cast<int>(state.range(0));
+  constexpr std::size_t chunk = 1024;
+  std::string out;
+  for (auto _ : state) {
+    out.clear();
+    auto compressor = Compressor::acquire(encoding, level);
+    for (std::size_t pos = 0; pos < body.size(); pos += chunk) {
+      compressor->compress(std::string_view(body).substr(pos, chunk),
+                           pos + chunk >= body.size(),
+                           out);
+    }
+    benchmark::DoNotOptimize(out.data());
+  }
+  report(state, body.size(), out.size());
+}
+
+void ZlibLevels(benchmark::internal::Benchmark *benchmark) {
+  for (int size : {4 << 10, 64 << 10}) {
+    for (int level : {1, 6, 9}) {
+      benchmark->Args({level, size});
+    }
+  }
+  benchmark->ArgNames({"level", "size"});
+}
+
+void BrotliQualities(benchmark::internal::Benchmark *benchmark) {
+  for (int size : {4 << 10, 64 << 10}) {
+    for (int quality : {1, 4, 6, 9, 11}) {
+      benchmark->Args({quality, size});
+    }
+  }
+  benchmark->ArgNames({"quality", "size"});
+}
+
+BENCHMARK_CAPTURE(BM_Compress, gzip, Encoding::Gzip)->Apply(ZlibLevels);
+BENCHMARK_CAPTURE(BM_Compress, deflate, Encoding::Deflate)
+    ->Args({6, 64 << 10})
+    ->ArgNames({"level", "size"});
+BENCHMARK_CAPTURE(BM_CompressStream, gzip, Encoding::Gzip)
+    ->Args({6, 64 << 10})
+    ->ArgNames({"level", "size"});
+
+void register_brotli() {
+  if (!brotli_supported()) {
+    return;
+  }
+  benchmark::RegisterBenchmark("BM_Compress/br", BM_Compress, Encoding::Brotli)
+      ->Apply(BrotliQualities);
+  benchmark::RegisterBenchmark(
+      "BM_CompressStream/br", BM_CompressStream, Encoding::Brotli)
+      ->Args({4, 64 << 10})
+      ->ArgNames({"quality", "size"});
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  register_brotli();
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+}
@@ -0,0 +1,118 @@
+// Microbenchmarks of the per-request conversions between Boost.Beast and
+// apee messages, and of the stream operators used when logging them.
+
+#include "apee.hpp"
+#include "beast.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <sstream>
+
+using namespace apee;
+namespace http = boost::beast::http;
+
+namespace {
+
+detail::BeastRequest make_request(std::size_t body_size) {
+  detail::BeastRequest req{
+      http::verb::post, "/api/v1/items?page=2", 11};
+  req.set(http::field::host, "localhost");
+  req.set(http::field::user_agent, "bench");
+  req.set(http::field::accept, "*/*");
+  req.set(http::field::content_type, "application/json");
+  req.body() = std::string(body_size, 'x');
+  req.prepare_payload();
+  return req;
+}
+
+void BM_FromBeast(benchmark::State &state) {
+  auto req = make_request(static_cast<std::size_t>(state.range(0)));
+  for (auto _ : state) {
+    auto request = detail::from_beast(req);
+    benchmark::DoNotOptimize(request);
+  }
+}
+BENCHMARK(BM_FromBeast)->Arg(0)->Arg(4096);
+
+void BM_FromBeastHeaderLookup(benchmark::State &state) {
+  auto req = make_request(0);
+  for (auto _ : state) {
+    auto request = detail::from_beast(req);
+    benchmark::DoNotOptimize(request.headers()["Content-Type"]);
+  }
+}
+BENCHMARK(BM_FromBeastHeaderLookup);
+
+void BM_FromBeastFieldLookup(benchmark::State &state) {
+  auto req = make_request(0);
+  for (auto _ : state) {
+    auto request = detail::from_beast(req);
+    benchmark::DoNotOptimize(request.headers()[Field::ContentType]);
+  }
+}
+BENCHMARK(BM_FromBeastFieldLookup);
+
+void BM_ToBeast(benchmark::State &state) {
+  std::string const body(static_cast<std::size_t>(state.range(0)), 'x');
+  detail::BeastResponse res;
+  for (auto _ : state) {
+    Response response(StatusCode::OK, MessageBody(body));
+    response.set_header("Content-Type", "text/plain");
+    response.set_header("Cache-Control", "no-cache");
+    res = {};
+    detail::to_beast(response, res);
+    benchmark::DoNotOptimize(res);
+  }
+}
+BENCHMARK(BM_ToBeast)->Arg(16)->Arg(4096);
+
+void BM_ToBeastFields(benchmark::State &state) {
+  std::string const body(static_cast<std::size_t>(state.range(0)), 'x');
+  detail::BeastResponse res;
+  for (auto _ : state) {
+    Response response(StatusCode::OK, MessageBody(body));
+    response.set_header(Field::ContentType, "text/plain");
+    response.set_header(Field::CacheControl, "no-cache");
+    res = {};
+    detail::to_beast(response, res);
+    benchmark::DoNotOptimize(res);
+  }
+}
+BENCHMARK(BM_ToBeastFields)->Arg(16)->Arg(4096);
+
+void BM_ToBeastOwnedBody(benchmark::State &state) {
+  detail::BeastResponse res;
+  for (auto _ : state) {
+    Response response(StatusCode::OK,
+                      std::string(static_cast<std::size_t>(state.range(0)),
+                                  'x'));
+    res = {};
+    detail::to_beast(response, res);
+    benchmark::DoNotOptimize(res);
+  }
+}
+BENCHMARK(BM_ToBeastOwnedBody)->Arg(16)->Arg(4096);
+
+void BM_MethodOstream(benchmark::State &state) {
+  std::ostringstream out;
+  for (auto _ : state) {
+    out.str({});
+    out << Method::OPTIONS;
+    benchmark::DoNotOptimize(out);
+  }
+}
+BENCHMARK(BM_MethodOstream);
+
+void BM_StatusCodeOstream(benchmark::State &state) {
+  std::ostringstream out;
+  for (auto _ : state) {
+    out.str({});
+    out << StatusCode::NotFound;
+    benchmark::DoNotOptimize(out);
+  }
+}
+BENCHMARK(BM_StatusCodeOstream);
+
+}  // namespace
+
+BENCHMARK_MAIN();
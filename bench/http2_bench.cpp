@@ -0,0 +1,105 @@
+// Throughput, latency and server CPU time per request of the same number of
+// requests in flight, sent over HTTP/1.1 with one connection per request and
+// over HTTP/2 multiplexed onto a few connections (see Http2).
+//
+// A Service accepting both is forked into a child process and driven by
+// closed-loop clients: HTTP/1.1 on `concurrency` persistent connections,
+// then HTTP/2 on `concurrency / streams` connections carrying `streams`
+// requests each. The CPU time the server process used during a run is read
+// from /proc.
+//
+// Usage: http2_bench [concurrency] [streams] [seconds] [port]
+
+#include "apee.hpp"
+#include "loadgen.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+#include <unistd.h>
+
+using namespace apee;
+
+namespace {
+
+struct Handler : public AbstractRequestHandler {
+  Response on_request(Request const &) override {
+    return Response(StatusCode::OK, MessageBody("Hello from Handler!\n"));
+  }
+};
+
+// User and system time of `pid` in microseconds, -1 if unknown.
+double cpu_time(pid_t pid) {
+  std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat;
+  if (!std::getline(in, stat)) {
+    return -1;
+  }
+  // The fields after the command name, which may contain spaces.
+  std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+  std::string field;
+  // utime and stime are fields 14 and 15, the state is field 3.
+  for (int i = 3; i < 14; ++i) {
+    fields >> field;
+  }
+  double utime = 0, stime = 0;
+  fields >> utime >> stime;
+  return (utime + stime) * 1e6 / ::sysconf(_SC_CLK_TCK);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  unsigned int concurrency = argc > 1 ? std::atoi(argv[1]) : 512;
+  unsigned int streams = std::max(1, argc > 2 ? std::atoi(argv[2]) : 64);
+  loadgen::Options options;
+  options.duration = std::chrono::seconds(argc > 3 ? std::atoi(argv[3]) : 5);
+  options.port = argc > 4 ? std::atoi(argv[4]) : 18580;
+  options.threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+
+  pid_t server = loadgen::fork_server([&] {
+    Config config;
+    config.address = "127.0.0.1";
+    config.port = options.port;
+    config.max_requests_per_connection = 1u << 30;
+    config.http2.enabled = true;
+    config.http2.max_concurrent_streams = streams;
+    Service service(config, std::make_shared<Handler>());
+    service.run();
+  });
+  if (!loadgen::wait_for_server(options.port)) {
+    std::cerr << "Server did not start on port " << options.port << '\n';
+    loadgen::stop_server(server);
+    return 1;
+  }
+
+  std::cout << concurrency << " requests in flight\n"
+            << std::left << std::setw(12) << "protocol" << std::setw(14)
+            << "connections" << std::setw(16) << "requests/sec"
+            << std::setw(12) << "p50 (us)" << std::setw(12) << "p99 (us)"
+            << "server CPU (us/request)\n";
+  for (bool http2 : {false, true}) {
+    options.streams = http2 ? streams : 0;
+    options.connections = http2 ? std::max(1u, concurrency / streams)
+                                : concurrency;
+    auto cpu_before = cpu_time(server);
+    auto result = loadgen::run(options);
+    auto cpu = cpu_time(server) - cpu_before;
+    auto cpu_per_request = result.requests > 0 ? cpu / result.requests : 0.0;
+    std::cout << std::left << std::setw(12)
+              << (http2 ? "HTTP/2" : "HTTP/1.1") << std::setw(14)
+              << options.connections << std::fixed << std::setprecision(0)
+              << std::setw(16) << result.rps() << std::setprecision(1)
+              << std::setw(12) << result.latency.percentile(0.5) / 1000.0
+              << std::setw(12) << result.latency.percentile(0.99) / 1000.0
+              << std::setprecision(2) << cpu_per_request << '\n';
+    if (result.errors > 0 || result.failed > 0) {
+      std::cout << "  " << result.errors << " errors, " << result.failed
+                << " failed\n";
+    }
+  }
+  loadgen::stop_server(server);
+}
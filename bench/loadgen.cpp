@@ -0,0 +1,718 @@
+#include "loadgen.hpp"
+
+#include "hpack.hpp"
+
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <charconv>
+#include <csignal>
+#include <cstdlib>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace http = boost::beast::http;
+using tcp = boost::asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+namespace loadgen {
+
+namespace {
+
+// Response body that only counts its bytes, so large responses are not
+// copied around.
+struct DiscardBody {
+  using value_type = std::uint64_t;
+
+  class reader {
+    value_type &m_size;
+
+   public:
+    template <bool isRequest, class Fields>
+    reader(http::header<isRequest, Fields> &, value_type &size)
+        : m_size{size} {}
+
+    void init(boost::optional<std::uint64_t> const &,
+              boost::system::error_code &ec) {
+      m_size = 0;
+      ec = {};
+    }
+
+    template <class ConstBufferSequence>
+    std::size_t put(ConstBufferSequence const &buffers,
+                    boost::system::error_code &ec) {
+      auto size = boost::asio::buffer_size(buffers);
+      m_size += size;
+      ec = {};
+      return size;
+    }
+
+    void finish(boost::system::error_code &ec) { ec = {}; }
+  };
+};
+
+// Counters of the connections on one client thread.
+struct Totals {
+  std::uint64_t requests = 0;
+  std::uint64_t errors = 0;
+  std::uint64_t failed = 0;
+  std::uint64_t bytes = 0;
+  apee::Histogram latency;
+};
+
+class Client : public std::enable_shared_from_this<Client> {
+  tcp::socket m_socket;
+  boost::asio::steady_timer m_timer;
+  tcp::endpoint m_endpoint;
+  std::string const &m_request;
+  bool m_keep_alive;
+  unsigned int m_pipeline;
+  // Responses still expected to the batch of requests written.
+  unsigned int m_remaining = 0;
+  Totals &m_totals;
+  Clock::time_point m_end;
+  // Time between requests in open-loop mode, zero in closed-loop mode.
+  Clock::duration m_interval;
+  // When the next request is due in open-loop mode.
+  Clock::time_point m_due;
+  // Start of the latency of the current request.
+  Clock::time_point m_start;
+  boost::beast::flat_buffer m_buffer;
+  std::optional<http::response_parser<DiscardBody>> m_parser;
+
+ public:
+  Client(boost::asio::io_context &ioc,
+         tcp::endpoint endpoint,
+         std::string const &request,
+         bool keep_alive,
+         unsigned int pipeline,
+         Totals &totals,
+         Clock::time_point end,
+         Clock::duration interval,
+         Clock::time_point first_due)
+      : m_socket{ioc},
+        m_timer{ioc},
+        m_endpoint{endpoint},
+        m_request{request},
+        m_keep_alive{keep_alive},
+        m_pipeline{pipeline},
+        m_totals{totals},
+        m_end{end},
+        m_interval{interval},
+        m_due{first_due} {}
+
+  void connect() {
+    auto self = shared_from_this();
+    boost::system::error_code ec;
+    m_socket.close(ec);
+    m_buffer.clear();
+    m_socket.async_connect(m_endpoint, [self](boost::system::error_code ec) {
+      if (!ec) {
+        self->m_socket.set_option(tcp::no_delay(true), ec);
+        self->send();
+        return;
+      }
+      ++self->m_totals.errors;
+      self->m_timer.expires_after(std::chrono::milliseconds(10));
+      self->m_timer.async_wait(
+          [self](boost::system::error_code) { self->connect(); });
+    });
+  }
+
+  void send() {
+    if (m_interval == Clock::duration::zero() || Clock::now() >= m_due) {
+      write();
+      return;
+    }
+    auto self = shared_from_this();
+    m_timer.expires_at(m_due);
+    m_timer.async_wait([self](boost::system::error_code) { self->write(); });
+  }
+
+  void write() {
+    m_start = m_interval == Clock::duration::zero() ? Clock::now() : m_due;
+    m_remaining = m_pipeline;
+    auto self = shared_from_this();
+    boost::asio::async_write(
+        m_socket,
+        boost::asio::buffer(m_request),
+        [self](boost::system::error_code ec, std::size_t) {
+          if (ec) {
+            self->on_response(ec);
+          } else {
+            self->read();
+          }
+        });
+  }
+
+  void read() {
+    m_parser.emplace();
+    m_parser->body_limit(std::numeric_limits<std::uint64_t>::max());
+    auto self = shared_from_this();
+    http::async_read(m_socket,
+                     m_buffer,
+                     *m_parser,
+                     [self](boost::system::error_code ec, std::size_t) {
+                       self->on_response(ec);
+                     });
+  }
+
+  void on_response(boost::system::error_code ec) {
+    auto now = Clock::now();
+    if (now >= m_end) {
+      return;
+    }
+    if (ec) {
+      ++m_totals.errors;
+      connect();
+      return;
+    }
+    if (m_parser->get().result_int() >= 400) {
+      ++m_totals.failed;
+    } else {
+      ++m_totals.requests;
+      m_totals.bytes += m_parser->get().body();
+      m_totals.latency.record(static_cast<std::uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_start)
+              .count()));
+    }
+    if (--m_remaining > 0 && m_parser->keep_alive()) {
+      read();
+      return;
+    }
+    m_due += m_interval;
+    if (m_keep_alive && m_parser->keep_alive()) {
+      send();
+    } else {
+      connect();
+    }
+  }
+};
+
+// A persistent connection speaking HTTP/2 with prior knowledge in
+// closed-loop mode, keeping `streams` requests in flight. Requests are
+// written in batches: all those that replace the responses of one read go
+// out with one write.
+class Http2Client : public std::enable_shared_from_this<Http2Client> {
+  static constexpr std::uint8_t data_frame = 0x0;
+  static constexpr std::uint8_t headers_frame = 0x1;
+  static constexpr std::uint8_t rst_stream_frame = 0x3;
+  static constexpr std::uint8_t settings_frame = 0x4;
+  static constexpr std::uint8_t ping_frame = 0x6;
+  static constexpr std::uint8_t goaway_frame = 0x7;
+  static constexpr std::uint8_t window_update_frame = 0x8;
+  static constexpr std::uint8_t continuation_frame = 0x9;
+  static constexpr std::uint8_t end_stream = 0x1;
+  static constexpr std::uint8_t ack = 0x1;
+  static constexpr std::uint8_t end_headers = 0x4;
+  static constexpr std::uint8_t padded = 0x8;
+  static constexpr std::uint8_t priority = 0x20;
+  // The receive windows, so that only the connection window needs updates.
+  static constexpr std::uint32_t window_size = 0x7fffffff;
+
+  struct Request {
+    std::uint32_t stream;
+    Clock::time_point start;
+    unsigned int status;
+    std::uint64_t bytes;
+  };
+
+  tcp::socket m_socket;
+  boost::asio::steady_timer m_timer;
+  tcp::endpoint m_endpoint;
+  // The header block of every request.
+  std::string const &m_block;
+  unsigned int m_streams;
+  Totals &m_totals;
+  Clock::time_point m_end;
+  // Counts connections, so handlers of the previous one are ignored.
+  unsigned int m_generation = 0;
+  std::uint32_t m_next_stream = 1;
+  std::vector<Request> m_requests;
+  // After GOAWAY, no more requests are sent and a new connection is made
+  // once the requests that will be answered finished.
+  bool m_goaway = false;
+  apee::detail::HpackDecoder m_decoder;
+  // The header block being received and its stream.
+  std::string m_header_block;
+  std::uint32_t m_header_stream = 0;
+  bool m_header_end_stream = false;
+  boost::beast::flat_buffer m_buffer;
+  std::string m_output;
+  std::string m_write;
+  bool m_writing = false;
+  // DATA received since the last WINDOW_UPDATE of the connection.
+  std::uint64_t m_unacked = 0;
+
+ public:
+  Http2Client(boost::asio::io_context &ioc,
+              tcp::endpoint endpoint,
+              std::string const &block,
+              unsigned int streams,
+              Totals &totals,
+              Clock::time_point end)
+      : m_socket{ioc},
+        m_timer{ioc},
+        m_endpoint{endpoint},
+        m_block{block},
+        m_streams{streams},
+        m_totals{totals},
+        m_end{end} {}
+
+  void connect() {
+    auto self = shared_from_this();
+    boost::system::error_code ec;
+    m_socket.close(ec);
+    ++m_generation;
+    m_buffer.clear();
+    m_output.clear();
+    m_writing = false;
+    m_requests.clear();
+    m_next_stream = 1;
+    m_goaway = false;
+    m_unacked = 0;
+    m_header_block.clear();
+    m_decoder.reset(4096);
+    m_socket.async_connect(m_endpoint, [self](boost::system::error_code ec) {
+      if (!ec) {
+        self->m_socket.set_option(tcp::no_delay(true), ec);
+        self->start();
+        return;
+      }
+      ++self->m_totals.errors;
+      self->m_timer.expires_after(std::chrono::milliseconds(10));
+      self->m_timer.async_wait(
+          [self](boost::system::error_code) { self->connect(); });
+    });
+  }
+
+ private:
+  void start() {
+    m_output = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    // SETTINGS_INITIAL_WINDOW_SIZE.
+    write_frame_header(6, settings_frame, 0, 0);
+    put16(0x4);
+    put32(window_size);
+    write_frame_header(4, window_update_frame, 0, 0);
+    put32(window_size - 65535);
+    for (unsigned int i = 0; i < m_streams; ++i) {
+      send_request();
+    }
+    flush();
+    read();
+  }
+
+  void send_request() {
+    m_requests.push_back({m_next_stream, Clock::now(), 0, 0});
+    write_frame_header(
+        m_block.size(), headers_frame, end_headers | end_stream, m_next_stream);
+    m_output += m_block;
+    m_next_stream += 2;
+  }
+
+  void flush() {
+    if (m_writing || m_output.empty()) {
+      return;
+    }
+    m_writing = true;
+    m_write.swap(m_output);
+    m_output.clear();
+    auto self = shared_from_this();
+    boost::asio::async_write(
+        m_socket,
+        boost::asio::buffer(m_write),
+        [self, generation = m_generation](boost::system::error_code ec,
+                                          std::size_t) {
+          if (generation != self->m_generation) {
+            return;
+          }
+          self->m_writing = false;
+          // A failed write shows as a failed read as well.
+          if (!ec) {
+            self->flush();
+          }
+        });
+  }
+
+  void read() {
+    auto self = shared_from_this();
+    m_socket.async_read_some(
+        m_buffer.prepare(64 * 1024),
+        [self, generation = m_generation](boost::system::error_code ec,
+                                          std::size_t bytes_transferred) {
+          if (generation == self->m_generation) {
+            self->on_read(ec, bytes_transferred);
+          }
+        });
+  }
+
+  void on_read(boost::system::error_code ec, std::size_t bytes_transferred) {
+    if (Clock::now() >= m_end) {
+      return;
+    }
+    if (ec) {
+      if (!m_goaway || !m_requests.empty()) {
+        ++m_totals.errors;
+      }
+      connect();
+      return;
+    }
+    m_buffer.commit(bytes_transferred);
+    auto data = static_cast<unsigned char const *>(m_buffer.data().data());
+    std::size_t size = m_buffer.size(), offset = 0;
+    while (size - offset >= 9) {
+      auto const *head = data + offset;
+      std::size_t length = head[0] << 16 | head[1] << 8 | head[2];
+      if (size - offset < 9 + length) {
+        break;
+      }
+      std::uint32_t stream = get32(head + 5) & 0x7fffffff;
+      if (!on_frame(head[3],
+                    head[4],
+                    stream,
+                    std::string_view(reinterpret_cast<char const *>(head) + 9,
+                                     length))) {
+        ++m_totals.errors;
+        connect();
+        return;
+      }
+      offset += 9 + length;
+    }
+    m_buffer.consume(offset);
+    if (m_unacked >= window_size / 2) {
+      write_frame_header(4, window_update_frame, 0, 0);
+      put32(static_cast<std::uint32_t>(m_unacked));
+      m_unacked = 0;
+    }
+    if (m_goaway && m_requests.empty()) {
+      connect();
+      return;
+    }
+    flush();
+    read();
+  }
+
+  // Returns false on a connection error.
+  bool on_frame(std::uint8_t type,
+                std::uint8_t flags,
+                std::uint32_t stream,
+                std::string_view payload) {
+    switch (type) {
+      case data_frame:
+        m_unacked += payload.size();
+        if (auto request = find(stream)) {
+          request->bytes += payload.size();
+          if (flags & end_stream) {
+            finish(*request);
+          }
+        }
+        return true;
+      case headers_frame:
+        if (flags & padded) {
+          std::size_t padding =
+              payload.empty() ? 0 : static_cast<unsigned char>(payload[0]);
+          if (payload.empty() || padding >= payload.size()) {
+            return false;
+          }
+          payload = payload.substr(1, payload.size() - 1 - padding);
+        }
+        if (flags & priority) {
+          payload.remove_prefix(std::min<std::size_t>(5, payload.size()));
+        }
+        m_header_block.assign(payload);
+        m_header_stream = stream;
+        m_header_end_stream = flags & end_stream;
+        return !(flags & end_headers) || on_header_block();
+      case continuation_frame:
+        m_header_block.append(payload);
+        return !(flags & end_headers) || on_header_block();
+      case rst_stream_frame:
+        if (auto request = find(stream)) {
+          ++m_totals.errors;
+          m_requests.erase(m_requests.begin() + (request - m_requests.data()));
+          replace();
+        }
+        return true;
+      case settings_frame:
+        if (!(flags & ack)) {
+          write_frame_header(0, settings_frame, ack, 0);
+        }
+        return true;
+      case ping_frame:
+        if (!(flags & ack)) {
+          write_frame_header(payload.size(), ping_frame, ack, 0);
+          m_output += payload;
+        }
+        return true;
+      case goaway_frame: {
+        if (payload.size() < 8) {
+          return false;
+        }
+        // Requests on later streams were not processed.
+        auto last = get32(payload.data()) & 0x7fffffff;
+        m_goaway = true;
+        m_requests.erase(std::remove_if(m_requests.begin(),
+                                        m_requests.end(),
+                                        [last](Request const &request) {
+                                          return request.stream > last;
+                                        }),
+                         m_requests.end());
+        return get32(payload.data() + 4) == 0;
+      }
+      default:
+        return true;
+    }
+  }
+
+  bool on_header_block() {
+    auto request = find(m_header_stream);
+    unsigned int status = 0;
+    bool valid = m_decoder.decode(
+        m_header_block, [&](std::string_view name, std::string_view value) {
+          if (name == ":status") {
+            std::from_chars(value.data(), value.data() + value.size(), status);
+          }
+        });
+    // Interim responses are followed by the final one.
+    if (request && status >= 200) {
+      request->status = status;
+    }
+    if (request && m_header_end_stream) {
+      finish(*request);
+    }
+    return valid;
+  }
+
+  void finish(Request &request) {
+    auto now = Clock::now();
+    if (now >= m_end) {
+      return;
+    }
+    if (request.status >= 400) {
+      ++m_totals.failed;
+    } else {
+      ++m_totals.requests;
+      m_totals.bytes += request.bytes;
+      m_totals.latency.record(static_cast<std::uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              now - request.start)
+              .count()));
+    }
+    m_requests.erase(m_requests.begin() + (&request - m_requests.data()));
+    replace();
+  }
+
+  // Sends the request that takes the place of a finished one.
+  void replace() {
+    if (!m_goaway && m_next_stream < 0x7fffffff) {
+      send_request();
+    }
+  }
+
+  Request *find(std::uint32_t stream) {
+    for (auto &request : m_requests) {
+      if (request.stream == stream) {
+        return &request;
+      }
+    }
+    return nullptr;
+  }
+
+  void write_frame_header(std::size_t length,
+                          std::uint8_t type,
+                          std::uint8_t flags,
+                          std::uint32_t stream) {
+    m_output.push_back(static_cast<char>(length >> 16));
+    m_output.push_back(static_cast<char>(length >> 8));
+    m_output.push_back(static_cast<char>(length));
+    m_output.push_back(static_cast<char>(type));
+    m_output.push_back(static_cast<char>(flags));
+    put32(stream);
+  }
+
+  void put16(std::uint16_t value) {
+    m_output.push_back(static_cast<char>(value >> 8));
+    m_output.push_back(static_cast<char>(value));
+  }
+
+  void put32(std::uint32_t value) {
+    put16(static_cast<std::uint16_t>(value >> 16));
+    put16(static_cast<std::uint16_t>(value));
+  }
+
+  template <typename Byte>
+  static std::uint32_t get32(Byte const *data) {
+    auto bytes = reinterpret_cast<unsigned char const *>(data);
+    return std::uint32_t(bytes[0]) << 24 | bytes[1] << 16 | bytes[2] << 8 |
+           bytes[3];
+  }
+};
+
+// Appends a string literal of HPACK without Huffman coding.
+void hpack_string(std::string &out, std::string_view text) {
+  auto length = text.size();
+  if (length < 127) {
+    out.push_back(static_cast<char>(length));
+  } else {
+    out.push_back(127);
+    for (length -= 127; length >= 128; length >>= 7) {
+      out.push_back(static_cast<char>(length % 128 + 128));
+    }
+    out.push_back(static_cast<char>(length));
+  }
+  out += text;
+}
+
+// The header block of a GET request, with the static table only.
+std::string http2_request(Options const &options) {
+  // :method GET and :scheme http.
+  std::string block = "\x82\x86";
+  if (options.target == "/") {
+    block.push_back('\x84');
+  } else {
+    // Literal without indexing, the name :path of the static table.
+    block.push_back('\x04');
+    hpack_string(block, options.target);
+  }
+  // :authority.
+  block.push_back('\x01');
+  hpack_string(block, options.host);
+  return block;
+}
+
+std::string microseconds(std::uint64_t nanoseconds) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1) << nanoseconds / 1000.0 << " us";
+  return out.str();
+}
+
+}  // namespace
+
+Result run(Options const &options) {
+  std::string request = "GET " + options.target + " HTTP/1.1\r\nHost: " +
+                        options.host + "\r\n" +
+                        (options.keep_alive ? "" : "Connection: close\r\n") +
+                        "\r\n";
+  auto pipeline = options.keep_alive && options.rate == 0
+                      ? std::max(1u, options.pipeline)
+                      : 1u;
+  std::string batch;
+  for (unsigned int i = 0; i < pipeline; ++i) {
+    batch += request;
+  }
+  bool http2 = options.streams > 0 && options.keep_alive && options.rate == 0;
+  auto block = http2 ? http2_request(options) : std::string();
+  tcp::endpoint endpoint{boost::asio::ip::make_address(options.host),
+                         options.port};
+  auto threads = std::max(1u, std::min(options.threads, options.connections));
+  std::vector<Totals> totals(threads);
+  auto start = Clock::now();
+  auto end = start + options.duration;
+  // Each connection sends rate / connections requests per second, staggered
+  // so the schedule is spread evenly over time.
+  Clock::duration interval = Clock::duration::zero();
+  if (options.rate > 0) {
+    interval = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(options.connections / options.rate));
+  }
+
+  std::vector<std::thread> workers;
+  for (unsigned int t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      boost::asio::io_context ioc{1};
+      for (unsigned int c = t; c < options.connections; c += threads) {
+        if (http2) {
+          std::make_shared<Http2Client>(
+              ioc, endpoint, block, options.streams, totals[t], end)
+              ->connect();
+          continue;
+        }
+        std::make_shared<Client>(ioc,
+                                 endpoint,
+                                 batch,
+                                 options.keep_alive,
+                                 pipeline,
+                                 totals[t],
+                                 end,
+                                 interval,
+                                 start + interval * c / options.connections)
+            ->connect();
+      }
+      boost::asio::steady_timer stop{ioc, end};
+      stop.async_wait([&](boost::system::error_code) { ioc.stop(); });
+      ioc.run();
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  Result result;
+  result.elapsed = Clock::now() - start;
+  for (auto const &total : totals) {
+    result.requests += total.requests;
+    result.errors += total.errors;
+    result.failed += total.failed;
+    result.bytes += total.bytes;
+    result.latency.merge(total.latency);
+  }
+  return result;
+}
+
+void print(std::ostream &out, Result const &result) {
+  out << std::left << std::fixed << std::setprecision(0);
+  out << std::setw(16) << "requests/sec" << result.rps() << '\n';
+  out << std::setw(16) << "errors" << result.errors << '\n';
+  out << std::setw(16) << "failed" << result.failed << '\n';
+  std::pair<char const *, double> quantiles[] = {{"latency p50", 0.5},
+                                                 {"latency p90", 0.9},
+                                                 {"latency p99", 0.99},
+                                                 {"latency p99.9", 0.999},
+                                                 {"latency p99.99", 0.9999}};
+  for (auto const &quantile : quantiles) {
+    out << std::setw(16) << quantile.first
+        << microseconds(result.latency.percentile(quantile.second)) << '\n';
+  }
+  out << std::setw(16) << "latency max" << microseconds(result.latency.max())
+      << '\n';
+}
+
+pid_t fork_server(std::function<void()> const &serve) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    setenv("LOG", "critical", 1);
+    serve();
+    std::_Exit(0);
+  }
+  return pid;
+}
+
+void stop_server(pid_t server) {
+  kill(server, SIGKILL);
+  waitpid(server, nullptr, 0);
+}
+
+bool wait_for_server(unsigned short port) {
+  boost::asio::io_context ioc;
+  for (int attempt = 0; attempt < 500; ++attempt) {
+    tcp::socket socket{ioc};
+    boost::system::error_code ec;
+    socket.connect({boost::asio::ip::make_address("127.0.0.1"), port}, ec);
+    if (!ec) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+}  // namespace loadgen
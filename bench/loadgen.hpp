@@ -0,0 +1,80 @@
+// HTTP load generator shared by the benchmarks.
+//
+// Connections are spread over a number of client threads, each running its
+// own io_context. In closed-loop mode every connection sends its next request
+// as soon as the previous response arrived, which measures peak throughput.
+// Over HTTP/2 a connection keeps several requests in flight on streams of
+// their own instead.
+// In open-loop mode requests are scheduled at a fixed rate and latency is
+// measured from the time a request was due rather than when it was sent, so
+// a stalled server is charged for the requests it delayed (correcting for
+// coordinated omission, as wrk2 does).
+
+#ifndef APEE_BENCH_LOADGEN_H
+#define APEE_BENCH_LOADGEN_H
+
+#include "metrics.hpp"
+
+#include <sys/types.h>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+
+namespace loadgen {
+
+struct Options {
+  std::string host = "127.0.0.1";
+  unsigned short port = 18080;
+  std::string target = "/";
+  unsigned int connections = 32;
+  unsigned int threads = 1;
+  std::chrono::seconds duration{5};
+  // Requests per second over all connections, 0 runs closed-loop.
+  double rate = 0;
+  // Reuse connections; otherwise every request is sent with
+  // "Connection: close" on a new connection.
+  bool keep_alive = true;
+  // Requests written at once on a persistent connection, the next batch is
+  // sent when all of their responses arrived. Latency is measured from the
+  // write of the batch.
+  unsigned int pipeline = 1;
+  // Requests kept in flight on each persistent connection with HTTP/2 (with
+  // prior knowledge) in closed-loop mode, each answered response replaced
+  // by the next request at once. 0 speaks HTTP/1.1.
+  unsigned int streams = 0;
+};
+
+struct Result {
+  std::uint64_t requests = 0;
+  std::uint64_t errors = 0;
+  // Responses with a 4xx or 5xx status. They are counted neither as
+  // requests nor in the latency.
+  std::uint64_t failed = 0;
+  // Response body bytes.
+  std::uint64_t bytes = 0;
+  std::chrono::duration<double> elapsed{0};
+  // Nanoseconds per request.
+  apee::Histogram latency;
+
+  double rps() const { return requests / elapsed.count(); }
+};
+
+Result run(Options const &options);
+
+// Requests/sec, errors, failed responses and the latency distribution, one
+// value per line.
+void print(std::ostream &out, Result const &result);
+
+// Runs `serve` in a child process with logging turned down.
+pid_t fork_server(std::function<void()> const &serve);
+
+void stop_server(pid_t server);
+
+// Waits until something accepts connections on `port` of localhost.
+bool wait_for_server(unsigned short port);
+
+}  // namespace loadgen
+
+#endif  // APEE_BENCH_LOADGEN_H
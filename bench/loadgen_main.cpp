@@ -0,0 +1,113 @@
+// Drives a Service over loopback and reports requests/sec and the latency
+// distribution.
+//
+// Usage: loadgen [--connections=N] [--threads=N] [--duration=SECONDS]
+//                [--rate=REQUESTS_PER_SECOND] [--target=PATH] [--close]
+//                [--port=PORT] [--connect=ADDRESS:PORT]
+//                [--server-threads=N] [--pipeline=N] [--streams=N]
+//
+// Without --connect a Service answering every request with a short body is
+// forked on --port, running --server-threads threads with one io_context
+// each. --rate=0 (the default) runs closed-loop. --pipeline=N writes N
+// requests at once on each connection in closed-loop mode. --streams=N
+// speaks HTTP/2 with N requests in flight on each connection, the forked
+// Service then accepts HTTP/2 (see Http2).
+
+#include "apee.hpp"
+#include "loadgen.hpp"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using namespace apee;
+
+namespace {
+
+struct Handler : public AbstractRequestHandler {
+  Response on_request(Request const &) override {
+    return Response(StatusCode::OK, MessageBody("Hello from Handler!\n"));
+  }
+};
+
+bool option(std::string const &arg, char const *name, std::string &value) {
+  std::string prefix = std::string("--") + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0) {
+    return false;
+  }
+  value = arg.substr(prefix.size());
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  loadgen::Options options;
+  std::string connect;
+  unsigned int server_threads = 1;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i], value;
+    if (option(arg, "connections", value)) {
+      options.connections = std::stoul(value);
+    } else if (option(arg, "threads", value)) {
+      options.threads = std::stoul(value);
+    } else if (option(arg, "duration", value)) {
+      options.duration = std::chrono::seconds(std::stoul(value));
+    } else if (option(arg, "rate", value)) {
+      options.rate = std::stod(value);
+    } else if (option(arg, "target", value)) {
+      options.target = value;
+    } else if (option(arg, "port", value)) {
+      options.port = static_cast<unsigned short>(std::stoul(value));
+    } else if (option(arg, "connect", value)) {
+      connect = value;
+    } else if (option(arg, "server-threads", value)) {
+      server_threads = std::stoul(value);
+    } else if (option(arg, "pipeline", value)) {
+      options.pipeline = std::stoul(value);
+    } else if (option(arg, "streams", value)) {
+      options.streams = std::stoul(value);
+    } else if (arg == "--close") {
+      options.keep_alive = false;
+    } else {
+      std::cerr << "Unknown argument " << arg << '\n';
+      return 2;
+    }
+  }
+
+  pid_t server = 0;
+  if (!connect.empty()) {
+    auto colon = connect.rfind(':');
+    options.host = connect.substr(0, colon);
+    options.port = static_cast<unsigned short>(
+        std::stoul(connect.substr(colon + 1)));
+  } else {
+    server = loadgen::fork_server([&] {
+      Config config;
+      config.address = "127.0.0.1";
+      config.port = options.port;
+      config.threading.mode = Threading::Mode::ContextPerThread;
+      config.threading.threads = server_threads;
+      config.http2.enabled = options.streams > 0;
+      Service service(config, std::make_shared<Handler>());
+      service.run();
+    });
+    if (!loadgen::wait_for_server(options.port)) {
+      std::cerr << "Server did not start on port " << options.port << '\n';
+      loadgen::stop_server(server);
+      return 1;
+    }
+  }
+
+  auto result = loadgen::run(options);
+  if (server != 0) {
+    loadgen::stop_server(server);
+  }
+  std::cout << (options.rate > 0 ? "open-loop" : "closed-loop") << ", "
+            << options.connections << " connections, ";
+  if (options.streams > 0) {
+    std::cout << "HTTP/2 with " << options.streams << " streams each, ";
+  }
+  std::cout << options.duration.count() << " s\n";
+  loadgen::print(std::cout, result);
+}
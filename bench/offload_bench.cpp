@@ -0,0 +1,123 @@
+// Latency of cheap requests while other requests keep the handler busy with
+// CPU work, handled on the I/O thread and offloaded to the worker pool.
+//
+// A few connections send requests to /heavy, which spins for a fixed time,
+// in closed loop. At the same time requests to / are sent at a fixed rate;
+// their latency shows how long the I/O thread is held up. The worker pool
+// counters are read from the metrics of the Service after each run.
+//
+// Usage: offload_bench [workers] [seconds] [port]
+
+#include "apee.hpp"
+#include "loadgen.hpp"
+
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+using namespace apee;
+
+namespace {
+
+constexpr std::chrono::milliseconds heavy_time{10};
+
+class Handler : public AbstractRequestHandler {
+ public:
+  Response on_request(Request const &request) override {
+    if (request.request_line().uri() == "/heavy") {
+      auto end = std::chrono::steady_clock::now() + heavy_time;
+      while (std::chrono::steady_clock::now() < end) {
+      }
+    }
+    return Response(StatusCode::OK, MessageBody("done\n"));
+  }
+
+  bool offload(Request const &request) override {
+    return request.request_line().uri() == "/heavy";
+  }
+};
+
+// The apee_worker_* lines of the metrics.
+std::string worker_metrics(unsigned short port) {
+  namespace http = boost::beast::http;
+  boost::asio::io_context ioc;
+  boost::asio::ip::tcp::socket socket{ioc};
+  boost::system::error_code ec;
+  socket.connect({boost::asio::ip::make_address("127.0.0.1"), port}, ec);
+  http::request<http::empty_body> request{http::verb::get, "/metrics", 11};
+  http::write(socket, request, ec);
+  boost::beast::flat_buffer buffer;
+  http::response<http::string_body> response;
+  http::read(socket, buffer, response, ec);
+  if (ec) {
+    return "  (metrics unavailable: " + ec.message() + ")\n";
+  }
+  std::istringstream in(response.body());
+  std::string line, lines;
+  while (std::getline(in, line)) {
+    if (line.rfind("apee_worker_", 0) == 0) {
+      lines += "  " + line + "\n";
+    }
+  }
+  return lines;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  unsigned int workers = argc > 1 ? std::atoi(argv[1]) : 2;
+  auto duration = std::chrono::seconds(argc > 2 ? std::atoi(argv[2]) : 5);
+  unsigned short port = argc > 3 ? std::atoi(argv[3]) : 18380;
+
+  std::cout << "heavy requests spin " << heavy_time.count() << " ms\n\n";
+  std::cout << std::left << std::setw(14) << "workers" << std::setw(14)
+            << "heavy/sec" << std::setw(14) << "cheap/sec" << std::setw(14)
+            << "p50 (us)" << "p99 (us)\n";
+  for (unsigned int pool : {0u, workers}) {
+    pid_t server = loadgen::fork_server([&] {
+      Config config;
+      config.address = "127.0.0.1";
+      config.port = port;
+      config.threading.workers = pool;
+      config.metrics_path = "/metrics";
+      Service service(config, std::make_shared<Handler>());
+      service.run();
+    });
+    if (!loadgen::wait_for_server(port)) {
+      std::cerr << "Server did not start on port " << port << '\n';
+      loadgen::stop_server(server);
+      return 1;
+    }
+    loadgen::Options heavy;
+    heavy.port = port;
+    heavy.target = "/heavy";
+    heavy.connections = 4;
+    heavy.duration = duration;
+    loadgen::Options cheap;
+    cheap.port = port;
+    cheap.connections = 8;
+    cheap.duration = duration;
+    cheap.rate = 200;
+    loadgen::Result heavy_result;
+    std::thread heavy_thread{[&] { heavy_result = loadgen::run(heavy); }};
+    auto cheap_result = loadgen::run(cheap);
+    heavy_thread.join();
+    auto counters = worker_metrics(port);
+    loadgen::stop_server(server);
+    std::cout << std::left << std::setw(14)
+              << (pool ? std::to_string(pool) : std::string("I/O thread"))
+              << std::fixed << std::setprecision(0) << std::setw(14)
+              << heavy_result.rps() << std::setw(14) << cheap_result.rps()
+              << std::setw(14) << cheap_result.latency.percentile(0.5) / 1000.0
+              << cheap_result.latency.percentile(0.99) / 1000.0 << '\n';
+    if (pool) {
+      std::cout << counters;
+    }
+    ++port;
+  }
+}
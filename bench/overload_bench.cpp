@@ -0,0 +1,117 @@
+// Latency of admitted requests when a Service gets more requests than its
+// handler can process, without and with admission control.
+//
+// The handler passes requests to a pool of worker threads, each taking a
+// fixed service time per request, which bounds the throughput to
+// workers / service time. An open-loop client sends requests at a multiple of
+// that rate. Without a limit the queue in front of the workers grows for the
+// whole run; with one the excess is rejected with ServiceUnavailable and
+// counted as failed.
+//
+// Usage: overload_bench [overload factor] [seconds] [port]
+
+#include "apee.hpp"
+#include "loadgen.hpp"
+
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace apee;
+
+namespace {
+
+constexpr unsigned int workers = 4;
+constexpr std::chrono::milliseconds service_time{2};
+
+class Handler : public AbstractAsyncRequestHandler {
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::deque<Responder> m_queue;
+  std::vector<std::thread> m_workers;
+
+  void work() {
+    for (;;) {
+      std::unique_lock<std::mutex> lock{m_mutex};
+      m_ready.wait(lock, [this] { return !m_queue.empty(); });
+      auto responder = std::move(m_queue.front());
+      m_queue.pop_front();
+      lock.unlock();
+      std::this_thread::sleep_for(service_time);
+      responder(Response(StatusCode::OK, MessageBody("done\n")));
+    }
+  }
+
+ public:
+  Handler() {
+    for (unsigned int i = 0; i < workers; ++i) {
+      m_workers.emplace_back([this] { work(); });
+    }
+  }
+
+  ~Handler() override {
+    for (auto &worker : m_workers) {
+      worker.detach();
+    }
+  }
+
+  void on_request_async(Request const &, Responder responder) override {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_queue.push_back(std::move(responder));
+    m_ready.notify_one();
+  }
+};
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  double overload = argc > 1 ? std::atof(argv[1]) : 2;
+  loadgen::Options options;
+  options.connections = 64;
+  options.duration = std::chrono::seconds(argc > 2 ? std::atoi(argv[2]) : 5);
+  options.port = argc > 3 ? std::atoi(argv[3]) : 18280;
+  options.rate = overload * workers * 1000.0 / service_time.count();
+
+  std::pair<char const *, Admission> settings[4];
+  settings[0].first = "unlimited";
+  settings[1].first = "fixed 8";
+  settings[1].second.max_in_flight = 8;
+  settings[2].first = "aimd";
+  settings[2].second.limit = Admission::Limit::Aimd;
+  settings[2].second.latency_threshold = service_time * 2;
+  settings[3].first = "gradient";
+  settings[3].second.limit = Admission::Limit::Gradient;
+
+  std::cout << "capacity " << workers * 1000 / service_time.count()
+            << " requests/sec, offered " << options.rate << "\n\n";
+  std::cout << std::left << std::setw(12) << "limit" << std::setw(16)
+            << "requests/sec" << std::setw(12) << "rejected" << std::setw(14)
+            << "p50 (us)" << "p99 (us)\n";
+  for (auto const &setting : settings) {
+    pid_t server = loadgen::fork_server([&] {
+      Config config;
+      config.address = "127.0.0.1";
+      config.port = options.port;
+      config.admission = setting.second;
+      Service service(config, std::make_shared<Handler>());
+      service.run();
+    });
+    if (!loadgen::wait_for_server(options.port)) {
+      std::cerr << "Server did not start on port " << options.port << '\n';
+      loadgen::stop_server(server);
+      return 1;
+    }
+    auto result = loadgen::run(options);
+    loadgen::stop_server(server);
+    std::cout << std::left << std::setw(12) << setting.first << std::fixed
+              << std::setprecision(0) << std::setw(16) << result.rps()
+              << std::setw(12) << result.failed << std::setw(14)
+              << result.latency.percentile(0.5) / 1000.0
+              << result.latency.percentile(0.99) / 1000.0 << '\n';
+    ++options.port;
+  }
+}
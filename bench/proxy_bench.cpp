@@ -0,0 +1,244 @@
+// Throughput and latency of requests answered by an upstream Service
+// directly and through a second Service running a ReverseProxy to it, then
+// a large body streamed through the proxy in both directions.
+//
+// Upstream and proxy are forked into child processes. The streamed bodies
+// are sent and read with a Client from this process; the peak resident set
+// of the proxy shows that it does not hold them in memory.
+//
+// Usage: proxy_bench [connections] [seconds] [port]
+
+#include "apee.hpp"
+#include "loadgen.hpp"
+
+#include <condition_variable>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+
+#include <unistd.h>
+
+using namespace apee;
+
+namespace {
+
+constexpr std::uint64_t large_size = 256 * 1024 * 1024;
+constexpr std::size_t piece = 64 * 1024;
+
+// Answers / with a short body, /large with a streamed body of large_size
+// bytes and POST /sink with the size of the streamed request body.
+class Upstream : public AbstractRequestHandler {
+ public:
+  Response on_request(Request const &request) override {
+    if (request.request_line().uri() != "/large") {
+      return Response(StatusCode::OK, MessageBody("Hello from upstream!\n"));
+    }
+    auto sent = std::make_shared<std::uint64_t>(0);
+    return Response(StatusCode::OK, StreamBody([sent](std::string &chunk) {
+                      auto size = std::min<std::uint64_t>(
+                          piece, large_size - *sent);
+                      chunk.assign(size, 'x');
+                      *sent += size;
+                      return *sent < large_size;
+                    }));
+  }
+
+  bool stream_body(Request const &) override { return true; }
+
+  void on_request_stream(Request const &,
+                         BodyReader body,
+                         Responder responder) override {
+    auto state = std::make_shared<std::pair<BodyReader, Responder>>(
+        std::move(body), std::move(responder));
+    read(state, std::make_shared<std::uint64_t>(0));
+  }
+
+ private:
+  static void read(std::shared_ptr<std::pair<BodyReader, Responder>> state,
+                   std::shared_ptr<std::uint64_t> received) {
+    auto &body = state->first;
+    body.read([state, received](std::error_code const &ec,
+                                std::string_view data) {
+      if (ec) {
+        state->second(
+            Response(StatusCode::BadRequest, std::string(ec.message())));
+      } else if (data.empty()) {
+        state->second(
+            Response(StatusCode::OK, std::to_string(*received)));
+      } else {
+        *received += data.size();
+        read(state, received);
+      }
+    });
+  }
+};
+
+// Peak resident set size of `pid` in KiB, -1 if unknown.
+long peak_rss(pid_t pid) {
+  std::ifstream in("/proc/" + std::to_string(pid) + "/status");
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.rfind("VmHWM:", 0) == 0) {
+      return std::atol(line.c_str() + 6);
+    }
+  }
+  return -1;
+}
+
+// Waits for the callbacks of a Client, which run on its own thread.
+class Waiter {
+ public:
+  void done() {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_done = true;
+    m_condition.notify_all();
+  }
+  void wait() {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_condition.wait(lock, [this] { return m_done; });
+  }
+
+ private:
+  std::mutex m_mutex;
+  std::condition_variable m_condition;
+  bool m_done = false;
+};
+
+// Reads the body of /large through the proxy, returns the bytes received.
+std::uint64_t download(Client &client, unsigned short port) {
+  Waiter waiter;
+  std::uint64_t received = 0;
+  std::function<void(AsyncStreamBody)> read = [&](AsyncStreamBody body) {
+    body([&, body](std::error_code const &ec, std::string_view data) {
+      if (ec || data.empty()) {
+        waiter.done();
+        return;
+      }
+      received += data.size();
+      read(body);
+    });
+  };
+  ClientRequest request;
+  request.target = "/large";
+  client.stream("127.0.0.1",
+                port,
+                std::move(request),
+                [&](std::error_code const &ec,
+                    ClientResponse const &,
+                    AsyncStreamBody body) {
+                  if (ec) {
+                    std::cerr << "Download failed: " << ec.message() << '\n';
+                    waiter.done();
+                  } else {
+                    read(std::move(body));
+                  }
+                });
+  waiter.wait();
+  return received;
+}
+
+// Streams large_size bytes to /sink through the proxy, returns the size the
+// upstream reports.
+std::string upload(Client &client, unsigned short port) {
+  Waiter waiter;
+  std::string result;
+  auto sent = std::make_shared<std::uint64_t>(0);
+  auto data = std::make_shared<std::string>(piece, 'y');
+  ClientRequest request;
+  request.method = Method::POST;
+  request.target = "/sink";
+  request.body_stream = [sent, data](auto next) {
+    auto size = std::min<std::uint64_t>(piece, large_size - *sent);
+    *sent += size;
+    next({}, std::string_view(*data).substr(0, size));
+  };
+  client.request("127.0.0.1",
+                 port,
+                 std::move(request),
+                 [&](std::error_code const &ec, ClientResponse response) {
+                   result = ec ? ec.message() : response.body;
+                   waiter.done();
+                 });
+  waiter.wait();
+  return result;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  loadgen::Options options;
+  options.connections = argc > 1 ? std::atoi(argv[1]) : 64;
+  options.duration = std::chrono::seconds(argc > 2 ? std::atoi(argv[2]) : 5);
+  unsigned short upstream_port = argc > 3 ? std::atoi(argv[3]) : 18580;
+  unsigned short proxy_port = upstream_port + 1;
+  options.threads = std::max(1u, std::thread::hardware_concurrency() / 4);
+  auto threads = std::max(1u, std::thread::hardware_concurrency() / 4);
+
+  pid_t upstream = loadgen::fork_server([&] {
+    Config config;
+    config.address = "127.0.0.1";
+    config.port = upstream_port;
+    config.max_requests_per_connection = 1u << 30;
+    config.threading.mode = Threading::Mode::ContextPerThread;
+    config.threading.threads = threads;
+    Service service(config, std::make_shared<Upstream>());
+    service.run();
+  });
+  pid_t proxy = loadgen::fork_server([&] {
+    Config config;
+    config.address = "127.0.0.1";
+    config.port = proxy_port;
+    config.max_requests_per_connection = 1u << 30;
+    config.threading.mode = Threading::Mode::ContextPerThread;
+    config.threading.threads = threads;
+    Service service(
+        config, std::make_shared<ReverseProxy>("127.0.0.1", upstream_port));
+    service.run();
+  });
+  if (!loadgen::wait_for_server(upstream_port) ||
+      !loadgen::wait_for_server(proxy_port)) {
+    std::cerr << "Servers did not start\n";
+    loadgen::stop_server(proxy);
+    loadgen::stop_server(upstream);
+    return 1;
+  }
+
+  std::cout << std::left << std::setw(10) << "path" << std::setw(16)
+            << "requests/sec" << std::setw(12) << "p50 (us)" << "p99 (us)\n";
+  for (auto port : {upstream_port, proxy_port}) {
+    options.port = port;
+    auto result = loadgen::run(options);
+    std::cout << std::left << std::setw(10)
+              << (port == upstream_port ? "direct" : "proxied") << std::fixed
+              << std::setprecision(0) << std::setw(16) << result.rps()
+              << std::setprecision(1) << std::setw(12)
+              << result.latency.percentile(0.5) / 1000.0
+              << result.latency.percentile(0.99) / 1000.0 << '\n';
+    if (result.errors + result.failed > 0) {
+      std::cout << "  " << result.errors << " errors, " << result.failed
+                << " failed\n";
+    }
+  }
+
+  Client client;
+  auto start = std::chrono::steady_clock::now();
+  auto received = download(client, proxy_port);
+  auto download_time = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start);
+  start = std::chrono::steady_clock::now();
+  auto reported = upload(client, proxy_port);
+  auto upload_time = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start);
+  std::cout << std::setprecision(0) << "\nstreamed through the proxy:\n"
+            << "  download " << received << " of " << large_size
+            << " bytes, " << received / download_time.count() / (1 << 20)
+            << " MiB/s\n"
+            << "  upload " << reported << " of " << large_size << " bytes, "
+            << large_size / upload_time.count() / (1 << 20) << " MiB/s\n"
+            << "  proxy peak RSS " << peak_rss(proxy) << " KiB\n";
+
+  loadgen::stop_server(proxy);
+  loadgen::stop_server(upstream);
+}
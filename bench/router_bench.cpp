@@ -0,0 +1,100 @@
+// Compares Router against a hand-written chain of string comparisons, both
+// dispatching over a table of 500 routes.
+
+#include "apee.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+using namespace apee;
+
+namespace {
+
+constexpr int route_count = 500;
+
+std::vector<std::string> literal_paths() {
+  std::vector<std::string> paths;
+  for (int i = 0; i < route_count; ++i) {
+    paths.push_back("/api/v1/resource" + std::to_string(i) + "/items");
+  }
+  return paths;
+}
+
+Router make_router() {
+  Router router;
+  auto ok = [](Request const &, RouteParams const &) {
+    return Response(StatusCode::OK, MessageBody("ok"));
+  };
+  for (auto const &path : literal_paths()) {
+    router.add(Method::GET, path, ok);
+  }
+  for (int i = 0; i < route_count / 2; ++i) {
+    router.add(Method::GET,
+               "/api/v2/resource" + std::to_string(i) + "/{id}/items/{item}",
+               ok);
+  }
+  router.add(Method::GET, "/static/*path", ok);
+  return router;
+}
+
+Request get(std::string_view uri) {
+  return Request(RequestLine(Method::GET, uri, Version()), MessageBody(""));
+}
+
+void BM_LinearChain(benchmark::State &state) {
+  auto paths = literal_paths();
+  auto request = get("/api/v1/resource499/items");
+  for (auto _ : state) {
+    auto uri = request.request_line().uri();
+    auto status = StatusCode::NotFound;
+    for (auto const &path : paths) {
+      if (uri == path && request.request_line().method() == Method::GET) {
+        status = StatusCode::OK;
+        break;
+      }
+    }
+    benchmark::DoNotOptimize(status);
+  }
+}
+BENCHMARK(BM_LinearChain);
+
+void BM_RouterLiteral(benchmark::State &state) {
+  auto router = make_router();
+  auto request = get("/api/v1/resource499/items");
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(router.on_request(request));
+  }
+}
+BENCHMARK(BM_RouterLiteral);
+
+void BM_RouterParams(benchmark::State &state) {
+  auto router = make_router();
+  auto request = get("/api/v2/resource249/1234/items/abcd?verbose=1");
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(router.on_request(request));
+  }
+}
+BENCHMARK(BM_RouterParams);
+
+void BM_RouterWildcard(benchmark::State &state) {
+  auto router = make_router();
+  auto request = get("/static/css/site/main.css");
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(router.on_request(request));
+  }
+}
+BENCHMARK(BM_RouterWildcard);
+
+void BM_RouterNotFound(benchmark::State &state) {
+  auto router = make_router();
+  auto request = get("/api/v3/unknown/route");
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(router.on_request(request));
+  }
+}
+BENCHMARK(BM_RouterNotFound);
+
+}  // namespace
+
+BENCHMARK_MAIN();
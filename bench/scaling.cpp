@@ -0,0 +1,68 @@
+// Measures requests/sec of a Service as the number of server threads grows.
+//
+// For every thread count from 1 to N a Service is forked into a child process
+// and driven over loopback by a closed-loop client, once per threading mode.
+// Every request uses a new connection.
+//
+// Usage: scaling_bench [max_threads] [connections] [seconds] [port]
+
+#include "apee.hpp"
+#include "loadgen.hpp"
+
+#include <cstdlib>
+#include <iomanip>
+#include <thread>
+
+using namespace apee;
+
+struct Handler : public AbstractRequestHandler {
+  Response on_request(Request const &) override {
+    return Response(StatusCode::OK, MessageBody("Hello from Handler!\n"));
+  }
+};
+
+int main(int argc, char **argv) {
+  unsigned int max_threads =
+      argc > 1 ? std::atoi(argv[1])
+               : std::max(1u, std::thread::hardware_concurrency());
+  loadgen::Options options;
+  options.connections = argc > 2 ? std::atoi(argv[2]) : 32;
+  options.threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+  options.duration = std::chrono::seconds(argc > 3 ? std::atoi(argv[3]) : 5);
+  options.port = argc > 4 ? std::atoi(argv[4]) : 18080;
+  options.keep_alive = false;
+
+  std::cout << std::left << std::setw(20) << "mode" << std::setw(10)
+            << "threads" << std::setw(16) << "requests/sec" << "p99 (us)\n";
+  for (auto mode :
+       {Threading::Mode::SharedContext, Threading::Mode::ContextPerThread}) {
+    for (unsigned int threads = 1; threads <= max_threads; ++threads) {
+      Threading threading;
+      threading.mode = mode;
+      threading.threads = threads;
+      threading.pin_threads = true;
+      pid_t server = loadgen::fork_server([&] {
+        Service service("127.0.0.1",
+                        options.port,
+                        std::make_shared<Handler>(),
+                        threading);
+        service.run();
+      });
+      if (!loadgen::wait_for_server(options.port)) {
+        std::cerr << "Server did not start on port " << options.port << '\n';
+        loadgen::stop_server(server);
+        return 1;
+      }
+      auto result = loadgen::run(options);
+      loadgen::stop_server(server);
+      std::cout << std::left << std::setw(20)
+                << (mode == Threading::Mode::SharedContext
+                        ? "shared-context"
+                        : "context-per-thread")
+                << std::setw(10) << threads << std::fixed
+                << std::setprecision(0) << std::setw(16) << result.rps()
+                << result.latency.percentile(0.99) / 1000.0 << '\n';
+      ++options.port;
+    }
+  }
+}
@@ -0,0 +1,66 @@
+// Throughput of StaticFiles for a small (mapped) and a large (sendfile)
+// file, served by a forked Service to keep-alive clients over loopback.
+//
+// Usage: static_bench [connections] [seconds] [port]
+
+#include "apee.hpp"
+#include "loadgen.hpp"
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+
+using namespace apee;
+
+namespace {
+
+std::string make_root(std::size_t large_size) {
+  char dir[] = "/tmp/apee-static-XXXXXX";
+  std::string root = mkdtemp(dir);
+  std::ofstream(root + "/small.txt") << std::string(1024, 's');
+  std::ofstream(root + "/large.bin") << std::string(large_size, 'l');
+  return root;
+}
+
+void measure(std::string const &name,
+             std::string const &target,
+             loadgen::Options options) {
+  options.target = target;
+  auto result = loadgen::run(options);
+  std::cout << std::left << std::setw(12) << name << std::fixed
+            << std::setprecision(0) << std::setw(16) << result.rps()
+            << std::setprecision(1) << std::setw(12)
+            << result.bytes / result.elapsed.count() / (1 << 20)
+            << result.latency.percentile(0.99) / 1000.0 << '\n';
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  loadgen::Options options;
+  options.connections = argc > 1 ? std::atoi(argv[1]) : 8;
+  options.duration = std::chrono::seconds(argc > 2 ? std::atoi(argv[2]) : 5);
+  options.port = argc > 3 ? std::atoi(argv[3]) : 18180;
+
+  auto root = make_root(8 << 20);
+  pid_t server = loadgen::fork_server([&] {
+    Service service(
+        "127.0.0.1", options.port, std::make_shared<StaticFiles>(root));
+    service.run();
+  });
+  if (!loadgen::wait_for_server(options.port)) {
+    std::cerr << "Server did not start on port " << options.port << '\n';
+    loadgen::stop_server(server);
+    return 1;
+  }
+  std::cout << std::left << std::setw(12) << "file" << std::setw(16)
+            << "requests/sec" << std::setw(12) << "MiB/sec" << "p99 (us)\n";
+  measure("1 KiB", "/small.txt", options);
+  measure("8 MiB", "/large.bin", options);
+  loadgen::stop_server(server);
+  std::remove((root + "/small.txt").c_str());
+  std::remove((root + "/large.bin").c_str());
+  rmdir(root.c_str());
+}
@@ -0,0 +1,94 @@
+// Throughput, latency and server CPU time per request of the same workload
+// served with epoll and with io_uring (see IoUring).
+//
+// For each transport a Service is forked into a child process and driven by
+// closed-loop clients on persistent connections. The CPU time the server
+// process used during the run is read from /proc before it is stopped.
+//
+// Usage: uring_bench [connections] [seconds] [port]
+
+#include "apee.hpp"
+#include "loadgen.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+#include <unistd.h>
+
+using namespace apee;
+
+namespace {
+
+struct Handler : public AbstractRequestHandler {
+  Response on_request(Request const &) override {
+    return Response(StatusCode::OK, MessageBody("Hello from Handler!\n"));
+  }
+};
+
+// User and system time of `pid` in microseconds, -1 if unknown.
+double cpu_time(pid_t pid) {
+  std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat;
+  if (!std::getline(in, stat)) {
+    return -1;
+  }
+  // The fields after the command name, which may contain spaces.
+  std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+  std::string field;
+  // utime and stime are fields 14 and 15, the state is field 3.
+  for (int i = 3; i < 14; ++i) {
+    fields >> field;
+  }
+  double utime = 0, stime = 0;
+  fields >> utime >> stime;
+  return (utime + stime) * 1e6 / ::sysconf(_SC_CLK_TCK);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  loadgen::Options options;
+  options.connections = argc > 1 ? std::atoi(argv[1]) : 64;
+  options.duration = std::chrono::seconds(argc > 2 ? std::atoi(argv[2]) : 5);
+  options.port = argc > 3 ? std::atoi(argv[3]) : 18480;
+  options.threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+
+  std::cout << std::left << std::setw(12) << "transport" << std::setw(16)
+            << "requests/sec" << std::setw(12) << "p50 (us)" << std::setw(12)
+            << "p99 (us)" << "server CPU (us/request)\n";
+  for (bool io_uring : {false, true}) {
+    pid_t server = loadgen::fork_server([&] {
+      Config config;
+      config.address = "127.0.0.1";
+      config.port = options.port;
+      config.max_requests_per_connection = 1u << 30;
+      config.io_uring.enabled = io_uring;
+      Service service(config, std::make_shared<Handler>());
+      service.run();
+    });
+    if (!loadgen::wait_for_server(options.port)) {
+      std::cerr << "Server did not start on port " << options.port << '\n';
+      loadgen::stop_server(server);
+      return 1;
+    }
+    auto cpu_before = cpu_time(server);
+    auto result = loadgen::run(options);
+    auto cpu = cpu_time(server) - cpu_before;
+    loadgen::stop_server(server);
+    auto cpu_per_request = result.requests > 0 ? cpu / result.requests : 0.0;
+    std::cout << std::left << std::setw(12)
+              << (io_uring ? "io_uring" : "epoll") << std::fixed
+              << std::setprecision(0) << std::setw(16) << result.rps()
+              << std::setprecision(1) << std::setw(12)
+              << result.latency.percentile(0.5) / 1000.0 << std::setw(12)
+              << result.latency.percentile(0.99) / 1000.0
+              << std::setprecision(2) << cpu_per_request << '\n';
+    if (result.errors > 0) {
+      std::cout << "  " << result.errors << " errors\n";
+    }
+    ++options.port;
+  }
+}
@@ -0,0 +1,109 @@
+#ifndef APEE_ADMISSION_H
+#define APEE_ADMISSION_H
+
+#include "apee.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace apee {
+
+// The adaptive in-flight limit of Admission::Limit::Aimd and Gradient.
+// Handler latencies are summed up in windows of at least `window` and
+// `min_samples` requests, the limit is recomputed once per window by the
+// thread that completes it. Recording a sample takes no lock.
+class ConcurrencyLimit {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr Clock::duration window = std::chrono::milliseconds(100);
+  static constexpr std::uint64_t min_samples = 10;
+
+  explicit ConcurrencyLimit(Admission const &options);
+
+  std::size_t get() const { return m_limit.load(std::memory_order_relaxed); }
+
+  // Records a request that was handled in `latency` while `in_flight`
+  // requests, itself included, were being handled.
+  void record(Clock::duration latency,
+              std::size_t in_flight,
+              Clock::time_point now);
+
+ private:
+  // New limit from the window's average latency in nanoseconds and the
+  // highest number of requests in flight during the window.
+  double aimd(double latency,
+              std::size_t in_flight,
+              std::uint64_t samples) const;
+  double gradient(double latency, std::size_t in_flight);
+
+  Admission::Limit m_algorithm;
+  double m_min;
+  double m_max;
+  double m_threshold;
+  std::atomic<std::size_t> m_limit;
+
+  // The current window.
+  std::atomic<std::uint64_t> m_samples{0};
+  std::atomic<std::uint64_t> m_latency_sum{0};
+  std::atomic<std::size_t> m_max_in_flight{0};
+  std::atomic<Clock::rep> m_window_end;
+
+  // Guards the update at the end of a window.
+  std::mutex m_mutex;
+  double m_estimate;
+  // Long-term average latency of the gradient limit, in nanoseconds.
+  double m_long_latency = 0;
+};
+
+// Enforces the Admission settings of a Service for its listeners and
+// connections. Without limits nothing is counted.
+class AdmissionControl {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit AdmissionControl(Admission const &options);
+
+  // Takes a connection slot for the next accept, false if all are taken.
+  bool reserve_connection();
+  // Frees the slot of a closed connection or of a failed accept.
+  void release_connection();
+  // Calls `resume` once a slot is free, right away if one already is.
+  // `resume` is called on the thread that freed the slot.
+  void wait_for_connection(std::function<void()> resume);
+  // Drops the pending wait_for_connection() callbacks, for listeners that
+  // are going away.
+  void cancel_waiting();
+
+  // Admits a request to the handler unless the in-flight limit is reached.
+  bool admit();
+  // Ends an admitted request the handler answered after `latency`.
+  void release(Clock::duration latency, Clock::time_point now);
+
+  // Zero if not tracked, see MetricsSnapshot.
+  std::size_t in_flight() const {
+    return m_in_flight.load(std::memory_order_relaxed);
+  }
+  std::size_t limit() const;
+
+ private:
+  std::size_t m_max_connections;
+  std::size_t m_max_in_flight;
+  std::unique_ptr<ConcurrencyLimit> m_adaptive;
+
+  std::atomic<std::size_t> m_connections{0};
+  std::atomic<std::size_t> m_in_flight{0};
+
+  std::mutex m_mutex;
+  std::vector<std::function<void()>> m_waiting;
+  std::atomic<bool> m_has_waiting{false};
+};
+
+}  // namespace apee
+
+#endif  // APEE_ADMISSION_H
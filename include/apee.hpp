@@ -1,9 +1,19 @@
 #ifndef APEE_H
 #define APEE_H
 
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <variant>
+#include <vector>
 
 namespace apee {
 
@@ -56,6 +66,8 @@ enum class StatusCode {
   UnsupportedMediaType = 415,
   RequestedRangeNotSatisfiable = 416,
   ExpectationFailed = 417,
+  TooManyRequests = 429,
+  RequestHeaderFieldsTooLarge = 431,
   InternalServerError = 500,
   NotImplemented = 501,
   BadGateway = 502,
@@ -111,39 +123,887 @@ class MessageBody {
 
 std::ostream &operator<<(std::ostream &out, MessageBody const &op);
 
+// Well-known header fields, looked up in constant time. Other fields are
+// looked up by name.
+enum class Field : std::uint8_t {
+  Accept,
+  AcceptEncoding,
+  AcceptLanguage,
+  AcceptRanges,
+  AccessControlAllowOrigin,
+  Age,
+  Allow,
+  Authorization,
+  CacheControl,
+  Connection,
+  ContentDisposition,
+  ContentEncoding,
+  ContentLanguage,
+  ContentLength,
+  ContentLocation,
+  ContentRange,
+  ContentType,
+  Cookie,
+  Date,
+  ETag,
+  Expect,
+  Expires,
+  Forwarded,
+  Host,
+  IfMatch,
+  IfModifiedSince,
+  IfNoneMatch,
+  IfRange,
+  IfUnmodifiedSince,
+  LastModified,
+  Location,
+  Origin,
+  Range,
+  Referer,
+  RetryAfter,
+  Server,
+  SetCookie,
+  TransferEncoding,
+  Upgrade,
+  UserAgent,
+  Vary,
+  WWWAuthenticate,
+  // Any other field.
+  Unknown
+};
+
+constexpr std::size_t field_count = static_cast<std::size_t>(Field::Unknown);
+
+// The canonical name of `field`, empty for Field::Unknown.
+std::string_view to_string(Field field);
+// The Field named `name` (case-insensitive), Field::Unknown if none is.
+Field to_field(std::string_view name);
+
+// Read-only view of the header fields of a received request. The values of
+// the well-known fields are indexed once when the view is created.
+class Headers {
+  void const *m_fields = nullptr;
+  // One more for Field::Unknown, which is always empty.
+  std::array<std::string_view, field_count + 1> m_known{};
+
+ public:
+  Headers() = default;
+  // `fields` points to the parsed fields of the message held by a connection.
+  explicit Headers(void const *fields);
+
+  // The value of `field`, empty if absent. For repeated fields the first.
+  std::string_view operator[](Field field) const {
+    return m_known[static_cast<std::size_t>(field)];
+  }
+  // The value of the field `name` (case-insensitive), empty if absent.
+  std::string_view operator[](std::string_view name) const;
+
+  // Calls `visit` for every field in the order received, repeated ones
+  // included.
+  void for_each(std::function<void(std::string_view name,
+                                   std::string_view value)> const &visit)
+      const;
+};
+
+// A request as received by a Service. The URI, body and headers are views
+// into the buffers of the connection that read the request; they stay valid
+// until the response has been handed to the connection and must be copied if
+// needed for longer.
 class Request {
   RequestLine m_request_line;
   MessageBody m_body;
+  Headers m_headers;
 
  public:
-  Request(RequestLine const &request_line, MessageBody const &body);
+  Request(RequestLine const &request_line,
+          MessageBody const &body,
+          Headers const &headers = Headers());
 
-  RequestLine request_line() const;
-  MessageBody body() const;
+  RequestLine const &request_line() const;
+  MessageBody const &body() const;
+  Headers const &headers() const;
+};
+
+// A region of an open file, sent with sendfile(2). The descriptor is shared
+// by copies of the body and closed together with the last of them.
+class FileBody {
+  std::shared_ptr<int const> m_fd;
+  std::uint64_t m_offset;
+  std::uint64_t m_size;
+
+ public:
+  // Takes ownership of `fd`.
+  FileBody(int fd, std::uint64_t offset, std::uint64_t size);
+  FileBody(std::shared_ptr<int const> fd,
+           std::uint64_t offset,
+           std::uint64_t size);
+
+  // Opens the whole file at `path` for reading.
+  static FileBody open(std::string const &path, std::error_code &ec);
+
+  int fd() const { return *m_fd; }
+  std::shared_ptr<int const> const &shared_fd() const { return m_fd; }
+  std::uint64_t offset() const { return m_offset; }
+  std::uint64_t size() const { return m_size; }
+};
+
+// A view into memory owned elsewhere, such as a mapped file, sent without
+// copying. `owner` keeps the memory alive until the response is written.
+class SharedBody {
+  std::shared_ptr<void const> m_owner;
+  std::string_view m_data;
+
+ public:
+  SharedBody(std::shared_ptr<void const> owner, std::string_view data);
+
+  std::string_view str() const { return m_data; }
+  std::shared_ptr<void const> const &owner() const { return m_owner; }
+};
+
+// Produces a body piece by piece, sent with chunked transfer encoding. Each
+// call appends the next piece to `chunk`, which is empty on entry, and
+// returns false once the body is complete.
+using StreamBody = std::function<bool(std::string &chunk)>;
+
+// Produces a body piece by piece from an asynchronous source, such as the
+// response of an upstream server. Each call asks for the next piece, which
+// `next` receives on any thread. The piece stays valid until the following
+// call, an empty one ends the body and an error aborts it.
+using AsyncStreamBody = std::function<void(
+    std::function<void(std::error_code const &ec, std::string_view piece)>
+        next)>;
+
+// Header fields set on a Response. Names and values are copied into a single
+// buffer, so setting a field allocates only when that buffer or the list of
+// fields has to grow.
+class ResponseHeaders {
+ public:
+  struct Entry {
+    // Field::Unknown for fields set by a name that is not well-known.
+    Field field;
+    std::string_view name;
+    std::string_view value;
+    // Added by add() after a field of the same name.
+    bool repeated;
+  };
+
+  // Sets a field, replacing all previous ones of the same name.
+  void set(Field field, std::string_view value);
+  void set(std::string_view name, std::string_view value);
+  // Adds a field after those of the same name, e.g. another Set-Cookie.
+  void add(Field field, std::string_view value);
+  void add(std::string_view name, std::string_view value);
+
+  // The value of a field, empty if not set. For repeated fields the first.
+  std::string_view operator[](Field field) const;
+  std::string_view operator[](std::string_view name) const;
+
+  // The fields in the order they were first set.
+  std::size_t size() const { return m_slots.size(); }
+  Entry entry(std::size_t index) const;
+
+ private:
+  // The name, empty for well-known fields, followed by the value.
+  struct Slot {
+    Field field;
+    bool repeated;
+    std::uint32_t offset;
+    std::uint32_t name_size;
+    std::uint32_t value_size;
+  };
+
+  // The index of the first slot of the field from `from` on, size() if
+  // there is none.
+  std::size_t find(Field field,
+                   std::string_view name,
+                   std::size_t from = 0) const;
+  std::string_view value(std::size_t index) const;
+  void store(Field field,
+             std::string_view name,
+             std::string_view value,
+             bool repeat);
+
+  std::string m_data;
+  std::vector<Slot> m_slots;
 };
 
+// The Content-Length sent is that of the body, except for answers to HEAD
+// requests and NotModified responses with an empty body, which keep a
+// Content-Length set on them: that of the body a GET would get.
 class Response {
+ public:
+  // A view copied once into the connection, a string moved into it, a view
+  // sent from memory kept alive by its owner, a file or a stream.
+  using Payload = std::variant<MessageBody,
+                               std::string,
+                               SharedBody,
+                               FileBody,
+                               StreamBody,
+                               AsyncStreamBody>;
+
+ private:
   StatusLine m_status_line;
-  MessageBody m_body;
+  Payload m_payload;
+  ResponseHeaders m_headers;
+  std::chrono::milliseconds m_cache_ttl{-1};
 
  public:
   Response(StatusLine const &status_line, MessageBody const &body);
+  Response(StatusLine const &status_line, std::string body);
+  Response(StatusLine const &status_line, SharedBody body);
+  Response(StatusLine const &status_line, FileBody body);
+  Response(StatusLine const &status_line, StreamBody body);
+  Response(StatusLine const &status_line, AsyncStreamBody body);
 
+  // Adds a header field, replacing all previous ones of the same name.
+  Response &set_header(Field field, std::string_view value);
+  Response &set_header(std::string_view name, std::string_view value);
+  // Adds a header field after those of the same name.
+  Response &add_header(std::string_view name, std::string_view value);
+
+  // Keeps the response in the response cache of the Service for `ttl`,
+  // regardless of its Cache-Control header. Zero prevents caching.
+  Response &set_cache_ttl(std::chrono::milliseconds ttl);
+  // Negative unless set_cache_ttl() was called.
+  std::chrono::milliseconds cache_ttl() const { return m_cache_ttl; }
+
+  // The body for view, string and shared payloads, empty for files and
+  // streams.
   MessageBody body() const;
+  Payload const &payload() const { return m_payload; }
+  Payload &payload() { return m_payload; }
+  ResponseHeaders const &headers() const { return m_headers; }
   StatusLine status_line() const;
 };
 
+struct Threading {
+  enum class Mode {
+    // One io_context, run on the thread calling Service::run().
+    Single,
+    // One io_context shared by `threads` threads. Each connection is
+    // serialised on its own strand.
+    SharedContext,
+    // One io_context per thread, each with its own SO_REUSEPORT acceptor so
+    // the kernel balances incoming connections across threads.
+    ContextPerThread
+  };
+
+  Mode mode = Mode::Single;
+  // Number of threads, 0 selects std::thread::hardware_concurrency().
+  unsigned int threads = 0;
+  // Pin thread i to CPU i (modulo the number of CPUs).
+  bool pin_threads = false;
+  // Threads of the pool that runs the requests handlers offload, see
+  // AbstractRequestHandler::offload(). 0 for no pool, then such requests
+  // are handled on the I/O threads.
+  unsigned int workers = 0;
+};
+
+// Deadlines of the connections of a Service, enforced with a resolution of
+// 100 ms. A connection that misses one is closed.
+struct Timeouts {
+  // Waiting for the next request on a persistent connection.
+  std::chrono::milliseconds idle = std::chrono::seconds(60);
+  // Receiving the request line and headers, from the first byte or, for the
+  // first request, from accepting the connection.
+  std::chrono::milliseconds header = std::chrono::seconds(60);
+  // Receiving the request body.
+  std::chrono::milliseconds read = std::chrono::seconds(60);
+  // Sending the response. Streamed and file bodies restart it whenever a
+  // part of the body has been sent.
+  std::chrono::milliseconds write = std::chrono::seconds(60);
+};
+
+// Cache of GET responses in front of the handler, shared by all threads of
+// a Service. Hits are answered without calling the handler, from a copy of
+// the response serialised when it was stored.
+//
+// Responses with status 200, 203, 204, 300, 301, 404, 405, 410, 414 or 501
+// and a string, MessageBody or SharedBody payload are cached for their
+// Response::cache_ttl(), else for the s-maxage or max-age of their
+// Cache-Control header, else for default_ttl. Responses with Cache-Control
+// no-store, no-cache or private, with Set-Cookie or varying on fields
+// other than key_headers are not cached, nor are answers to requests with
+// an Authorization header.
+struct Caching {
+  // Memory used by cached responses, 0 disables the cache.
+  std::size_t memory_budget = 0;
+  // Independently locked parts of the cache, each with its own LRU list and
+  // an equal share of the budget.
+  unsigned int shards = 16;
+  // Request header fields whose values are part of the key, in addition to
+  // the URI, e.g. Accept-Encoding.
+  std::vector<std::string> key_headers;
+  // Lifetime of responses without TTL or Cache-Control, 0 to not cache
+  // them.
+  std::chrono::milliseconds default_ttl{0};
+  // Larger responses are not cached.
+  std::size_t max_entry_size = 1024 * 1024;
+  // Add a strong ETag computed from the body to responses that have none,
+  // so clients can revalidate with If-None-Match and get NotModified.
+  bool etags = true;
+};
+
+// Compression of response bodies with the encoding negotiated from
+// Accept-Encoding. String, MessageBody and SharedBody payloads are
+// compressed at once, StreamBody payloads chunk by chunk, files are sent as
+// they are. Responses that already have a Content-Encoding and partial
+// responses with a Content-Range are left alone.
+struct Compression {
+  bool enabled = false;
+  // zlib level of gzip and deflate, 1 (fastest) to 9 (smallest).
+  int level = 6;
+  // Offer brotli if apee was built with it, at this quality (0 to 11).
+  bool brotli = true;
+  int brotli_quality = 4;
+  // Smaller bodies are sent uncompressed.
+  std::size_t min_size = 1024;
+  // Prefixes of the Content-Type of compressed responses.
+  std::vector<std::string> content_types = {"text/",
+                                            "application/json",
+                                            "application/javascript",
+                                            "application/xml",
+                                            "image/svg+xml"};
+  // Memory for compressed bodies of responses with a strong ETag, such as
+  // those of StaticFiles, which are reused while the ETag is unchanged. 0
+  // compresses every response anew.
+  std::size_t variant_cache_size = 16 * 1024 * 1024;
+};
+
+// Protection of a Service against more load than it can handle. At
+// max_connections the acceptors stop accepting, further connections wait in
+// the listen backlog until one closes. Requests for the handler beyond the
+// in-flight limit are answered at once with ServiceUnavailable and
+// Retry-After instead of queueing behind the admitted ones, which keeps the
+// latency of those bounded. Requests answered from the response cache, OPTIONS
+// requests and the metrics path are always admitted.
+struct Admission {
+  enum class Limit {
+    // At most max_in_flight requests, no limit if it is 0.
+    Fixed,
+    // Additive increase while the average handler latency stays below
+    // latency_threshold, multiplicative decrease above it.
+    Aimd,
+    // Follows the ratio of the long-term to the short-term average handler
+    // latency, so the limit shrinks as soon as requests start queueing,
+    // without a latency target (in the style of Netflix' Gradient2).
+    Gradient
+  };
+
+  // Open connections, 0 for no limit.
+  std::size_t max_connections = 0;
+  // Requests passed to the handler and not yet answered, 0 for no limit.
+  std::size_t max_in_flight = 0;
+  Limit limit = Limit::Fixed;
+  // An adaptive limit starts at initial_limit and stays between min_limit
+  // and max_in_flight (unbounded if 0).
+  std::size_t initial_limit = 32;
+  std::size_t min_limit = 4;
+  std::chrono::milliseconds latency_threshold{100};
+  // Sent as Retry-After with ServiceUnavailable, rounded up to seconds.
+  // Omitted if 0.
+  std::chrono::milliseconds retry_after = std::chrono::seconds(1);
+};
+
+// Limits the request rate of each client. Every client key has a token
+// bucket holding up to `burst` requests that refills at `rate` requests per
+// second. A request that finds its bucket empty is answered with
+// TooManyRequests, and a Retry-After of when the next token arrives, right
+// after its header was read: neither the handler nor the body reader sees
+// it, and the connection is closed. Keys are the client's address, or the
+// value of `header` where a request has it, e.g. X-Forwarded-For behind a
+// proxy or an API key. With `per_path` each path of a client has a bucket
+// of its own. The buckets are spread over `shards` shards with a mutex and
+// an LRU list each, at most `max_keys` in all; when a shard is full, the
+// bucket of its longest idle key makes room.
+struct RateLimit {
+  // Requests per second and key, 0 disables the limit.
+  double rate = 0;
+  // Requests allowed at once after a key was idle, at least 1.
+  double burst = 10;
+  std::string header;
+  bool per_path = false;
+  std::size_t max_keys = 100000;
+  unsigned int shards = 16;
+};
+
+// Linux only: reads, writes and accepts of the connections are submitted to
+// an io_uring per io_context instead of waiting for readiness with epoll.
+// The read buffers of the connections are registered with the ring, so the
+// kernel reads into them without mapping their pages for every read, and
+// the submissions made while handling a batch of completions are passed to
+// the kernel with one system call. Without a connection limit, a single
+// multishot accept serves all connections of a listener. If apee was built
+// without io_uring or the kernel refuses to set up a ring, a warning is
+// logged and the Service uses epoll.
+struct IoUring {
+  bool enabled = false;
+  // Submission queue entries of each ring.
+  unsigned int entries = 1024;
+  // Registered read buffers of each ring, each of the size of the read
+  // buffer of a connection. Connections beyond that read into buffers of
+  // their own.
+  unsigned int registered_buffers = 1024;
+};
+
+// HTTP/2 without TLS (h2c) next to HTTP/1.1 on the listener. A connection
+// switches to it when it starts with the HTTP/2 connection preface (prior
+// knowledge) or when its first request asks for "Upgrade: h2c". Its
+// requests are then multiplexed as streams over the one connection, each
+// handed to the same AbstractRequestHandler; the responses are sent as
+// their bodies become ready, in the order of the priorities the client
+// gave the streams, and the header fields are compressed with HPACK. The
+// response cache only serves HTTP/1 requests. The requests per connection
+// of Config count the streams, after the last one the connection is closed
+// with GOAWAY. The idle timeout applies while a connection has no streams,
+// the read timeout while a request body is awaited.
+struct Http2 {
+  bool enabled = false;
+  // Streams a client may have open at once, more are refused.
+  unsigned int max_concurrent_streams = 100;
+  // Flow-control windows of every stream and of the whole connection: how
+  // much of the request bodies may be in flight before they are read.
+  std::uint32_t stream_window_size = 256 * 1024;
+  std::uint32_t connection_window_size = 1024 * 1024;
+  // Largest frame payload received, from 16384 to 16777215.
+  std::uint32_t max_frame_size = 16384;
+  // Size of the HPACK table for the header fields received.
+  std::uint32_t header_table_size = 4096;
+};
+
+// Settings of a Service. Zero for a socket option keeps the system default.
 struct Config {
-  std::string address;
-  unsigned short port;
-  std::string server_name;
+  std::string address = "0.0.0.0";
+  unsigned short port = 80;
+  // Value of the Server header, omitted if empty.
+  std::string server_name = "Beast";
+  Threading threading;
+  Timeouts timeouts;
+  Caching caching;
+  Compression compression;
+  Admission admission;
+  RateLimit rate_limit;
+  IoUring io_uring;
+  Http2 http2;
+
+  // Length of the queue of accepted connections, 0 for SOMAXCONN.
+  int backlog = 0;
+  // Disable Nagle's algorithm, so a response written in several parts is
+  // not delayed.
+  bool tcp_nodelay = true;
+  // SO_RCVBUF and SO_SNDBUF of accepted sockets, in bytes.
+  int receive_buffer_size = 0;
+  int send_buffer_size = 0;
+  // Linux only: hold a connection in the kernel until its first data
+  // arrives or this many seconds passed (TCP_DEFER_ACCEPT).
+  int defer_accept = 0;
+  // Pending TCP Fast Open requests, enables TCP_FASTOPEN when not 0.
+  int fast_open_queue = 0;
+
+  // Limit of the read buffer of a connection. It holds the request header,
+  // so it is never smaller than max_header_size.
+  std::size_t read_buffer_size = 8192;
+  // Larger requests are answered with 431 or 413 and the connection closed.
+  std::size_t max_header_size = 8192;
+  std::uint64_t max_body_size = 1024 * 1024;
+  // Limit of bodies streamed to AbstractRequestHandler::on_request_stream,
+  // 0 for none. A larger Content-Length is answered with 413, a chunked body
+  // growing beyond it fails the BodyReader.
+  std::uint64_t max_streamed_body_size = 0;
+  // Answer POST, PUT and PATCH requests without Content-Length, including
+  // chunked ones, with LengthRequired.
+  bool require_content_length = false;
+  // Requests served on a persistent connection before it is closed.
+  unsigned int max_requests_per_connection = 100;
+  // Target answered with the metrics, see Service::serve_metrics().
+  std::string metrics_path;
+
+  // Call Service::stop() on SIGTERM and SIGINT.
+  bool stop_on_signals = true;
+  // Time open connections get to finish when the Service stops.
+  std::chrono::milliseconds drain_timeout = std::chrono::seconds(30);
+  // Unix socket over which a Service hands its listening sockets to its
+  // successor, see Service. Empty disables restarts without downtime.
+  std::string handoff_path;
+
+  // Reads the settings present in a YAML file, using the member names as
+  // keys. Threading, Timeouts, Caching, Compression, Admission, RateLimit
+  // (as rate_limit), IoUring (as io_uring) and Http2 (as http2) are nested
+  // maps, durations are given in milliseconds, the threading mode as
+  // single, shared_context or context_per_thread and the admission limit as
+  // fixed, aimd or gradient:
+  //
+  //   port: 8080
+  //   threading:
+  //     mode: context_per_thread
+  //     threads: 4
+  //   timeouts:
+  //     idle: 5000
+  //
+  // Throws std::runtime_error if the file cannot be read or parsed, or if
+  // apee was built without yaml-cpp.
+  static Config from_yaml(std::string const &path);
+};
+
+// Latency distribution of one stage of request processing.
+struct StageMetrics {
+  std::uint64_t count = 0;
+  std::chrono::nanoseconds sum{0};
+  std::chrono::nanoseconds p50{0};
+  std::chrono::nanoseconds p90{0};
+  std::chrono::nanoseconds p99{0};
+  std::chrono::nanoseconds p999{0};
+  std::chrono::nanoseconds max{0};
+};
+
+// Counters and stage latencies of a Service since it was created.
+struct MetricsSnapshot {
+  // From accepting a connection until its first request has been read.
+  StageMetrics accept;
+  // From the first byte of a request (or from starting to read a pipelined
+  // request) until it has been parsed.
+  StageMetrics read;
+  // From the parsed request until the handler responded.
+  StageMetrics handler;
+  // Writing the response.
+  StageMetrics write;
+  // Responses by status code.
+  std::map<unsigned int, std::uint64_t> responses;
+  // Failed accepts and reads by "stage: message".
+  std::map<std::string, std::uint64_t> errors;
+  std::uint64_t connections_accepted = 0;
+  std::int64_t connections_active = 0;
+  std::uint64_t bytes_received = 0;
+  std::uint64_t bytes_sent = 0;
+  // Connections closed because they missed one of their Timeouts.
+  std::uint64_t timeouts = 0;
+  // Requests answered from the response cache and requests it could have
+  // answered but had no fresh entry for.
+  std::uint64_t cache_hits = 0;
+  std::uint64_t cache_misses = 0;
+  // Requests answered with ServiceUnavailable by admission control, the
+  // requests being handled and their current limit. The last two are only
+  // tracked with a limit configured, see Admission.
+  std::uint64_t requests_rejected = 0;
+  std::uint64_t requests_in_flight = 0;
+  std::uint64_t concurrency_limit = 0;
+  // Requests answered with TooManyRequests by the RateLimit and the client
+  // keys it tracks.
+  std::uint64_t requests_rate_limited = 0;
+  std::uint64_t rate_limit_keys = 0;
+  // Offloaded requests waiting for a thread of the worker pool, requests a
+  // worker took from the queue of another one and requests run on the pool.
+  // Zero without Threading::workers.
+  std::uint64_t worker_queue_depth = 0;
+  std::uint64_t worker_steals = 0;
+  std::uint64_t worker_tasks = 0;
+};
+
+namespace detail {
+struct ResponseSink {
+  virtual ~ResponseSink();
+  virtual void respond(Response &&response) = 0;
+};
+}  // namespace detail
+
+// Completes a request handled by on_request_async. It may be invoked from any
+// thread, exactly once; a MessageBody is copied before the call returns,
+// other payloads are moved, and the response is written on the connection's
+// executor. A Responder destroyed without being invoked answers with
+// InternalServerError.
+class Responder {
+  std::shared_ptr<detail::ResponseSink> m_sink;
+
+ public:
+  explicit Responder(std::shared_ptr<detail::ResponseSink> sink);
+  ~Responder();
+  Responder(Responder &&) noexcept;
+  Responder &operator=(Responder &&) noexcept;
+  Responder(Responder const &) = delete;
+  Responder &operator=(Responder const &) = delete;
+
+  void operator()(Response response);
+};
+
+namespace detail {
+struct BodySource {
+  virtual ~BodySource();
+  virtual void read_body(
+      std::uint64_t request,
+      std::function<void(std::error_code const &, std::string_view)>
+          handler) = 0;
+};
+}  // namespace detail
+
+// Reads the body of a request streamed to on_request_stream. Nothing is read
+// from the client until read() is called, so a handler that consumes the
+// body slower than it arrives holds the client back through TCP flow
+// control, and memory stays constant however large the body is.
+class BodyReader {
+ public:
+  // Receives the next piece of the body on the connection's executor. The
+  // piece stays valid until the next read(), an empty one ends the body.
+  // After an error, such as the body exceeding
+  // Config::max_streamed_body_size or the client going away, the body is
+  // incomplete.
+  using Handler =
+      std::function<void(std::error_code const &ec, std::string_view piece)>;
+
+  BodyReader(std::shared_ptr<detail::BodySource> source,
+             std::uint64_t request);
+
+  // Reads the next piece. May be called from any thread, one read at a
+  // time.
+  void read(Handler handler);
+
+ private:
+  std::shared_ptr<detail::BodySource> m_source;
+  std::uint64_t m_request;
 };
 
 struct AbstractRequestHandler {
   virtual ~AbstractRequestHandler();
   virtual Response on_request(Request const &) = 0;
+  // Called by the Service for every request. The default implementation
+  // answers with on_request on the I/O thread. Handlers that wait on other
+  // services override it and invoke the Responder once done; the Request
+  // stays valid until then.
+  virtual void on_request_async(Request const &request, Responder responder);
+  // Whether on_request_async is called on the worker pool of the Service
+  // instead of the I/O thread, for requests that take much CPU time. The
+  // response is written back on the I/O thread. Called on the I/O thread,
+  // the default is false.
+  virtual bool offload(Request const &request);
+
+  // Whether the body of `request` is streamed to on_request_stream instead
+  // of being read into the Request first. Called on the I/O thread for
+  // requests with a body, once their header has been read; the default is
+  // false.
+  virtual bool stream_body(Request const &request);
+  // Called instead of on_request_async for streamed requests. The Request
+  // has an empty body, `body` reads it. A response sent before the body has
+  // been read completely closes the connection after it. The default
+  // implementation answers with NotImplemented.
+  virtual void on_request_stream(Request const &request,
+                                 BodyReader body,
+                                 Responder responder);
 };
 
+// Base for handlers that only answer asynchronously.
+struct AbstractAsyncRequestHandler : public AbstractRequestHandler {
+  Response on_request(Request const &) override;
+  void on_request_async(Request const &request,
+                        Responder responder) override = 0;
+};
+
+// Parameters captured by a Router while matching a request, in the order
+// they appear in the route pattern. Values are views into the request URI.
+class RouteParams {
+ public:
+  static constexpr std::size_t max_params = 8;
+  using Param = std::pair<std::string_view, std::string_view>;
+
+  // The value captured for `name`, empty if the route has no such parameter.
+  std::string_view operator[](std::string_view name) const;
+  std::size_t size() const { return m_size; }
+  Param const *begin() const { return m_params.data(); }
+  Param const *end() const { return m_params.data() + m_size; }
+
+ private:
+  friend class Router;
+  std::array<Param, max_params> m_params;
+  std::size_t m_size = 0;
+};
+
+// Dispatches requests by method and path. Patterns consist of literal
+// segments, `{name}` segments capturing one path segment and an optional
+// trailing `*` (or `*name`) capturing the rest of the path:
+//
+//   router.add(Method::GET, "/users/{id}/posts", handler);
+//   router.add(Method::GET, "/static/*", handler);
+//
+// Literal segments take precedence over captures, captures over wildcards.
+// HEAD requests without a HEAD route are served by the GET route. Unmatched
+// paths are answered with NotFound, paths registered for other methods only
+// with MethodNotAllowed and an Allow field listing those methods.
+class Router : public AbstractRequestHandler {
+  class impl;
+  std::unique_ptr<impl> d_ptr;
+
+ public:
+  using Handler = std::function<Response(Request const &, RouteParams const &)>;
+
+  Router();
+  ~Router();
+  Router(Router &&) noexcept;
+  Router &operator=(Router &&) noexcept;
+
+  // Throws std::invalid_argument for malformed or duplicate patterns.
+  Router &add(Method method, std::string_view pattern, Handler handler);
+  Response on_request(Request const &request) override;
+};
+
+// Serves the files below a directory for GET and HEAD requests.
+//
+// Open descriptors and stat metadata of recently served files are kept in a
+// bounded LRU cache. Small files are mapped into memory once and sent from
+// the mapping as a SharedBody, larger ones are sent with sendfile(2).
+// Responses carry ETag and Last-Modified, conditional requests are answered
+// with NotModified and single byte ranges with PartialContent.
+class StaticFiles : public AbstractRequestHandler {
+  class impl;
+  std::unique_ptr<impl> d_ptr;
+
+ public:
+  struct Options {
+    // Prefix of the request URI that is stripped before looking up a file.
+    std::string prefix = "/";
+    // Served for requests naming a directory.
+    std::string index = "index.html";
+    // Number of files kept open.
+    std::size_t cache_entries = 1024;
+    // Files up to this size are mapped into memory and sent from the
+    // mapping without copying.
+    std::uint64_t mmap_limit = 64 * 1024;
+    // Cached metadata older than this is checked against the file again.
+    std::chrono::milliseconds revalidate_after{1000};
+  };
+
+  explicit StaticFiles(std::string root);
+  StaticFiles(std::string root, Options const &options);
+  ~StaticFiles();
+
+  Response on_request(Request const &request) override;
+  // Serves `path`, relative to the root, e.g. as captured by a Router:
+  //
+  //   router.add(Method::GET, "/assets/*path", [&](auto &req, auto &params) {
+  //     return files.serve(req, params["path"]);
+  //   });
+  Response serve(Request const &request, std::string_view path);
+};
+
+struct ClientOptions {
+  // Connections to one upstream kept open while unused.
+  std::size_t max_idle_per_host = 16;
+  // Connections opened to one upstream, further requests wait for one of
+  // them. Pools are kept per io_context, so this applies per thread of a
+  // Service with Threading::Mode::ContextPerThread.
+  std::size_t max_connections_per_host = 32;
+  // Requests sent on a connection ahead of the response to the first. 1
+  // disables pipelining; requests with a streamed body are never pipelined.
+  std::size_t pipeline_depth = 1;
+  std::chrono::milliseconds connect_timeout = std::chrono::seconds(5);
+  // Limit of each read and write, and of the wait for a response.
+  std::chrono::milliseconds io_timeout = std::chrono::seconds(30);
+  // Idle connections are closed after this.
+  std::chrono::milliseconds idle_timeout = std::chrono::seconds(30);
+  // Limit of the bodies read by Client::request().
+  std::uint64_t max_body_size = 8 * 1024 * 1024;
+};
+
+struct ClientRequest {
+  Method method = Method::GET;
+  std::string target = "/";
+  // Host is set from the upstream unless given. Content-Length or chunked
+  // Transfer-Encoding is set for the body.
+  ResponseHeaders headers;
+  std::string body;
+  // Sent instead of `body` if set, with chunked encoding unless the headers
+  // carry a Content-Length.
+  AsyncStreamBody body_stream;
+};
+
+struct ClientResponse {
+  StatusCode status = StatusCode::OK;
+  ResponseHeaders headers;
+  // Empty for responses read by Client::stream().
+  std::string body;
+};
+
+// An HTTP/1.1 client with a pool of keep-alive connections per upstream.
+//
+// Called on a thread of a Service, requests are sent from the io_context of
+// that thread and their callbacks run there, so a handler calling an
+// upstream never leaves its thread. Called from other threads, the Client
+// runs its own io_context on a thread started on first use.
+//
+// A request whose connection fails before its response was passed on, e.g.
+// because the upstream closed it meanwhile, is sent once more on another
+// connection if its method is idempotent and its body not streamed.
+// Requests pipelined behind a response with Connection: close are sent
+// again in any case. Errors are std::errc::timed_out for expired
+// ClientOptions timeouts, otherwise those of the socket or the parser.
+class Client {
+  class impl;
+  std::unique_ptr<impl> d_ptr;
+
+ public:
+  using Callback =
+      std::function<void(std::error_code const &ec, ClientResponse response)>;
+  // `body` reads the response body, the connection is reused once it has
+  // been read to the end; dropping it earlier closes the connection.
+  using StreamCallback = std::function<void(std::error_code const &ec,
+                                            ClientResponse response,
+                                            AsyncStreamBody body)>;
+
+  explicit Client(ClientOptions const &options = ClientOptions());
+  ~Client();
+  Client(Client &&) noexcept;
+  Client &operator=(Client &&) noexcept;
+
+  // Sends `request` to host:port and reads the whole response.
+  void request(std::string const &host,
+               unsigned short port,
+               ClientRequest request,
+               Callback callback);
+  // Sends `request` and calls back once the response header has arrived.
+  void stream(std::string const &host,
+              unsigned short port,
+              ClientRequest request,
+              StreamCallback callback);
+};
+
+// Forwards requests to an upstream server and streams the responses back.
+// Request bodies are streamed to the upstream as they arrive, so neither
+// direction is buffered whole. Hop-by-hop fields are not forwarded. Failing
+// upstreams are answered with BadGateway, timeouts with GatewayTimeOut.
+class ReverseProxy : public AbstractAsyncRequestHandler {
+  class impl;
+  std::unique_ptr<impl> d_ptr;
+
+ public:
+  ReverseProxy(std::string host,
+               unsigned short port,
+               ClientOptions const &options = ClientOptions());
+  ~ReverseProxy();
+
+  void on_request_async(Request const &request,
+                        Responder responder) override;
+  bool stream_body(Request const &request) override;
+  void on_request_stream(Request const &request,
+                         BodyReader body,
+                         Responder responder) override;
+};
+
+// Serves requests with a handler.
+//
+// Listening sockets are bound when the Service is created, unless they are
+// inherited:
+//
+// - With Config::handoff_path set and another Service listening there, the
+//   new one takes over the listening sockets of the old one, which then
+//   stops as if stop() had been called. Connections queued on the sockets
+//   meanwhile are accepted by the new process, so a restart drops none.
+//   The sockets are matched to the new listeners in order, extra ones are
+//   closed; keeping the threading settings across restarts keeps them all.
+// - Otherwise sockets passed by systemd socket activation (LISTEN_FDS) are
+//   used.
+//
+// Inherited sockets must be bound to the address family of
+// Config::address.
+//
+// Constructing a Service ignores SIGPIPE for the whole process, as file
+// bodies are sent with sendfile(2), which cannot suppress it per call.
 class Service {
   class impl;
   std::unique_ptr<impl> d_ptr;
@@ -155,7 +1015,36 @@ class Service {
   Service &operator=(Service &&) noexcept;
 
   Service(std::shared_ptr<AbstractRequestHandler> handler);
+  Service(std::shared_ptr<AbstractRequestHandler> handler,
+          Threading const &threading);
+  Service(std::string const &address,
+          unsigned short port,
+          std::shared_ptr<AbstractRequestHandler> handler,
+          Threading const &threading = Threading());
+  Service(Config const &config,
+          std::shared_ptr<AbstractRequestHandler> handler);
+
+  // Serves until stop() is called, or until SIGTERM or SIGINT with
+  // Config::stop_on_signals.
   void run();
+
+  // Stops accepting connections and lets the open ones finish, then run()
+  // returns. Connections waiting for another request are closed at once,
+  // the others after their current response. Those still open after
+  // `timeout` are closed. May be called from any thread, also before run().
+  void stop(std::chrono::milliseconds timeout);
+  // Stops with Config::drain_timeout.
+  void stop();
+
+  // Answers GET requests for `path` with metrics() in the Prometheus text
+  // format instead of passing them to the handler. Call before run().
+  void serve_metrics(std::string path = "/metrics");
+
+  // Counters and latencies so far, may be called from any thread.
+  MetricsSnapshot metrics() const;
+
+  // Call before run().
+  void set_timeouts(Timeouts const &timeouts);
 };
 
 }  // namespace apee
@@ -0,0 +1,40 @@
+#ifndef APEE_BEAST_H
+#define APEE_BEAST_H
+
+#include "apee.hpp"
+#include "recycling_allocator.hpp"
+
+#include <boost/beast/http.hpp>
+
+// Conversion between apee messages and Boost.Beast messages, used by the
+// connections and by the benchmarks.
+namespace apee {
+namespace detail {
+
+// Header fields allocate one node per field, these are recycled.
+using Fields = boost::beast::http::basic_fields<RecyclingAllocator<char>>;
+using BeastRequest =
+    boost::beast::http::request<boost::beast::http::string_body, Fields>;
+using BeastResponse =
+    boost::beast::http::response<boost::beast::http::string_body, Fields>;
+
+// Verbs beyond TRACE (WebDAV and friends) have no apee::Method.
+Method to_method(boost::beast::http::verb verb);
+
+// The Beast field of a well-known Field, and back. Fields without a Field
+// map to Field::Unknown.
+boost::beast::http::field to_beast(Field field);
+Field from_beast(boost::beast::http::field field);
+
+// The returned Request refers to the target, body and fields stored in `req`.
+Request from_beast(BeastRequest const &req);
+
+// Sets the status, headers and, for MessageBody and std::string payloads,
+// the body of `res`. A std::string body is moved out of `response`, shared,
+// file and stream payloads are left for the caller.
+void to_beast(Response &response, BeastResponse &res);
+
+}  // namespace detail
+}  // namespace apee
+
+#endif  // APEE_BEAST_H
@@ -0,0 +1,17 @@
+#ifndef APEE_CLIENT_H
+#define APEE_CLIENT_H
+
+#include <boost/asio/io_context.hpp>
+
+namespace apee {
+namespace detail {
+
+// The io_context the calling thread runs for a Service, null on other
+// threads. A Client sends the requests made on a thread from there.
+boost::asio::io_context *thread_context();
+void set_thread_context(boost::asio::io_context *context);
+
+}  // namespace detail
+}  // namespace apee
+
+#endif  // APEE_CLIENT_H
@@ -0,0 +1,93 @@
+#ifndef APEE_COMPRESSION_H
+#define APEE_COMPRESSION_H
+
+#include "apee.hpp"
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+namespace apee {
+
+enum class Encoding { Identity, Gzip, Deflate, Brotli };
+
+// The token of `encoding` in Accept-Encoding and Content-Encoding.
+std::string_view to_string(Encoding encoding);
+
+// Whether apee was built with brotli.
+bool brotli_supported();
+
+// The encoding preferred by a client sending `accept_encoding`, among those
+// enabled in `options`. The highest q-value wins, ties go to brotli, then
+// gzip, then deflate.
+Encoding negotiate(std::string_view accept_encoding,
+                   Compression const &options);
+
+// Whether bodies with `content_type` are compressed.
+bool compressible(std::string_view content_type, Compression const &options);
+
+// A gzip, deflate (zlib format) or brotli encoder. Compressors are pooled
+// per thread and reset between streams, so compressing a body does not set
+// up a new encoder once the pool of the thread is warm.
+class Compressor {
+ public:
+  struct Release {
+    void operator()(Compressor *compressor) const noexcept;
+  };
+  using Ptr = std::unique_ptr<Compressor, Release>;
+
+  // A compressor for a new stream from the pool of the calling thread. The
+  // level is the zlib level (1 to 9) or the brotli quality (0 to 11).
+  // `size_hint`, the expected input size if known, lets brotli use a
+  // smaller window.
+  static Ptr acquire(Encoding encoding, int level, std::size_t size_hint = 0);
+
+  ~Compressor();
+  Compressor(Compressor const &) = delete;
+  Compressor &operator=(Compressor const &) = delete;
+
+  // Compresses `input` and appends the output to `out`. Unless `finish` is
+  // set, the output is flushed so that a client can decode everything
+  // passed in so far; `finish` ends the stream.
+  void compress(std::string_view input, bool finish, std::string &out);
+
+  Encoding encoding() const { return m_encoding; }
+  int level() const { return m_level; }
+
+ private:
+  struct Codec;
+
+  Compressor(Encoding encoding, int level);
+  void reset(std::size_t size_hint);
+
+  Encoding m_encoding;
+  int m_level;
+  std::unique_ptr<Codec> m_codec;
+};
+
+// Compressed bodies of responses with a strong ETag, reused as long as the
+// ETag of the URI does not change. Keys combine URI, ETag and encoding.
+class VariantCache {
+ public:
+  explicit VariantCache(std::size_t budget) : m_budget{budget} {}
+
+  std::shared_ptr<std::string const> find(std::string_view key);
+  void insert(std::string_view key, std::shared_ptr<std::string const> body);
+
+ private:
+  std::size_t m_budget;
+  std::size_t m_size = 0;
+  std::mutex m_mutex;
+  // Most recently used first.
+  std::list<std::pair<std::string, std::shared_ptr<std::string const>>> m_lru;
+  std::unordered_map<std::string_view, decltype(m_lru)::iterator> m_index;
+};
+
+}  // namespace apee
+
+#endif  // APEE_COMPRESSION_H
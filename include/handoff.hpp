@@ -0,0 +1,33 @@
+#ifndef APEE_HANDOFF_H
+#define APEE_HANDOFF_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Passing listening sockets between processes, for restarts that keep the
+// sockets (and the connections queued on them) open.
+namespace apee {
+namespace detail {
+
+// More sockets are never passed.
+constexpr std::size_t max_handoff_fds = 64;
+
+// Listening sockets passed by socket activation: LISTEN_FDS sockets from fd
+// 3 on, if LISTEN_PID is the pid of this process. The variables are removed
+// so child processes do not take them for theirs.
+std::vector<int> activated_fds();
+
+// Connects to the handoff socket at `path` and receives the listening
+// sockets of the process serving there. Empty if nobody listens at `path`.
+// Throws std::system_error if the transfer fails midway.
+std::vector<int> receive_fds(std::string const &path);
+
+// Sends `fds` with SCM_RIGHTS over the connected Unix socket `socket`.
+// Returns false with errno set on failure.
+bool send_fds(int socket, std::vector<int> const &fds);
+
+}  // namespace detail
+}  // namespace apee
+
+#endif  // APEE_HANDOFF_H
@@ -0,0 +1,122 @@
+#ifndef APEE_HPACK_H
+#define APEE_HPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// HPACK, the header compression of HTTP/2 (RFC 7541).
+namespace apee {
+namespace detail {
+
+// The dynamic table of an encoder or a decoder. Entries are slots of a ring
+// whose strings keep their capacity, so adding a field allocates only while
+// the table is still growing.
+class HpackTable {
+ public:
+  struct Field {
+    std::string_view name;
+    std::string_view value;
+  };
+
+  // The entries counted from 0, the most recently added.
+  Field operator[](std::size_t index) const;
+  std::size_t count() const { return m_count; }
+  // The size of the entries as defined by RFC 7541, section 4.1.
+  std::size_t size() const { return m_size; }
+  std::size_t max_size() const { return m_max_size; }
+
+  // Adds a field, evicting the oldest ones to make room. A field larger
+  // than the table empties it. `name` and `value` must not refer to
+  // entries of the table.
+  void add(std::string_view name, std::string_view value);
+  // Evicts entries until the table fits into `max_size`.
+  void resize(std::size_t max_size);
+  void clear();
+
+ private:
+  struct Entry {
+    std::string name;
+    std::string value;
+  };
+
+  void evict();
+
+  std::vector<Entry> m_ring;
+  // Slot of the newest entry.
+  std::size_t m_first = 0;
+  std::size_t m_count = 0;
+  std::size_t m_size = 0;
+  std::size_t m_max_size = 4096;
+};
+
+// Decodes the header blocks received on one connection.
+class HpackDecoder {
+ public:
+  // Receives the fields of a block in order. The views are valid during
+  // the call.
+  using FieldHandler =
+      std::function<void(std::string_view name, std::string_view value)>;
+
+  // Starts over with an empty table for a new connection. `max_table_size`
+  // is the SETTINGS_HEADER_TABLE_SIZE sent to the peer, the largest table
+  // size its encoder may switch to.
+  void reset(std::size_t max_table_size);
+
+  // Decodes a complete header block. Returns false if it is malformed,
+  // which is a connection error of type COMPRESSION_ERROR.
+  bool decode(std::string_view block, FieldHandler const &field);
+
+ private:
+  bool read_string(std::string_view &block,
+                   std::string &scratch,
+                   std::string_view &text);
+  bool lookup(std::uint64_t index, HpackTable::Field &field) const;
+
+  HpackTable m_table;
+  std::size_t m_max_table_size = 4096;
+  // Names and values that are not used from the block as they are.
+  std::string m_name;
+  std::string m_value;
+};
+
+// Encodes the header blocks sent on one connection. Fields whose values
+// tend to repeat are added to the dynamic table, so a later response sends
+// them as a single index.
+class HpackEncoder {
+ public:
+  // Starts over with an empty table of the default size.
+  void reset();
+  // Applies the SETTINGS_HEADER_TABLE_SIZE of the peer, signalled to it at
+  // the start of the next block. The table never grows beyond 4096 bytes.
+  void set_max_table_size(std::size_t size);
+
+  // Appends the :status pseudo-header field of a response.
+  void encode_status(std::string &out, unsigned int status);
+  // Appends a field. `name` is lower-cased.
+  void encode(std::string &out, std::string_view name, std::string_view value);
+
+ private:
+  void begin(std::string &out);
+
+  HpackTable m_table;
+  // A dynamic table size update is due before the next field.
+  bool m_resized = false;
+  std::string m_name;
+};
+
+// Appends `text` encoded with the Huffman code of HPACK.
+void huffman_encode(std::string &out, std::string_view text);
+// The size of `text` after huffman_encode().
+std::size_t huffman_size(std::string_view text);
+// Appends the text decoded from `data`. Returns false if `data` is not a
+// valid Huffman-encoded string.
+bool huffman_decode(std::string &out, std::string_view data);
+
+}  // namespace detail
+}  // namespace apee
+
+#endif  // APEE_HPACK_H
@@ -0,0 +1,280 @@
+#ifndef APEE_HTTP2_H
+#define APEE_HTTP2_H
+
+#include "hpack.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The framing layer of HTTP/2 over cleartext TCP (RFC 9113): frames,
+// stream states, flow control and the priority tree of RFC 7540, without
+// any I/O of its own.
+namespace apee {
+namespace detail {
+
+// What a client sends first on an HTTP/2 connection (RFC 9113, section
+// 3.4). Its first line parses as an HTTP/1 request line.
+constexpr std::string_view http2_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// Error codes of RST_STREAM and GOAWAY frames (RFC 9113, section 7).
+enum class Http2Error : std::uint32_t {
+  NoError = 0x0,
+  ProtocolError = 0x1,
+  InternalError = 0x2,
+  FlowControlError = 0x3,
+  SettingsTimeout = 0x4,
+  StreamClosed = 0x5,
+  FrameSizeError = 0x6,
+  RefusedStream = 0x7,
+  Cancel = 0x8,
+  CompressionError = 0x9,
+  ConnectError = 0xa,
+  EnhanceYourCalm = 0xb,
+  InadequateSecurity = 0xc,
+  Http11Required = 0xd
+};
+
+// What a server announces in its SETTINGS frame.
+struct Http2Settings {
+  std::uint32_t header_table_size = 4096;
+  std::uint32_t max_concurrent_streams = 100;
+  // Receive window of every stream.
+  std::uint32_t initial_window_size = 65535;
+  std::uint32_t max_frame_size = 16384;
+  std::uint32_t max_header_list_size = 8192;
+  // Receive window of the connection, raised from the default of 65535 by
+  // a WINDOW_UPDATE right after the SETTINGS frame.
+  std::uint32_t connection_window_size = 65535;
+};
+
+// The header of a request. The views are valid during
+// Http2Session::Handler::on_request().
+struct Http2Header {
+  std::string_view method;
+  std::string_view scheme;
+  std::string_view authority;
+  std::string_view path;
+  // The other fields in the order received, names in lower case. Cookie
+  // fields are joined into one (RFC 9113, section 8.2.3).
+  std::vector<HpackTable::Field> fields;
+  // The header list was larger than Http2Settings::max_header_list_size,
+  // `fields` is incomplete.
+  bool too_large = false;
+};
+
+// One HTTP/2 connection of a server. Received bytes are passed to
+// receive(), which calls the Handler for requests and their bodies; the
+// responses are submitted with begin_headers() and send_data(). Frames to
+// be written collect in output(), DATA frames are added by produce() as
+// the flow-control windows allow, taking streams in the order of their
+// priorities. The session is reused for the next connection after
+// start().
+class Http2Session {
+ public:
+  // Callbacks of a session, only ever made from receive() and produce().
+  // They may call back into the session.
+  class Handler {
+   public:
+    // The header of a request on a new stream; `end_stream` if it has no
+    // body.
+    virtual void on_request(std::uint32_t stream,
+                            Http2Header const &header,
+                            bool end_stream) = 0;
+    // A piece of the body of a request. The end of the body comes as an
+    // empty piece with `end_stream` set.
+    virtual void on_data(std::uint32_t stream,
+                         std::string_view data,
+                         bool end_stream) = 0;
+    // The data given to send_data() has been framed and is no longer
+    // referred to. Not called for the last piece of a body.
+    virtual void on_sent(std::uint32_t stream) = 0;
+    // The stream is gone: it was reset with `error` by the peer or the
+    // session, or both sides have finished with it (Http2Error::NoError).
+    // Not called for reset().
+    virtual void on_close(std::uint32_t stream, Http2Error error) = 0;
+
+   protected:
+    ~Handler() = default;
+  };
+
+  Http2Session();
+  ~Http2Session();
+
+  // Starts a new connection, queueing the SETTINGS of the server.
+  // `preface` is what is still to be received of the client preface.
+  void start(Handler &handler,
+             Http2Settings const &settings,
+             std::string_view preface);
+  // Takes over an HTTP/1.1 connection upgraded with "Upgrade: h2c", after
+  // start(). `settings` is the decoded HTTP2-Settings field of the request,
+  // which is answered on stream 1. Returns false if it is malformed.
+  bool upgrade(std::string_view settings);
+
+  // Processes received bytes.
+  void receive(std::string_view data);
+
+  // Encodes the header of a response or, with a status below 200, an
+  // interim response: begin_headers(), add_header() for every field, then
+  // end_headers(). Ignored for streams that are gone.
+  void begin_headers(std::uint32_t stream, unsigned int status);
+  void add_header(std::string_view name, std::string_view value);
+  void end_headers(bool end_stream);
+  // Passes the next piece of a response body. `data` must stay valid until
+  // on_sent(), or until the stream is closed for the last piece.
+  void send_data(std::uint32_t stream, std::string_view data, bool end_stream);
+  // Resets a stream that has not finished.
+  void reset(std::uint32_t stream, Http2Error error);
+  // Opens the receive window of a stream again for `size` bytes of its
+  // body, once they are taken off the connection.
+  void consume(std::uint32_t stream, std::size_t size);
+  // Sends GOAWAY: no further streams are accepted, the open ones finish.
+  void shutdown();
+
+  // Adds DATA frames to the output until it holds `budget` bytes or no
+  // stream can send.
+  void produce(std::size_t budget);
+  // The frames to be written, which the caller takes out.
+  std::string &output() { return m_output; }
+
+  // Whether the connection is to be closed once the output is written:
+  // after a connection error, or after GOAWAY once no streams are left.
+  bool finished() const;
+  // Streams opened by requests and not yet closed.
+  std::size_t open_streams() const { return m_open; }
+  // Whether a stream has body data waiting for a flow-control window.
+  bool blocked() const;
+
+ private:
+  struct Stream;
+  enum class Input { Preface, Header, Payload, Data, Discard };
+
+  Stream *find(std::uint32_t id) const;
+  Stream &create(std::uint32_t id);
+  void close(Stream &stream, Http2Error error, bool notify = true);
+  void finish(Stream &stream);
+  void stream_error(std::uint32_t id, Http2Error error);
+  void fail(Http2Error error);
+
+  void on_frame_header();
+  void on_data_header();
+  void on_data_payload(std::string_view &data);
+  void on_data_end();
+  void on_frame();
+  void on_headers();
+  void on_continuation();
+  void on_header_block();
+  bool decode_header();
+  bool validate_header(bool trailers);
+  void on_priority();
+  void on_rst_stream();
+  bool apply_settings(std::string_view payload);
+  void on_settings();
+  void on_ping();
+  void on_goaway();
+  void on_window_update();
+
+  void write_frame_header(std::size_t length,
+                          std::uint8_t type,
+                          std::uint8_t flags,
+                          std::uint32_t stream);
+  void write_window_update(std::uint32_t stream, std::uint32_t increment);
+  void write_rst_stream(std::uint32_t stream, Http2Error error);
+  void update_ready(Stream &stream);
+
+  // The priority tree.
+  void set_ready(Stream &stream, bool ready);
+  void add_active(Stream &node, std::ptrdiff_t count);
+  void attach(Stream &stream, Stream &parent);
+  void detach(Stream &stream);
+  void prioritize(Stream &stream,
+                  std::uint32_t dependency,
+                  std::uint16_t weight,
+                  bool exclusive);
+  Stream *schedule();
+  void charge(Stream &stream, std::size_t size);
+
+  Handler *m_handler = nullptr;
+  Http2Settings m_settings;
+  HpackDecoder m_decoder;
+  HpackEncoder m_encoder;
+
+  Input m_input = Input::Header;
+  std::string_view m_preface;
+  // The header of the frame being received, then its fields.
+  unsigned char m_head[9];
+  std::size_t m_head_size = 0;
+  std::uint32_t m_length = 0;
+  std::uint8_t m_type = 0;
+  std::uint8_t m_flags = 0;
+  std::uint32_t m_stream = 0;
+  // The payload of a frame other than DATA.
+  std::string m_payload;
+  // Bytes of the DATA or discarded frame still to come, and of them the
+  // padding of the DATA frame. The pad length is still to be read if
+  // m_pad_pending.
+  std::size_t m_remaining = 0;
+  std::size_t m_padding = 0;
+  bool m_pad_pending = false;
+
+  // The header block being received in HEADERS and CONTINUATION frames,
+  // and what the HEADERS frame said about it.
+  std::string m_block;
+  std::uint32_t m_block_stream = 0;
+  bool m_block_end_stream = false;
+  bool m_block_priority = false;
+  std::uint32_t m_block_dependency = 0;
+  std::uint16_t m_block_weight = 16;
+  bool m_block_exclusive = false;
+  // The decoded header: names and values one after the other in
+  // m_header_data, where m_spans locates them.
+  struct Span {
+    std::uint32_t offset;
+    std::uint32_t name_size;
+    std::uint32_t value_size;
+  };
+  std::string m_header_data;
+  std::vector<Span> m_spans;
+  std::size_t m_header_size = 0;
+  Http2Header m_header;
+  std::string m_cookie;
+  std::int64_t m_content_length = -1;
+
+  // The response header being encoded, see begin_headers().
+  std::string m_out_block;
+  std::uint32_t m_out_stream = 0;
+  bool m_out_final = false;
+
+  std::string m_output;
+  // Streams whose response ended with its header, closed by produce().
+  std::vector<std::uint32_t> m_finished;
+
+  // Streams by id, with the idle ones that only carry a priority.
+  std::vector<std::unique_ptr<Stream>> m_streams;
+  std::vector<std::unique_ptr<Stream>> m_free;
+  std::unique_ptr<Stream> m_root;
+  std::size_t m_open = 0;
+  std::size_t m_idle = 0;
+  // The highest stream opened by the client.
+  std::uint32_t m_last_stream = 0;
+
+  // Flow control of the connection.
+  std::int64_t m_send_window = 65535;
+  std::int64_t m_receive_window = 65535;
+  std::uint64_t m_unacked = 0;
+  // Settings of the peer.
+  std::int64_t m_peer_window = 65535;
+  std::uint32_t m_peer_max_frame = 16384;
+
+  bool m_settings_received = false;
+  bool m_goaway_sent = false;
+  bool m_goaway_received = false;
+  bool m_failed = false;
+};
+
+}  // namespace detail
+}  // namespace apee
+
+#endif  // APEE_HTTP2_H
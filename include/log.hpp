@@ -13,6 +13,19 @@
 
 #include <boost/log/trivial.hpp>
 
+#include <atomic>
+#include <ostream>
+
+// Log statements below this severity are removed at compile time, so trace
+// and debug output costs nothing in release builds.
+#ifndef APEE_LOG_MIN_SEVERITY
+#ifdef NDEBUG
+#define APEE_LOG_MIN_SEVERITY ::logger::info
+#else
+#define APEE_LOG_MIN_SEVERITY ::logger::trace
+#endif
+#endif
+
 namespace logging = boost::log;
 namespace sinks = boost::log::sinks;
 namespace attrs = boost::log::attributes;
@@ -59,8 +72,64 @@ enum severity_level { trace, debug, info, warning, error, critical };
 
 extern std::ostream& operator<<(std::ostream& strm, severity_level level);
 
+struct options {
+  enum class mode {
+    // Records go through the Boost.Log core and its console sinks.
+    sync,
+    // Records are queued in a lock-free ring buffer per thread and written
+    // to std::clog by a background thread.
+    async
+  };
+  // What a thread does when its ring buffer is full in async mode.
+  enum class overflow { drop, block };
+
+  mode log_mode = mode::sync;
+  overflow on_overflow = overflow::drop;
+  // Records per thread ring buffer, rounded up to a power of two.
+  std::size_t queue_size = 1024;
+};
+
+// Sets up logging once per process, later calls have no effect. The level is
+// read from the LOG environment variable; LOG_MODE=async and
+// LOG_OVERFLOW=block override the options.
 extern void init();
+extern void init(options const& opts);
+
+// Records below this level are discarded before they are formatted.
+extern std::atomic<int> runtime_level;
+
+template <severity_level Severity>
+inline bool enabled() {
+  return Severity >= APEE_LOG_MIN_SEVERITY &&
+         Severity >= runtime_level.load(std::memory_order_relaxed);
+}
+
+// Formats one record into a per-thread buffer and hands it to the active
+// backend when destroyed.
+class record {
+  char const* m_channel;
+  severity_level m_severity;
+
+ public:
+  record(char const* channel, severity_level severity);
+  ~record();
+  record(record const&) = delete;
+  record& operator=(record const&) = delete;
+
+  std::ostream& stream();
+};
 
 }  // namespace logger
 
+// Logs to `channel` with the given severity:
+//
+//   APEE_LOG(m_channel, debug) << "Request:\n" << m_request;
+//
+// The operands are only evaluated when the record is emitted, and records
+// below APEE_LOG_MIN_SEVERITY are compiled out.
+#define APEE_LOG(channel, severity)                \
+  if (!::logger::enabled<::logger::severity>()) { \
+  } else                                           \
+    ::logger::record(channel, ::logger::severity).stream()
+
 #endif  // OPCUA_CLIENT_LOG_H
@@ -0,0 +1,185 @@
+#ifndef APEE_METRICS_H
+#define APEE_METRICS_H
+
+#include "apee.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace apee {
+
+// Log-linear bucketing of nanosecond values in the style of HdrHistogram:
+// values below 64 get a bucket each, every power of two above is split into
+// 32 buckets, which bounds the relative error to about 3%. Values above
+// 2^40 ns (about 18 minutes) land in the last bucket.
+struct HistogramBuckets {
+  static constexpr unsigned int sub_bits = 5;
+  static constexpr unsigned int max_bits = 40;
+  static constexpr std::size_t count = (max_bits - sub_bits + 1) << sub_bits;
+
+  static std::size_t index(std::uint64_t value) {
+    constexpr std::uint64_t max = (std::uint64_t{1} << max_bits) - 1;
+    if (value > max) {
+      value = max;
+    }
+    auto msb = 63 - static_cast<unsigned int>(__builtin_clzll(value | 1));
+    unsigned int shift = msb > sub_bits ? msb - sub_bits : 0;
+    return (std::size_t{shift} << sub_bits) + (value >> shift);
+  }
+
+  // Midpoint of the values counted in bucket `index`.
+  static std::uint64_t value(std::size_t index) {
+    unsigned int shift = index < (2u << sub_bits)
+                             ? 0
+                             : static_cast<unsigned int>(index >> sub_bits) - 1;
+    std::uint64_t lower = (index - (std::size_t{shift} << sub_bits)) << shift;
+    return lower + ((std::uint64_t{1} << shift) >> 1);
+  }
+};
+
+// Histogram owned by a single thread, used for snapshots and by the
+// benchmarks.
+class Histogram {
+  std::vector<std::uint64_t> m_counts =
+      std::vector<std::uint64_t>(HistogramBuckets::count);
+  std::uint64_t m_count = 0;
+  std::uint64_t m_sum = 0;
+  std::uint64_t m_max = 0;
+
+  friend class ConcurrentHistogram;
+
+ public:
+  void record(std::uint64_t value, std::uint64_t count = 1) {
+    m_counts[HistogramBuckets::index(value)] += count;
+    m_count += count;
+    m_sum += value * count;
+    m_max = std::max(m_max, value);
+  }
+
+  void merge(Histogram const &other);
+  void clear();
+
+  // Value at quantile `q` (0 to 1), 0 when the histogram is empty.
+  std::uint64_t percentile(double q) const;
+
+  std::uint64_t count() const { return m_count; }
+  std::uint64_t sum() const { return m_sum; }
+  std::uint64_t max() const { return m_max; }
+};
+
+// Histogram written by one I/O thread and read by snapshots from any thread.
+// Counts are relaxed atomics on memory private to the writer, so recording
+// never contends.
+class ConcurrentHistogram {
+  std::array<std::atomic<std::uint64_t>, HistogramBuckets::count> m_counts{};
+  std::atomic<std::uint64_t> m_sum{0};
+  std::atomic<std::uint64_t> m_max{0};
+
+ public:
+  void record(std::uint64_t value) {
+    m_counts[HistogramBuckets::index(value)].fetch_add(
+        1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+    if (value > m_max.load(std::memory_order_relaxed)) {
+      m_max.store(value, std::memory_order_relaxed);
+    }
+  }
+
+  void add_to(Histogram &histogram) const;
+};
+
+// Counters and stage timings of one Service, sharded per I/O thread.
+class Metrics {
+ public:
+  enum class Stage { Accept, Read, Handler, Write };
+  static constexpr std::size_t stage_count = 4;
+
+  explicit Metrics(unsigned int threads);
+
+  // Selects the shard the calling thread records into. Threads that never
+  // call this (e.g. threads of an asynchronous handler) use shard 0.
+  static void set_thread(unsigned int thread);
+
+  void record(Stage stage, std::chrono::steady_clock::duration duration) {
+    local().stages[static_cast<std::size_t>(stage)].record(
+        static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+                .count()));
+  }
+
+  void record_status(unsigned int status) {
+    if (status < status_count) {
+      increment(local().statuses[status]);
+    }
+  }
+
+  void record_accepted() {
+    increment(local().accepted);
+    m_active.fetch_add(1, std::memory_order_relaxed);
+  }
+  void record_closed() { m_active.fetch_sub(1, std::memory_order_relaxed); }
+  std::int64_t active() const {
+    return m_active.load(std::memory_order_relaxed);
+  }
+  void record_received(std::uint64_t bytes) {
+    increment(local().bytes_received, bytes);
+  }
+  void record_sent(std::uint64_t bytes) {
+    increment(local().bytes_sent, bytes);
+  }
+  void record_timeout() { increment(local().timeouts); }
+  void record_cache_hit() { increment(local().cache_hits); }
+  void record_cache_miss() { increment(local().cache_misses); }
+  void record_rejected() { increment(local().rejected); }
+  void record_rate_limited() { increment(local().rate_limited); }
+
+  // Counts a failed accept or read by stage and error message. Errors are
+  // rare, so they are kept in a map guarded by a per-shard mutex.
+  void record_error(char const *stage, std::error_code const &ec);
+
+  MetricsSnapshot snapshot() const;
+
+  // `snapshot` in the Prometheus text exposition format.
+  static std::string prometheus(MetricsSnapshot const &snapshot);
+
+ private:
+  static constexpr unsigned int status_count = 600;
+
+  struct alignas(64) Shard {
+    std::array<ConcurrentHistogram, stage_count> stages;
+    std::array<std::atomic<std::uint64_t>, status_count> statuses{};
+    std::atomic<std::uint64_t> accepted{0};
+    std::atomic<std::uint64_t> bytes_received{0};
+    std::atomic<std::uint64_t> bytes_sent{0};
+    std::atomic<std::uint64_t> timeouts{0};
+    std::atomic<std::uint64_t> cache_hits{0};
+    std::atomic<std::uint64_t> cache_misses{0};
+    std::atomic<std::uint64_t> rejected{0};
+    std::atomic<std::uint64_t> rate_limited{0};
+    std::mutex errors_mutex;
+    std::map<std::string, std::uint64_t> errors;
+  };
+
+  static void increment(std::atomic<std::uint64_t> &counter,
+                        std::uint64_t value = 1) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  Shard &local();
+
+  std::vector<std::unique_ptr<Shard>> m_shards;
+  std::atomic<std::int64_t> m_active{0};
+};
+
+}  // namespace apee
+
+#endif  // APEE_METRICS_H
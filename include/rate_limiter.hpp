@@ -0,0 +1,61 @@
+#ifndef APEE_RATE_LIMITER_H
+#define APEE_RATE_LIMITER_H
+
+#include "apee.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace apee {
+
+// The token buckets of a RateLimit. Keys are hashed onto shards, each with
+// its own mutex, LRU list and share of RateLimit::max_keys, so threads
+// checking different clients rarely contend. Checking a known key does not
+// allocate; a new key in a full shard takes over the node of the least
+// recently used one.
+class RateLimiter {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit RateLimiter(RateLimit const &options);
+
+  // Takes a token from the bucket of `key`. Returns zero if there was one,
+  // else the time until the next token arrives.
+  Clock::duration acquire(std::string_view key, Clock::time_point now);
+
+  // The keys with a bucket.
+  std::size_t keys() const { return m_keys.load(std::memory_order_relaxed); }
+
+ private:
+  struct Bucket {
+    std::string key;
+    double tokens = 0;
+    Clock::time_point updated;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    // Most recently used first.
+    std::list<Bucket> lru;
+    std::unordered_map<std::string_view, std::list<Bucket>::iterator> index;
+  };
+
+  Shard &shard(std::string_view key);
+
+  double m_rate;
+  double m_burst;
+  std::size_t m_shard_keys;
+  std::vector<std::unique_ptr<Shard>> m_shards;
+  std::atomic<std::size_t> m_keys{0};
+};
+
+}  // namespace apee
+
+#endif  // APEE_RATE_LIMITER_H
@@ -0,0 +1,79 @@
+#ifndef APEE_RECYCLING_ALLOCATOR_H
+#define APEE_RECYCLING_ALLOCATOR_H
+
+#include <boost/asio/associated_allocator.hpp>
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+namespace apee {
+namespace detail {
+
+// Thread-local cache of freed blocks in power-of-two size classes from 64
+// bytes to 4 KiB, in the spirit of asio::recycling_allocator. A block freed
+// on another thread than the one that allocated it moves to the cache of the
+// freeing thread. Larger blocks are passed to ::operator new.
+struct BlockCache {
+  static void *allocate(std::size_t size);
+  static void deallocate(void *p, std::size_t size) noexcept;
+};
+
+template <typename T>
+class RecyclingAllocator {
+ public:
+  using value_type = T;
+
+  RecyclingAllocator() noexcept = default;
+  template <typename U>
+  RecyclingAllocator(RecyclingAllocator<U> const &) noexcept {}
+
+  T *allocate(std::size_t n) {
+    return static_cast<T *>(BlockCache::allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, std::size_t n) noexcept {
+    BlockCache::deallocate(p, n * sizeof(T));
+  }
+
+  template <typename U>
+  bool operator==(RecyclingAllocator<U> const &) const noexcept {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(RecyclingAllocator<U> const &) const noexcept {
+    return false;
+  }
+};
+
+// Wraps a completion handler so that its associated allocator is a
+// RecyclingAllocator: the operations started with it, and the state Beast
+// keeps for its composed operations, then reuse memory instead of calling
+// malloc.
+template <typename Handler>
+class RecyclingHandler {
+  Handler m_handler;
+
+ public:
+  using allocator_type = RecyclingAllocator<void>;
+
+  explicit RecyclingHandler(Handler handler) : m_handler(std::move(handler)) {}
+
+  allocator_type get_allocator() const noexcept { return allocator_type(); }
+
+  template <typename... Args>
+  void operator()(Args &&... args) {
+    m_handler(std::forward<Args>(args)...);
+  }
+};
+
+template <typename Handler>
+RecyclingHandler<std::decay_t<Handler>> recycling(Handler &&handler) {
+  return RecyclingHandler<std::decay_t<Handler>>(
+      std::forward<Handler>(handler));
+}
+
+}  // namespace detail
+}  // namespace apee
+
+#endif  // APEE_RECYCLING_ALLOCATOR_H
@@ -0,0 +1,96 @@
+#ifndef APEE_RESPONSE_CACHE_H
+#define APEE_RESPONSE_CACHE_H
+
+#include "apee.hpp"
+#include "beast.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace apee {
+
+// A response as stored by the ResponseCache, serialised once. The heads
+// start after the HTTP version of the status line and end before the
+// Connection field and the empty line closing the header, which both depend
+// on the request.
+struct CachedResponse {
+  unsigned int status = 0;
+  std::string head;
+  // Answer to a request whose If-None-Match matches `etag`, empty if the
+  // response has no ETag.
+  std::string not_modified_head;
+  std::string body;
+  std::string etag;
+  std::chrono::steady_clock::time_point expires;
+};
+
+// The cache described by Caching. Keys are hashed onto shards, each with
+// its own mutex, LRU list and share of the memory budget, so threads
+// looking up different URIs rarely contend. Expired entries are dropped
+// when they are found.
+class ResponseCache {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // With `encoding_in_key`, keys include the content coding negotiated for
+  // the request, so responses varying on Accept-Encoding are cached.
+  ResponseCache(Caching const &options, bool encoding_in_key);
+
+  // Builds the key of `request` into `key`, reusing its capacity. Returns
+  // false for requests that bypass the cache. Only GET and HEAD requests
+  // are looked up, both under the key of the GET request.
+  bool key(detail::BeastRequest const &request,
+           std::string_view encoding,
+           std::string &key) const;
+
+  // The fresh entry stored under `key`, null if there is none.
+  std::shared_ptr<CachedResponse const> find(std::string_view key,
+                                             Clock::time_point now);
+
+  // Stores the handler's `response` to the GET request with `key` if it is
+  // cacheable, `ttl` being its Response::cache_ttl(). Returns the new
+  // entry, null if the response was not stored.
+  std::shared_ptr<CachedResponse const> store(
+      std::string_view key,
+      detail::BeastResponse const &response,
+      std::chrono::milliseconds ttl,
+      Clock::time_point now);
+
+ private:
+  struct Shard {
+    std::mutex mutex;
+    // Most recently used first.
+    std::list<std::pair<std::string, std::shared_ptr<CachedResponse const>>>
+        lru;
+    std::unordered_map<std::string_view, decltype(lru)::iterator> index;
+    std::size_t size = 0;
+  };
+
+  Shard &shard(std::string_view key);
+  void erase(Shard &shard, decltype(Shard::lru)::iterator entry);
+
+  Caching m_options;
+  bool m_encoding_in_key;
+  std::size_t m_shard_budget;
+  std::vector<std::unique_ptr<Shard>> m_shards;
+};
+
+namespace detail {
+
+// Whether the If-None-Match field `header` lists `etag`, using the weak
+// comparison.
+bool etag_matches(std::string_view header, std::string_view etag);
+
+}  // namespace detail
+
+}  // namespace apee
+
+#endif  // APEE_RESPONSE_CACHE_H
@@ -0,0 +1,33 @@
+#ifndef APEE_RESPONSE_HEAD_H
+#define APEE_RESPONSE_HEAD_H
+
+#include <string>
+#include <string_view>
+
+// Serialisation of response headers without Beast's serializer, from pieces
+// that are rendered ahead of time.
+namespace apee {
+namespace detail {
+
+// Appends "HTTP/1.1 200 OK\r\n" for `status`, "HTTP/1.0" if `version` is
+// below 11. The lines of the status codes 100 to 599 are precomputed.
+void append_status_line(std::string &head,
+                        unsigned int status,
+                        unsigned int version);
+
+void append_field(std::string &head,
+                  std::string_view name,
+                  std::string_view value);
+
+// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n" for the current second. Each
+// thread renders it at most once per second, into the storage the view
+// refers to, so it has to be copied for asynchronous writes.
+std::string_view date_field();
+
+// The value of date_field().
+std::string_view http_date();
+
+}  // namespace detail
+}  // namespace apee
+
+#endif  // APEE_RESPONSE_HEAD_H
@@ -0,0 +1,95 @@
+#ifndef APEE_TIMER_WHEEL_H
+#define APEE_TIMER_WHEEL_H
+
+#include <boost/asio/execution_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace apee {
+
+// Coarse deadlines of the connections on one io_context, kept in a hashed
+// timing wheel: arming, moving and cancelling a deadline is O(1) and no
+// per-connection timer is queued with Asio. A single steady_timer advances
+// the wheel every `resolution` while deadlines are armed. Deadlines longer
+// than the wheel span stay in their slot for several revolutions.
+class TimerWheel : public boost::asio::execution_context::service {
+ public:
+  using Clock = std::chrono::steady_clock;
+  // Invoked on a thread running the io_context when a deadline expires.
+  using Callback = void (*)(std::shared_ptr<void> const &owner,
+                            std::uint64_t generation);
+
+  static constexpr std::chrono::milliseconds resolution{100};
+  static constexpr std::size_t slot_count = 512;
+
+  // A deadline embedded in its owner. arm() and cancel() must not be called
+  // concurrently for the same Timer.
+  class Timer {
+    friend class TimerWheel;
+
+    Timer *m_prev = nullptr;
+    Timer *m_next = nullptr;
+    std::size_t m_slot = 0;
+    std::size_t m_rounds = 0;
+    std::uint64_t m_generation = 0;
+    bool m_armed = false;
+    std::weak_ptr<void> m_owner;
+    Callback m_callback = nullptr;
+
+   public:
+    // The callback gets the owner only while it is still alive.
+    void bind(std::weak_ptr<void> owner, Callback callback) {
+      m_owner = std::move(owner);
+      m_callback = callback;
+    }
+
+    // Changed by every arm() and cancel(). The callback receives the value
+    // the expired deadline was armed with, a different current value means
+    // the expiry is stale.
+    std::uint64_t generation() const { return m_generation; }
+  };
+
+  static boost::asio::execution_context::id id;
+
+  explicit TimerWheel(boost::asio::execution_context &context);
+
+  // Arms or moves the deadline of `timer` to `timeout` from now. It expires
+  // no earlier than that and at most two resolutions later.
+  void arm(Timer &timer, Clock::duration timeout);
+
+  void cancel(Timer &timer);
+
+ private:
+  void shutdown() override;
+
+  void link(Timer &timer, std::size_t ticks);
+  void unlink(Timer &timer);
+  void schedule_tick();
+  void tick();
+
+  std::mutex m_mutex;
+  std::vector<Timer *> m_slots;
+  std::size_t m_current = 0;
+  std::size_t m_armed = 0;
+  bool m_ticking = false;
+  Clock::time_point m_next_tick;
+  boost::asio::steady_timer m_ticker;
+
+  struct Expiry {
+    std::shared_ptr<void> owner;
+    Callback callback;
+    std::uint64_t generation;
+  };
+  // Only used by tick(), which is never run concurrently.
+  std::vector<Expiry> m_expired;
+};
+
+}  // namespace apee
+
+#endif  // APEE_TIMER_WHEEL_H
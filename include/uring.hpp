@@ -0,0 +1,352 @@
+#ifndef APEE_URING_H
+#define APEE_URING_H
+
+#include <boost/asio.hpp>
+#include <boost/beast/core/bind_handler.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+
+// io_uring transport of a Service, see IoUring. The ring is driven by the
+// io_context it belongs to: its descriptor is waited on like a socket, and
+// the completions are reaped whenever it becomes readable.
+namespace apee {
+namespace detail {
+
+class Ring : public boost::asio::execution_context::service {
+ public:
+  // Something that disposes of itself, possibly freeing other operations.
+  class Disposable {
+   public:
+    virtual void dispose() = 0;
+
+   protected:
+    ~Disposable() = default;
+  };
+
+  // A submission embedded in its owner, whose address is the user data of
+  // the submission queue entry. An operation is submitted at most once at a
+  // time.
+  class Operation {
+   public:
+    // Called on a thread running the io_context with the result of the
+    // operation, a negated errno on failure. `more` is set if a multishot
+    // operation stays armed.
+    virtual void complete(int result, bool more) = 0;
+    // Called instead of complete() for operations still pending when the
+    // io_context is destroyed. Returns what has to be disposed of, which is
+    // done once all pending operations have been abandoned.
+    virtual Disposable *abandon() { return nullptr; }
+
+    bool pending() const { return m_pending.load(std::memory_order_acquire); }
+
+   protected:
+    ~Operation() = default;
+
+   private:
+    friend class Ring;
+    Operation *m_prev = nullptr;
+    Operation *m_next = nullptr;
+    std::atomic<bool> m_pending{false};
+  };
+
+  static boost::asio::execution_context::id id;
+
+  explicit Ring(boost::asio::execution_context &context);
+  ~Ring() override;
+
+  // Sets up a ring with `entries` submission queue entries and `buffers`
+  // registered buffers of `buffer_size` bytes. Returns false with errno set
+  // if io_uring is not available. Failing to register the buffers leaves
+  // the ring without them.
+  bool start(unsigned int entries,
+             std::size_t buffers,
+             std::size_t buffer_size);
+  bool started() const { return m_fd >= 0; }
+  std::size_t buffer_size() const { return m_buffer_size; }
+  std::size_t registered_buffers() const { return m_buffer_count; }
+
+  // A registered buffer of buffer_size() bytes, null if all are in use.
+  char *acquire_buffer();
+  void release_buffer(char *buffer);
+
+  // Queue an operation. The submissions queued while the io_context runs
+  // its handlers are passed to the kernel together once they are done.
+  // Reads into a registered buffer use its registration.
+  void read(Operation &operation, int fd, void *data, std::size_t size);
+  // `message` has to stay valid until the operation completes.
+  void send(Operation &operation, int fd, msghdr const &message);
+  void poll(Operation &operation, int fd, short events);
+  // The result is the accepted socket, with FD_CLOEXEC set.
+  void accept(Operation &operation, int fd, bool multishot);
+  // Completes `operation` with -ECANCELED if it is still pending.
+  void cancel(Operation &operation);
+  // Drops `operation` from the pending ones without cancelling it, for an
+  // owner that goes away after the io_context stopped running.
+  void forget(Operation &operation);
+
+ private:
+  struct Queues;
+
+  void shutdown() override;
+
+  struct Completion {
+    Operation *operation;
+    int result;
+    bool more;
+  };
+
+  // A cleared submission queue entry for `operation`, which is null for
+  // entries whose completion is ignored. Submits the queued entries first
+  // if the queue is full, releasing `lock` on m_mutex while waiting for the
+  // kernel to take them. Returns null if they cannot be submitted, after
+  // arranging for `operation` to complete with the error. Called with
+  // m_mutex held, as is push().
+  io_uring_sqe *next_entry(std::unique_lock<std::mutex> &lock,
+                           Operation *operation);
+  // Queues the entry returned by next_entry().
+  void push();
+  // Passes the queued entries to the kernel.
+  void flush();
+  // Returns the number of entries the kernel took, -1 with errno set on
+  // failure.
+  int submit(unsigned int count);
+  // Waits for the ring to become readable, i.e. for completions.
+  void wait();
+  void reap();
+  // Moves up to `count` completions off the completion queue into `out`,
+  // with m_mutex held. Returns their number.
+  std::size_t take(Completion *out, std::size_t count);
+  // Moves the completions the kernel kept back while the completion queue
+  // was full into it. Returns whether there are completions to take.
+  bool flush_overflow();
+  bool ready() const;
+  void link(Operation &operation);
+  void unlink(Operation &operation);
+
+  boost::asio::io_context &m_context;
+  boost::asio::posix::stream_descriptor m_descriptor;
+  int m_fd = -1;
+  std::unique_ptr<Queues> m_queues;
+
+  // Guards the queues, the pending operations and the free buffers.
+  std::mutex m_mutex;
+  bool m_flush_posted = false;
+  Operation *m_pending = nullptr;
+  // Completions taken by next_entry() and failed submissions, handed to
+  // their operations by the next reap().
+  std::vector<Completion> m_deferred;
+
+  char *m_buffers = nullptr;
+  std::size_t m_buffer_size = 0;
+  std::size_t m_buffer_count = 0;
+  std::vector<char *> m_free_buffers;
+};
+
+// A connected socket read and written through a Ring, for Beast's and
+// Asio's composed operations. As for the socket, one read, one write and one
+// wait may be pending at a time. Handlers are called through their
+// associated executor, their state is allocated with their associated
+// allocator.
+class RingStream {
+ public:
+  using executor_type = boost::asio::ip::tcp::socket::executor_type;
+
+  RingStream(boost::asio::ip::tcp::socket &socket, Ring &ring)
+      : m_socket{socket}, m_ring{ring} {}
+
+  RingStream(RingStream const &) = delete;
+  RingStream &operator=(RingStream const &) = delete;
+
+  executor_type get_executor() { return m_socket.get_executor(); }
+
+  template <typename MutableBufferSequence, typename Token>
+  auto async_read_some(MutableBufferSequence const &buffers, Token &&token) {
+    return boost::asio::async_initiate<Token,
+                                       void(boost::system::error_code,
+                                            std::size_t)>(
+        [this](auto handler, MutableBufferSequence const &buffers) {
+          boost::asio::mutable_buffer buffer;
+          for (auto i = boost::asio::buffer_sequence_begin(buffers);
+               i != boost::asio::buffer_sequence_end(buffers);
+               ++i) {
+            buffer = *i;
+            if (buffer.size() > 0) {
+              break;
+            }
+          }
+          if (buffer.size() == 0) {
+            complete_now(std::move(handler));
+            return;
+          }
+          m_read.start<false>(std::move(handler), get_executor(), true);
+          m_ring.read(m_read,
+                      m_socket.native_handle(),
+                      buffer.data(),
+                      buffer.size());
+        },
+        token,
+        buffers);
+  }
+
+  template <typename ConstBufferSequence, typename Token>
+  auto async_write_some(ConstBufferSequence const &buffers, Token &&token) {
+    return boost::asio::async_initiate<Token,
+                                       void(boost::system::error_code,
+                                            std::size_t)>(
+        [this](auto handler, ConstBufferSequence const &buffers) {
+          std::size_t count = 0;
+          for (auto i = boost::asio::buffer_sequence_begin(buffers);
+               i != boost::asio::buffer_sequence_end(buffers) &&
+               count < max_iovecs;
+               ++i) {
+            boost::asio::const_buffer buffer = *i;
+            if (buffer.size() > 0) {
+              m_iovecs[count].iov_base = const_cast<void *>(buffer.data());
+              m_iovecs[count].iov_len = buffer.size();
+              ++count;
+            }
+          }
+          if (count == 0) {
+            complete_now(std::move(handler));
+            return;
+          }
+          m_message = {};
+          m_message.msg_iov = m_iovecs;
+          m_message.msg_iovlen = count;
+          m_write.start<false>(std::move(handler), get_executor(), false);
+          m_ring.send(m_write, m_socket.native_handle(), m_message);
+        },
+        token,
+        buffers);
+  }
+
+  // Waits until the socket is ready for reading or writing, like
+  // basic_socket::async_wait().
+  template <typename Token>
+  auto async_wait(boost::asio::socket_base::wait_type type, Token &&token) {
+    return boost::asio::async_initiate<Token,
+                                       void(boost::system::error_code)>(
+        [this](auto handler, boost::asio::socket_base::wait_type type) {
+          m_wait.start<true>(std::move(handler), get_executor(), false);
+          m_ring.poll(m_wait,
+                      m_socket.native_handle(),
+                      type == boost::asio::socket_base::wait_read ? POLLIN
+                                                                  : POLLOUT);
+        },
+        token,
+        type);
+  }
+
+  // Aborts the pending operations, their handlers get operation_aborted.
+  void cancel() {
+    for (auto operation : {&m_read, &m_write, &m_wait}) {
+      if (operation->pending()) {
+        m_ring.cancel(*operation);
+      }
+    }
+  }
+
+ private:
+  // Larger buffer sequences are written in several parts.
+  static constexpr std::size_t max_iovecs = 16;
+
+  // The handler of the pending operation, type-erased.
+  class Handler : public Ring::Disposable {
+   public:
+    // Frees the handler, then calls it through its associated executor.
+    virtual void invoke(boost::system::error_code ec, std::size_t size) = 0;
+  };
+
+  // `Wait` for handlers taking only an error_code.
+  template <typename Wrapped, typename Executor, bool Wait>
+  class HandlerImpl final : public Handler {
+    using Allocator = typename std::allocator_traits<
+        boost::asio::associated_allocator_t<Wrapped>>::
+        template rebind_alloc<HandlerImpl>;
+
+    Wrapped m_handler;
+    Executor m_executor;
+
+    void free() {
+      Allocator allocator{boost::asio::get_associated_allocator(m_handler)};
+      this->~HandlerImpl();
+      std::allocator_traits<Allocator>::deallocate(allocator, this, 1);
+    }
+
+   public:
+    HandlerImpl(Wrapped handler, Executor executor)
+        : m_handler(std::move(handler)), m_executor(std::move(executor)) {}
+
+    static HandlerImpl *create(Wrapped handler, Executor executor) {
+      Allocator allocator{boost::asio::get_associated_allocator(handler)};
+      auto p = std::allocator_traits<Allocator>::allocate(allocator, 1);
+      return new (p) HandlerImpl(std::move(handler), std::move(executor));
+    }
+
+    void invoke(boost::system::error_code ec, std::size_t size) override {
+      auto handler = std::move(m_handler);
+      auto executor =
+          boost::asio::get_associated_executor(handler, m_executor);
+      free();
+      if constexpr (Wait) {
+        boost::asio::dispatch(
+            executor, boost::beast::bind_front_handler(std::move(handler), ec));
+      } else {
+        boost::asio::dispatch(
+            executor,
+            boost::beast::bind_front_handler(std::move(handler), ec, size));
+      }
+    }
+
+    void dispose() override { free(); }
+  };
+
+  class Slot final : public Ring::Operation {
+    Handler *m_handler = nullptr;
+    // A result of 0 is the end of the stream.
+    bool m_read = false;
+
+   public:
+    template <bool Wait, typename Wrapped, typename Executor>
+    void start(Wrapped handler, Executor executor, bool read) {
+      m_read = read;
+      m_handler = HandlerImpl<Wrapped, Executor, Wait>::create(
+          std::move(handler), std::move(executor));
+    }
+
+    void complete(int result, bool more) override;
+    Ring::Disposable *abandon() override;
+  };
+
+  template <typename Wrapped>
+  void complete_now(Wrapped handler) {
+    auto executor =
+        boost::asio::get_associated_executor(handler, get_executor());
+    boost::asio::post(executor,
+                      boost::beast::bind_front_handler(
+                          std::move(handler), boost::system::error_code(), 0));
+  }
+
+  boost::asio::ip::tcp::socket &m_socket;
+  Ring &m_ring;
+  Slot m_read;
+  Slot m_write;
+  Slot m_wait;
+  iovec m_iovecs[max_iovecs];
+  msghdr m_message{};
+};
+
+}  // namespace detail
+}  // namespace apee
+
+#endif  // APEE_URING_H
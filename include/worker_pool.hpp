@@ -0,0 +1,89 @@
+#ifndef APEE_WORKER_POOL_H
+#define APEE_WORKER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace apee {
+
+// Threads for handlers doing CPU-bound work, kept apart from the I/O threads
+// so that such work does not hold up accepts and reads, see
+// AbstractRequestHandler::offload(). Every worker has its own queue, which
+// submitted tasks are spread over in turn. A worker whose queue runs empty
+// takes tasks from the others before it goes to sleep.
+class WorkerPool {
+ public:
+  // Work queued without allocating, linked through the task itself. A task
+  // is in at most one queue at a time.
+  class Task {
+   public:
+    virtual void run() = 0;
+
+   protected:
+    ~Task() = default;
+
+   private:
+    friend class WorkerPool;
+    Task *m_next_task = nullptr;
+  };
+
+  explicit WorkerPool(unsigned int threads);
+  // Runs the tasks still queued, then joins the threads.
+  ~WorkerPool();
+
+  WorkerPool(WorkerPool const &) = delete;
+  WorkerPool &operator=(WorkerPool const &) = delete;
+
+  // Queues `task`, run() is called on one of the workers.
+  void submit(Task &task);
+
+  // Tasks waiting for a worker.
+  std::uint64_t queued() const {
+    return m_queued.load(std::memory_order_relaxed);
+  }
+  // Tasks a worker took from the queue of another one.
+  std::uint64_t steals() const {
+    return m_steals.load(std::memory_order_relaxed);
+  }
+  // Tasks run so far.
+  std::uint64_t completed() const {
+    return m_completed.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct alignas(64) Queue {
+    std::mutex mutex;
+    Task *head = nullptr;
+    Task *tail = nullptr;
+  };
+
+  void work(std::size_t index);
+  // The next task from the worker's own queue, else from another one.
+  Task *take(std::size_t index);
+  Task *pop(Queue &queue);
+
+  std::size_t m_size;
+  std::unique_ptr<Queue[]> m_queues;
+  std::atomic<std::size_t> m_next{0};
+
+  std::atomic<std::uint64_t> m_queued{0};
+  std::atomic<std::uint64_t> m_steals{0};
+  std::atomic<std::uint64_t> m_completed{0};
+
+  // Guards sleeping and stopping.
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::atomic<unsigned int> m_sleeping{0};
+  bool m_stopping = false;
+
+  std::vector<std::thread> m_threads;
+};
+
+}  // namespace apee
+
+#endif  // APEE_WORKER_POOL_H
@@ -0,0 +1,208 @@
+#include "admission.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace apee {
+
+namespace {
+
+// Factor applied to the AIMD limit when the latency is too high.
+constexpr double backoff = 0.9;
+// Short-term latency tolerated above the long-term average before the
+// gradient limit shrinks.
+constexpr double tolerance = 1.5;
+// Weight of a new gradient limit against the current one.
+constexpr double smoothing = 0.2;
+// Windows averaged by the long-term latency of the gradient limit.
+constexpr double long_windows = 50;
+
+}  // namespace
+
+ConcurrencyLimit::ConcurrencyLimit(Admission const &options)
+    : m_algorithm{options.limit},
+      m_min{static_cast<double>(std::max<std::size_t>(1, options.min_limit))},
+      m_max{options.max_in_flight > 0
+                ? static_cast<double>(options.max_in_flight)
+                : std::numeric_limits<double>::max()},
+      m_threshold{static_cast<double>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              options.latency_threshold)
+              .count())},
+      m_window_end{(Clock::now() + window).time_since_epoch().count()} {
+  m_max = std::max(m_min, m_max);
+  m_estimate =
+      std::clamp(static_cast<double>(options.initial_limit), m_min, m_max);
+  m_limit.store(static_cast<std::size_t>(m_estimate),
+                std::memory_order_relaxed);
+}
+
+void ConcurrencyLimit::record(Clock::duration latency,
+                              std::size_t in_flight,
+                              Clock::time_point now) {
+  m_latency_sum.fetch_add(
+      static_cast<std::uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(latency)
+              .count()),
+      std::memory_order_relaxed);
+  auto samples = m_samples.fetch_add(1, std::memory_order_relaxed) + 1;
+  if (in_flight > m_max_in_flight.load(std::memory_order_relaxed)) {
+    m_max_in_flight.store(in_flight, std::memory_order_relaxed);
+  }
+  auto tick = now.time_since_epoch().count();
+  if (samples < min_samples ||
+      tick < m_window_end.load(std::memory_order_relaxed)) {
+    return;
+  }
+  // Whoever holds the lock is closing this window already.
+  std::unique_lock<std::mutex> lock{m_mutex, std::try_to_lock};
+  if (!lock.owns_lock() ||
+      tick < m_window_end.load(std::memory_order_relaxed)) {
+    return;
+  }
+  samples = m_samples.exchange(0, std::memory_order_relaxed);
+  auto sum = m_latency_sum.exchange(0, std::memory_order_relaxed);
+  auto max_in_flight = m_max_in_flight.exchange(0, std::memory_order_relaxed);
+  m_window_end.store((now + window).time_since_epoch().count(),
+                     std::memory_order_relaxed);
+  if (samples == 0) {
+    return;
+  }
+  auto average = std::max(1.0, static_cast<double>(sum) / samples);
+  double next = m_algorithm == Admission::Limit::Aimd
+                    ? aimd(average, max_in_flight, samples)
+                    : gradient(average, max_in_flight);
+  m_estimate = std::clamp(next, m_min, m_max);
+  m_limit.store(static_cast<std::size_t>(m_estimate),
+                std::memory_order_relaxed);
+}
+
+double ConcurrencyLimit::aimd(double latency,
+                              std::size_t in_flight,
+                              std::uint64_t samples) const {
+  if (latency > m_threshold) {
+    return m_estimate * backoff;
+  }
+  // A limit that is not reached says nothing about the capacity, raising
+  // it would let it grow without bound while the load is light.
+  if (2.0 * in_flight < m_estimate) {
+    return m_estimate;
+  }
+  // One more request per `limit` completed ones, as TCP congestion
+  // avoidance does per round trip, but at most doubling per window.
+  return m_estimate + std::min(samples / m_estimate, m_estimate);
+}
+
+double ConcurrencyLimit::gradient(double latency, std::size_t in_flight) {
+  if (m_long_latency == 0) {
+    m_long_latency = latency;
+  } else {
+    m_long_latency += (latency - m_long_latency) / long_windows;
+  }
+  // After latency dropped for good the long-term average would keep the
+  // limit high for a long time, let it catch up faster.
+  if (m_long_latency > 2 * latency) {
+    m_long_latency *= 0.95;
+  }
+  if (2.0 * in_flight < m_estimate) {
+    return m_estimate;
+  }
+  auto ratio = std::clamp(tolerance * m_long_latency / latency, 0.5, 1.0);
+  // The square root leaves room for some queueing, so the limit can grow
+  // while the latency stays flat.
+  auto next = m_estimate * ratio + std::sqrt(m_estimate);
+  return m_estimate * (1 - smoothing) + next * smoothing;
+}
+
+AdmissionControl::AdmissionControl(Admission const &options)
+    : m_max_connections{options.max_connections},
+      m_max_in_flight{options.max_in_flight} {
+  if (options.limit != Admission::Limit::Fixed) {
+    m_adaptive = std::make_unique<ConcurrencyLimit>(options);
+  }
+}
+
+bool AdmissionControl::reserve_connection() {
+  if (m_max_connections == 0) {
+    return true;
+  }
+  if (m_connections.fetch_add(1) >= m_max_connections) {
+    m_connections.fetch_sub(1);
+    return false;
+  }
+  return true;
+}
+
+void AdmissionControl::release_connection() {
+  if (m_max_connections == 0) {
+    return;
+  }
+  // Sequentially consistent with the store and load in
+  // wait_for_connection(), so that one of both sees the free slot.
+  m_connections.fetch_sub(1);
+  if (!m_has_waiting.load()) {
+    return;
+  }
+  std::vector<std::function<void()>> waiting;
+  {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    if (m_connections.load() < m_max_connections) {
+      waiting.swap(m_waiting);
+      m_has_waiting.store(false);
+    }
+  }
+  for (auto &resume : waiting) {
+    resume();
+  }
+}
+
+void AdmissionControl::wait_for_connection(std::function<void()> resume) {
+  std::vector<std::function<void()>> waiting;
+  {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_waiting.push_back(std::move(resume));
+    m_has_waiting.store(true);
+    if (m_connections.load() < m_max_connections) {
+      waiting.swap(m_waiting);
+      m_has_waiting.store(false);
+    }
+  }
+  for (auto &resume : waiting) {
+    resume();
+  }
+}
+
+void AdmissionControl::cancel_waiting() {
+  std::lock_guard<std::mutex> lock{m_mutex};
+  m_waiting.clear();
+  m_has_waiting.store(false);
+}
+
+bool AdmissionControl::admit() {
+  if (m_max_in_flight == 0 && !m_adaptive) {
+    return true;
+  }
+  auto limit = this->limit();
+  if (m_in_flight.fetch_add(1, std::memory_order_relaxed) >= limit) {
+    m_in_flight.fetch_sub(1, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+void AdmissionControl::release(Clock::duration latency, Clock::time_point now) {
+  if (m_max_in_flight == 0 && !m_adaptive) {
+    return;
+  }
+  auto in_flight = m_in_flight.fetch_sub(1, std::memory_order_relaxed);
+  if (m_adaptive) {
+    m_adaptive->record(latency, in_flight, now);
+  }
+}
+
+std::size_t AdmissionControl::limit() const {
+  return m_adaptive ? m_adaptive->get() : m_max_in_flight;
+}
+
+}  // namespace apee
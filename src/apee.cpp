@@ -1,5 +1,18 @@
 #include "apee.hpp"
+#include "admission.hpp"
+#include "beast.hpp"
+#include "client.hpp"
+#include "compression.hpp"
+#include "handoff.hpp"
+#include "http2.hpp"
 #include "log.hpp"
+#include "metrics.hpp"
+#include "rate_limiter.hpp"
+#include "response_cache.hpp"
+#include "response_head.hpp"
+#include "timer_wheel.hpp"
+#include "uring.hpp"
+#include "worker_pool.hpp"
 
 // Boost
 #include <boost/asio.hpp>
@@ -7,192 +20,3040 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <csignal>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 namespace ip = boost::asio::ip;       // from <boost/asio.hpp>
 using tcp = boost::asio::ip::tcp;     // from <boost/asio.hpp>
 namespace http = boost::beast::http;  // from <boost/beast/http.hpp>
 
-namespace apee {
-using namespace logger;
+namespace apee {
+using namespace logger;
+
+using Clock = std::chrono::steady_clock;
+
+// State shared by the listeners and connections of a Service.
+struct ServiceState {
+  ServiceState(Config const &config,
+               std::shared_ptr<AbstractRequestHandler> handler,
+               unsigned int threads)
+      : config{config},
+        handler{std::move(handler)},
+        metrics{threads},
+        admission{config.admission} {
+    if (config.caching.memory_budget > 0) {
+      cache = std::make_unique<ResponseCache>(config.caching,
+                                              config.compression.enabled);
+    }
+    if (config.compression.enabled &&
+        config.compression.variant_cache_size > 0) {
+      variants = std::make_unique<VariantCache>(
+          config.compression.variant_cache_size);
+    }
+    if (config.rate_limit.rate > 0) {
+      rate_limiter = std::make_unique<RateLimiter>(config.rate_limit);
+    }
+    detail::append_field(cors_field, "Access-Control-Allow-Origin", "*");
+    if (!config.server_name.empty()) {
+      detail::append_field(server_field, "Server", config.server_name);
+    }
+  }
+
+  // The metrics including the admission gauges.
+  MetricsSnapshot snapshot() const {
+    auto snapshot = metrics.snapshot();
+    snapshot.requests_in_flight = admission.in_flight();
+    snapshot.concurrency_limit = admission.limit();
+    if (workers) {
+      snapshot.worker_queue_depth = workers->queued();
+      snapshot.worker_steals = workers->steals();
+      snapshot.worker_tasks = workers->completed();
+    }
+    if (rate_limiter) {
+      snapshot.rate_limit_keys = rate_limiter->keys();
+    }
+    return snapshot;
+  }
+
+  Config config;
+  std::shared_ptr<AbstractRequestHandler> handler;
+  Metrics metrics;
+  AdmissionControl admission;
+  // Set by Service::stop(), connections are no longer kept alive.
+  std::atomic<bool> stopping{false};
+  // Null unless Caching::memory_budget is set.
+  std::unique_ptr<ResponseCache> cache;
+  // Null unless compression is enabled with a variant cache.
+  std::unique_ptr<VariantCache> variants;
+  // Null unless RateLimit::rate is set.
+  std::unique_ptr<RateLimiter> rate_limiter;
+  // Owned by the Service, null unless Threading::workers is set.
+  WorkerPool *workers = nullptr;
+  // Fields sent with every response that does not set them itself,
+  // rendered once. server_field is empty without a server name.
+  std::string cors_field;
+  std::string server_field;
+};
+
+// Capacity of the request and response bodies kept when a Connection goes
+// back to its pool, larger strings are released.
+constexpr std::size_t retained_body_capacity = 64 * 1024;
+
+// Responses to pipelined requests are collected up to this size before they
+// are written, see Connection::send().
+constexpr std::size_t max_deferred = 64 * 1024;
+
+constexpr std::string_view continue_response = "HTTP/1.1 100 Continue\r\n\r\n";
+
+bool expects_continue(detail::Fields const &fields, unsigned int version) {
+  return version >= 11 &&
+         boost::beast::iequals(fields[http::field::expect], "100-continue");
+}
+
+using detail::recycling;
+
+// The ring of `context` if it was started, see IoUring.
+detail::Ring *started_ring(boost::asio::execution_context &context) {
+  if (!boost::asio::has_service<detail::Ring>(context)) {
+    return nullptr;
+  }
+  auto &ring = boost::asio::use_service<detail::Ring>(context);
+  return ring.started() ? &ring : nullptr;
+}
+
+// The wait for a token of the RateLimit of the client of `header`, whose
+// address bytes are `peer`; zero if the request may be answered now. `key`
+// is scratch space.
+Clock::duration rate_limit_wait(
+    ServiceState &state,
+    std::string_view peer,
+    http::request_header<detail::Fields> const &header,
+    std::string &key,
+    Clock::time_point now) {
+  auto const &options = state.config.rate_limit;
+  boost::beast::string_view value;
+  if (!options.header.empty()) {
+    value = header[options.header];
+  }
+  // Tagged, so a header value cannot collide with an address.
+  key.clear();
+  if (value.empty()) {
+    key.append("a").append(peer);
+  } else {
+    key.append("h").append(value.data(), value.size());
+  }
+  if (options.per_path) {
+    auto target = header.target();
+    auto path = target.substr(0, target.find('?'));
+    key.append("\n").append(path.data(), path.size());
+  }
+  return state.rate_limiter->acquire(key, now);
+}
+
+void options_response(detail::BeastResponse &response) {
+  response.result(http::status::ok);
+  response.set(http::field::access_control_request_method, "GET, POST");
+  response.set(http::field::access_control_allow_headers,
+               "Origin, Content-Type, X-Auth-Token");
+}
+
+void not_found_response(detail::BeastResponse &response) {
+  response.result(http::status::not_found);
+  response.set(http::field::content_type, "text/plain");
+  response.body() = "File not found\r\n";
+}
+
+// Answers a request the handler has no capacity for, see Admission.
+void overload_response(ServiceState &state, detail::BeastResponse &response) {
+  state.metrics.record_rejected();
+  response.result(http::status::service_unavailable);
+  auto retry_after = std::chrono::ceil<std::chrono::seconds>(
+      state.config.admission.retry_after);
+  if (retry_after.count() > 0) {
+    response.set(http::field::retry_after, std::to_string(retry_after.count()));
+  }
+  response.set(http::field::content_type, "text/plain");
+  response.body() = "Service unavailable\r\n";
+}
+
+// Sets the body of the response to the compressed form of `body`, taken
+// from the variant cache if the response has a strong ETag. Returns false
+// if compression would not make the body smaller. `compressed` and
+// `variant_key` are scratch space.
+bool compress_body(ServiceState &state,
+                   Encoding encoding,
+                   int level,
+                   boost::beast::string_view target,
+                   std::string_view body,
+                   detail::BeastResponse &response,
+                   std::string &compressed,
+                   std::string &variant_key) {
+  auto etag = response[http::field::etag];
+  auto &variants = state.variants;
+  bool reuse = variants && !etag.empty() && !etag.starts_with("W/");
+  if (reuse) {
+    variant_key.assign(target.data(), target.size());
+    variant_key.append("\n").append(etag.data(), etag.size());
+    variant_key.append("\n").append(to_string(encoding));
+    if (auto variant = variants->find(variant_key)) {
+      response.body().assign(*variant);
+      return true;
+    }
+  }
+  compressed.clear();
+  Compressor::acquire(encoding, level, body.size())
+      ->compress(body, true, compressed);
+  if (compressed.size() >= body.size()) {
+    return false;
+  }
+  if (reuse) {
+    variants->insert(variant_key,
+                     std::make_shared<std::string const>(compressed));
+  }
+  response.body().swap(compressed);
+  return true;
+}
+
+// Compresses a string body at once into the body of the response and
+// returns the compressor of a stream body, see Compression. `body` is that
+// of the response or of its SharedBody. Responses that are not compressed
+// are left as they are.
+Compressor::Ptr encode_response(ServiceState &state,
+                                Encoding encoding,
+                                boost::beast::string_view target,
+                                bool streaming,
+                                std::string_view body,
+                                detail::BeastResponse &response,
+                                std::string &compressed,
+                                std::string &variant_key) {
+  auto const &options = state.config.compression;
+  auto status = response.result_int();
+  auto content_type = response[http::field::content_type];
+  // The Content-Range of a partial response counts bytes of the identity
+  // encoding, compressing the part would not match it.
+  if (status < 200 || status == 204 || status == 206 || status == 304 ||
+      response.count(http::field::content_range) > 0 ||
+      response.count(http::field::content_encoding) > 0 ||
+      !compressible(std::string_view(content_type.data(), content_type.size()),
+                    options)) {
+    return nullptr;
+  }
+  int level = encoding == Encoding::Brotli ? options.brotli_quality
+                                           : options.level;
+  Compressor::Ptr compressor;
+  if (streaming) {
+    compressor = Compressor::acquire(encoding, level);
+  } else if (body.size() < options.min_size ||
+             !compress_body(state,
+                            encoding,
+                            level,
+                            target,
+                            body,
+                            response,
+                            compressed,
+                            variant_key)) {
+    return nullptr;
+  }
+  auto coding = to_string(encoding);
+  response.set(http::field::content_encoding,
+               boost::beast::string_view(coding.data(), coding.size()));
+  auto vary = response[http::field::vary];
+  if (vary.empty()) {
+    response.set(http::field::vary, "Accept-Encoding");
+  } else if (!boost::beast::http::token_list(vary).exists("Accept-Encoding")) {
+    response.set(http::field::vary, vary.to_string() + ", Accept-Encoding");
+  }
+  // The encoded body is a different representation, a strong ETag is
+  // weakened as it no longer identifies the bytes sent.
+  auto etag = response[http::field::etag];
+  if (!etag.empty() && !etag.starts_with("W/")) {
+    response.set(http::field::etag, "W/" + etag.to_string());
+  }
+  return compressor;
+}
+
+// Whether the Content-Length set on a response with an empty string body is
+// sent instead of the length of that body: the answer to a HEAD request or
+// a NotModified response gives that of the body a GET would get.
+bool declared_length(detail::BeastResponse const &response,
+                     unsigned int status,
+                     bool head,
+                     std::string_view body) {
+  return (head || status == 304) && body.empty() &&
+         response.count(http::field::content_length) > 0;
+}
+
+// The read buffer of a Connection, over storage that changes with the
+// socket: a registered buffer of the ring or one of the connection's own.
+class ReadBuffer : public boost::beast::flat_static_buffer_base {
+ public:
+  ReadBuffer() : flat_static_buffer_base(nullptr, 0) {}
+  using flat_static_buffer_base::reset;
+};
+
+// Decodes the value of an HTTP2-Settings field, base64url without padding
+// (RFC 7540, section 3.2.1).
+bool decode_base64url(boost::beast::string_view text, std::string &out) {
+  out.clear();
+  std::uint32_t bits = 0;
+  int count = 0;
+  for (char c : text) {
+    int value;
+    if (c >= 'A' && c <= 'Z') {
+      value = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      value = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      value = c - '0' + 52;
+    } else if (c == '-' || c == '_') {
+      value = c == '-' ? 62 : 63;
+    } else {
+      return false;
+    }
+    bits = bits << 6 | static_cast<std::uint32_t>(value);
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      out.push_back(static_cast<char>(bits >> count));
+    }
+  }
+  return true;
+}
+
+constexpr std::string_view switching_protocols =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+// Output of an HTTP/2 connection written at once. Reading pauses while more
+// than this is waiting behind the write in progress.
+constexpr std::size_t http2_write_size = 64 * 1024;
+
+class Connection;
+class Http2Stream;
+
+// HTTP/2 on a Connection that switched to it, see Http2. Everything read is
+// passed to the session, whose output is written one write at a time while
+// the streams' requests are answered by Http2Stream. Lives with its
+// Connection and is reused with it.
+class Http2Connection : public detail::Http2Session::Handler {
+ public:
+  explicit Http2Connection(Connection &connection)
+      : m_connection{connection} {}
+
+  bool active() const { return m_active; }
+  bool closed() const { return m_closed; }
+  detail::Http2Session &session() { return m_session; }
+
+  // Takes over after the client started with the connection preface.
+  // `preface` is what the read buffer, and the reads after it, start with.
+  void start(std::string_view preface);
+  // Takes over after `request` asked for "Upgrade: h2c" with `settings`.
+  // The request becomes stream 1.
+  void upgrade(std::string_view settings, detail::BeastRequest &&request);
+  // Writes the output of the session unless a write is in progress.
+  void flush();
+  // Ends the connection for Service::stop(): with GOAWAY, after which the
+  // open streams finish, or at once with `force`.
+  void drain(bool force);
+  // Drops the streams and closes the socket.
+  void close();
+  // Forgets the last socket, see Connection::recycle().
+  void reset();
+
+  void on_request(std::uint32_t stream,
+                  detail::Http2Header const &header,
+                  bool end_stream) override;
+  void on_data(std::uint32_t stream,
+               std::string_view data,
+               bool end_stream) override;
+  void on_sent(std::uint32_t stream) override;
+  void on_close(std::uint32_t stream, detail::Http2Error error) override;
+
+ private:
+  detail::Http2Settings settings() const;
+  std::shared_ptr<Http2Stream> open(std::uint32_t id);
+  Http2Stream *find(std::uint32_t id) const;
+  void receive();
+  void read();
+  void on_read(boost::beast::error_code ec, std::size_t bytes_transferred);
+  void on_write(boost::beast::error_code ec, std::size_t bytes_transferred);
+  void update_timeout();
+
+  Connection &m_connection;
+  detail::Http2Session m_session;
+  // The open streams by id.
+  std::vector<std::pair<std::uint32_t, std::shared_ptr<Http2Stream>>>
+      m_streams;
+  // The output being written, swapped with that of the session.
+  std::string m_write;
+  bool m_active = false;
+  bool m_closed = false;
+  bool m_writing = false;
+  // Inside the session, which is not re-entered from its callbacks.
+  bool m_busy = false;
+  bool m_read_paused = false;
+  // The session is finished and the sending side shut down.
+  bool m_shut_down = false;
+};
+
+// Connections are owned by the ConnectionPool of their io_context and
+// reused for later sockets, see ConnectionPool::acquire().
+class Connection : public std::enable_shared_from_this<Connection>,
+                   public detail::ResponseSink,
+                   public detail::BodySource,
+                   public WorkerPool::Task {
+  friend class ConnectionPool;
+  friend class Http2Connection;
+  friend class Http2Stream;
+
+  char const *m_channel = "http_connection";
+  // Neighbours in the list of open connections of the pool.
+  Connection *m_prev = nullptr;
+  Connection *m_next = nullptr;
+  tcp::socket m_socket;
+  // The ring of the io_context if it has one, see IoUring. The socket is
+  // then read and written through m_ring_stream.
+  detail::Ring *m_ring;
+  std::optional<detail::RingStream> m_ring_stream;
+  ReadBuffer m_buffer;
+  char *m_ring_buffer = nullptr;
+  std::unique_ptr<char[]> m_storage;
+  std::size_t m_storage_size = 0;
+  detail::BeastRequest m_request;
+  std::optional<http::request_parser<http::string_body,
+                                     detail::RecyclingAllocator<char>>>
+      m_parser;
+  // Parser of a body streamed to the handler, which reads it piece by piece
+  // into m_piece.
+  std::optional<http::request_parser<http::buffer_body,
+                                     detail::RecyclingAllocator<char>>>
+      m_body_parser;
+  std::string m_piece;
+  // 100 Continue is still to be sent before reading the streamed body.
+  bool m_continue = false;
+  detail::BeastResponse m_response;
+  std::optional<http::response_serializer<http::string_body, detail::Fields>>
+      m_serializer;
+  // The body of a response with a SharedBody, sent instead of that of
+  // m_response.
+  std::optional<SharedBody> m_shared;
+  std::optional<FileBody> m_file;
+  StreamBody m_stream;
+  // The body of a response with an AsyncStreamBody, see pull_chunk().
+  AsyncStreamBody m_source;
+  std::string m_chunk;
+  TimerWheel &m_wheel;
+  TimerWheel::Timer m_timeout;
+  std::shared_ptr<ServiceState> m_state;
+  std::optional<Request> m_pending;
+  Clock::time_point m_accepted;
+  // Start of the stage the request is in, see Metrics::Stage.
+  Clock::time_point m_stage_start;
+  std::size_t m_received = 0;
+  unsigned int m_requests = 0;
+  // Whether the request counts against the in-flight limit.
+  bool m_admitted = false;
+  // Keeps the connection alive while its request waits for a worker.
+  std::shared_ptr<Connection> m_offloaded;
+  // Waiting for the next request on a persistent connection.
+  bool m_idle = false;
+  // The bytes of the client's address and the key of the request in the
+  // RateLimit, only set with a rate limit.
+  std::string m_peer;
+  std::string m_rate_key;
+  // Key of the request in the response cache, valid if the handler's
+  // response is to be stored there.
+  std::string m_cache_key;
+  bool m_cache_store = false;
+  std::chrono::milliseconds m_cache_ttl{-1};
+  // The cached response being written.
+  std::shared_ptr<CachedResponse const> m_cached;
+  // Content coding negotiated for the response, its compressor while a
+  // StreamBody is compressed and the output of the compressor.
+  Encoding m_encoding = Encoding::Identity;
+  Compressor::Ptr m_compressor;
+  std::string m_compressed;
+  std::string m_variant_key;
+  // Header of a response with a string body, see send_response().
+  std::string m_head;
+  // Responses to pipelined requests that wait to go out with a later one,
+  // see send().
+  std::string m_out;
+  // m_out is written on its own, see flush_deferred().
+  bool m_flushing = false;
+  // write_response() was called while flushing and is called again after.
+  bool m_write_waiting = false;
+  // The handler has the request and has not answered yet.
+  bool m_handling = false;
+  // Created when a socket of the connection first switches to HTTP/2 and
+  // kept for the later ones.
+  std::unique_ptr<Http2Connection> m_http2;
+
+ public:
+  Connection(tcp::socket socket, TimerWheel &wheel, detail::Ring *ring)
+      : m_socket(std::move(socket)), m_ring(ring), m_wheel(wheel) {}
+
+  // Takes over a newly accepted socket.
+  void open(tcp::socket socket, std::shared_ptr<ServiceState> state) {
+    m_socket = std::move(socket);
+    m_state = std::move(state);
+    m_accepted = Clock::now();
+    m_requests = 0;
+    m_peer.clear();
+    if (m_state->rate_limiter) {
+      boost::beast::error_code ec;
+      auto address = m_socket.remote_endpoint(ec).address();
+      if (address.is_v4()) {
+        auto bytes = address.to_v4().to_bytes();
+        m_peer.assign(bytes.begin(), bytes.end());
+      } else {
+        auto bytes = address.to_v6().to_bytes();
+        m_peer.assign(bytes.begin(), bytes.end());
+      }
+    }
+    // The whole header has to fit into the buffer.
+    auto size = std::max(m_state->config.read_buffer_size,
+                         m_state->config.max_header_size);
+    if (m_ring) {
+      if (!m_ring_stream) {
+        m_ring_stream.emplace(m_socket, *m_ring);
+      }
+      if (m_ring->buffer_size() == size) {
+        m_ring_buffer = m_ring->acquire_buffer();
+      }
+    }
+    if (m_ring_buffer) {
+      m_buffer.reset(m_ring_buffer, size);
+    } else {
+      if (m_storage_size != size) {
+        m_storage.reset(new char[size]);
+        m_storage_size = size;
+      }
+      m_buffer.reset(m_storage.get(), size);
+    }
+    m_state->metrics.record_accepted();
+  }
+
+  // Drops everything referring to the last socket, keeping the capacity of
+  // the buffers for the next one.
+  void recycle() {
+    boost::beast::error_code ec;
+    m_wheel.cancel(m_timeout);
+    m_socket.close(ec);
+    if (m_ring_buffer) {
+      m_ring->release_buffer(std::exchange(m_ring_buffer, nullptr));
+    }
+    m_state->metrics.record_closed();
+    m_state->admission.release_connection();
+    m_state.reset();
+    reset_request();
+    m_response.clear();
+    m_response.body().clear();
+    m_chunk.clear();
+    m_compressed.clear();
+    m_out.clear();
+    m_flushing = false;
+    m_write_waiting = false;
+    m_handling = false;
+    if (m_http2) {
+      m_http2->reset();
+    }
+    for (auto body : {&m_request.body(),
+                      &m_response.body(),
+                      &m_chunk,
+                      &m_compressed,
+                      &m_piece,
+                      &m_head,
+                      &m_out}) {
+      if (body->capacity() > retained_body_capacity) {
+        std::string().swap(*body);
+      }
+    }
+  }
+
+  // Calls `function` with the stream the socket is read and written through.
+  template <typename Function>
+  void with_stream(Function &&function) {
+    if (m_ring_stream) {
+      function(*m_ring_stream);
+    } else {
+      function(m_socket);
+    }
+  }
+
+  // Aborts the pending operations and closes the socket.
+  void close_socket() {
+    boost::beast::error_code ec;
+    if (m_ring_stream) {
+      // Operations of the ring keep the socket open until they end.
+      m_ring_stream->cancel();
+    }
+    m_socket.close(ec);
+  }
+
+  void start() {
+    APEE_LOG(m_channel, debug) << "Started";
+    m_timeout.bind(weak_from_this(), &Connection::expired);
+    read_request();
+  }
+
+  void reset_request() {
+    m_pending.reset();
+    m_parser.reset();
+    m_serializer.reset();
+    m_shared.reset();
+    m_file.reset();
+    m_stream = nullptr;
+    m_source = nullptr;
+    m_body_parser.reset();
+    m_continue = false;
+    m_cache_store = false;
+    m_cache_ttl = std::chrono::milliseconds(-1);
+    m_cached.reset();
+    m_encoding = Encoding::Identity;
+    m_compressor.reset();
+    // Clearing instead of assigning a new message keeps the body capacity.
+    m_request.clear();
+    m_request.body().clear();
+  }
+
+  void read_request() {
+    APEE_LOG(m_channel, debug) << "Reading request";
+    reset_request();
+    m_received = 0;
+    // Pipelined requests already in m_buffer are parsed from there without
+    // another read on the socket. Otherwise a persistent connection waits
+    // for the next request under the idle timeout.
+    if (m_requests == 0 || m_buffer.size() > 0) {
+      read_header();
+      return;
+    }
+    m_wheel.arm(m_timeout, m_state->config.timeouts.idle);
+    m_idle = true;
+    auto self = shared_from_this();
+    with_stream([&](auto &stream) {
+      stream.async_wait(tcp::socket::wait_read,
+                        recycling([self](boost::beast::error_code ec) {
+                          self->m_idle = false;
+                          if (ec) {
+                            self->on_read_error(ec);
+                          } else {
+                            self->read_header();
+                          }
+                        }));
+    });
+  }
+
+  void read_header() {
+    m_stage_start = Clock::now();
+    m_wheel.arm(m_timeout, m_state->config.timeouts.header);
+    m_parser.emplace(std::move(m_request));
+    m_parser->header_limit(static_cast<std::uint32_t>(std::min<std::size_t>(
+        m_state->config.max_header_size, UINT32_MAX)));
+    // A Content-Length is checked against the limit that applies once it
+    // is known whether the body is streamed, see on_header(). Beast 1.74
+    // treats an empty limit as 0 here, hence the maximum.
+    m_parser->body_limit(std::numeric_limits<std::uint64_t>::max());
+    auto self = shared_from_this();
+    with_stream([&](auto &stream) {
+      http::async_read_header(
+          stream,
+          m_buffer,
+          *m_parser,
+          recycling([self](boost::beast::error_code ec,
+                           std::size_t bytes_transferred) {
+            self->m_received += bytes_transferred;
+            if (ec) {
+              self->on_read_error(ec);
+            } else {
+              self->on_header();
+            }
+          }));
+    });
+  }
+
+  // Refuses the request or decides whether its body is read into the
+  // request or streamed to the handler.
+  void on_header() {
+    // The responses deferred before this request go out before its body is
+    // waited for.
+    if (!m_out.empty() && !m_parser->is_done()) {
+      flush_deferred([self = shared_from_this()] { self->on_header(); });
+      return;
+    }
+    if (m_state->config.http2.enabled && upgrade_to_http2()) {
+      return;
+    }
+    if (m_state->rate_limiter && rate_limited()) {
+      return;
+    }
+    auto const &config = m_state->config;
+    auto const &header = m_parser->get();
+    auto length = m_parser->content_length();
+    auto method = header.method();
+    if (config.require_content_length && !length &&
+        (method == http::verb::post || method == http::verb::put ||
+         method == http::verb::patch)) {
+      reject(http::status::length_required);
+      return;
+    }
+    if (!m_parser->is_done() && m_state->handler &&
+        m_state->handler->stream_body(detail::from_beast(header))) {
+      auto limit = config.max_streamed_body_size;
+      if (limit > 0 && length && *length > limit) {
+        reject(http::status::payload_too_large);
+      } else {
+        start_stream(limit > 0 ? limit
+                               : std::numeric_limits<std::uint64_t>::max());
+      }
+      return;
+    }
+    if (length && *length > config.max_body_size) {
+      reject(http::status::payload_too_large);
+      return;
+    }
+    // Chunked bodies are counted against the limit as they arrive.
+    m_parser->body_limit(config.max_body_size);
+    if (!m_parser->is_done() &&
+        expects_continue(header.base(), header.version())) {
+      write_continue([self = shared_from_this()](boost::beast::error_code ec) {
+        if (ec) {
+          self->on_read_error(ec);
+        } else {
+          self->read_body();
+        }
+      });
+      return;
+    }
+    read_body();
+  }
+
+  // Hands the connection to m_http2 if the client started with the HTTP/2
+  // preface (RFC 9113, section 3.4), whose request line Beast refuses for
+  // its version.
+  bool start_http2() {
+    auto data = m_buffer.data();
+    auto received =
+        std::string_view(static_cast<char const *>(data.data()), data.size());
+    if (m_requests > 0 ||
+        received.substr(0, detail::http2_preface.size()) !=
+            detail::http2_preface.substr(0, received.size())) {
+      return false;
+    }
+    m_parser.reset();
+    finish_read();
+    if (!m_http2) {
+      m_http2 = std::make_unique<Http2Connection>(*this);
+    }
+    m_http2->start(detail::http2_preface);
+    return true;
+  }
+
+  // Hands the connection to m_http2 if the request asks for "Upgrade: h2c"
+  // (RFC 7540, section 3.2). Only taken for a request without a body whose
+  // response would go out right away.
+  bool upgrade_to_http2() {
+    auto const &header = m_parser->get();
+    auto upgrade = header[http::field::upgrade];
+    if (upgrade.empty() || !m_out.empty() || !m_parser->is_done() ||
+        !http::token_list(upgrade).exists("h2c") ||
+        !decode_base64url(header["HTTP2-Settings"], m_piece) ||
+        m_piece.size() % 6 != 0) {
+      return false;
+    }
+    APEE_LOG(m_channel, debug) << "Upgrading to HTTP/2";
+    m_request = m_parser->release();
+    m_parser.reset();
+    finish_read();
+    if (!m_http2) {
+      m_http2 = std::make_unique<Http2Connection>(*this);
+    }
+    m_http2->upgrade(m_piece, std::move(m_request));
+    return true;
+  }
+
+  // Answers Expect: 100-continue, after which the client sends the body.
+  template <typename Handler>
+  void write_continue(Handler &&handler) {
+    m_wheel.arm(m_timeout, m_state->config.timeouts.write);
+    auto next = recycling([self = shared_from_this(),
+                           handler = std::forward<Handler>(handler)](
+                              boost::beast::error_code ec,
+                              std::size_t bytes_transferred) mutable {
+      self->m_wheel.cancel(self->m_timeout);
+      self->m_state->metrics.record_sent(bytes_transferred);
+      handler(ec);
+    });
+    with_stream([&](auto &stream) {
+      boost::asio::async_write(stream,
+                               boost::asio::buffer(continue_response.data(),
+                                                   continue_response.size()),
+                               std::move(next));
+    });
+  }
+
+  // Hands the request to the handler with its body still unread, see
+  // AbstractRequestHandler::on_request_stream.
+  void start_stream(std::uint64_t limit) {
+    m_body_parser.emplace(std::move(*m_parser));
+    m_parser.reset();
+    m_body_parser->body_limit(limit);
+    auto const &header = m_body_parser->get();
+    m_continue = expects_continue(header.base(), header.version());
+    m_request.base() = header.base();
+    m_request.body().clear();
+    finish_read();
+    process_request();
+  }
+
+  void read_body(std::uint64_t request, BodyReader::Handler handler) override {
+    auto self = shared_from_this();
+    boost::asio::post(
+        m_socket.get_executor(),
+        [self, request, handler = std::move(handler)]() mutable {
+          if (request != self->m_requests || !self->m_body_parser) {
+            // The reader outlived its request.
+            handler(std::make_error_code(std::errc::operation_canceled), {});
+          } else {
+            self->read_piece(std::move(handler));
+          }
+        });
+  }
+
+  void read_piece(BodyReader::Handler handler) {
+    if (m_body_parser->is_done()) {
+      handler({}, {});
+      return;
+    }
+    if (m_continue) {
+      m_continue = false;
+      write_continue([self = shared_from_this(), handler = std::move(handler)](
+                         boost::beast::error_code ec) mutable {
+        if (ec) {
+          handler(ec, {});
+        } else {
+          self->read_piece(std::move(handler));
+        }
+      });
+      return;
+    }
+    m_piece.resize(m_buffer.max_size());
+    auto &body = m_body_parser->get().body();
+    body.data = m_piece.data();
+    body.size = m_piece.size();
+    body.more = true;
+    m_wheel.arm(m_timeout, m_state->config.timeouts.read);
+    auto next = recycling([self = shared_from_this(),
+                           handler = std::move(handler)](
+                              boost::beast::error_code ec,
+                              std::size_t bytes_transferred) mutable {
+      self->m_wheel.cancel(self->m_timeout);
+      self->m_state->metrics.record_received(bytes_transferred);
+      // A full piece ends the read with need_buffer.
+      if (ec == http::error::need_buffer) {
+        ec = {};
+      }
+      auto size =
+          self->m_piece.size() - self->m_body_parser->get().body().size;
+      if (!ec && size == 0 && !self->m_body_parser->is_done()) {
+        // Only framing was read, e.g. a chunk header.
+        self->read_piece(std::move(handler));
+        return;
+      }
+      handler(ec, std::string_view(self->m_piece.data(), size));
+    });
+    with_stream([&](auto &stream) {
+      http::async_read_some(stream, m_buffer, *m_body_parser, std::move(next));
+    });
+  }
+
+  void read_body() {
+    if (m_parser->is_done()) {
+      on_read();
+      return;
+    }
+    m_wheel.arm(m_timeout, m_state->config.timeouts.read);
+    auto self = shared_from_this();
+    with_stream([&](auto &stream) {
+      http::async_read(stream,
+                       m_buffer,
+                       *m_parser,
+                       recycling([self](boost::beast::error_code ec,
+                                        std::size_t bytes_transferred) {
+                         self->m_received += bytes_transferred;
+                         if (ec) {
+                           self->on_read_error(ec);
+                         } else {
+                           self->on_read();
+                         }
+                       }));
+    });
+  }
+
+  void on_read() {
+    m_request = m_parser->release();
+    m_parser.reset();
+    finish_read();
+    process_request();
+  }
+
+  // Ends the read stage.
+  void finish_read() {
+    m_wheel.cancel(m_timeout);
+    auto now = Clock::now();
+    auto &metrics = m_state->metrics;
+    metrics.record_received(m_received);
+    metrics.record(Metrics::Stage::Read, now - m_stage_start);
+    if (m_requests == 0) {
+      metrics.record(Metrics::Stage::Accept, now - m_accepted);
+    }
+    m_stage_start = now;
+  }
+
+  void on_read_error(boost::beast::error_code ec) {
+    if (ec == http::error::bad_version && m_state->config.http2.enabled &&
+        start_http2()) {
+      return;
+    }
+    if (ec == http::error::header_limit || ec == http::error::body_limit) {
+      APEE_LOG(m_channel, warning) << ec;
+      m_state->metrics.record_error("read", ec);
+      reject(ec == http::error::header_limit
+                 ? http::status::request_header_fields_too_large
+                 : http::status::payload_too_large);
+      return;
+    }
+    if (ec == http::error::end_of_stream) {
+      APEE_LOG(m_channel, debug) << "Closed by peer";
+    } else if (ec == boost::asio::error::operation_aborted &&
+               m_state->stopping.load(std::memory_order_relaxed)) {
+      APEE_LOG(m_channel, debug) << "Closed by stop";
+    } else {
+      APEE_LOG(m_channel, error) << ec;
+      if (ec != boost::asio::error::operation_aborted) {
+        m_state->metrics.record_error("read", ec);
+      }
+    }
+    close();
+  }
+
+  // Answers a request over the RateLimit of its client with TooManyRequests.
+  bool rate_limited() {
+    auto wait = rate_limit_wait(
+        *m_state, m_peer, m_parser->get(), m_rate_key, m_stage_start);
+    if (wait == Clock::duration::zero()) {
+      return false;
+    }
+    APEE_LOG(m_channel, debug) << "Rejecting request, rate limit reached";
+    m_state->metrics.record_rate_limited();
+    reject(http::status::too_many_requests,
+           std::chrono::ceil<std::chrono::seconds>(wait));
+    return true;
+  }
+
+  // Answers a request that exceeds the configured limits. The connection is
+  // closed afterwards, the rest of the request is never read. A Retry-After
+  // is sent unless `retry_after` is zero.
+  void reject(http::status status,
+              std::chrono::seconds retry_after = std::chrono::seconds(0)) {
+    m_wheel.cancel(m_timeout);
+    auto version = m_parser->is_header_done() ? m_parser->get().version() : 11;
+    m_parser.reset();
+    m_response.clear();
+    m_response.body().clear();
+    m_response.version(version);
+    m_response.keep_alive(false);
+    m_response.result(status);
+    if (retry_after.count() > 0) {
+      m_response.set(http::field::retry_after,
+                     std::to_string(retry_after.count()));
+    }
+    m_stage_start = Clock::now();
+    write_response();
+  }
+
+  void process_request() {
+    APEE_LOG(m_channel, info)
+        << "Processing " << m_request.method() << " request";
+    APEE_LOG(m_channel, debug) << "Request:\n" << m_request;
+    m_response.clear();
+    m_response.body().clear();
+    m_response.version(m_request.version());
+    m_response.keep_alive(
+        m_request.keep_alive() &&
+        ++m_requests < m_state->config.max_requests_per_connection &&
+        !m_state->stopping.load(std::memory_order_relaxed));
+    if (m_state->config.compression.enabled) {
+      auto accept_encoding = m_request[http::field::accept_encoding];
+      m_encoding = negotiate(
+          std::string_view(accept_encoding.data(), accept_encoding.size()),
+          m_state->config.compression);
+    }
+
+    if (m_request.method() == http::verb::options) {
+      handle_options_request();
+    } else if (is_metrics_request()) {
+      m_response.result(http::status::ok);
+      m_response.set(http::field::content_type, "text/plain; version=0.0.4");
+      m_response.body() = Metrics::prometheus(m_state->snapshot());
+    } else if (detail::to_method(m_request.method()) != Method::UNKNOWN) {
+      if (lookup_cache()) {
+        return;
+      }
+      m_response.result(http::status::ok);
+      if (!m_state->handler) {
+        handle_target_not_found();
+      } else if (!m_state->admission.admit()) {
+        handle_overload();
+      } else {
+        m_admitted = true;
+        m_pending.emplace(detail::from_beast(m_request));
+        m_handling = true;
+        if (m_body_parser) {
+          m_state->handler->on_request_stream(
+              *m_pending,
+              BodyReader(shared_from_this(), m_requests),
+              Responder(shared_from_this()));
+        } else if (m_state->workers &&
+                   m_state->handler->offload(*m_pending)) {
+          m_offloaded = shared_from_this();
+          m_state->workers->submit(*this);
+        } else {
+          m_state->handler->on_request_async(*m_pending,
+                                             Responder(shared_from_this()));
+        }
+        // A handler that answers later does not hold back the responses
+        // deferred before its request.
+        if (m_handling && !m_out.empty()) {
+          flush_deferred([self = shared_from_this()] {
+            if (std::exchange(self->m_write_waiting, false)) {
+              self->write_response();
+            }
+          });
+        }
+        return;
+      }
+    } else {
+      APEE_LOG(m_channel, error) << "Invalid request-method";
+      m_response.result(http::status::bad_request);
+      m_response.set(http::field::content_type, "text/plain");
+      m_response.body() = "Invalid request-method '" +
+                          m_request.method_string().to_string() + "'";
+    }
+    write_response();
+  }
+
+  bool is_metrics_request() const {
+    auto const &path = m_state->config.metrics_path;
+    return !path.empty() && m_request.method() == http::verb::get &&
+           std::string_view(m_request.target().data(),
+                            m_request.target().size()) == path;
+  }
+
+  // Answers GET and HEAD requests from the response cache. On a miss the
+  // response of the handler is offered to the cache by write_response().
+  bool lookup_cache() {
+    auto &cache = m_state->cache;
+    if (!cache || !cache->key(m_request, to_string(m_encoding), m_cache_key)) {
+      return false;
+    }
+    if (auto entry = cache->find(m_cache_key, m_stage_start)) {
+      APEE_LOG(m_channel, debug) << "Answering from cache";
+      m_state->metrics.record_cache_hit();
+      start_write();
+      write_cached(std::move(entry));
+      return true;
+    }
+    m_state->metrics.record_cache_miss();
+    m_cache_store = m_request.method() == http::verb::get;
+    return false;
+  }
+
+  // Handles an offloaded request on a thread of the worker pool.
+  void run() override {
+    auto self = std::move(m_offloaded);
+    m_state->handler->on_request_async(*m_pending, Responder(std::move(self)));
+  }
+
+  void respond(Response &&response) override {
+    detail::to_beast(response, m_response);
+    m_cache_ttl = response.cache_ttl();
+    auto &payload = response.payload();
+    if (auto body = std::get_if<SharedBody>(&payload)) {
+      m_shared = std::move(*body);
+    } else if (auto body = std::get_if<FileBody>(&payload)) {
+      m_file = std::move(*body);
+    } else if (auto body = std::get_if<StreamBody>(&payload)) {
+      m_stream = std::move(*body);
+    } else if (auto body = std::get_if<AsyncStreamBody>(&payload)) {
+      m_source = std::move(*body);
+    }
+    auto self = shared_from_this();
+    boost::asio::dispatch(m_socket.get_executor(),
+                          [self] { self->write_response(); });
+  }
+
+  // Sets the fields of ServiceState::cors_field and server_field on
+  // responses that are not serialised by send_response(): those stored in
+  // the cache and those with a file or stream body.
+  void add_service_fields() {
+    if (m_response.count(http::field::access_control_allow_origin) == 0) {
+      m_response.set(http::field::access_control_allow_origin, "*");
+    }
+    auto const &server_name = m_state->config.server_name;
+    if (!server_name.empty() && m_response.count(http::field::server) == 0) {
+      m_response.set(http::field::server, server_name);
+    }
+  }
+
+  void handle_options_request() {
+    APEE_LOG(m_channel, debug) << "Handling OPTIONS request";
+    options_response(m_response);
+  }
+
+  void handle_target_not_found() {
+    APEE_LOG(m_channel, error) << "Target not found!";
+    not_found_response(m_response);
+  }
+
+  void handle_overload() {
+    APEE_LOG(m_channel, warning) << "Rejecting request, limit reached";
+    overload_response(*m_state, m_response);
+  }
+
+  // Ends the handler stage and starts the write stage.
+  void start_write() {
+    auto now = Clock::now();
+    m_state->metrics.record(Metrics::Stage::Handler, now - m_stage_start);
+    if (m_admitted) {
+      m_admitted = false;
+      m_state->admission.release(now - m_stage_start, now);
+    }
+    m_stage_start = now;
+    m_wheel.arm(m_timeout, m_state->config.timeouts.write);
+    // The rest of a streamed body that was not read cannot be skipped.
+    if (m_state->stopping.load(std::memory_order_relaxed) ||
+        (m_body_parser && !m_body_parser->is_done())) {
+      m_response.keep_alive(false);
+    }
+  }
+
+  // Whether the response has a StreamBody or an AsyncStreamBody.
+  bool streaming() const { return m_stream || m_source; }
+
+  void write_response() {
+    m_handling = false;
+    if (m_flushing) {
+      m_write_waiting = true;
+      return;
+    }
+    if (!m_out.empty() && (m_file || streaming())) {
+      flush_deferred([self = shared_from_this()] { self->write_response(); });
+      return;
+    }
+    APEE_LOG(m_channel, debug) << "Writing response";
+    start_write();
+    if (m_encoding != Encoding::Identity) {
+      compress_response();
+    }
+    if (m_cache_store && !m_file && !streaming()) {
+      // The cache keeps its own copy of the body.
+      if (m_shared) {
+        m_response.body().assign(m_shared->str());
+        m_shared.reset();
+      }
+      add_service_fields();
+      if (auto entry = m_state->cache->store(
+              m_cache_key, m_response, m_cache_ttl, m_stage_start)) {
+        write_cached(std::move(entry));
+        return;
+      }
+    }
+    m_state->metrics.record_status(m_response.result_int());
+    if (!m_file && !streaming()) {
+      send_response();
+      return;
+    }
+    add_service_fields();
+    if (m_response.count(http::field::date) == 0) {
+      auto date = detail::http_date();
+      m_response.set(http::field::date,
+                     boost::beast::string_view(date.data(), date.size()));
+    }
+    bool head = m_request.method() == http::verb::head;
+    if (m_file) {
+      m_response.content_length(m_file->size());
+    } else if (m_request.version() < 11) {
+      // No chunked encoding for HTTP/1.0, the end of the body is marked by
+      // closing the connection.
+      m_response.keep_alive(false);
+    } else {
+      m_response.chunked(true);
+    }
+    APEE_LOG(m_channel, debug) << "Response:\n" << m_response.base();
+    auto self = shared_from_this();
+    m_serializer.emplace(m_response);
+    with_stream([&](auto &stream) {
+      http::async_write_header(
+          stream,
+          *m_serializer,
+          recycling([self, head](boost::beast::error_code ec,
+                                 std::size_t bytes_transferred) {
+            self->m_state->metrics.record_sent(bytes_transferred);
+            if (ec || head) {
+              self->on_write(ec);
+            } else if (self->m_file) {
+              self->send_file();
+            } else {
+              self->write_chunk();
+            }
+          }));
+    });
+  }
+
+  // Compresses string bodies at once and sets up the compression of stream
+  // bodies, see Compression.
+  void compress_response() {
+    if (!m_file) {
+      m_compressor = encode_response(*m_state,
+                                     m_encoding,
+                                     m_request.target(),
+                                     streaming(),
+                                     body(),
+                                     m_response,
+                                     m_compressed,
+                                     m_variant_key);
+      // The string body is empty unless compression replaced a shared one.
+      if (m_shared && !m_response.body().empty()) {
+        m_shared.reset();
+      }
+    }
+  }
+
+  // The body of a response with a string or shared body.
+  std::string_view body() const {
+    if (m_shared) {
+      return m_shared->str();
+    }
+    return m_response.body();
+  }
+
+  // Writes a cached response with a single gather write. Requests whose
+  // If-None-Match lists its ETag are answered with NotModified.
+  void write_cached(std::shared_ptr<CachedResponse const> entry) {
+    m_cached = std::move(entry);
+    auto if_none_match = m_request[http::field::if_none_match];
+    bool not_modified =
+        !m_cached->etag.empty() && !if_none_match.empty() &&
+        detail::etag_matches(
+            std::string_view(if_none_match.data(), if_none_match.size()),
+            m_cached->etag);
+    m_state->metrics.record_status(not_modified ? 304 : m_cached->status);
+    bool http11 = m_request.version() >= 11;
+    bool keep_alive = m_response.keep_alive();
+    std::string_view version = http11 ? "HTTP/1.1" : "HTTP/1.0";
+    // The Connection field is only needed if it differs from the default of
+    // the HTTP version.
+    std::string_view end = "\r\n";
+    if (keep_alive != http11) {
+      end = keep_alive ? "Connection: keep-alive\r\n\r\n"
+                       : "Connection: close\r\n\r\n";
+    }
+    boost::asio::const_buffer body;
+    if (!not_modified && m_request.method() != http::verb::head) {
+      body = boost::asio::buffer(m_cached->body);
+    }
+    // Copied, the view of the Date field changes with the second.
+    m_head.assign(detail::date_field());
+    m_head.append(end.data(), end.size());
+    send(std::array<boost::asio::const_buffer, 4>{
+        boost::asio::buffer(version.data(), version.size()),
+        boost::asio::buffer(not_modified ? m_cached->not_modified_head
+                                         : m_cached->head),
+        boost::asio::buffer(m_head),
+        body});
+  }
+
+  // Sends a response with a string body. Its header is rendered into m_head
+  // from the precomputed status line, the fields of the response, the
+  // fields pre-rendered for the Service and the Date of the current second.
+  void send_response() {
+    auto status = m_response.result_int();
+    bool bodyless = status == 204 || status == 304;
+    if (bodyless) {
+      m_response.body().clear();
+      m_shared.reset();
+    }
+    auto body = this->body();
+    bool head = m_request.method() == http::verb::head;
+    bool declared = declared_length(m_response, status, head, body);
+    m_head.clear();
+    detail::append_status_line(m_head, status, m_response.version());
+    for (auto const &field : m_response) {
+      // The framing is that of the body sent.
+      if ((field.name() == http::field::content_length && !declared) ||
+          field.name() == http::field::transfer_encoding) {
+        continue;
+      }
+      auto name = field.name_string();
+      auto value = field.value();
+      detail::append_field(m_head,
+                           std::string_view(name.data(), name.size()),
+                           std::string_view(value.data(), value.size()));
+    }
+    if (m_response.count(http::field::access_control_allow_origin) == 0) {
+      m_head.append(m_state->cors_field);
+    }
+    if (m_response.count(http::field::server) == 0) {
+      m_head.append(m_state->server_field);
+    }
+    if (m_response.count(http::field::date) == 0) {
+      m_head.append(detail::date_field());
+    }
+    if (!bodyless && !declared) {
+      char length[24];
+      auto end = std::to_chars(length, length + sizeof(length), body.size());
+      detail::append_field(
+          m_head,
+          "Content-Length",
+          std::string_view(length, static_cast<std::size_t>(end.ptr - length)));
+    }
+    m_head.append("\r\n");
+    APEE_LOG(m_channel, debug) << "Response:\n" << m_head;
+    boost::asio::const_buffer payload;
+    if (!head) {
+      payload = boost::asio::buffer(body.data(), body.size());
+    }
+    send(std::array<boost::asio::const_buffer, 2>{boost::asio::buffer(m_head),
+                                                  payload});
+  }
+
+  // Writes the buffers of a response with a single gather write, after the
+  // responses deferred before it. The response is deferred as well if the
+  // header of the next pipelined request is already buffered, so that the
+  // responses to a batch of pipelined requests go out together.
+  template <std::size_t N>
+  void send(std::array<boost::asio::const_buffer, N> const &buffers) {
+    auto self = shared_from_this();
+    if (defer(boost::asio::buffer_size(buffers))) {
+      for (auto const &buffer : buffers) {
+        m_out.append(static_cast<char const *>(buffer.data()), buffer.size());
+      }
+      // Not called from here, the handler may still use its request.
+      boost::asio::post(m_socket.get_executor(), recycling([self] {
+                          self->on_write(boost::beast::error_code());
+                        }));
+      return;
+    }
+    std::array<boost::asio::const_buffer, N + 1> all;
+    all[0] = boost::asio::buffer(m_out);
+    std::copy(buffers.begin(), buffers.end(), all.begin() + 1);
+    with_stream([&](auto &stream) {
+      boost::asio::async_write(
+          stream,
+          all,
+          recycling([self](boost::beast::error_code ec,
+                           std::size_t bytes_transferred) {
+            self->m_out.clear();
+            self->m_state->metrics.record_sent(bytes_transferred);
+            self->on_write(ec);
+          }));
+    });
+  }
+
+  // Whether a response of `size` bytes can wait for the response to the
+  // next request, which is then handled without reading from the socket.
+  bool defer(std::size_t size) const {
+    if (!m_response.keep_alive() || m_out.size() + size > max_deferred ||
+        m_state->stopping.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    auto data = m_buffer.data();
+    std::string_view buffered(static_cast<char const *>(data.data()),
+                              data.size());
+    return buffered.find("\r\n\r\n") != std::string_view::npos;
+  }
+
+  // Writes the deferred responses on their own, then calls `next`. A failed
+  // write leaves the socket broken, which the next operation reports.
+  template <typename Next>
+  void flush_deferred(Next &&next) {
+    m_flushing = true;
+    m_wheel.arm(m_timeout, m_state->config.timeouts.write);
+    auto done = recycling([self = shared_from_this(),
+                           next = std::forward<Next>(next)](
+                              boost::beast::error_code,
+                              std::size_t bytes_transferred) mutable {
+      self->m_wheel.cancel(self->m_timeout);
+      self->m_state->metrics.record_sent(bytes_transferred);
+      self->m_out.clear();
+      self->m_flushing = false;
+      next();
+    });
+    with_stream([&](auto &stream) {
+      boost::asio::async_write(
+          stream, boost::asio::buffer(m_out), std::move(done));
+    });
+  }
+
+  // Sends the file with sendfile(2) whenever the socket is writable.
+  void send_file() {
+    boost::beast::error_code ec;
+    m_socket.native_non_blocking(true, ec);
+    auto offset = static_cast<off_t>(m_file->offset());
+    while (!ec && m_file->size() > 0) {
+      auto sent = ::sendfile(
+          m_socket.native_handle(), m_file->fd(), &offset, m_file->size());
+      if (sent > 0) {
+        m_state->metrics.record_sent(static_cast<std::uint64_t>(sent));
+        *m_file = FileBody(m_file->shared_fd(), offset, m_file->size() - sent);
+      } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // The write timeout applies between two successful writes.
+        m_wheel.arm(m_timeout, m_state->config.timeouts.write);
+        auto self = shared_from_this();
+        with_stream([&](auto &stream) {
+          stream.async_wait(tcp::socket::wait_write,
+                            recycling([self](boost::beast::error_code ec) {
+                              if (ec) {
+                                self->on_write(ec);
+                              } else {
+                                self->send_file();
+                              }
+                            }));
+        });
+        return;
+      } else if (sent < 0 && errno != EINTR) {
+        ec.assign(errno, boost::system::system_category());
+      } else if (sent == 0) {
+        // The file is shorter than announced.
+        ec = boost::asio::error::eof;
+      }
+    }
+    if (m_ring_stream) {
+      // Fixed reads of the ring fail with EAGAIN on a non-blocking socket.
+      boost::beast::error_code ignored;
+      m_socket.native_non_blocking(false, ignored);
+    }
+    on_write(ec);
+  }
+
+  void write_chunk() {
+    m_wheel.arm(m_timeout, m_state->config.timeouts.write);
+    if (m_source) {
+      pull_chunk();
+      return;
+    }
+    m_chunk.clear();
+    bool more = m_stream(m_chunk);
+    send_chunk(m_chunk, more);
+  }
+
+  // Asks the AsyncStreamBody for its next piece, under the write timeout.
+  // The piece is written from where it is, the source keeps it until it is
+  // asked for the next one.
+  void pull_chunk() {
+    m_source([self = shared_from_this()](std::error_code const &ec,
+                                         std::string_view piece) {
+      boost::asio::dispatch(
+          self->m_socket.get_executor(), recycling([self, ec, piece] {
+            if (ec) {
+              // The body is cut short, which only closing can tell.
+              APEE_LOG(self->m_channel, error)
+                  << "Response body failed: " << ec.message();
+              self->on_write(boost::asio::error::connection_aborted);
+            } else {
+              self->send_chunk(piece, !piece.empty());
+            }
+          }));
+    });
+  }
+
+  void send_chunk(std::string_view chunk, bool more) {
+    if (m_compressor) {
+      // Every chunk is flushed, so clients see the data as it is produced.
+      m_compressed.clear();
+      m_compressor->compress(chunk, !more, m_compressed);
+      chunk = m_compressed;
+    }
+    auto self = shared_from_this();
+    auto next = [self, more](boost::beast::error_code ec,
+                             std::size_t bytes_transferred) {
+      self->m_state->metrics.record_sent(bytes_transferred);
+      if (ec) {
+        self->on_write(ec);
+      } else if (more) {
+        self->write_chunk();
+      } else if (self->m_response.chunked()) {
+        self->write_last_chunk();
+      } else {
+        self->on_write(ec);
+      }
+    };
+    if (!m_response.chunked()) {
+      with_stream([&](auto &stream) {
+        boost::asio::async_write(
+            stream,
+            boost::asio::buffer(chunk.data(), chunk.size()),
+            recycling(next));
+      });
+    } else if (!chunk.empty()) {
+      with_stream([&](auto &stream) {
+        boost::asio::async_write(
+            stream,
+            http::make_chunk(boost::asio::buffer(chunk.data(), chunk.size())),
+            recycling(next));
+      });
+    } else {
+      // An empty chunk would end the body, skip it.
+      boost::asio::post(
+          m_socket.get_executor(),
+          recycling([next] { next(boost::beast::error_code(), 0); }));
+    }
+  }
+
+  void write_last_chunk() {
+    auto self = shared_from_this();
+    with_stream([&](auto &stream) {
+      boost::asio::async_write(
+          stream,
+          http::make_chunk_last(),
+          recycling([self](boost::beast::error_code ec,
+                           std::size_t bytes_transferred) {
+            self->m_state->metrics.record_sent(bytes_transferred);
+            self->on_write(ec);
+          }));
+    });
+  }
+
+  void on_write(boost::beast::error_code ec) {
+    m_wheel.cancel(m_timeout);
+    m_state->metrics.record(Metrics::Stage::Write,
+                            Clock::now() - m_stage_start);
+    if (ec) {
+      APEE_LOG(m_channel, error) << ec;
+      close();
+    } else if (m_response.keep_alive() &&
+               !m_state->stopping.load(std::memory_order_relaxed)) {
+      read_request();
+    } else {
+      close();
+    }
+  }
+
+  void close() {
+    if (!m_out.empty() && !m_flushing) {
+      // Responses deferred before a request that failed still go out.
+      flush_deferred([self = shared_from_this()] { self->close(); });
+      return;
+    }
+    boost::beast::error_code ec;
+    m_wheel.cancel(m_timeout);
+    m_socket.shutdown(tcp::socket::shutdown_send, ec);
+  }
+
+  // Ends the connection for Service::stop(): at once if it waits for the
+  // next request or with `force`, else after the current response.
+  void drain(bool force) {
+    if (m_state && m_http2 && m_http2->active()) {
+      m_http2->drain(force);
+      return;
+    }
+    boost::beast::error_code ec;
+    // A request that arrived already is still answered.
+    if (m_state && (force || (m_idle && m_socket.available(ec) == 0))) {
+      m_wheel.cancel(m_timeout);
+      close_socket();
+    }
+  }
+
+  static void expired(std::shared_ptr<void> const &owner,
+                      std::uint64_t generation) {
+    auto self = std::static_pointer_cast<Connection>(owner);
+    boost::asio::post(self->m_socket.get_executor(),
+                      recycling([self, generation] {
+                        // The deadline may have been moved meanwhile.
+                        if (generation == self->m_timeout.generation()) {
+                          self->on_timeout();
+                        }
+                      }));
+  }
+
+  // Closing the socket aborts the pending operation, which then closes the
+  // connection.
+  void on_timeout() {
+    APEE_LOG(m_channel, debug) << "Timed out";
+    m_state->metrics.record_timeout();
+    close_socket();
+  }
+};
+
+// A request on an HTTP/2 connection and its response, handed to the handler
+// like the requests of a Connection. Held by its Http2Connection while the
+// stream is open and by the handler until it responds.
+class Http2Stream : public std::enable_shared_from_this<Http2Stream>,
+                    public detail::ResponseSink,
+                    public detail::BodySource,
+                    public WorkerPool::Task {
+  char const *m_channel = "http2_stream";
+  std::shared_ptr<Connection> m_connection;
+  std::uint32_t m_id;
+  detail::BeastRequest m_request;
+  std::optional<Request> m_pending;
+  detail::BeastResponse m_response;
+  std::optional<SharedBody> m_shared;
+  std::optional<FileBody> m_file;
+  StreamBody m_stream;
+  AsyncStreamBody m_source;
+  // The piece of the body being sent.
+  std::string m_chunk;
+  Encoding m_encoding = Encoding::Identity;
+  Compressor::Ptr m_compressor;
+  std::string m_compressed;
+  std::string m_variant_key;
+  Clock::time_point m_stage_start;
+  bool m_admitted = false;
+  std::shared_ptr<Http2Stream> m_offloaded;
+  // The request body arrived completely.
+  bool m_body_done = false;
+  // The body is streamed to the handler: m_piece collects what arrives
+  // until m_reader asks for it, then holds what was handed out.
+  bool m_streamed = false;
+  std::uint64_t m_body_limit = 0;
+  std::uint64_t m_body_size = 0;
+  std::string m_piece;
+  std::string m_read;
+  BodyReader::Handler m_reader;
+  bool m_body_failed = false;
+  // 100 Continue is still to be sent before the body is read.
+  bool m_continue = false;
+  bool m_dispatched = false;
+  bool m_responded = false;
+  bool m_closed = false;
+
+ public:
+  Http2Stream(std::shared_ptr<Connection> connection, std::uint32_t id)
+      : m_connection{std::move(connection)},
+        m_id{id},
+        m_stage_start{Clock::now()} {}
+
+  // Takes the request of a new stream.
+  void start(detail::Http2Header const &header, bool end_stream) {
+    auto to_beast = [](std::string_view text) {
+      return boost::beast::string_view(text.data(), text.size());
+    };
+    m_request.method_string(to_beast(header.method));
+    m_request.target(to_beast(header.method == "CONNECT" ? header.authority
+                                                         : header.path));
+    m_request.version(20);
+    for (auto const &field : header.fields) {
+      m_request.insert(to_beast(field.name), to_beast(field.value));
+    }
+    if (!header.authority.empty() && m_request.count(http::field::host) == 0) {
+      m_request.set(http::field::host, to_beast(header.authority));
+    }
+    m_body_done = end_stream;
+    if (header.too_large) {
+      reject(http::status::request_header_fields_too_large);
+      return;
+    }
+    admit();
+  }
+
+  // Takes the request that was upgraded to HTTP/2, which has no body.
+  void start(detail::BeastRequest &&request) {
+    m_request = std::move(request);
+    m_request.version(20);
+    for (auto field : {http::field::connection,
+                       http::field::upgrade,
+                       http::field::keep_alive}) {
+      m_request.erase(field);
+    }
+    m_request.erase("HTTP2-Settings");
+    m_body_done = true;
+    admit();
+  }
+
+  void on_data(std::string_view data, bool end_stream) {
+    if (m_responded && !m_streamed) {
+      return;
+    }
+    m_body_size += data.size();
+    if (end_stream) {
+      m_body_done = true;
+    }
+    if (!m_streamed) {
+      // Read into the request, the window opens again at once.
+      if (m_body_size > state().config.max_body_size) {
+        reject(http::status::payload_too_large);
+        return;
+      }
+      m_request.body().append(data);
+      session().consume(m_id, data.size());
+      if (m_body_done) {
+        dispatch();
+      }
+      return;
+    }
+    if (m_body_size > m_body_limit) {
+      m_body_failed = true;
+    }
+    // Held until the handler reads it, the client is held back by the
+    // window of the stream meanwhile.
+    m_piece.append(data);
+    if (m_reader) {
+      deliver();
+    }
+  }
+
+  void on_sent() {
+    if (m_file) {
+      send_file();
+    } else {
+      next_piece();
+    }
+  }
+
+  void on_close(detail::Http2Error error) {
+    m_closed = true;
+    auto &metrics = state().metrics;
+    if (m_responded && error == detail::Http2Error::NoError) {
+      metrics.record(Metrics::Stage::Write, Clock::now() - m_stage_start);
+    } else if (error != detail::Http2Error::NoError) {
+      APEE_LOG(m_channel, debug) << "Stream reset, error " << unsigned(error);
+    }
+    if (m_reader) {
+      std::exchange(m_reader, nullptr)(
+          std::make_error_code(std::errc::connection_reset), {});
+    }
+  }
+
+  // Whether the stream waits for the client to send more of the body.
+  bool awaiting_body() const {
+    return !m_body_done && !m_closed && (!m_streamed || m_reader);
+  }
+
+  void read_body(std::uint64_t, BodyReader::Handler handler) override {
+    auto self = shared_from_this();
+    boost::asio::post(executor(),
+                      [self, handler = std::move(handler)]() mutable {
+                        self->read_piece(std::move(handler));
+                      });
+  }
+
+  void run() override {
+    auto self = std::move(m_offloaded);
+    state().handler->on_request_async(*m_pending, Responder(std::move(self)));
+  }
+
+  void respond(Response &&response) override {
+    detail::to_beast(response, m_response);
+    auto &payload = response.payload();
+    if (auto body = std::get_if<SharedBody>(&payload)) {
+      m_shared = std::move(*body);
+    } else if (auto body = std::get_if<FileBody>(&payload)) {
+      m_file = std::move(*body);
+    } else if (auto body = std::get_if<StreamBody>(&payload)) {
+      m_stream = std::move(*body);
+    } else if (auto body = std::get_if<AsyncStreamBody>(&payload)) {
+      m_source = std::move(*body);
+    }
+    auto self = shared_from_this();
+    boost::asio::dispatch(executor(), [self] { self->write_response(); });
+  }
+
+ private:
+  tcp::socket::executor_type executor() {
+    return m_connection->m_socket.get_executor();
+  }
+  ServiceState &state() { return *m_connection->m_state; }
+  Http2Connection &http2() { return *m_connection->m_http2; }
+  detail::Http2Session &session() { return http2().session(); }
+
+  // Refuses requests over the limits, then hands the request to the
+  // handler once its body is complete or right away if it is streamed.
+  void admit() {
+    auto &state = this->state();
+    auto const &config = state.config;
+    if (state.rate_limiter) {
+      auto wait = rate_limit_wait(state,
+                                  m_connection->m_peer,
+                                  m_request,
+                                  m_connection->m_rate_key,
+                                  m_stage_start);
+      if (wait != Clock::duration::zero()) {
+        APEE_LOG(m_channel, debug) << "Rejecting request, rate limit reached";
+        state.metrics.record_rate_limited();
+        reject(http::status::too_many_requests,
+               std::chrono::ceil<std::chrono::seconds>(wait));
+        return;
+      }
+    }
+    auto method = m_request.method();
+    auto length = m_request[http::field::content_length];
+    if (config.require_content_length && length.empty() && !m_body_done &&
+        (method == http::verb::post || method == http::verb::put ||
+         method == http::verb::patch)) {
+      reject(http::status::length_required);
+      return;
+    }
+    // The session checked the length against the DATA received.
+    std::uint64_t size = 0;
+    std::from_chars(length.data(), length.data() + length.size(), size);
+    if (!m_body_done && state.handler &&
+        state.handler->stream_body(detail::from_beast(m_request))) {
+      auto limit = config.max_streamed_body_size;
+      m_body_limit =
+          limit > 0 ? limit : std::numeric_limits<std::uint64_t>::max();
+      if (size > m_body_limit) {
+        reject(http::status::payload_too_large);
+        return;
+      }
+      m_streamed = true;
+      m_continue = expects_continue(m_request.base(), m_request.version());
+      dispatch();
+      return;
+    }
+    if (size > config.max_body_size) {
+      reject(http::status::payload_too_large);
+      return;
+    }
+    if (m_body_done) {
+      dispatch();
+    } else if (expects_continue(m_request.base(), m_request.version())) {
+      send_continue();
+    }
+  }
+
+  void send_continue() {
+    session().begin_headers(m_id, 100);
+    session().end_headers(false);
+    http2().flush();
+  }
+
+  // Answers like Connection::process_request().
+  void dispatch() {
+    m_dispatched = true;
+    auto &state = this->state();
+    auto now = Clock::now();
+    state.metrics.record(Metrics::Stage::Read, now - m_stage_start);
+    m_stage_start = now;
+    APEE_LOG(m_channel, info)
+        << "Processing " << m_request.method() << " request";
+    if (state.config.compression.enabled) {
+      auto accept_encoding = m_request[http::field::accept_encoding];
+      m_encoding = negotiate(
+          std::string_view(accept_encoding.data(), accept_encoding.size()),
+          state.config.compression);
+    }
+    m_response.result(http::status::ok);
+    auto const &metrics_path = state.config.metrics_path;
+    if (m_request.method() == http::verb::options) {
+      options_response(m_response);
+    } else if (!metrics_path.empty() &&
+               m_request.method() == http::verb::get &&
+               m_request.target() == metrics_path) {
+      m_response.set(http::field::content_type, "text/plain; version=0.0.4");
+      m_response.body() = Metrics::prometheus(state.snapshot());
+    } else if (detail::to_method(m_request.method()) == Method::UNKNOWN) {
+      APEE_LOG(m_channel, error) << "Invalid request-method";
+      m_response.result(http::status::bad_request);
+      m_response.set(http::field::content_type, "text/plain");
+      m_response.body() = "Invalid request-method '" +
+                          m_request.method_string().to_string() + "'";
+    } else if (!state.handler) {
+      not_found_response(m_response);
+    } else if (!state.admission.admit()) {
+      APEE_LOG(m_channel, warning) << "Rejecting request, limit reached";
+      overload_response(state, m_response);
+    } else {
+      m_admitted = true;
+      m_pending.emplace(detail::from_beast(m_request));
+      if (m_streamed) {
+        state.handler->on_request_stream(
+            *m_pending,
+            BodyReader(shared_from_this(), m_id),
+            Responder(shared_from_this()));
+      } else if (state.workers && state.handler->offload(*m_pending)) {
+        m_offloaded = shared_from_this();
+        state.workers->submit(*this);
+      } else {
+        state.handler->on_request_async(*m_pending,
+                                        Responder(shared_from_this()));
+      }
+      return;
+    }
+    write_response();
+  }
+
+  // Answers a request that exceeds the configured limits without handing
+  // it to the handler. A Retry-After is sent unless `retry_after` is zero.
+  void reject(http::status status,
+              std::chrono::seconds retry_after = std::chrono::seconds(0)) {
+    m_response.result(status);
+    if (retry_after.count() > 0) {
+      m_response.set(http::field::retry_after,
+                     std::to_string(retry_after.count()));
+    }
+    write_response();
+  }
+
+  void read_piece(BodyReader::Handler handler) {
+    if (m_closed || m_body_failed) {
+      handler(m_closed ? std::make_error_code(std::errc::connection_reset)
+                       : std::error_code(boost::beast::error_code(
+                             http::error::body_limit)),
+              {});
+      return;
+    }
+    m_reader = std::move(handler);
+    if (std::exchange(m_continue, false) && !m_body_done) {
+      send_continue();
+    }
+    if (!m_piece.empty() || m_body_done) {
+      deliver();
+    } else {
+      http2().flush();
+    }
+  }
+
+  // Hands what arrived of the body to the waiting reader.
+  void deliver() {
+    auto reader = std::exchange(m_reader, nullptr);
+    if (m_body_failed) {
+      reader(boost::beast::error_code(http::error::body_limit), {});
+      return;
+    }
+    m_read.swap(m_piece);
+    m_piece.clear();
+    session().consume(m_id, m_read.size());
+    http2().flush();
+    reader({}, m_read);
+  }
+
+  void write_response() {
+    if (m_responded) {
+      return;
+    }
+    m_responded = true;
+    auto &state = this->state();
+    auto now = Clock::now();
+    if (m_dispatched) {
+      state.metrics.record(Metrics::Stage::Handler, now - m_stage_start);
+    }
+    if (m_admitted) {
+      m_admitted = false;
+      state.admission.release(now - m_stage_start, now);
+    }
+    m_stage_start = now;
+    if (m_closed || http2().closed()) {
+      return;
+    }
+    APEE_LOG(m_channel, debug) << "Writing response";
+    bool streaming = m_stream || m_source;
+    if (m_encoding != Encoding::Identity && !m_file) {
+      m_compressor = encode_response(
+          state,
+          m_encoding,
+          m_request.target(),
+          streaming,
+          m_shared ? m_shared->str() : std::string_view(m_response.body()),
+          m_response,
+          m_compressed,
+          m_variant_key);
+      // The string body is empty unless compression replaced a shared one.
+      if (m_shared && !m_response.body().empty()) {
+        m_shared.reset();
+      }
+    }
+    auto status = m_response.result_int();
+    state.metrics.record_status(status);
+    auto &session = this->session();
+    session.begin_headers(m_id, status);
+    for (auto const &field : m_response) {
+      // Framing is HTTP/2's, and fields of HTTP/1 connections are not sent
+      // (RFC 9113, section 8.2.2).
+      auto name = field.name();
+      if (name == http::field::content_length ||
+          name == http::field::transfer_encoding ||
+          name == http::field::connection ||
+          name == http::field::keep_alive ||
+          name == http::field::upgrade ||
+          name == http::field::proxy_connection) {
+        continue;
+      }
+      auto name_string = field.name_string();
+      auto value = field.value();
+      session.add_header(
+          std::string_view(name_string.data(), name_string.size()),
+          std::string_view(value.data(), value.size()));
+    }
+    if (m_response.count(http::field::access_control_allow_origin) == 0) {
+      session.add_header("access-control-allow-origin", "*");
+    }
+    auto const &server_name = state.config.server_name;
+    if (!server_name.empty() && m_response.count(http::field::server) == 0) {
+      session.add_header("server", server_name);
+    }
+    if (m_response.count(http::field::date) == 0) {
+      session.add_header("date", detail::http_date());
+    }
+    bool bodyless = status == 204 || status == 304;
+    std::string_view body = m_response.body();
+    if (m_shared) {
+      body = m_shared->str();
+    }
+    bool head = m_request.method() == http::verb::head;
+    std::optional<std::uint64_t> length;
+    if (m_file) {
+      length = m_file->size();
+    } else if (!streaming) {
+      length = bodyless ? 0 : body.size();
+    }
+    if (!m_file && !streaming &&
+        declared_length(m_response, status, head, body)) {
+      auto value = m_response[http::field::content_length];
+      session.add_header("content-length",
+                         std::string_view(value.data(), value.size()));
+    } else if (length && !bodyless) {
+      char digits[24];
+      auto end = std::to_chars(digits, digits + sizeof(digits), *length);
+      session.add_header(
+          "content-length",
+          std::string_view(digits,
+                           static_cast<std::size_t>(end.ptr - digits)));
+    }
+    bool end = bodyless || head || (length && *length == 0);
+    session.end_headers(end);
+    if (!end) {
+      if (m_file) {
+        send_file();
+      } else if (streaming) {
+        next_piece();
+      } else {
+        session.send_data(m_id, body, true);
+      }
+    }
+    http2().flush();
+  }
+
+  // Sends the next piece of the file, read with pread(2).
+  void send_file() {
+    auto size = std::min<std::uint64_t>(m_file->size(), http2_write_size);
+    m_chunk.resize(size);
+    auto offset = static_cast<off_t>(m_file->offset());
+    ssize_t result;
+    do {
+      result = ::pread(m_file->fd(), m_chunk.data(), size, offset);
+    } while (result < 0 && errno == EINTR);
+    if (result <= 0) {
+      // The file is shorter than announced or failed.
+      APEE_LOG(m_channel, error) << "Reading the file failed";
+      session().reset(m_id, detail::Http2Error::InternalError);
+      http2().flush();
+      return;
+    }
+    auto read = static_cast<std::uint64_t>(result);
+    *m_file =
+        FileBody(m_file->shared_fd(), offset + read, m_file->size() - read);
+    session().send_data(m_id,
+                        std::string_view(m_chunk.data(), read),
+                        m_file->size() == 0);
+    http2().flush();
+  }
+
+  void next_piece() {
+    if (m_source) {
+      m_source([self = shared_from_this()](std::error_code const &ec,
+                                           std::string_view piece) {
+        boost::asio::dispatch(
+            self->executor(), recycling([self, ec, piece] {
+              if (self->m_closed) {
+                return;
+              }
+              if (ec) {
+                APEE_LOG(self->m_channel, error)
+                    << "Response body failed: " << ec.message();
+                self->session().reset(self->m_id,
+                                      detail::Http2Error::InternalError);
+                self->http2().flush();
+              } else {
+                self->send_piece(piece, !piece.empty());
+              }
+            }));
+      });
+      return;
+    }
+    m_chunk.clear();
+    bool more = m_stream(m_chunk);
+    send_piece(m_chunk, more);
+  }
+
+  void send_piece(std::string_view piece, bool more) {
+    if (m_compressor) {
+      // Every piece is flushed, so clients see the data as it is produced.
+      m_compressed.clear();
+      m_compressor->compress(piece, !more, m_compressed);
+      piece = m_compressed;
+    }
+    if (piece.empty() && more) {
+      // An empty piece is not worth a frame, the next one is asked for
+      // outside the session.
+      boost::asio::post(executor(), recycling([self = shared_from_this()] {
+                          if (!self->m_closed) {
+                            self->next_piece();
+                          }
+                        }));
+      return;
+    }
+    session().send_data(m_id, piece, !more);
+    http2().flush();
+  }
+};
+
+detail::Http2Settings Http2Connection::settings() const {
+  auto const &config = m_connection.m_state->config;
+  auto const &options = config.http2;
+  detail::Http2Settings settings;
+  settings.max_concurrent_streams = options.max_concurrent_streams;
+  settings.initial_window_size =
+      std::min<std::uint32_t>(options.stream_window_size, 0x7fffffff);
+  settings.connection_window_size = std::clamp<std::uint32_t>(
+      options.connection_window_size, 65535, 0x7fffffff);
+  settings.max_frame_size =
+      std::clamp<std::uint32_t>(options.max_frame_size, 16384, 16777215);
+  settings.header_table_size = options.header_table_size;
+  settings.max_header_list_size = static_cast<std::uint32_t>(
+      std::min<std::size_t>(config.max_header_size, UINT32_MAX));
+  return settings;
+}
+
+void Http2Connection::start(std::string_view preface) {
+  APEE_LOG(m_connection.m_channel, debug) << "Switching to HTTP/2";
+  m_active = true;
+  m_session.start(*this, settings(), preface);
+  receive();
+  flush();
+  read();
+}
+
+void Http2Connection::upgrade(std::string_view settings,
+                              detail::BeastRequest &&request) {
+  m_active = true;
+  m_session.start(*this, this->settings(), detail::http2_preface);
+  m_session.output().insert(0, switching_protocols);
+  ++m_connection.m_requests;
+  if (m_session.upgrade(settings)) {
+    auto stream = open(1);
+    stream->start(std::move(request));
+  }
+  receive();
+  flush();
+  read();
+}
+
+void Http2Connection::flush() {
+  if (m_busy || m_writing || m_closed || m_shut_down) {
+    return;
+  }
+  m_busy = true;
+  m_session.produce(http2_write_size);
+  m_busy = false;
+  auto &output = m_session.output();
+  if (output.empty()) {
+    if (m_session.finished()) {
+      // After GOAWAY, the client closes once it read everything.
+      m_shut_down = true;
+      boost::beast::error_code ec;
+      m_connection.m_socket.shutdown(tcp::socket::shutdown_send, ec);
+    }
+    update_timeout();
+    return;
+  }
+  m_write.swap(output);
+  output.clear();
+  m_writing = true;
+  auto &connection = m_connection;
+  connection.m_wheel.arm(connection.m_timeout,
+                         connection.m_state->config.timeouts.write);
+  auto self = connection.shared_from_this();
+  connection.with_stream([&](auto &stream) {
+    boost::asio::async_write(
+        stream,
+        boost::asio::buffer(m_write),
+        recycling([self](boost::beast::error_code ec,
+                         std::size_t bytes_transferred) {
+          self->m_http2->on_write(ec, bytes_transferred);
+        }));
+  });
+}
+
+void Http2Connection::drain(bool force) {
+  if (force) {
+    m_connection.close_socket();
+    return;
+  }
+  m_session.shutdown();
+  flush();
+}
+
+void Http2Connection::close() {
+  if (m_closed) {
+    return;
+  }
+  m_closed = true;
+  m_connection.m_wheel.cancel(m_connection.m_timeout);
+  auto streams = std::move(m_streams);
+  m_streams.clear();
+  for (auto &stream : streams) {
+    stream.second->on_close(detail::Http2Error::Cancel);
+  }
+  m_connection.close_socket();
+}
+
+void Http2Connection::reset() {
+  m_active = false;
+  m_closed = false;
+  m_writing = false;
+  m_busy = false;
+  m_read_paused = false;
+  m_shut_down = false;
+  m_streams.clear();
+  m_write.clear();
+  if (m_write.capacity() > retained_body_capacity) {
+    std::string().swap(m_write);
+  }
+}
+
+void Http2Connection::on_request(std::uint32_t stream,
+                                 detail::Http2Header const &header,
+                                 bool end_stream) {
+  auto &connection = m_connection;
+  if (++connection.m_requests >=
+          connection.m_state->config.max_requests_per_connection ||
+      connection.m_state->stopping.load(std::memory_order_relaxed)) {
+    m_session.shutdown();
+  }
+  open(stream)->start(header, end_stream);
+}
+
+void Http2Connection::on_data(std::uint32_t stream,
+                              std::string_view data,
+                              bool end_stream) {
+  if (auto s = find(stream)) {
+    s->on_data(data, end_stream);
+  }
+}
+
+void Http2Connection::on_sent(std::uint32_t stream) {
+  if (auto s = find(stream)) {
+    s->on_sent();
+  }
+}
+
+void Http2Connection::on_close(std::uint32_t stream,
+                               detail::Http2Error error) {
+  auto it = std::lower_bound(
+      m_streams.begin(),
+      m_streams.end(),
+      stream,
+      [](auto const &entry, std::uint32_t id) { return entry.first < id; });
+  if (it == m_streams.end() || it->first != stream) {
+    return;
+  }
+  auto s = std::move(it->second);
+  m_streams.erase(it);
+  s->on_close(error);
+}
+
+std::shared_ptr<Http2Stream> Http2Connection::open(std::uint32_t id) {
+  auto stream = std::allocate_shared<Http2Stream>(
+      detail::RecyclingAllocator<Http2Stream>(),
+      m_connection.shared_from_this(),
+      id);
+  // Clients open streams in increasing order.
+  m_streams.emplace_back(id, stream);
+  return stream;
+}
+
+Http2Stream *Http2Connection::find(std::uint32_t id) const {
+  auto it = std::lower_bound(
+      m_streams.begin(),
+      m_streams.end(),
+      id,
+      [](auto const &entry, std::uint32_t id) { return entry.first < id; });
+  return it != m_streams.end() && it->first == id ? it->second.get()
+                                                  : nullptr;
+}
+
+// Passes what the read buffer holds to the session.
+void Http2Connection::receive() {
+  auto &buffer = m_connection.m_buffer;
+  auto data = buffer.data();
+  m_busy = true;
+  m_session.receive(
+      std::string_view(static_cast<char const *>(data.data()), data.size()));
+  m_busy = false;
+  buffer.consume(buffer.size());
+}
+
+void Http2Connection::read() {
+  auto &connection = m_connection;
+  auto self = connection.shared_from_this();
+  connection.with_stream([&](auto &stream) {
+    stream.async_read_some(
+        connection.m_buffer.prepare(connection.m_buffer.max_size() -
+                                    connection.m_buffer.size()),
+        recycling([self](boost::beast::error_code ec,
+                         std::size_t bytes_transferred) {
+          self->m_http2->on_read(ec, bytes_transferred);
+        }));
+  });
+}
+
+void Http2Connection::on_read(boost::beast::error_code ec,
+                              std::size_t bytes_transferred) {
+  auto &connection = m_connection;
+  if (m_closed) {
+    return;
+  }
+  if (ec) {
+    if (ec == boost::asio::error::eof) {
+      APEE_LOG(connection.m_channel, debug) << "Closed by peer";
+    } else if (ec != boost::asio::error::operation_aborted) {
+      APEE_LOG(connection.m_channel, error) << ec;
+      connection.m_state->metrics.record_error("read", ec);
+    }
+    close();
+    return;
+  }
+  connection.m_state->metrics.record_received(bytes_transferred);
+  connection.m_buffer.commit(bytes_transferred);
+  receive();
+  flush();
+  // A client that does not read what it asks for is not read from either.
+  if (m_session.output().size() > http2_write_size) {
+    m_read_paused = true;
+  } else {
+    read();
+  }
+}
+
+void Http2Connection::on_write(boost::beast::error_code ec,
+                               std::size_t bytes_transferred) {
+  auto &connection = m_connection;
+  m_writing = false;
+  m_write.clear();
+  connection.m_state->metrics.record_sent(bytes_transferred);
+  if (m_closed) {
+    return;
+  }
+  if (ec) {
+    APEE_LOG(connection.m_channel, error) << ec;
+    close();
+    return;
+  }
+  flush();
+  if (m_read_paused && m_session.output().size() <= http2_write_size) {
+    m_read_paused = false;
+    read();
+  }
+}
+
+// Arms the timeout that applies to what the connection waits for.
+void Http2Connection::update_timeout() {
+  auto &connection = m_connection;
+  auto const &timeouts = connection.m_state->config.timeouts;
+  if (m_writing || m_session.blocked()) {
+    connection.m_wheel.arm(connection.m_timeout, timeouts.write);
+  } else if (m_session.open_streams() == 0) {
+    connection.m_wheel.arm(connection.m_timeout, timeouts.idle);
+  } else if (std::any_of(m_streams.begin(),
+                         m_streams.end(),
+                         [](auto const &entry) {
+                           return entry.second->awaiting_body();
+                         })) {
+    connection.m_wheel.arm(connection.m_timeout, timeouts.read);
+  } else {
+    connection.m_wheel.cancel(connection.m_timeout);
+  }
+}
+
+// Idle Connections of one io_context. Reusing them spares the allocation of
+// the connection and its buffers, and the buffers keep their capacity.
+class ConnectionPool : public boost::asio::execution_context::service {
+  // Idle connections kept, more are destroyed.
+  static constexpr std::size_t max_idle = 1024;
+
+  std::mutex m_mutex;
+  std::vector<std::unique_ptr<Connection>> m_idle;
+  // Connections handed out and not yet released.
+  Connection *m_open = nullptr;
+  bool m_shutdown = false;
+  TimerWheel &m_wheel;
+  detail::Ring *m_ring;
 
-class Connection : public std::enable_shared_from_this<Connection> {
-  src::severity_channel_logger<severity_level, std::string> m_lg;
-  std::string m_channel = "http_connection";
-  tcp::socket m_socket;
-  boost::beast::flat_buffer m_buffer{8192};
-  http::request<http::dynamic_body> m_request;
-  http::response<http::dynamic_body> m_response;
-  boost::asio::basic_waitable_timer<std::chrono::steady_clock> m_deadline{
-      m_socket.get_executor().context(), std::chrono::seconds(60)};
-  std::shared_ptr<AbstractRequestHandler> m_request_handler;
-
-  Request from_beast(http::request<http::dynamic_body> req) {
-    return Request(
-        RequestLine(
-            static_cast<Method>(req.method()),
-            std::string_view(req.target().data(), req.target().length()),
-            Version(req.version())),
-        MessageBody(std::string(boost::asio::buffers_begin(req.body().data()),
-                                boost::asio::buffers_end(req.body().data()))));
+  void release(Connection *connection) {
+    {
+      std::lock_guard<std::mutex> lock{m_mutex};
+      unlink(connection);
+    }
+    connection->recycle();
+    std::unique_lock<std::mutex> lock{m_mutex};
+    if (!m_shutdown && m_idle.size() < max_idle) {
+      m_idle.emplace_back(connection);
+      return;
+    }
+    lock.unlock();
+    delete connection;
   }
 
- public:
-  Connection(tcp::socket socket,
-             std::shared_ptr<AbstractRequestHandler> request_handler)
-      : m_socket(std::move(socket)),
-        m_request_handler(std::move(request_handler)) {}
+  void link(Connection *connection) {
+    connection->m_prev = nullptr;
+    connection->m_next = m_open;
+    if (m_open) {
+      m_open->m_prev = connection;
+    }
+    m_open = connection;
+  }
 
-  void start() {
-    BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, debug) << "Started";
-    read_request();
-    check_deadline();
+  void unlink(Connection *connection) {
+    if (connection->m_prev) {
+      connection->m_prev->m_next = connection->m_next;
+    } else {
+      m_open = connection->m_next;
+    }
+    if (connection->m_next) {
+      connection->m_next->m_prev = connection->m_prev;
+    }
+    connection->m_prev = connection->m_next = nullptr;
   }
 
-  void read_request() {
-    BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, debug) << "Received request";
-    auto self = shared_from_this();
-    http::async_read(
-        m_socket,
-        m_buffer,
-        m_request,
-        [self](boost::beast::error_code ec, std::size_t bytes_transferred) {
-          boost::ignore_unused(bytes_transferred);
-          if (!ec) {
-            self->process_request();
-          } else {
-            BOOST_LOG_CHANNEL_SEV(self->m_lg, self->m_channel, error) << ec;
-          }
-        });
+  void shutdown() override {
+    std::vector<std::unique_ptr<Connection>> idle;
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_shutdown = true;
+    idle.swap(m_idle);
   }
 
-  void process_request() {
-    BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, info)
-        << "Processing " << m_request.method() << " request";
-    BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, debug) << "Request:\n" << m_request;
-    m_response.version(m_request.version());
-    m_response.keep_alive(false);
-    m_response.set(http::field::access_control_allow_origin, "*");
+ public:
+  static boost::asio::execution_context::id id;
 
-    if (m_request.method() == http::verb::get ||
-        m_request.method() == http::verb::post) {
-      m_response.result(http::status::ok);
-      m_response.set(http::field::server, "Beast");
-      if (m_request_handler) {
-        auto response = m_request_handler->on_request(from_beast(m_request));
-        m_response.result(
-            static_cast<http::status>(response.status_line().status_code()));
-        boost::beast::ostream(m_response.body()) << response.body();
-      } else {
-        handle_target_not_found();
+  explicit ConnectionPool(boost::asio::execution_context &context)
+      : boost::asio::execution_context::service(context),
+        m_wheel(boost::asio::use_service<TimerWheel>(
+            static_cast<boost::asio::io_context &>(context))),
+        m_ring(started_ring(context)) {}
+
+  // The returned connection goes back to the pool once the last reference
+  // to it is gone; its control block comes from the recycling allocator.
+  std::shared_ptr<Connection> acquire(tcp::socket socket,
+                                      std::shared_ptr<ServiceState> state) {
+    std::unique_ptr<Connection> connection;
+    {
+      std::lock_guard<std::mutex> lock{m_mutex};
+      if (!m_idle.empty()) {
+        connection = std::move(m_idle.back());
+        m_idle.pop_back();
       }
-    } else if (m_request.method() == http::verb::options) {
-      handle_options_request();
-    } else {
-      BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, error) << "Invalid request-method";
-      m_response.result(http::status::bad_request);
-      m_response.set(http::field::content_type, "text/plain");
-      boost::beast::ostream(m_response.body())
-          << "Invalid request-method '" << m_request.method_string().to_string()
-          << "'";
     }
-    write_response();
+    if (!connection) {
+      connection = std::make_unique<Connection>(
+          tcp::socket(socket.get_executor()), m_wheel, m_ring);
+    }
+    connection->open(std::move(socket), std::move(state));
+    std::shared_ptr<Connection> shared(
+        connection.release(),
+        [this](Connection *connection) { release(connection); },
+        detail::RecyclingAllocator<Connection>());
+    std::lock_guard<std::mutex> lock{m_mutex};
+    link(shared.get());
+    return shared;
   }
 
-  void handle_options_request() {
-    BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, debug) << "Handling OPTIONS request";
-    m_response.result(http::status::ok);
-    m_response.set(http::field::server, "Beast");
-    m_response.set(http::field::access_control_allow_origin, "*");
-    m_response.set(http::field::access_control_request_method, "GET, POST");
-    m_response.set(http::field::access_control_allow_headers,
-                   "Origin, Content-Type, X-Auth-Token");
+  // Calls Connection::drain() on the executor of every open connection.
+  void drain(bool force) {
+    std::vector<std::shared_ptr<Connection>> open;
+    {
+      std::lock_guard<std::mutex> lock{m_mutex};
+      for (auto connection = m_open; connection;
+           connection = connection->m_next) {
+        // Null for a connection whose last reference is being released.
+        if (auto shared = connection->weak_from_this().lock()) {
+          open.push_back(std::move(shared));
+        }
+      }
+    }
+    for (auto &connection : open) {
+      boost::asio::post(connection->m_socket.get_executor(),
+                        [connection, force] { connection->drain(force); });
+    }
   }
+};
 
-  void handle_target_not_found() {
-    BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, error) << "Target not found!";
-    m_response.result(http::status::not_found);
-    m_response.set(http::field::content_type, "text/plain");
-    boost::beast::ostream(m_response.body()) << "File not found\r\n";
+boost::asio::execution_context::id ConnectionPool::id;
+
+using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET,
+                                                                SO_REUSEPORT>;
+#ifdef __linux__
+using defer_accept =
+    boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_DEFER_ACCEPT>;
+using fast_open =
+    boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN>;
+#endif
+
+class Listener {
+  char const *m_channel = "http_listener";
+  boost::asio::io_context &m_ioc;
+  // On a strand if several threads run the context, so stop() can close
+  // it while they accept.
+  tcp::acceptor m_acceptor;
+  bool m_use_strands;
+  tcp m_protocol;
+  std::shared_ptr<ServiceState> m_state;
+  ConnectionPool &m_pool;
+
+  // Completes accepts submitted to the ring on the acceptor's executor.
+  class RingAccept : public detail::Ring::Operation {
+    Listener &m_listener;
+
+   public:
+    explicit RingAccept(Listener &listener) : m_listener{listener} {}
+
+    void complete(int result, bool more) override {
+      auto &listener = m_listener;
+      boost::asio::dispatch(
+          listener.m_acceptor.get_executor(),
+          recycling([&listener, result, more] {
+            listener.on_ring_accept(result, more);
+          }));
+    }
+  };
+
+  // Connections are accepted through the ring of the context if it has
+  // one. Without a connection limit a single multishot accept stays armed,
+  // unless the kernel does not support those.
+  detail::Ring *m_ring;
+  bool m_multishot;
+  RingAccept m_accept{*this};
+
+ public:
+  // Listens on `endpoint`, or on the listening socket `fd` if it is not -1.
+  Listener(boost::asio::io_context &ioc,
+           tcp::endpoint const &endpoint,
+           bool share_port,
+           bool use_strands,
+           std::shared_ptr<ServiceState> state,
+           int fd = -1)
+      : m_ioc{ioc},
+        m_acceptor{use_strands ? boost::asio::any_io_executor(
+                                     boost::asio::make_strand(ioc))
+                               : boost::asio::any_io_executor(
+                                     ioc.get_executor())},
+        m_use_strands{use_strands},
+        m_protocol{endpoint.protocol()},
+        m_state{std::move(state)},
+        m_pool{boost::asio::use_service<ConnectionPool>(ioc)},
+        m_ring{started_ring(ioc)},
+        m_multishot{m_state->config.admission.max_connections == 0} {
+    if (fd != -1) {
+      m_acceptor.assign(endpoint.protocol(), fd);
+      if (m_ring) {
+        // Accepts of the ring fail with EAGAIN instead of waiting on a
+        // non-blocking socket, as a predecessor using epoll leaves it.
+        m_acceptor.native_non_blocking(false);
+      }
+      return;
+    }
+    auto const &config = m_state->config;
+    m_acceptor.open(endpoint.protocol());
+    m_acceptor.set_option(tcp::acceptor::reuse_address(true));
+    if (share_port) {
+      m_acceptor.set_option(reuse_port(true));
+    }
+    // Accepted sockets inherit the buffer sizes. They are set before listen()
+    // so the window scale offered in the handshake can use them.
+    if (config.receive_buffer_size > 0) {
+      m_acceptor.set_option(boost::asio::socket_base::receive_buffer_size(
+          config.receive_buffer_size));
+    }
+    if (config.send_buffer_size > 0) {
+      m_acceptor.set_option(
+          boost::asio::socket_base::send_buffer_size(config.send_buffer_size));
+    }
+#ifdef __linux__
+    if (config.defer_accept > 0) {
+      m_acceptor.set_option(defer_accept(config.defer_accept));
+    }
+    if (config.fast_open_queue > 0) {
+      m_acceptor.set_option(fast_open(config.fast_open_queue));
+    }
+#endif
+    m_acceptor.bind(endpoint);
+    m_acceptor.listen(config.backlog > 0
+                          ? config.backlog
+                          : boost::asio::socket_base::max_listen_connections);
   }
 
-  void write_response() {
-    BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, debug) << "Writing response";
-    auto self = shared_from_this();
-    m_response.set(http::field::content_length, m_response.body().size());
-    http::async_write(
-        m_socket, m_response, [self](boost::beast::error_code ec, std::size_t) {
-          self->m_socket.shutdown(tcp::socket::shutdown_send, ec);
-          self->m_deadline.cancel();
-        });
-    BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, debug) << "Response:\n"
-                                                  << m_response;
+  // Callbacks waiting for a connection slot refer to the listener, as does
+  // an accept left in the ring once the context stopped.
+  ~Listener() {
+    m_state->admission.cancel_waiting();
+    if (m_ring) {
+      m_ring->forget(m_accept);
+    }
   }
 
-  void check_deadline() {
-    BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, debug) << "Checking deadline";
-    auto self = shared_from_this();
-    m_deadline.async_wait([self](boost::beast::error_code ec) {
-      if (!ec) {
-        self->m_socket.close(ec);
+  int native_handle() { return m_acceptor.native_handle(); }
+
+  void close() {
+    boost::asio::post(m_acceptor.get_executor(), [this] {
+      // The accept of the ring keeps the socket listening until it ends.
+      if (m_ring && m_accept.pending()) {
+        m_ring->cancel(m_accept);
       }
+      boost::beast::error_code ec;
+      m_acceptor.close(ec);
     });
   }
+
+  void add_connection() {
+    if (m_state->stopping.load() || !m_acceptor.is_open()) {
+      return;
+    }
+    // At the connection limit accepting pauses until a connection closes.
+    if (!m_state->admission.reserve_connection()) {
+      APEE_LOG(m_channel, debug) << "Connection limit reached";
+      m_state->admission.wait_for_connection([this] {
+        boost::asio::post(m_acceptor.get_executor(),
+                          [this] { add_connection(); });
+      });
+      return;
+    }
+    APEE_LOG(m_channel, debug) << "Accepting requests";
+    if (m_ring) {
+      m_ring->accept(m_accept, m_acceptor.native_handle(), m_multishot);
+      return;
+    }
+    m_acceptor.async_accept(
+        connection_executor(),
+        recycling([this](boost::beast::error_code ec, tcp::socket socket) {
+          if (accepted(ec, std::move(socket))) {
+            add_connection();
+          }
+        }));
+  }
+
+ private:
+  // Connections accepted on a context run by several threads get a strand,
+  // so their handlers never run concurrently.
+  boost::asio::any_io_executor connection_executor() {
+    return m_use_strands
+               ? boost::asio::any_io_executor(boost::asio::make_strand(m_ioc))
+               : boost::asio::any_io_executor(m_ioc.get_executor());
+  }
+
+  // Starts serving the accepted socket. Returns false if the acceptor was
+  // closed.
+  bool accepted(boost::beast::error_code ec, tcp::socket socket) {
+    if (!ec) {
+      if (m_state->config.tcp_nodelay) {
+        socket.set_option(tcp::no_delay(true), ec);
+      }
+      m_pool.acquire(std::move(socket), m_state)->start();
+    } else if (ec == boost::asio::error::operation_aborted) {
+      m_state->admission.release_connection();
+      return false;
+    } else {
+      APEE_LOG(m_channel, error) << ec;
+      m_state->metrics.record_error("accept", ec);
+      m_state->admission.release_connection();
+    }
+    return true;
+  }
+
+  void on_ring_accept(int result, bool more) {
+    boost::beast::error_code ec;
+    tcp::socket socket{connection_executor()};
+    if (result >= 0) {
+      socket.assign(m_protocol, result, ec);
+      if (ec) {
+        ::close(result);
+      }
+    } else if (result == -ECANCELED) {
+      ec = boost::asio::error::operation_aborted;
+    } else {
+      ec.assign(-result, boost::system::system_category());
+      if (result == -EINVAL && m_multishot) {
+        // Multishot accepts need Linux 5.19, accept one at a time.
+        m_multishot = false;
+      }
+    }
+    // A multishot accept that stays armed needs no new submission.
+    if (accepted(ec, std::move(socket)) && !more) {
+      add_connection();
+    }
+  }
 };
 
+// How often a stopping Service checks whether its connections are closed.
+constexpr std::chrono::milliseconds drain_poll_interval{50};
+
 class Service::impl {
-  src::severity_channel_logger<severity_level, std::string> m_lg;
-  boost::asio::io_context m_ioc{1};
-  tcp::acceptor m_acceptor;
-  tcp::socket m_socket;
-  std::string m_channel = "http_server";
-  std::shared_ptr<AbstractRequestHandler> m_handler;
+  using Local = boost::asio::local::stream_protocol;
 
- public:
-  //  impl()
-  //      : m_acceptor{m_ioc, {boost::asio::ip::make_address("0.0.0.0"), 80}},
-  //        m_socket{m_ioc} {}
-
-  impl(std::shared_ptr<AbstractRequestHandler> handler)
-      : m_acceptor{m_ioc, {boost::asio::ip::make_address("0.0.0.0"), 80}},
-        m_socket{m_ioc},
-        m_handler{handler} {
-    logger::init();
+  char const *m_channel = "http_server";
+  unsigned int m_thread_count;
+  std::vector<std::unique_ptr<boost::asio::io_context>> m_contexts;
+  // Destroyed before the contexts, requests it still runs respond to them.
+  std::unique_ptr<WorkerPool> m_workers;
+  std::vector<std::unique_ptr<Listener>> m_listeners;
+  std::shared_ptr<ServiceState> m_state;
+  // Serialises stopping, signals and handoffs on context 0.
+  boost::asio::strand<boost::asio::io_context::executor_type> m_control;
+  std::optional<boost::asio::signal_set> m_signals;
+  std::optional<Local::acceptor> m_handoff;
+  bool m_handed_off = false;
+  std::optional<boost::asio::steady_timer> m_drain_timer;
+  Clock::time_point m_deadline;
+  bool m_forced = false;
+
+  static unsigned int thread_count(Threading const &threading) {
+    if (threading.mode == Threading::Mode::Single) {
+      return 1;
+    }
+    if (threading.threads != 0) {
+      return threading.threads;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
   }
 
-  impl(std::string const &address, uint16_t port)
-      : m_acceptor{m_ioc, {boost::asio::ip::make_address(address), port}},
-        m_socket{m_ioc} {
-    logger::init();
+  // One context per thread, or one shared by all threads.
+  static std::vector<std::unique_ptr<boost::asio::io_context>> make_contexts(
+      Threading const &threading, unsigned int threads) {
+    std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+    if (threading.mode == Threading::Mode::ContextPerThread) {
+      for (unsigned int i = 0; i < threads; ++i) {
+        contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+      }
+    } else {
+      contexts.push_back(std::make_unique<boost::asio::io_context>(threads));
+    }
+    return contexts;
   }
 
-  //  impl(Config const &config)
-  //      : m_acceptor{m_ioc, {config.address(), config.port()}},
-  //      m_socket{m_ioc} {}
+  boost::asio::io_context &context(unsigned int thread) {
+    return *m_contexts[thread % m_contexts.size()];
+  }
 
-  void add_connection() {
-    BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, debug) << "Accepting requests";
-    m_acceptor.async_accept(m_socket, [&](boost::beast::error_code ec) {
-      if (!ec) {
-        std::make_shared<Connection>(std::move(m_socket), m_handler)->start();
-      } else {
-        BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, error) << ec;
+  void pin(unsigned int thread) {
+    if (!m_state->config.threading.pin_threads) {
+      return;
+    }
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(thread % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+      APEE_LOG(m_channel, warning) << "Could not pin thread " << thread;
+    }
+#endif
+  }
+
+  // Sets up the ring of every context, see IoUring. The connections of a
+  // context without one use epoll.
+  void start_rings() {
+    auto const &config = m_state->config;
+    auto buffer_size =
+        std::max(config.read_buffer_size, config.max_header_size);
+    for (auto &context : m_contexts) {
+      auto &ring = boost::asio::use_service<detail::Ring>(*context);
+      if (!ring.start(config.io_uring.entries,
+                      config.io_uring.registered_buffers,
+                      buffer_size)) {
+        APEE_LOG(m_channel, warning) << "io_uring is not available ("
+                                     << std::strerror(errno)
+                                     << "), using epoll";
+        return;
       }
-      add_connection();
+    }
+    APEE_LOG(m_channel, info) << "Using io_uring";
+  }
+
+  // Listening sockets of a predecessor or from socket activation, see
+  // Service.
+  std::vector<int> inherited_sockets() {
+    auto const &path = m_state->config.handoff_path;
+    if (!path.empty()) {
+      auto fds = detail::receive_fds(path);
+      if (!fds.empty()) {
+        APEE_LOG(m_channel, info) << "Took over " << fds.size()
+                                  << " listening socket(s) from " << path;
+        return fds;
+      }
+    }
+    auto fds = detail::activated_fds();
+    if (!fds.empty()) {
+      APEE_LOG(m_channel, info)
+          << "Using " << fds.size() << " socket(s) from socket activation";
+    }
+    return fds;
+  }
+
+  // Passes the listening sockets to a successor connecting to the handoff
+  // socket, then stops.
+  void accept_handoff() {
+    m_handoff->async_accept(
+        [this](boost::beast::error_code ec, Local::socket successor) {
+          if (ec) {
+            return;
+          }
+          std::vector<int> fds;
+          for (auto &listener : m_listeners) {
+            fds.push_back(listener->native_handle());
+          }
+          if (!detail::send_fds(successor.native_handle(), fds)) {
+            APEE_LOG(m_channel, error)
+                << "Handing over listening sockets failed: "
+                << std::strerror(errno);
+            accept_handoff();
+            return;
+          }
+          APEE_LOG(m_channel, warning) << "Handed over listening sockets";
+          m_handed_off = true;
+          begin_stop(m_state->config.drain_timeout);
+        });
+  }
+
+  // Runs on m_control.
+  void begin_stop(std::chrono::milliseconds timeout) {
+    auto deadline = Clock::now() + timeout;
+    if (m_state->stopping.exchange(true)) {
+      m_deadline = std::min(m_deadline, deadline);
+      return;
+    }
+    APEE_LOG(m_channel, warning)
+        << "Stopping, " << m_state->metrics.active() << " connection(s) open";
+    m_deadline = deadline;
+    boost::beast::error_code ec;
+    if (m_signals) {
+      // A second signal terminates the process as usual.
+      m_signals->cancel(ec);
+      m_signals->clear(ec);
+    }
+    if (m_handoff) {
+      m_handoff->close(ec);
+      // After a handoff the path belongs to the successor.
+      if (!m_handed_off) {
+        ::unlink(m_state->config.handoff_path.c_str());
+      }
+    }
+    for (auto &listener : m_listeners) {
+      listener->close();
+    }
+    for (auto &context : m_contexts) {
+      boost::asio::use_service<ConnectionPool>(*context).drain(false);
+    }
+    m_drain_timer.emplace(m_control);
+    wait_for_drain();
+  }
+
+  // Stops the io_contexts once all connections are closed. At the deadline
+  // the remaining ones are closed, and the contexts stopped a poll later.
+  void wait_for_drain() {
+    m_drain_timer->expires_after(drain_poll_interval);
+    m_drain_timer->async_wait([this](boost::beast::error_code ec) {
+      if (ec) {
+        return;
+      }
+      auto open = m_state->metrics.active();
+      if (open == 0 || m_forced) {
+        for (auto &context : m_contexts) {
+          context->stop();
+        }
+        return;
+      }
+      if (Clock::now() >= m_deadline) {
+        APEE_LOG(m_channel, warning)
+            << "Closing " << open << " connection(s) at the deadline";
+        for (auto &context : m_contexts) {
+          boost::asio::use_service<ConnectionPool>(*context).drain(true);
+        }
+        m_forced = true;
+      }
+      wait_for_drain();
     });
   }
 
+ public:
+  impl(Config const &config, std::shared_ptr<AbstractRequestHandler> handler)
+      : m_thread_count{thread_count(config.threading)},
+        m_contexts{make_contexts(config.threading, m_thread_count)},
+        m_state{std::make_shared<ServiceState>(
+            config, std::move(handler), m_thread_count)},
+        m_control{boost::asio::make_strand(*m_contexts.front())} {
+    if (config.threading.workers > 0) {
+      m_workers = std::make_unique<WorkerPool>(config.threading.workers);
+      m_state->workers = m_workers.get();
+    }
+    logger::init();
+    // Before the listeners, whose connections pick up the rings.
+    if (config.io_uring.enabled) {
+      start_rings();
+    }
+    // sendfile(2) has no MSG_NOSIGNAL, a peer closing the connection during a
+    // transfer would otherwise terminate the process.
+    std::signal(SIGPIPE, SIG_IGN);
+    tcp::endpoint endpoint{boost::asio::ip::make_address(config.address),
+                           config.port};
+    auto fds = inherited_sockets();
+    auto fd = [&fds](std::size_t i) { return i < fds.size() ? fds[i] : -1; };
+    if (config.threading.mode == Threading::Mode::ContextPerThread) {
+      for (unsigned int i = 0; i < m_thread_count; ++i) {
+        m_listeners.push_back(std::make_unique<Listener>(
+            *m_contexts[i], endpoint, true, false, m_state, fd(i)));
+      }
+    } else {
+      m_listeners.push_back(std::make_unique<Listener>(*m_contexts.front(),
+                                                       endpoint,
+                                                       false,
+                                                       m_thread_count > 1,
+                                                       m_state,
+                                                       fd(0)));
+    }
+    for (auto i = m_listeners.size(); i < fds.size(); ++i) {
+      ::close(fds[i]);
+    }
+    if (!config.handoff_path.empty()) {
+      // A stale file or the predecessor's, which it no longer needs.
+      ::unlink(config.handoff_path.c_str());
+      m_handoff.emplace(m_control, Local::endpoint(config.handoff_path));
+    }
+  }
+
   void run() {
-    BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, info) << "Running";
-    add_connection();
-    m_ioc.run();
-    BOOST_LOG_CHANNEL_SEV(m_lg, m_channel, warning) << "Stopped";
+    APEE_LOG(m_channel, info)
+        << "Running on " << m_thread_count << " thread(s)";
+    if (m_state->config.stop_on_signals) {
+      m_signals.emplace(m_control, SIGTERM, SIGINT);
+      m_signals->async_wait([this](boost::beast::error_code ec, int signal) {
+        if (!ec) {
+          APEE_LOG(m_channel, warning) << "Received signal " << signal;
+          begin_stop(m_state->config.drain_timeout);
+        }
+      });
+    }
+    if (m_handoff) {
+      accept_handoff();
+    }
+    for (auto &listener : m_listeners) {
+      listener->add_connection();
+    }
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < m_thread_count; ++i) {
+      threads.emplace_back([this, i] {
+        Metrics::set_thread(i);
+        pin(i);
+        detail::set_thread_context(&context(i));
+        context(i).run();
+      });
+    }
+    Metrics::set_thread(0);
+    pin(0);
+    // Clients called by the handlers use the context of their thread.
+    detail::set_thread_context(&context(0));
+    context(0).run();
+    detail::set_thread_context(nullptr);
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    APEE_LOG(m_channel, warning) << "Stopped";
+  }
+
+  void stop(std::chrono::milliseconds timeout) {
+    boost::asio::post(m_control, [this, timeout] { begin_stop(timeout); });
+  }
+
+  std::chrono::milliseconds drain_timeout() const {
+    return m_state->config.drain_timeout;
+  }
+
+  void serve_metrics(std::string path) {
+    m_state->config.metrics_path = std::move(path);
+  }
+
+  MetricsSnapshot metrics() const { return m_state->snapshot(); }
+
+  void set_timeouts(Timeouts const &timeouts) {
+    m_state->config.timeouts = timeouts;
   }
 };
 
+namespace {
+
+Config make_config(std::string const &address,
+                   unsigned short port,
+                   Threading const &threading) {
+  Config config;
+  config.address = address;
+  config.port = port;
+  config.threading = threading;
+  return config;
+}
+
+}  // namespace
+
 Service::Service(std::shared_ptr<AbstractRequestHandler> handler)
-    : d_ptr{std::make_unique<impl>(handler)} {}
+    : Service(Config(), std::move(handler)) {}
+
+Service::Service(std::shared_ptr<AbstractRequestHandler> handler,
+                 Threading const &threading)
+    : Service(make_config("0.0.0.0", 80, threading), std::move(handler)) {}
+
+Service::Service(std::string const &address,
+                 unsigned short port,
+                 std::shared_ptr<AbstractRequestHandler> handler,
+                 Threading const &threading)
+    : Service(make_config(address, port, threading), std::move(handler)) {}
+
+Service::Service(Config const &config,
+                 std::shared_ptr<AbstractRequestHandler> handler)
+    : d_ptr{std::make_unique<impl>(config, std::move(handler))} {}
 
 void Service::run() { d_ptr->run(); }
 
+void Service::stop(std::chrono::milliseconds timeout) { d_ptr->stop(timeout); }
+
+void Service::stop() { d_ptr->stop(d_ptr->drain_timeout()); }
+
+void Service::serve_metrics(std::string path) {
+  d_ptr->serve_metrics(std::move(path));
+}
+
+MetricsSnapshot Service::metrics() const { return d_ptr->metrics(); }
+
+void Service::set_timeouts(Timeouts const &timeouts) {
+  d_ptr->set_timeouts(timeouts);
+}
+
 Service::~Service() = default;
 
 Service::Service(Service &&) noexcept = default;
@@ -269,22 +3130,307 @@ std::ostream &operator<<(std::ostream &out, const MessageBody &op) {
   return out;
 }
 
-Request::Request(RequestLine const &request_line, MessageBody const &body)
-    : m_request_line{request_line}, m_body{body} {}
+Headers::Headers(void const *fields) : m_fields{fields} {
+  for (auto const &field : *static_cast<detail::Fields const *>(fields)) {
+    auto &value = m_known[static_cast<std::size_t>(
+        detail::from_beast(field.name()))];
+    // Views of present fields are never null, even for empty values.
+    if (value.data() == nullptr) {
+      value = std::string_view(field.value().data(), field.value().size());
+    }
+  }
+  m_known[field_count] = {};
+}
+
+std::string_view Headers::operator[](std::string_view name) const {
+  if (!m_fields) {
+    return {};
+  }
+  auto const &fields = *static_cast<detail::Fields const *>(m_fields);
+  auto it = fields.find(boost::beast::string_view(name.data(), name.size()));
+  if (it == fields.end()) {
+    return {};
+  }
+  return std::string_view(it->value().data(), it->value().size());
+}
+
+void Headers::for_each(
+    std::function<void(std::string_view name, std::string_view value)> const
+        &visit) const {
+  if (!m_fields) {
+    return;
+  }
+  for (auto const &field :
+       *static_cast<detail::Fields const *>(m_fields)) {
+    visit(std::string_view(field.name_string().data(),
+                           field.name_string().size()),
+          std::string_view(field.value().data(), field.value().size()));
+  }
+}
+
+Request::Request(RequestLine const &request_line,
+                 MessageBody const &body,
+                 Headers const &headers)
+    : m_request_line{request_line}, m_body{body}, m_headers{headers} {}
+
+Headers const &Request::headers() const { return m_headers; }
+
+RequestLine const &Request::request_line() const { return m_request_line; }
+
+MessageBody const &Request::body() const { return m_body; }
 
-RequestLine Request::request_line() const { return m_request_line; }
+SharedBody::SharedBody(std::shared_ptr<void const> owner,
+                       std::string_view data)
+    : m_owner{std::move(owner)}, m_data{data} {}
 
-MessageBody Request::body() const { return m_body; }
+FileBody::FileBody(int fd, std::uint64_t offset, std::uint64_t size)
+    : m_fd{new int{fd},
+           [](int const *fd) {
+             if (*fd >= 0) {
+               ::close(*fd);
+             }
+             delete fd;
+           }},
+      m_offset{offset},
+      m_size{size} {}
+
+FileBody::FileBody(std::shared_ptr<int const> fd,
+                   std::uint64_t offset,
+                   std::uint64_t size)
+    : m_fd{std::move(fd)}, m_offset{offset}, m_size{size} {}
+
+FileBody FileBody::open(std::string const &path, std::error_code &ec) {
+  FileBody file(::open(path.c_str(), O_RDONLY | O_CLOEXEC), 0, 0);
+  struct stat st;
+  if (file.fd() < 0 || ::fstat(file.fd(), &st) != 0) {
+    ec.assign(errno, std::generic_category());
+    return file;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    ec = std::make_error_code(S_ISDIR(st.st_mode) ? std::errc::is_a_directory
+                                                  : std::errc::invalid_argument);
+    return file;
+  }
+  ec.clear();
+  return FileBody(file.shared_fd(), 0, static_cast<std::uint64_t>(st.st_size));
+}
 
 Response::Response(StatusLine const &status_line, MessageBody const &body)
-    : m_status_line{status_line}, m_body{body} {}
+    : m_status_line{status_line}, m_payload{body} {}
+
+Response::Response(StatusLine const &status_line, std::string body)
+    : m_status_line{status_line}, m_payload{std::move(body)} {}
+
+Response::Response(StatusLine const &status_line, SharedBody body)
+    : m_status_line{status_line}, m_payload{std::move(body)} {}
+
+Response::Response(StatusLine const &status_line, FileBody body)
+    : m_status_line{status_line}, m_payload{std::move(body)} {}
 
-MessageBody Response::body() const { return m_body; }
+Response::Response(StatusLine const &status_line, StreamBody body)
+    : m_status_line{status_line}, m_payload{std::move(body)} {}
+
+Response::Response(StatusLine const &status_line, AsyncStreamBody body)
+    : m_status_line{status_line}, m_payload{std::move(body)} {}
+
+void ResponseHeaders::set(Field field, std::string_view value) {
+  store(field, {}, value, false);
+}
+
+void ResponseHeaders::set(std::string_view name, std::string_view value) {
+  auto field = to_field(name);
+  store(field,
+        field == Field::Unknown ? name : std::string_view(),
+        value,
+        false);
+}
+
+void ResponseHeaders::add(Field field, std::string_view value) {
+  store(field, {}, value, true);
+}
+
+void ResponseHeaders::add(std::string_view name, std::string_view value) {
+  auto field = to_field(name);
+  store(field,
+        field == Field::Unknown ? name : std::string_view(),
+        value,
+        true);
+}
+
+std::string_view ResponseHeaders::operator[](Field field) const {
+  return value(find(field, {}));
+}
+
+std::string_view ResponseHeaders::operator[](std::string_view name) const {
+  auto field = to_field(name);
+  return value(
+      find(field, field == Field::Unknown ? name : std::string_view()));
+}
+
+ResponseHeaders::Entry ResponseHeaders::entry(std::size_t index) const {
+  auto const &slot = m_slots[index];
+  return Entry{slot.field,
+               slot.field == Field::Unknown
+                   ? std::string_view(m_data).substr(slot.offset,
+                                                     slot.name_size)
+                   : to_string(slot.field),
+               value(index),
+               slot.repeated};
+}
+
+std::size_t ResponseHeaders::find(Field field,
+                                  std::string_view name,
+                                  std::size_t from) const {
+  for (std::size_t i = from; i < m_slots.size(); ++i) {
+    auto const &slot = m_slots[i];
+    if (slot.field == field &&
+        (field != Field::Unknown ||
+         boost::beast::iequals(
+             boost::beast::string_view(m_data.data() + slot.offset,
+                                       slot.name_size),
+             boost::beast::string_view(name.data(), name.size())))) {
+      return i;
+    }
+  }
+  return m_slots.size();
+}
+
+std::string_view ResponseHeaders::value(std::size_t index) const {
+  if (index == m_slots.size()) {
+    return {};
+  }
+  auto const &slot = m_slots[index];
+  return std::string_view(m_data).substr(slot.offset + slot.name_size,
+                                         slot.value_size);
+}
+
+void ResponseHeaders::store(Field field,
+                            std::string_view name,
+                            std::string_view value,
+                            bool repeat) {
+  auto index = find(field, name);
+  Slot slot{field,
+            repeat && index < m_slots.size(),
+            static_cast<std::uint32_t>(m_data.size()),
+            static_cast<std::uint32_t>(name.size()),
+            static_cast<std::uint32_t>(value.size())};
+  std::less_equal<char const *> before;
+  auto end = m_data.data() + m_data.size();
+  if (before(m_data.data(), value.data()) && before(value.data(), end)) {
+    // A value of this very object, which the append may move.
+    std::string copy(value);
+    m_data.append(name).append(copy);
+  } else {
+    m_data.append(name).append(value);
+  }
+  // A replaced value stays in the buffer until the response is gone.
+  if (index < m_slots.size() && !repeat) {
+    m_slots[index] = slot;
+    // Values added after the replaced one go as well.
+    for (auto i = find(field, name, index + 1); i < m_slots.size();
+         i = find(field, name, i)) {
+      m_slots.erase(m_slots.begin() + static_cast<std::ptrdiff_t>(i));
+    }
+  } else {
+    m_slots.push_back(slot);
+  }
+}
+
+Response &Response::set_header(Field field, std::string_view value) {
+  m_headers.set(field, value);
+  return *this;
+}
+
+Response &Response::set_header(std::string_view name,
+                               std::string_view value) {
+  m_headers.set(name, value);
+  return *this;
+}
+
+Response &Response::add_header(std::string_view name,
+                               std::string_view value) {
+  m_headers.add(name, value);
+  return *this;
+}
+
+Response &Response::set_cache_ttl(std::chrono::milliseconds ttl) {
+  m_cache_ttl = ttl;
+  return *this;
+}
+
+MessageBody Response::body() const {
+  if (auto body = std::get_if<MessageBody>(&m_payload)) {
+    return *body;
+  }
+  if (auto body = std::get_if<std::string>(&m_payload)) {
+    return MessageBody(*body);
+  }
+  if (auto body = std::get_if<SharedBody>(&m_payload)) {
+    return MessageBody(body->str());
+  }
+  return MessageBody("");
+}
 
 StatusLine Response::status_line() const { return m_status_line; }
 
 AbstractRequestHandler::~AbstractRequestHandler() = default;
 
+void AbstractRequestHandler::on_request_async(Request const &request,
+                                              Responder responder) {
+  responder(on_request(request));
+}
+
+Response AbstractAsyncRequestHandler::on_request(Request const &) {
+  return Response(StatusCode::NotImplemented, MessageBody(""));
+}
+
+bool AbstractRequestHandler::offload(Request const &) { return false; }
+
+bool AbstractRequestHandler::stream_body(Request const &) { return false; }
+
+void AbstractRequestHandler::on_request_stream(Request const &,
+                                               BodyReader,
+                                               Responder responder) {
+  responder(Response(StatusCode::NotImplemented, MessageBody("")));
+}
+
+detail::ResponseSink::~ResponseSink() = default;
+
+detail::BodySource::~BodySource() = default;
+
+BodyReader::BodyReader(std::shared_ptr<detail::BodySource> source,
+                       std::uint64_t request)
+    : m_source{std::move(source)}, m_request{request} {}
+
+void BodyReader::read(Handler handler) {
+  m_source->read_body(m_request, std::move(handler));
+}
+
+Responder::Responder(std::shared_ptr<detail::ResponseSink> sink)
+    : m_sink{std::move(sink)} {}
+
+Responder::~Responder() {
+  if (m_sink) {
+    m_sink->respond(Response(StatusCode::InternalServerError, MessageBody("")));
+  }
+}
+
+Responder::Responder(Responder &&) noexcept = default;
+
+Responder &Responder::operator=(Responder &&other) noexcept {
+  if (this != &other) {
+    Responder discarded{std::move(*this)};
+    m_sink = std::move(other.m_sink);
+  }
+  return *this;
+}
+
+void Responder::operator()(Response response) {
+  if (auto sink = std::move(m_sink)) {
+    sink->respond(std::move(response));
+  }
+}
+
 Version::Version() : major{1}, minor{1} {}
 
 Version::Version(unsigned int http_version)
@@ -0,0 +1,143 @@
+#include "beast.hpp"
+
+#include <iterator>
+
+namespace http = boost::beast::http;
+
+namespace apee {
+namespace detail {
+
+namespace {
+
+// Indexed by Field.
+constexpr http::field beast_fields[] = {
+    http::field::accept,
+    http::field::accept_encoding,
+    http::field::accept_language,
+    http::field::accept_ranges,
+    http::field::access_control_allow_origin,
+    http::field::age,
+    http::field::allow,
+    http::field::authorization,
+    http::field::cache_control,
+    http::field::connection,
+    http::field::content_disposition,
+    http::field::content_encoding,
+    http::field::content_language,
+    http::field::content_length,
+    http::field::content_location,
+    http::field::content_range,
+    http::field::content_type,
+    http::field::cookie,
+    http::field::date,
+    http::field::etag,
+    http::field::expect,
+    http::field::expires,
+    http::field::forwarded,
+    http::field::host,
+    http::field::if_match,
+    http::field::if_modified_since,
+    http::field::if_none_match,
+    http::field::if_range,
+    http::field::if_unmodified_since,
+    http::field::last_modified,
+    http::field::location,
+    http::field::origin,
+    http::field::range,
+    http::field::referer,
+    http::field::retry_after,
+    http::field::server,
+    http::field::set_cookie,
+    http::field::transfer_encoding,
+    http::field::upgrade,
+    http::field::user_agent,
+    http::field::vary,
+    http::field::www_authenticate,
+    http::field::unknown};
+static_assert(std::size(beast_fields) == field_count + 1,
+              "Every Field needs a Beast field");
+
+// Indexed by Beast field.
+constexpr std::size_t beast_field_count =
+    static_cast<std::size_t>(http::field::xref) + 1;
+
+struct FieldTable {
+  Field fields[beast_field_count];
+
+  constexpr FieldTable() : fields{} {
+    for (auto &field : fields) {
+      field = Field::Unknown;
+    }
+    for (std::size_t i = 0; i < field_count; ++i) {
+      fields[static_cast<std::size_t>(beast_fields[i])] =
+          static_cast<Field>(i);
+    }
+  }
+};
+
+constexpr FieldTable field_table;
+
+}  // namespace
+
+http::field to_beast(Field field) {
+  return beast_fields[static_cast<std::size_t>(field)];
+}
+
+Field from_beast(http::field field) {
+  auto index = static_cast<std::size_t>(field);
+  return index < beast_field_count ? field_table.fields[index]
+                                   : Field::Unknown;
+}
+
+Method to_method(http::verb verb) {
+  return verb <= http::verb::trace ? static_cast<Method>(verb)
+                                   : Method::UNKNOWN;
+}
+
+Request from_beast(BeastRequest const &req) {
+  return Request(
+      RequestLine(to_method(req.method()),
+                  std::string_view(req.target().data(), req.target().length()),
+                  Version(req.version())),
+      MessageBody(req.body()),
+      Headers(&req.base()));
+}
+
+void to_beast(Response &response, BeastResponse &res) {
+  res.result(static_cast<http::status>(response.status_line().status_code()));
+  auto const &headers = response.headers();
+  for (std::size_t i = 0; i < headers.size(); ++i) {
+    auto header = headers.entry(i);
+    boost::beast::string_view value(header.value.data(), header.value.size());
+    boost::beast::string_view name(header.name.data(), header.name.size());
+    if (header.repeated) {
+      res.insert(name, value);
+    } else if (header.field != Field::Unknown) {
+      res.set(to_beast(header.field), value);
+    } else {
+      res.set(name, value);
+    }
+  }
+  auto &payload = response.payload();
+  if (auto body = std::get_if<MessageBody>(&payload)) {
+    res.body().assign(body->str().data(), body->str().size());
+  } else if (auto body = std::get_if<std::string>(&payload)) {
+    res.body() = std::move(*body);
+  }
+}
+
+}  // namespace detail
+
+std::string_view to_string(Field field) {
+  if (field == Field::Unknown) {
+    return {};
+  }
+  auto name = http::to_string(detail::to_beast(field));
+  return std::string_view(name.data(), name.size());
+}
+
+Field to_field(std::string_view name) {
+  return detail::from_beast(http::string_to_field(
+      boost::beast::string_view(name.data(), name.size())));
+}
+}  // namespace apee
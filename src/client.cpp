@@ -0,0 +1,1028 @@
+#include "client.hpp"
+#include "apee.hpp"
+#include "log.hpp"
+#include "recycling_allocator.hpp"
+#include "response_head.hpp"
+#include "timer_wheel.hpp"
+
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <deque>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <tuple>
+
+using tcp = boost::asio::ip::tcp;
+namespace http = boost::beast::http;
+
+namespace apee {
+using namespace logger;
+
+namespace detail {
+
+namespace {
+thread_local boost::asio::io_context *current_context = nullptr;
+}  // namespace
+
+boost::asio::io_context *thread_context() { return current_context; }
+
+void set_thread_context(boost::asio::io_context *context) {
+  current_context = context;
+}
+
+}  // namespace detail
+
+namespace {
+
+using detail::recycling;
+
+using PieceHandler =
+    std::function<void(std::error_code const &ec, std::string_view piece)>;
+
+// Capacity of the read buffer of a connection. Beast reads no more than fits
+// into it at once, and response bodies streamed by Client::stream() are
+// handed out in pieces of up to this size.
+constexpr std::size_t read_size = 64 * 1024;
+
+// A request and where its response goes.
+struct Exchange {
+  ClientRequest request;
+  // Only one of the two is set.
+  Client::Callback on_response;
+  Client::StreamCallback on_header;
+  // The request line and header fields, rendered by render().
+  std::string head;
+  bool chunked = false;
+  // Sent once already on a connection that failed.
+  bool retried = false;
+  // The callback has been called.
+  bool answered = false;
+
+  bool idempotent() const {
+    switch (request.method) {
+      case Method::GET:
+      case Method::HEAD:
+      case Method::PUT:
+      case Method::DELETE:
+      case Method::OPTIONS:
+      case Method::TRACE:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  void fail(std::error_code const &ec) {
+    if (std::exchange(answered, true)) {
+      return;
+    }
+    if (on_response) {
+      on_response(ec, ClientResponse());
+    } else {
+      on_header(ec, ClientResponse(), nullptr);
+    }
+  }
+
+  void render(std::string_view host) {
+    auto method = http::to_string(static_cast<http::verb>(request.method));
+    head.append(method.data(), method.size())
+        .append(" ")
+        .append(request.target)
+        .append(" HTTP/1.1\r\n");
+    bool has_length = false;
+    for (std::size_t i = 0; i < request.headers.size(); ++i) {
+      auto field = request.headers.entry(i);
+      if (field.field == Field::TransferEncoding) {
+        continue;
+      }
+      if (field.field == Field::ContentLength) {
+        // Only a streamed body of known length is sent as given.
+        if (!request.body_stream) {
+          continue;
+        }
+        has_length = true;
+      }
+      detail::append_field(head, field.name, field.value);
+    }
+    if (request.headers[Field::Host].empty()) {
+      detail::append_field(head, "Host", host);
+    }
+    if (request.body_stream) {
+      if (!has_length) {
+        detail::append_field(head, "Transfer-Encoding", "chunked");
+        chunked = true;
+      }
+    } else if (!request.body.empty() || request.method == Method::POST ||
+               request.method == Method::PUT) {
+      detail::append_field(
+          head, "Content-Length", std::to_string(request.body.size()));
+    }
+    head.append("\r\n");
+  }
+};
+
+template <typename Fields>
+void copy_fields(Fields const &fields, ResponseHeaders &headers) {
+  for (auto const &field : fields) {
+    headers.add(
+        std::string_view(field.name_string().data(),
+                         field.name_string().size()),
+        std::string_view(field.value().data(), field.value().size()));
+  }
+}
+
+class UpstreamConnection;
+
+// The connections of one Client to one upstream on one io_context. Requests
+// go to an idle connection, else to a new one while there are fewer than
+// ClientOptions::max_connections_per_host, else are pipelined behind those
+// on the least busy connection if ClientOptions::pipeline_depth allows, and
+// otherwise wait for a connection to finish one.
+class HostPool : public std::enable_shared_from_this<HostPool> {
+ public:
+  HostPool(boost::asio::io_context &context,
+           std::shared_ptr<ClientOptions const> options,
+           std::string host,
+           unsigned short port)
+      : m_context(context),
+        m_options{std::move(options)},
+        m_host{std::move(host)},
+        m_port{std::to_string(port)} {}
+
+  ClientOptions const &options() const { return *m_options; }
+  std::string const &host() const { return m_host; }
+  std::string const &port() const { return m_port; }
+
+  void submit(std::shared_ptr<Exchange> exchange) {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_waiting.push_back(std::move(exchange));
+    dispatch(lock);
+  }
+
+  // Puts exchanges back in front of the waiting ones.
+  void requeue(std::deque<std::shared_ptr<Exchange>> exchanges) {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_waiting.insert(m_waiting.begin(),
+                     std::make_move_iterator(exchanges.begin()),
+                     std::make_move_iterator(exchanges.end()));
+    dispatch(lock);
+  }
+
+  // Called by a connection that finished an exchange. Returns false if the
+  // connection is idle and should close as enough others are.
+  bool released(UpstreamConnection &connection);
+  // Removes a connection that closed and sends `retry` on others.
+  void closed(UpstreamConnection &connection,
+              std::deque<std::shared_ptr<Exchange>> retry);
+  // Removes an idle connection whose idle timeout expired. Returns false if
+  // it was given an exchange meanwhile.
+  bool expire(UpstreamConnection &connection);
+
+  // Drops the connections and waiting exchanges.
+  void shutdown() {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    auto connections = std::move(m_connections);
+    auto waiting = std::move(m_waiting);
+    lock.unlock();
+  }
+
+  // The addresses of the upstream, resolved by the first connection.
+  std::optional<tcp::resolver::results_type> endpoints() {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    return m_endpoints;
+  }
+  void set_endpoints(std::optional<tcp::resolver::results_type> endpoints) {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_endpoints = std::move(endpoints);
+  }
+
+ private:
+  struct Entry {
+    std::shared_ptr<UpstreamConnection> connection;
+    // Exchanges given to the connection and not finished.
+    std::size_t assigned;
+  };
+
+  std::vector<Entry>::iterator find(UpstreamConnection &connection) {
+    return std::find_if(
+        m_connections.begin(), m_connections.end(), [&](Entry const &entry) {
+          return entry.connection.get() == &connection;
+        });
+  }
+
+  // Hands waiting exchanges to connections, unlocking `lock`.
+  void dispatch(std::unique_lock<std::mutex> &lock);
+
+  boost::asio::io_context &m_context;
+  std::shared_ptr<ClientOptions const> m_options;
+  std::string m_host;
+  std::string m_port;
+  std::mutex m_mutex;
+  std::vector<Entry> m_connections;
+  std::deque<std::shared_ptr<Exchange>> m_waiting;
+  std::optional<tcp::resolver::results_type> m_endpoints;
+};
+
+// A keep-alive connection to an upstream, serialised on a strand. Requests
+// are written in order, the response to the first is read while later ones
+// are written; with pipelining several wait for their responses.
+class UpstreamConnection
+    : public std::enable_shared_from_this<UpstreamConnection> {
+  using Strand = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+  // How close() treats the exchanges that were sent.
+  enum class Close {
+    // The upstream announced it with Connection: close, they were not
+    // processed and are sent again.
+    Graceful,
+    // Reading or writing failed, as on a connection the upstream closed
+    // while it was idle. Idempotent ones whose response was not passed on
+    // yet are sent again, once.
+    Stale,
+    // They fail.
+    Failed,
+  };
+
+  // Reads the body of a streamed response for the StreamCallback. Dropped
+  // before the end of the body, it closes the connection, as the next
+  // response cannot be found without reading the rest.
+  class BodyStream {
+   public:
+    BodyStream(std::shared_ptr<UpstreamConnection> connection,
+               std::shared_ptr<Exchange> exchange)
+        : m_connection{std::move(connection)},
+          m_exchange{std::move(exchange)} {}
+
+    ~BodyStream() {
+      auto strand = m_connection->m_strand;
+      boost::asio::post(strand,
+                        [connection = std::move(m_connection),
+                         exchange = std::move(m_exchange)] {
+                          connection->abandon(exchange);
+                        });
+    }
+
+    void read(PieceHandler handler) {
+      boost::asio::post(
+          m_connection->m_strand,
+          recycling([connection = m_connection,
+                     exchange = m_exchange,
+                     handler = std::move(handler)]() mutable {
+            connection->read_body(exchange, std::move(handler));
+          }));
+    }
+
+   private:
+    std::shared_ptr<UpstreamConnection> m_connection;
+    std::shared_ptr<Exchange> m_exchange;
+  };
+
+  char const *m_channel = "http_client";
+  Strand m_strand;
+  tcp::socket m_socket;
+  tcp::resolver m_resolver;
+  TimerWheel &m_wheel;
+  TimerWheel::Timer m_timeout;
+  std::shared_ptr<HostPool> m_pool;
+  // In the order the requests are sent. The response to the first is read
+  // next.
+  std::deque<std::shared_ptr<Exchange>> m_exchanges;
+  // Exchanges whose request is being or has been written.
+  std::size_t m_sent = 0;
+  // Pending operations, the timeout is armed while there are any.
+  bool m_connecting = false;
+  bool m_write_pending = false;
+  bool m_read_pending = false;
+  bool m_connected = false;
+  // A request body is being written.
+  bool m_writing = false;
+  // The response to the first exchange is being read.
+  bool m_reading = false;
+  bool m_closed = false;
+  // Waiting for the socket to become readable, see watch().
+  bool m_watching = false;
+  std::error_code m_error;
+  boost::beast::flat_buffer m_buffer;
+  std::optional<http::response_parser<http::string_body>> m_parser;
+  std::optional<http::response_parser<http::buffer_body>> m_stream_parser;
+  std::string m_piece;
+  // Size line of the request body chunk being written.
+  std::array<char, 20> m_chunk_size;
+
+ public:
+  UpstreamConnection(boost::asio::io_context &context,
+                     std::shared_ptr<HostPool> pool)
+      : m_strand(boost::asio::make_strand(context)),
+        m_socket(m_strand),
+        m_resolver(m_strand),
+        m_wheel(boost::asio::use_service<TimerWheel>(context)),
+        m_pool{std::move(pool)} {
+    m_buffer.reserve(read_size);
+  }
+
+  void start() {
+    m_timeout.bind(weak_from_this(), &UpstreamConnection::expired);
+    boost::asio::post(m_strand,
+                      recycling([self = shared_from_this()] {
+                        self->resolve();
+                      }));
+  }
+
+  // Queues an exchange given by the pool, from any thread.
+  void post(std::shared_ptr<Exchange> exchange) {
+    boost::asio::post(
+        m_strand,
+        recycling([self = shared_from_this(),
+                   exchange = std::move(exchange)]() mutable {
+          self->add(std::move(exchange));
+        }));
+  }
+
+ private:
+  ClientOptions const &options() const { return m_pool->options(); }
+
+  void resolve() {
+    if (m_closed) {
+      return;
+    }
+    m_connecting = true;
+    m_wheel.arm(m_timeout, options().connect_timeout);
+    if (auto endpoints = m_pool->endpoints()) {
+      connect(*endpoints);
+      return;
+    }
+    m_resolver.async_resolve(
+        m_pool->host(),
+        m_pool->port(),
+        recycling([self = shared_from_this()](
+                      boost::beast::error_code ec,
+                      tcp::resolver::results_type endpoints) {
+          if (self->m_closed) {
+            return;
+          }
+          if (ec) {
+            self->m_connecting = false;
+            self->close(ec, Close::Failed);
+            return;
+          }
+          self->m_pool->set_endpoints(endpoints);
+          self->connect(endpoints);
+        }));
+  }
+
+  void connect(tcp::resolver::results_type const &endpoints) {
+    APEE_LOG(m_channel, debug)
+        << "Connecting to " << m_pool->host() << ":" << m_pool->port();
+    boost::asio::async_connect(
+        m_socket,
+        endpoints,
+        recycling([self = shared_from_this()](boost::beast::error_code ec,
+                                              tcp::endpoint const &) {
+          self->m_connecting = false;
+          if (self->m_closed) {
+            return;
+          }
+          if (ec) {
+            // The upstream may have moved.
+            self->m_pool->set_endpoints(std::nullopt);
+            self->close(ec, Close::Failed);
+            return;
+          }
+          self->m_socket.set_option(tcp::no_delay(true), ec);
+          self->m_connected = true;
+          self->pump();
+        }));
+  }
+
+  void add(std::shared_ptr<Exchange> exchange) {
+    if (m_closed) {
+      // Assigned while the connection was closing.
+      m_pool->requeue({std::move(exchange)});
+      return;
+    }
+    m_exchanges.push_back(std::move(exchange));
+    if (m_connected) {
+      pump();
+    }
+  }
+
+  // Starts writing the next request and reading the next response if
+  // neither is in progress.
+  void pump() {
+    if (!m_writing && m_sent < m_exchanges.size()) {
+      write_request();
+    }
+    if (!m_reading && m_sent > 0) {
+      read_response();
+    }
+    update_timeout();
+  }
+
+  void update_timeout() {
+    if (m_connecting) {
+      return;
+    }
+    if (m_write_pending || m_read_pending) {
+      m_wheel.arm(m_timeout, options().io_timeout);
+    } else if (m_exchanges.empty()) {
+      m_wheel.arm(m_timeout, options().idle_timeout);
+      watch();
+    } else {
+      // Waiting for the reader of a streamed body or the source of one.
+      m_wheel.cancel(m_timeout);
+    }
+  }
+
+  // Waits for the socket of an idle connection to become readable, which
+  // means the upstream closed it. It then leaves the pool at once rather
+  // than failing the next request sent on it.
+  void watch() {
+    if (m_watching) {
+      return;
+    }
+    m_watching = true;
+    m_socket.async_wait(
+        tcp::socket::wait_read,
+        recycling([self = shared_from_this()](boost::beast::error_code ec) {
+          self->m_watching = false;
+          // Readable with an exchange means its response arrived.
+          if (!ec && !self->m_closed && self->m_exchanges.empty() &&
+              self->m_pool->expire(*self)) {
+            APEE_LOG(self->m_channel, debug) << "Closed by the upstream";
+            self->close(std::make_error_code(std::errc::connection_reset),
+                        Close::Graceful);
+          }
+        }));
+  }
+
+  void write_request() {
+    auto exchange = m_exchanges[m_sent++];
+    m_writing = true;
+    m_write_pending = true;
+    std::array<boost::asio::const_buffer, 2> buffers{
+        boost::asio::buffer(exchange->head),
+        boost::asio::buffer(exchange->request.body_stream
+                                ? std::string_view()
+                                : exchange->request.body)};
+    boost::asio::async_write(
+        m_socket,
+        buffers,
+        recycling([self = shared_from_this(), exchange](
+                      boost::beast::error_code ec, std::size_t) {
+          self->m_write_pending = false;
+          if (self->m_closed) {
+            return;
+          }
+          if (ec) {
+            self->write_failed();
+          } else if (exchange->request.body_stream) {
+            self->pull_body(exchange);
+          } else {
+            self->m_writing = false;
+            self->pump();
+          }
+        }));
+  }
+
+  // Asks the source of a streamed request body for its next piece, which
+  // is written from where it is.
+  void pull_body(std::shared_ptr<Exchange> const &exchange) {
+    update_timeout();
+    exchange->request.body_stream(
+        [self = shared_from_this(), exchange](std::error_code const &ec,
+                                              std::string_view piece) {
+          boost::asio::dispatch(
+              self->m_strand, recycling([self, exchange, ec, piece] {
+                self->write_body(exchange, ec, piece);
+              }));
+        });
+  }
+
+  void write_body(std::shared_ptr<Exchange> const &exchange,
+                  std::error_code const &ec,
+                  std::string_view piece) {
+    if (m_closed) {
+      return;
+    }
+    if (ec) {
+      // The upstream cannot tell an incomplete body, only closing can.
+      close(ec, Close::Failed);
+      return;
+    }
+    if (piece.empty() && !exchange->chunked) {
+      m_writing = false;
+      pump();
+      return;
+    }
+    std::array<boost::asio::const_buffer, 3> buffers;
+    if (!exchange->chunked) {
+      buffers = {boost::asio::buffer(piece.data(), piece.size())};
+    } else if (piece.empty()) {
+      buffers = {boost::asio::buffer("0\r\n\r\n", 5)};
+    } else {
+      auto end = std::to_chars(m_chunk_size.data(),
+                               m_chunk_size.data() + m_chunk_size.size() - 2,
+                               piece.size(),
+                               16)
+                     .ptr;
+      *end++ = '\r';
+      *end++ = '\n';
+      buffers = {boost::asio::buffer(m_chunk_size.data(),
+                                     end - m_chunk_size.data()),
+                 boost::asio::buffer(piece.data(), piece.size()),
+                 boost::asio::buffer("\r\n", 2)};
+    }
+    m_write_pending = true;
+    update_timeout();
+    boost::asio::async_write(
+        m_socket,
+        buffers,
+        recycling([self = shared_from_this(), exchange, last = piece.empty()](
+                      boost::beast::error_code ec, std::size_t) {
+          self->m_write_pending = false;
+          if (self->m_closed) {
+            return;
+          }
+          if (ec) {
+            self->write_failed();
+          } else if (last) {
+            self->m_writing = false;
+            self->pump();
+          } else {
+            self->pull_body(exchange);
+          }
+        }));
+  }
+
+  // The upstream may have closed the connection after responses that were
+  // not read yet. No more requests are written, m_writing stays set, but
+  // reading goes on until it fails as well.
+  void write_failed() {
+    APEE_LOG(m_channel, debug) << "Writing to " << m_pool->host() << " failed";
+    pump();
+  }
+
+  void read_response() {
+    auto const &exchange = m_exchanges.front();
+    m_reading = true;
+    m_read_pending = true;
+    bool head = exchange->request.method == Method::HEAD;
+    auto self = shared_from_this();
+    if (exchange->on_response) {
+      m_parser.emplace();
+      m_parser->body_limit(options().max_body_size);
+      m_parser->skip(head);
+      http::async_read(
+          m_socket,
+          m_buffer,
+          *m_parser,
+          recycling([self](boost::beast::error_code ec, std::size_t) {
+            self->on_response(ec);
+          }));
+    } else {
+      m_stream_parser.emplace();
+      m_stream_parser->body_limit(std::numeric_limits<std::uint64_t>::max());
+      m_stream_parser->skip(head);
+      http::async_read_header(
+          m_socket,
+          m_buffer,
+          *m_stream_parser,
+          recycling([self](boost::beast::error_code ec, std::size_t) {
+            self->on_header(ec);
+          }));
+    }
+  }
+
+  void on_response(boost::beast::error_code ec) {
+    m_read_pending = false;
+    if (m_closed) {
+      return;
+    }
+    if (ec) {
+      close(ec, Close::Stale);
+      return;
+    }
+    auto &message = m_parser->get();
+    if (message.result_int() < 200) {
+      // An interim response such as 103 Early Hints.
+      read_response();
+      return;
+    }
+    ClientResponse response;
+    response.status = static_cast<StatusCode>(message.result_int());
+    copy_fields(message.base(), response.headers);
+    response.body = std::move(message.body());
+    auto exchange = finish(message.keep_alive());
+    exchange->answered = true;
+    exchange->on_response({}, std::move(response));
+  }
+
+  void on_header(boost::beast::error_code ec) {
+    m_read_pending = false;
+    if (m_closed) {
+      return;
+    }
+    if (ec) {
+      close(ec, Close::Stale);
+      return;
+    }
+    auto &message = m_stream_parser->get();
+    if (message.result_int() < 200) {
+      read_response();
+      return;
+    }
+    ClientResponse response;
+    response.status = static_cast<StatusCode>(message.result_int());
+    copy_fields(message.base(), response.headers);
+    auto exchange = m_exchanges.front();
+    AsyncStreamBody body;
+    if (m_stream_parser->is_done()) {
+      finish(message.keep_alive());
+      body = [](PieceHandler next) { next({}, {}); };
+    } else {
+      update_timeout();
+      auto stream = std::make_shared<BodyStream>(shared_from_this(), exchange);
+      body = [stream](PieceHandler next) { stream->read(std::move(next)); };
+    }
+    exchange->answered = true;
+    exchange->on_header({}, std::move(response), std::move(body));
+  }
+
+  void read_body(std::shared_ptr<Exchange> const &exchange,
+                 PieceHandler handler) {
+    if (m_closed || m_exchanges.empty() || m_exchanges.front() != exchange) {
+      // The body ended already or the connection failed.
+      handler(m_closed ? m_error : std::error_code(), {});
+      return;
+    }
+    if (m_stream_parser->is_done()) {
+      finish(m_stream_parser->get().keep_alive());
+      handler({}, {});
+      return;
+    }
+    m_piece.resize(read_size);
+    auto &body = m_stream_parser->get().body();
+    body.data = m_piece.data();
+    body.size = m_piece.size();
+    body.more = true;
+    m_read_pending = true;
+    update_timeout();
+    http::async_read_some(
+        m_socket,
+        m_buffer,
+        *m_stream_parser,
+        recycling([self = shared_from_this(),
+                   exchange,
+                   handler = std::move(handler)](boost::beast::error_code ec,
+                                                 std::size_t) mutable {
+          self->m_read_pending = false;
+          if (self->m_closed) {
+            handler(self->m_error, {});
+            return;
+          }
+          // A full piece ends the read with need_buffer.
+          if (ec == http::error::need_buffer) {
+            ec = {};
+          }
+          if (ec) {
+            self->close(ec, Close::Failed);
+            handler(ec, {});
+            return;
+          }
+          auto size =
+              self->m_piece.size() - self->m_stream_parser->get().body().size;
+          if (size == 0) {
+            // Only framing was read, e.g. a chunk header, or the body
+            // ended.
+            self->read_body(exchange, std::move(handler));
+            return;
+          }
+          self->update_timeout();
+          handler({}, std::string_view(self->m_piece.data(), size));
+        }));
+  }
+
+  // Closes the connection if the reader of a streamed body was dropped
+  // before its end.
+  void abandon(std::shared_ptr<Exchange> const &exchange) {
+    if (!m_closed && !m_exchanges.empty() && m_exchanges.front() == exchange) {
+      APEE_LOG(m_channel, debug) << "Response body abandoned";
+      close(std::make_error_code(std::errc::operation_canceled), Close::Failed);
+    }
+  }
+
+  // Ends the exchange whose response was read and returns it.
+  std::shared_ptr<Exchange> finish(bool keep_alive) {
+    auto exchange = std::move(m_exchanges.front());
+    m_exchanges.pop_front();
+    --m_sent;
+    m_reading = false;
+    m_parser.reset();
+    m_stream_parser.reset();
+    if (keep_alive && m_pool->released(*this)) {
+      pump();
+    } else {
+      close(std::make_error_code(std::errc::connection_aborted),
+            Close::Graceful);
+    }
+    return exchange;
+  }
+
+  // Closes the socket. Exchanges that may be sent again go back to the
+  // pool, the others fail with `ec`.
+  void close(std::error_code const &ec, Close how) {
+    if (m_closed) {
+      return;
+    }
+    m_closed = true;
+    m_error = ec;
+    m_wheel.cancel(m_timeout);
+    m_resolver.cancel();
+    boost::beast::error_code ignored;
+    m_socket.close(ignored);
+    std::deque<std::shared_ptr<Exchange>> retry;
+    std::vector<std::shared_ptr<Exchange>> failed;
+    for (std::size_t i = 0; i < m_exchanges.size(); ++i) {
+      auto &exchange = m_exchanges[i];
+      bool sent = i < m_sent;
+      bool again = m_connected && !exchange->answered;
+      if (again && sent) {
+        // A body read from its source cannot be sent again.
+        again = !exchange->request.body_stream &&
+                (how == Close::Graceful ||
+                 (how == Close::Stale && exchange->idempotent() &&
+                  !exchange->retried));
+        exchange->retried = exchange->retried || how == Close::Stale;
+      }
+      if (again) {
+        retry.push_back(std::move(exchange));
+      } else {
+        failed.push_back(std::move(exchange));
+      }
+    }
+    m_exchanges.clear();
+    m_sent = 0;
+    if (!retry.empty()) {
+      APEE_LOG(m_channel, debug)
+          << "Retrying " << retry.size() << " request(s) after " << ec;
+    }
+    m_pool->closed(*this, std::move(retry));
+    for (auto &exchange : failed) {
+      exchange->fail(ec);
+    }
+  }
+
+  static void expired(std::shared_ptr<void> const &owner,
+                      std::uint64_t generation) {
+    auto self = std::static_pointer_cast<UpstreamConnection>(owner);
+    boost::asio::post(self->m_strand, recycling([self, generation] {
+                        if (generation == self->m_timeout.generation()) {
+                          self->on_timeout();
+                        }
+                      }));
+  }
+
+  void on_timeout() {
+    if (m_closed) {
+      return;
+    }
+    if (!m_exchanges.empty() || m_connecting) {
+      APEE_LOG(m_channel, warning)
+          << "Request to " << m_pool->host() << " timed out";
+      close(std::make_error_code(std::errc::timed_out), Close::Failed);
+    } else if (m_pool->expire(*this)) {
+      close(std::make_error_code(std::errc::timed_out), Close::Graceful);
+    }
+  }
+};
+
+bool HostPool::released(UpstreamConnection &connection) {
+  std::unique_lock<std::mutex> lock{m_mutex};
+  auto it = find(connection);
+  if (it == m_connections.end()) {
+    return true;
+  }
+  if (--it->assigned == 0 && m_waiting.empty()) {
+    auto idle = std::count_if(
+        m_connections.begin(), m_connections.end(), [](Entry const &entry) {
+          return entry.assigned == 0;
+        });
+    if (static_cast<std::size_t>(idle) > m_options->max_idle_per_host) {
+      m_connections.erase(it);
+      return false;
+    }
+  }
+  dispatch(lock);
+  return true;
+}
+
+void HostPool::closed(UpstreamConnection &connection,
+                      std::deque<std::shared_ptr<Exchange>> retry) {
+  // Destroyed after the lock is released.
+  std::shared_ptr<UpstreamConnection> removed;
+  std::unique_lock<std::mutex> lock{m_mutex};
+  auto it = find(connection);
+  if (it != m_connections.end()) {
+    removed = std::move(it->connection);
+    m_connections.erase(it);
+  }
+  m_waiting.insert(m_waiting.begin(),
+                   std::make_move_iterator(retry.begin()),
+                   std::make_move_iterator(retry.end()));
+  dispatch(lock);
+}
+
+bool HostPool::expire(UpstreamConnection &connection) {
+  std::lock_guard<std::mutex> lock{m_mutex};
+  auto it = find(connection);
+  if (it == m_connections.end()) {
+    return true;
+  }
+  if (it->assigned > 0) {
+    return false;
+  }
+  m_connections.erase(it);
+  return true;
+}
+
+void HostPool::dispatch(std::unique_lock<std::mutex> &lock) {
+  std::vector<
+      std::pair<std::shared_ptr<UpstreamConnection>, std::shared_ptr<Exchange>>>
+      assigned;
+  std::vector<std::shared_ptr<UpstreamConnection>> opened;
+  while (!m_waiting.empty()) {
+    auto &exchange = m_waiting.front();
+    Entry *target = nullptr;
+    for (auto &entry : m_connections) {
+      if (entry.assigned == 0) {
+        target = &entry;
+        break;
+      }
+    }
+    if (!target &&
+        m_connections.size() < std::max<std::size_t>(
+                                   1, m_options->max_connections_per_host)) {
+      m_connections.push_back(Entry{
+          std::make_shared<UpstreamConnection>(m_context, shared_from_this()),
+          0});
+      target = &m_connections.back();
+      opened.push_back(target->connection);
+    }
+    if (!target && !exchange->request.body_stream) {
+      for (auto &entry : m_connections) {
+        if (entry.assigned < m_options->pipeline_depth &&
+            (!target || entry.assigned < target->assigned)) {
+          target = &entry;
+        }
+      }
+    }
+    if (!target) {
+      break;
+    }
+    ++target->assigned;
+    assigned.emplace_back(target->connection, std::move(exchange));
+    m_waiting.pop_front();
+  }
+  lock.unlock();
+  for (auto &connection : opened) {
+    connection->start();
+  }
+  for (auto &[connection, exchange] : assigned) {
+    connection->post(std::move(exchange));
+  }
+}
+
+// The HostPools of the Clients used on one io_context.
+class Upstreams : public boost::asio::execution_context::service {
+ public:
+  static boost::asio::execution_context::id id;
+
+  explicit Upstreams(boost::asio::execution_context &context)
+      : boost::asio::execution_context::service(context),
+        m_context(static_cast<boost::asio::io_context &>(context)) {}
+
+  std::shared_ptr<HostPool> pool(
+      std::uint64_t client,
+      std::shared_ptr<ClientOptions const> const &options,
+      std::string const &host,
+      unsigned short port) {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    auto &pool = m_pools[std::make_tuple(client, host, port)];
+    if (!pool) {
+      pool = std::make_shared<HostPool>(m_context, options, host, port);
+    }
+    return pool;
+  }
+
+ private:
+  void shutdown() override {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    auto pools = std::move(m_pools);
+    lock.unlock();
+    // Breaks the cycles between the pools and their connections.
+    for (auto &entry : pools) {
+      entry.second->shutdown();
+    }
+  }
+
+  boost::asio::io_context &m_context;
+  std::mutex m_mutex;
+  std::map<std::tuple<std::uint64_t, std::string, unsigned short>,
+           std::shared_ptr<HostPool>>
+      m_pools;
+};
+
+boost::asio::execution_context::id Upstreams::id;
+
+}  // namespace
+
+class Client::impl {
+ public:
+  explicit impl(ClientOptions const &options)
+      : m_options{std::make_shared<ClientOptions const>(options)},
+        m_id{next_id.fetch_add(1, std::memory_order_relaxed)} {}
+
+  ~impl() {
+    if (m_context) {
+      m_guard.reset();
+      m_context->stop();
+      m_thread.join();
+    }
+  }
+
+  void submit(std::string const &host,
+              unsigned short port,
+              std::shared_ptr<Exchange> exchange) {
+    exchange->render(port == 80 ? host : host + ":" + std::to_string(port));
+    boost::asio::use_service<Upstreams>(context())
+        .pool(m_id, m_options, host, port)
+        ->submit(std::move(exchange));
+  }
+
+ private:
+  // The context of the calling thread, else the Client's own.
+  boost::asio::io_context &context() {
+    if (auto context = detail::thread_context()) {
+      return *context;
+    }
+    std::lock_guard<std::mutex> lock{m_mutex};
+    if (!m_context) {
+      m_context = std::make_unique<boost::asio::io_context>(1);
+      m_guard.emplace(boost::asio::make_work_guard(*m_context));
+      m_thread = std::thread([context = m_context.get()] { context->run(); });
+    }
+    return *m_context;
+  }
+
+  static std::atomic<std::uint64_t> next_id;
+
+  std::shared_ptr<ClientOptions const> m_options;
+  // Tells the pools of this Client apart from those of others.
+  std::uint64_t m_id;
+  std::mutex m_mutex;
+  std::unique_ptr<boost::asio::io_context> m_context;
+  std::optional<boost::asio::executor_work_guard<
+      boost::asio::io_context::executor_type>>
+      m_guard;
+  std::thread m_thread;
+};
+
+std::atomic<std::uint64_t> Client::impl::next_id{0};
+
+Client::Client(ClientOptions const &options)
+    : d_ptr{std::make_unique<impl>(options)} {}
+
+Client::~Client() = default;
+Client::Client(Client &&) noexcept = default;
+Client &Client::operator=(Client &&) noexcept = default;
+
+void Client::request(std::string const &host,
+                     unsigned short port,
+                     ClientRequest request,
+                     Callback callback) {
+  auto exchange = std::make_shared<Exchange>();
+  exchange->request = std::move(request);
+  exchange->on_response = std::move(callback);
+  d_ptr->submit(host, port, std::move(exchange));
+}
+
+void Client::stream(std::string const &host,
+                    unsigned short port,
+                    ClientRequest request,
+                    StreamCallback callback) {
+  auto exchange = std::make_shared<Exchange>();
+  exchange->request = std::move(request);
+  exchange->on_header = std::move(callback);
+  d_ptr->submit(host, port, std::move(exchange));
+}
+
+}  // namespace apee
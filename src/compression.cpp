@@ -0,0 +1,436 @@
+#include "compression.hpp"
+
+#include <zlib.h>
+
+#ifdef APEE_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+
+namespace apee {
+
+namespace {
+
+// Compressors kept per thread, more are destroyed.
+constexpr std::size_t max_pooled = 8;
+
+// Output space added per step when the output does not fit.
+constexpr std::size_t output_step = 4096;
+
+std::string_view trim(std::string_view value) {
+  while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+    value.remove_prefix(1);
+  }
+  while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+    value.remove_suffix(1);
+  }
+  return value;
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+  return a.size() == b.size() &&
+         std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+           return std::tolower(static_cast<unsigned char>(x)) ==
+                  std::tolower(static_cast<unsigned char>(y));
+         });
+}
+
+// The q-value of an Accept-Encoding element's parameters, 1 if absent.
+double quality(std::string_view parameters) {
+  while (!parameters.empty()) {
+    auto end = std::min(parameters.find(';'), parameters.size());
+    auto parameter = trim(parameters.substr(0, end));
+    if (parameter.size() > 2 && (parameter[0] == 'q' || parameter[0] == 'Q') &&
+        parameter[1] == '=') {
+      // qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] )
+      double q = parameter[2] == '1' ? 1 : 0;
+      double scale = 0.1;
+      auto digits =
+          parameter.substr(std::min(parameter.size(), std::size_t{4}));
+      for (auto c : digits) {
+        if (c < '0' || c > '9') {
+          break;
+        }
+        q += (c - '0') * scale;
+        scale /= 10;
+      }
+      return std::min(q, 1.0);
+    }
+    parameters.remove_prefix(std::min(end + 1, parameters.size()));
+  }
+  return 1;
+}
+
+class Pool {
+  std::vector<Compressor *> m_free;
+
+ public:
+  ~Pool();
+
+  Compressor *take(Encoding encoding, int level) {
+    for (auto it = m_free.begin(); it != m_free.end(); ++it) {
+      if ((*it)->encoding() == encoding && (*it)->level() == level) {
+        auto compressor = *it;
+        m_free.erase(it);
+        return compressor;
+      }
+    }
+    return nullptr;
+  }
+
+  bool put(Compressor *compressor) {
+    if (m_free.size() == max_pooled) {
+      return false;
+    }
+    m_free.push_back(compressor);
+    return true;
+  }
+};
+
+// Compressors released after the pool of the thread was destroyed (during
+// thread exit) are deleted.
+thread_local bool pool_destroyed = false;
+
+Pool &local_pool() {
+  thread_local Pool pool;
+  return pool;
+}
+
+Pool::~Pool() {
+  pool_destroyed = true;
+  for (auto compressor : m_free) {
+    delete compressor;
+  }
+}
+
+#ifdef APEE_HAVE_BROTLI
+
+// Brotli has no way to reset an encoder, a new one is created per stream.
+// Its few large allocations are recycled per thread by size instead.
+struct BrotliBlocks {
+  static constexpr std::size_t max_blocks = 32;
+  // Blocks are prefixed with their size, brotli frees without it.
+  static constexpr std::size_t header = alignof(std::max_align_t);
+
+  std::vector<std::pair<std::size_t, void *>> free;
+
+  ~BrotliBlocks() {
+    for (auto const &block : free) {
+      std::free(block.second);
+    }
+  }
+
+  static void *allocate(void *, std::size_t size) {
+    auto &blocks = local();
+    for (auto it = blocks.free.rbegin(); it != blocks.free.rend(); ++it) {
+      if (it->first == size) {
+        auto p = it->second;
+        blocks.free.erase(std::next(it).base());
+        return static_cast<char *>(p) + header;
+      }
+    }
+    auto p = static_cast<char *>(std::malloc(size + header));
+    if (!p) {
+      return nullptr;
+    }
+    *reinterpret_cast<std::size_t *>(p) = size;
+    return p + header;
+  }
+
+  static void deallocate(void *, void *address) {
+    if (!address) {
+      return;
+    }
+    auto p = static_cast<char *>(address) - header;
+    if (blocks_destroyed) {
+      std::free(p);
+      return;
+    }
+    auto size = *reinterpret_cast<std::size_t *>(p);
+    auto &blocks = local();
+    if (blocks.free.size() == max_blocks) {
+      std::free(blocks.free.front().second);
+      blocks.free.erase(blocks.free.begin());
+    }
+    blocks.free.emplace_back(size, p);
+  }
+
+  static thread_local bool blocks_destroyed;
+
+  static BrotliBlocks &local() {
+    thread_local struct Holder {
+      BrotliBlocks blocks;
+      ~Holder() { blocks_destroyed = true; }
+    } holder;
+    return holder.blocks;
+  }
+};
+
+thread_local bool BrotliBlocks::blocks_destroyed = false;
+
+#endif
+
+}  // namespace
+
+struct Compressor::Codec {
+  z_stream zlib{};
+  bool zlib_initialized = false;
+#ifdef APEE_HAVE_BROTLI
+  BrotliEncoderState *brotli = nullptr;
+#endif
+
+  ~Codec() {
+    if (zlib_initialized) {
+      deflateEnd(&zlib);
+    }
+#ifdef APEE_HAVE_BROTLI
+    if (brotli) {
+      BrotliEncoderDestroyInstance(brotli);
+    }
+#endif
+  }
+};
+
+std::string_view to_string(Encoding encoding) {
+  switch (encoding) {
+    case Encoding::Gzip:
+      return "gzip";
+    case Encoding::Deflate:
+      return "deflate";
+    case Encoding::Brotli:
+      return "br";
+    default:
+      return "identity";
+  }
+}
+
+bool brotli_supported() {
+#ifdef APEE_HAVE_BROTLI
+  return true;
+#else
+  return false;
+#endif
+}
+
+Encoding negotiate(std::string_view accept_encoding,
+                   Compression const &options) {
+  // In order of preference when q-values are equal.
+  Encoding candidates[] = {Encoding::Brotli, Encoding::Gzip, Encoding::Deflate};
+  double qualities[] = {-1, -1, -1};
+  double any = -1;
+  std::size_t pos = 0;
+  while (pos < accept_encoding.size()) {
+    auto end = std::min(accept_encoding.find(',', pos), accept_encoding.size());
+    auto element = trim(accept_encoding.substr(pos, end - pos));
+    auto semicolon = std::min(element.find(';'), element.size());
+    auto coding = trim(element.substr(0, semicolon));
+    auto q = quality(element.substr(std::min(semicolon + 1, element.size())));
+    if (coding == "*") {
+      any = q;
+    }
+    for (std::size_t i = 0; i < std::size(candidates); ++i) {
+      if (iequals(coding, to_string(candidates[i])) ||
+          (candidates[i] == Encoding::Gzip && iequals(coding, "x-gzip"))) {
+        qualities[i] = q;
+      }
+    }
+    pos = end + 1;
+  }
+  auto best = Encoding::Identity;
+  double best_quality = 0;
+  for (std::size_t i = 0; i < std::size(candidates); ++i) {
+    if (candidates[i] == Encoding::Brotli &&
+        (!options.brotli || !brotli_supported())) {
+      continue;
+    }
+    auto q = qualities[i] < 0 ? any : qualities[i];
+    if (q > best_quality) {
+      best = candidates[i];
+      best_quality = q;
+    }
+  }
+  return best;
+}
+
+bool compressible(std::string_view content_type, Compression const &options) {
+  for (auto const &type : options.content_types) {
+    if (content_type.size() >= type.size() &&
+        iequals(content_type.substr(0, type.size()), type)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Compressor::Release::operator()(Compressor *compressor) const noexcept {
+  if (pool_destroyed || !local_pool().put(compressor)) {
+    delete compressor;
+  }
+}
+
+Compressor::Ptr Compressor::acquire(Encoding encoding,
+                                    int level,
+                                    std::size_t size_hint) {
+  auto compressor = local_pool().take(encoding, level);
+  if (!compressor) {
+    compressor = new Compressor(encoding, level);
+  }
+  Ptr ptr{compressor};
+  ptr->reset(size_hint);
+  return ptr;
+}
+
+Compressor::Compressor(Encoding encoding, int level)
+    : m_encoding{encoding}, m_level{level}, m_codec{new Codec} {
+  if (encoding == Encoding::Gzip || encoding == Encoding::Deflate) {
+    // 15 window bits, plus 16 for the gzip wrapper instead of zlib's.
+    int window_bits = encoding == Encoding::Gzip ? 15 + 16 : 15;
+    if (deflateInit2(&m_codec->zlib,
+                     std::clamp(level, 1, 9),
+                     Z_DEFLATED,
+                     window_bits,
+                     8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      throw std::runtime_error("Cannot initialize zlib");
+    }
+    m_codec->zlib_initialized = true;
+  } else if (encoding != Encoding::Brotli || !brotli_supported()) {
+    throw std::invalid_argument("Unsupported encoding");
+  }
+}
+
+Compressor::~Compressor() = default;
+
+void Compressor::reset(std::size_t size_hint) {
+  if (m_codec->zlib_initialized) {
+    deflateReset(&m_codec->zlib);
+    return;
+  }
+#ifdef APEE_HAVE_BROTLI
+  if (m_codec->brotli) {
+    BrotliEncoderDestroyInstance(m_codec->brotli);
+  }
+  m_codec->brotli = BrotliEncoderCreateInstance(
+      &BrotliBlocks::allocate, &BrotliBlocks::deallocate, nullptr);
+  if (!m_codec->brotli) {
+    throw std::bad_alloc();
+  }
+  auto quality = std::clamp(m_level, BROTLI_MIN_QUALITY, BROTLI_MAX_QUALITY);
+  BrotliEncoderSetParameter(m_codec->brotli,
+                            BROTLI_PARAM_QUALITY,
+                            static_cast<std::uint32_t>(quality));
+  if (size_hint > 0) {
+    // A window just large enough for the body saves memory.
+    std::uint32_t window = BROTLI_MIN_WINDOW_BITS;
+    while (window < BROTLI_DEFAULT_WINDOW &&
+           (std::size_t{1} << window) - 16 < size_hint) {
+      ++window;
+    }
+    BrotliEncoderSetParameter(m_codec->brotli, BROTLI_PARAM_LGWIN, window);
+    BrotliEncoderSetParameter(m_codec->brotli,
+                              BROTLI_PARAM_SIZE_HINT,
+                              static_cast<std::uint32_t>(std::min<std::size_t>(
+                                  size_hint, 1u << 30)));
+  }
+#else
+  (void)size_hint;
+#endif
+}
+
+void Compressor::compress(std::string_view input,
+                          bool finish,
+                          std::string &out) {
+  if (m_codec->zlib_initialized) {
+    auto &zlib = m_codec->zlib;
+    zlib.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    zlib.avail_in = static_cast<uInt>(input.size());
+    // Enough space for the whole input in one step.
+    std::size_t room = deflateBound(&zlib, zlib.avail_in) + 16;
+    while (true) {
+      auto used = out.size();
+      out.resize(used + room);
+      zlib.next_out = reinterpret_cast<Bytef *>(&out[used]);
+      zlib.avail_out = static_cast<uInt>(room);
+      auto result = deflate(&zlib, finish ? Z_FINISH : Z_SYNC_FLUSH);
+      out.resize(used + room - zlib.avail_out);
+      if (result == Z_STREAM_END ||
+          (!finish && zlib.avail_out > 0 && zlib.avail_in == 0)) {
+        return;
+      }
+      if (result != Z_OK && result != Z_BUF_ERROR) {
+        throw std::runtime_error("zlib compression failed");
+      }
+      room = output_step;
+    }
+  }
+#ifdef APEE_HAVE_BROTLI
+  auto next_in = reinterpret_cast<std::uint8_t const *>(input.data());
+  auto avail_in = input.size();
+  auto operation = finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_FLUSH;
+  std::size_t room = BrotliEncoderMaxCompressedSize(avail_in);
+  room = room == 0 ? output_step : room;
+  while (true) {
+    auto used = out.size();
+    out.resize(used + room);
+    auto next_out = reinterpret_cast<std::uint8_t *>(&out[used]);
+    auto avail_out = room;
+    if (!BrotliEncoderCompressStream(m_codec->brotli,
+                                     operation,
+                                     &avail_in,
+                                     &next_in,
+                                     &avail_out,
+                                     &next_out,
+                                     nullptr)) {
+      throw std::runtime_error("brotli compression failed");
+    }
+    out.resize(used + room - avail_out);
+    if (avail_in == 0 && !BrotliEncoderHasMoreOutput(m_codec->brotli) &&
+        (!finish || BrotliEncoderIsFinished(m_codec->brotli))) {
+      return;
+    }
+    room = output_step;
+  }
+#endif
+}
+
+std::shared_ptr<std::string const> VariantCache::find(std::string_view key) {
+  std::lock_guard<std::mutex> lock{m_mutex};
+  auto it = m_index.find(key);
+  if (it == m_index.end()) {
+    return nullptr;
+  }
+  m_lru.splice(m_lru.begin(), m_lru, it->second);
+  return it->second->second;
+}
+
+void VariantCache::insert(std::string_view key,
+                          std::shared_ptr<std::string const> body) {
+  auto size = key.size() + body->size();
+  if (size > m_budget) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock{m_mutex};
+  auto it = m_index.find(key);
+  if (it != m_index.end()) {
+    m_size -= it->second->first.size() + it->second->second->size();
+    m_lru.erase(it->second);
+    m_index.erase(it);
+  }
+  m_lru.emplace_front(std::string(key), std::move(body));
+  m_index.emplace(m_lru.front().first, m_lru.begin());
+  m_size += size;
+  while (m_size > m_budget) {
+    auto &last = m_lru.back();
+    m_size -= last.first.size() + last.second->size();
+    m_index.erase(last.first);
+    m_lru.pop_back();
+  }
+}
+
+}  // namespace apee
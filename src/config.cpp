@@ -0,0 +1,171 @@
+#include "apee.hpp"
+
+#include <stdexcept>
+
+#ifdef APEE_HAVE_YAML_CPP
+#include <yaml-cpp/yaml.h>
+#endif
+
+namespace apee {
+
+#ifdef APEE_HAVE_YAML_CPP
+
+namespace {
+
+template <typename T>
+void read(YAML::Node const &node, char const *key, T &value) {
+  if (auto child = node[key]) {
+    value = child.as<T>();
+  }
+}
+
+void read(YAML::Node const &node,
+          char const *key,
+          std::chrono::milliseconds &value) {
+  if (auto child = node[key]) {
+    value = std::chrono::milliseconds(child.as<std::int64_t>());
+  }
+}
+
+Threading::Mode to_mode(std::string const &mode) {
+  if (mode == "single") {
+    return Threading::Mode::Single;
+  }
+  if (mode == "shared_context") {
+    return Threading::Mode::SharedContext;
+  }
+  if (mode == "context_per_thread") {
+    return Threading::Mode::ContextPerThread;
+  }
+  throw std::runtime_error("Unknown threading mode '" + mode + "'");
+}
+
+Admission::Limit to_limit(std::string const &limit) {
+  if (limit == "fixed") {
+    return Admission::Limit::Fixed;
+  }
+  if (limit == "aimd") {
+    return Admission::Limit::Aimd;
+  }
+  if (limit == "gradient") {
+    return Admission::Limit::Gradient;
+  }
+  throw std::runtime_error("Unknown admission limit '" + limit + "'");
+}
+
+}  // namespace
+
+Config Config::from_yaml(std::string const &path) {
+  YAML::Node root;
+  try {
+    root = YAML::LoadFile(path);
+  } catch (YAML::Exception const &e) {
+    throw std::runtime_error(path + ": " + e.what());
+  }
+  Config config;
+  try {
+    read(root, "address", config.address);
+    read(root, "port", config.port);
+    read(root, "server_name", config.server_name);
+    if (auto threading = root["threading"]) {
+      if (auto mode = threading["mode"]) {
+        config.threading.mode = to_mode(mode.as<std::string>());
+      }
+      read(threading, "threads", config.threading.threads);
+      read(threading, "pin_threads", config.threading.pin_threads);
+      read(threading, "workers", config.threading.workers);
+    }
+    if (auto timeouts = root["timeouts"]) {
+      read(timeouts, "idle", config.timeouts.idle);
+      read(timeouts, "header", config.timeouts.header);
+      read(timeouts, "read", config.timeouts.read);
+      read(timeouts, "write", config.timeouts.write);
+    }
+    if (auto caching = root["caching"]) {
+      read(caching, "memory_budget", config.caching.memory_budget);
+      read(caching, "shards", config.caching.shards);
+      read(caching, "key_headers", config.caching.key_headers);
+      read(caching, "default_ttl", config.caching.default_ttl);
+      read(caching, "max_entry_size", config.caching.max_entry_size);
+      read(caching, "etags", config.caching.etags);
+    }
+    if (auto compression = root["compression"]) {
+      auto &options = config.compression;
+      read(compression, "enabled", options.enabled);
+      read(compression, "level", options.level);
+      read(compression, "brotli", options.brotli);
+      read(compression, "brotli_quality", options.brotli_quality);
+      read(compression, "min_size", options.min_size);
+      read(compression, "content_types", options.content_types);
+      read(compression, "variant_cache_size", options.variant_cache_size);
+    }
+    if (auto admission = root["admission"]) {
+      auto &options = config.admission;
+      read(admission, "max_connections", options.max_connections);
+      read(admission, "max_in_flight", options.max_in_flight);
+      if (auto limit = admission["limit"]) {
+        options.limit = to_limit(limit.as<std::string>());
+      }
+      read(admission, "initial_limit", options.initial_limit);
+      read(admission, "min_limit", options.min_limit);
+      read(admission, "latency_threshold", options.latency_threshold);
+      read(admission, "retry_after", options.retry_after);
+    }
+    if (auto rate_limit = root["rate_limit"]) {
+      auto &options = config.rate_limit;
+      read(rate_limit, "rate", options.rate);
+      read(rate_limit, "burst", options.burst);
+      read(rate_limit, "header", options.header);
+      read(rate_limit, "per_path", options.per_path);
+      read(rate_limit, "max_keys", options.max_keys);
+      read(rate_limit, "shards", options.shards);
+    }
+    if (auto io_uring = root["io_uring"]) {
+      auto &options = config.io_uring;
+      read(io_uring, "enabled", options.enabled);
+      read(io_uring, "entries", options.entries);
+      read(io_uring, "registered_buffers", options.registered_buffers);
+    }
+    if (auto http2 = root["http2"]) {
+      auto &options = config.http2;
+      read(http2, "enabled", options.enabled);
+      read(http2, "max_concurrent_streams", options.max_concurrent_streams);
+      read(http2, "stream_window_size", options.stream_window_size);
+      read(http2, "connection_window_size", options.connection_window_size);
+      read(http2, "max_frame_size", options.max_frame_size);
+      read(http2, "header_table_size", options.header_table_size);
+    }
+    read(root, "backlog", config.backlog);
+    read(root, "tcp_nodelay", config.tcp_nodelay);
+    read(root, "receive_buffer_size", config.receive_buffer_size);
+    read(root, "send_buffer_size", config.send_buffer_size);
+    read(root, "defer_accept", config.defer_accept);
+    read(root, "fast_open_queue", config.fast_open_queue);
+    read(root, "read_buffer_size", config.read_buffer_size);
+    read(root, "max_header_size", config.max_header_size);
+    read(root, "max_body_size", config.max_body_size);
+    read(root, "max_streamed_body_size", config.max_streamed_body_size);
+    read(root, "require_content_length", config.require_content_length);
+    read(root,
+         "max_requests_per_connection",
+         config.max_requests_per_connection);
+    read(root, "metrics_path", config.metrics_path);
+    read(root, "stop_on_signals", config.stop_on_signals);
+    read(root, "drain_timeout", config.drain_timeout);
+    read(root, "handoff_path", config.handoff_path);
+  } catch (YAML::Exception const &e) {
+    throw std::runtime_error(path + ": " + e.what());
+  }
+  return config;
+}
+
+#else
+
+Config Config::from_yaml(std::string const &path) {
+  throw std::runtime_error("Cannot read " + path +
+                           ": apee was built without yaml-cpp");
+}
+
+#endif
+
+}  // namespace apee
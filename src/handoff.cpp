@@ -0,0 +1,151 @@
+#include "handoff.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace apee {
+namespace detail {
+
+namespace {
+
+// First fd passed by socket activation, SD_LISTEN_FDS_START of systemd.
+constexpr int first_activated_fd = 3;
+
+// How long the new process waits for the old one to answer.
+constexpr int receive_timeout_seconds = 5;
+
+class Fd {
+  int m_fd;
+
+ public:
+  explicit Fd(int fd) : m_fd{fd} {}
+  ~Fd() {
+    if (m_fd >= 0) {
+      ::close(m_fd);
+    }
+  }
+  Fd(Fd const &) = delete;
+  Fd &operator=(Fd const &) = delete;
+
+  int get() const { return m_fd; }
+};
+
+}  // namespace
+
+std::vector<int> activated_fds() {
+  char const *pid = std::getenv("LISTEN_PID");
+  char const *count = std::getenv("LISTEN_FDS");
+  std::vector<int> fds;
+  if (pid == nullptr || count == nullptr ||
+      std::strtol(pid, nullptr, 10) != ::getpid()) {
+    return fds;
+  }
+  auto n = std::strtol(count, nullptr, 10);
+  for (long i = 0; i < n && fds.size() < max_handoff_fds; ++i) {
+    int fd = first_activated_fd + static_cast<int>(i);
+    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fds.push_back(fd);
+  }
+  ::unsetenv("LISTEN_PID");
+  ::unsetenv("LISTEN_FDS");
+  return fds;
+}
+
+std::vector<int> receive_fds(std::string const &path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    throw std::system_error(
+        ENAMETOOLONG, std::system_category(), "Handoff socket " + path);
+  }
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  Fd socket{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+  if (socket.get() < 0) {
+    throw std::system_error(errno, std::system_category(), "socket");
+  }
+  if (::connect(socket.get(),
+                reinterpret_cast<sockaddr const *>(&address),
+                sizeof(address)) != 0) {
+    // No file or a stale one left by a process that is gone.
+    return {};
+  }
+  timeval timeout{receive_timeout_seconds, 0};
+  ::setsockopt(
+      socket.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  char count = 0;
+  iovec iov{&count, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * max_handoff_fds)];
+  msghdr message{};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t received;
+  do {
+    received = ::recvmsg(socket.get(), &message, MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+  if (received < 0) {
+    throw std::system_error(
+        errno, std::system_category(), "Receiving sockets from " + path);
+  }
+  std::vector<int> fds;
+  for (auto header = CMSG_FIRSTHDR(&message); header != nullptr;
+       header = CMSG_NXTHDR(&message, header)) {
+    if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    auto n = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    auto data = CMSG_DATA(header);
+    for (std::size_t i = 0; i < n; ++i) {
+      int fd;
+      std::memcpy(&fd, data + i * sizeof(int), sizeof(int));
+      fds.push_back(fd);
+    }
+  }
+  if (received != 1 || (message.msg_flags & MSG_CTRUNC) != 0 ||
+      fds.size() != static_cast<unsigned char>(count)) {
+    for (int fd : fds) {
+      ::close(fd);
+    }
+    throw std::system_error(
+        EPROTO, std::system_category(), "Receiving sockets from " + path);
+  }
+  return fds;
+}
+
+bool send_fds(int socket, std::vector<int> const &fds) {
+  if (fds.empty() || fds.size() > max_handoff_fds) {
+    errno = EINVAL;
+    return false;
+  }
+  // The count lets the receiver tell a truncated transfer apart.
+  char count = static_cast<char>(fds.size());
+  iovec iov{&count, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * max_handoff_fds)];
+  msghdr message{};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+  auto header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+  std::memcpy(CMSG_DATA(header), fds.data(), sizeof(int) * fds.size());
+  ssize_t sent;
+  do {
+    sent = ::sendmsg(socket, &message, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  return sent == 1;
+}
+
+}  // namespace detail
+}  // namespace apee
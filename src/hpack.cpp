@@ -0,0 +1,513 @@
+#include "hpack.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+
+namespace apee {
+namespace detail {
+
+namespace {
+
+// The static table of RFC 7541, appendix A. Index 1 is the first entry.
+constexpr HpackTable::Field static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+constexpr std::size_t static_count = std::size(static_table);
+
+// Fields indexed from the dynamic table come after the static ones.
+constexpr std::size_t dynamic_base = static_count + 1;
+
+// Encoders never use a larger dynamic table, whatever the peer allows.
+constexpr std::size_t max_encoder_table_size = 4096;
+
+// Lengths of the codes of the symbols 0 to 255 and 256 (EOS) in the
+// Huffman code of RFC 7541, appendix B. The code is canonical: codes of
+// the same length are consecutive in symbol order and shorter codes come
+// first, so the codes follow from the lengths.
+constexpr std::uint8_t huffman_lengths[] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28, 28, 28, 28,
+    28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28, 6, 10, 10, 12, 13, 6, 8,
+    11, 10, 10, 8, 11, 8, 6, 6, 6, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6,
+    12, 10, 13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 8, 7, 8, 13, 19, 13, 14, 6, 15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6,
+    6, 5, 6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28, 20, 22, 20, 20,
+    22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23, 24, 24, 22, 23, 24, 23, 23,
+    23, 23, 21, 22, 23, 22, 23, 23, 24, 22, 21, 20, 22, 22, 23, 23, 21, 23, 22,
+    22, 24, 21, 22, 23, 23, 21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23,
+    22, 22, 23, 26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27, 20, 24, 20,
+    21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23, 26, 27, 26, 26, 27, 27,
+    27, 27, 27, 28, 27, 27, 27, 27, 27, 26, 30};
+constexpr std::size_t huffman_symbols = std::size(huffman_lengths);
+constexpr std::size_t max_code_length = 30;
+
+struct HuffmanTable {
+  // Code of every symbol, right-aligned.
+  std::uint32_t codes[huffman_symbols];
+  // Per length, the first code and the first code past the codes of that
+  // length, and the index of the first symbol of that length in `sorted`.
+  std::uint32_t first[max_code_length + 1];
+  std::uint32_t limit[max_code_length + 1];
+  std::uint16_t offset[max_code_length + 1];
+  // The symbols ordered by code.
+  std::uint16_t sorted[huffman_symbols];
+
+  constexpr HuffmanTable() : codes{}, first{}, limit{}, offset{}, sorted{} {
+    std::uint32_t code = 0;
+    std::uint16_t index = 0;
+    for (std::size_t length = 1; length <= max_code_length; ++length) {
+      first[length] = code;
+      offset[length] = index;
+      for (std::size_t symbol = 0; symbol < huffman_symbols; ++symbol) {
+        if (huffman_lengths[symbol] == length) {
+          codes[symbol] = code++;
+          sorted[index++] = static_cast<std::uint16_t>(symbol);
+        }
+      }
+      limit[length] = code;
+      code <<= 1;
+    }
+  }
+};
+
+constexpr HuffmanTable huffman_table;
+
+// Index of the first entry of the static table named `name`, 0 if none is.
+std::size_t static_name(std::string_view name) {
+  static auto const names = [] {
+    std::unordered_map<std::string_view, std::size_t> names;
+    for (std::size_t i = static_count; i > 0; --i) {
+      names[static_table[i - 1].name] = i;
+    }
+    return names;
+  }();
+  auto it = names.find(name);
+  return it == names.end() ? 0 : it->second;
+}
+
+// Appends `value` with a prefix of `bits` bits, the rest of the first
+// byte being `flags` (RFC 7541, section 5.1).
+void write_integer(std::string &out,
+                   std::uint8_t flags,
+                   unsigned int bits,
+                   std::uint64_t value) {
+  std::uint64_t max = (1u << bits) - 1;
+  if (value < max) {
+    out.push_back(static_cast<char>(flags | value));
+    return;
+  }
+  out.push_back(static_cast<char>(flags | max));
+  value -= max;
+  while (value >= 128) {
+    out.push_back(static_cast<char>(0x80 | (value & 0x7f)));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+bool read_integer(std::string_view &block,
+                  unsigned int bits,
+                  std::uint64_t &value) {
+  std::uint64_t max = (1u << bits) - 1;
+  value = static_cast<std::uint8_t>(block.front()) & max;
+  block.remove_prefix(1);
+  if (value < max) {
+    return true;
+  }
+  for (unsigned int shift = 0; !block.empty(); shift += 7) {
+    // Nothing in a header block needs more than 32 bits.
+    if (shift > 28) {
+      return false;
+    }
+    auto byte = static_cast<std::uint8_t>(block.front());
+    block.remove_prefix(1);
+    value += static_cast<std::uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Appends a string literal, Huffman-encoded if that is shorter.
+void write_string(std::string &out, std::string_view text) {
+  auto size = huffman_size(text);
+  if (size < text.size()) {
+    write_integer(out, 0x80, 7, size);
+    huffman_encode(out, text);
+  } else {
+    write_integer(out, 0, 7, text.size());
+    out.append(text);
+  }
+}
+
+}  // namespace
+
+HpackTable::Field HpackTable::operator[](std::size_t index) const {
+  auto const &entry = m_ring[(m_first + index) % m_ring.size()];
+  return {entry.name, entry.value};
+}
+
+void HpackTable::add(std::string_view name, std::string_view value) {
+  auto size = name.size() + value.size() + 32;
+  while (m_count > 0 && m_size + size > m_max_size) {
+    evict();
+  }
+  if (size > m_max_size) {
+    return;
+  }
+  if (m_count == m_ring.size()) {
+    // The ring grows by a slot in front of the newest entry.
+    std::rotate(m_ring.begin(), m_ring.begin() + m_first, m_ring.end());
+    m_ring.emplace(m_ring.begin());
+    m_first = 0;
+  } else {
+    m_first = (m_first + m_ring.size() - 1) % m_ring.size();
+  }
+  auto &entry = m_ring[m_first];
+  entry.name.assign(name);
+  entry.value.assign(value);
+  ++m_count;
+  m_size += size;
+}
+
+void HpackTable::resize(std::size_t max_size) {
+  m_max_size = max_size;
+  while (m_size > m_max_size) {
+    evict();
+  }
+}
+
+void HpackTable::clear() {
+  m_count = 0;
+  m_size = 0;
+}
+
+void HpackTable::evict() {
+  auto const &entry = m_ring[(m_first + m_count - 1) % m_ring.size()];
+  m_size -= entry.name.size() + entry.value.size() + 32;
+  --m_count;
+}
+
+void HpackDecoder::reset(std::size_t max_table_size) {
+  m_max_table_size = max_table_size;
+  m_table.clear();
+  m_table.resize(max_table_size);
+}
+
+bool HpackDecoder::decode(std::string_view block, FieldHandler const &field) {
+  // Table size updates are only allowed ahead of the first field.
+  bool first = true;
+  while (!block.empty()) {
+    auto byte = static_cast<std::uint8_t>(block.front());
+    std::uint64_t index = 0;
+    if (byte & 0x80) {
+      HpackTable::Field indexed;
+      if (!read_integer(block, 7, index) || !lookup(index, indexed)) {
+        return false;
+      }
+      field(indexed.name, indexed.value);
+      first = false;
+      continue;
+    }
+    if ((byte & 0xe0) == 0x20) {
+      if (!first || !read_integer(block, 5, index) ||
+          index > m_max_table_size) {
+        return false;
+      }
+      m_table.resize(index);
+      continue;
+    }
+    // A literal, added to the table or not.
+    bool add = byte & 0x40;
+    if (!read_integer(block, add ? 6 : 4, index)) {
+      return false;
+    }
+    std::string_view name;
+    std::string_view value;
+    if (index == 0) {
+      if (block.empty() || !read_string(block, m_name, name)) {
+        return false;
+      }
+    } else {
+      HpackTable::Field indexed;
+      if (!lookup(index, indexed)) {
+        return false;
+      }
+      name = indexed.name;
+      if (add && index >= dynamic_base) {
+        // Adding the field may evict the entry the name is taken from.
+        m_name.assign(name);
+        name = m_name;
+      }
+    }
+    if (block.empty() || !read_string(block, m_value, value)) {
+      return false;
+    }
+    field(name, value);
+    if (add) {
+      m_table.add(name, value);
+    }
+    first = false;
+  }
+  return true;
+}
+
+bool HpackDecoder::read_string(std::string_view &block,
+                               std::string &scratch,
+                               std::string_view &text) {
+  bool huffman = static_cast<std::uint8_t>(block.front()) & 0x80;
+  std::uint64_t size = 0;
+  if (!read_integer(block, 7, size) || size > block.size()) {
+    return false;
+  }
+  auto data = block.substr(0, size);
+  block.remove_prefix(size);
+  if (!huffman) {
+    text = data;
+    return true;
+  }
+  scratch.clear();
+  if (!huffman_decode(scratch, data)) {
+    return false;
+  }
+  text = scratch;
+  return true;
+}
+
+bool HpackDecoder::lookup(std::uint64_t index, HpackTable::Field &field) const {
+  if (index == 0) {
+    return false;
+  }
+  if (index < dynamic_base) {
+    field = static_table[index - 1];
+    return true;
+  }
+  if (index - dynamic_base >= m_table.count()) {
+    return false;
+  }
+  field = m_table[index - dynamic_base];
+  return true;
+}
+
+void HpackEncoder::reset() {
+  m_table.clear();
+  m_table.resize(max_encoder_table_size);
+  m_resized = false;
+}
+
+void HpackEncoder::set_max_table_size(std::size_t size) {
+  size = std::min(size, max_encoder_table_size);
+  if (size != m_table.max_size()) {
+    m_table.resize(size);
+    m_resized = true;
+  }
+}
+
+void HpackEncoder::begin(std::string &out) {
+  if (m_resized) {
+    m_resized = false;
+    write_integer(out, 0x20, 5, m_table.max_size());
+  }
+}
+
+void HpackEncoder::encode_status(std::string &out, unsigned int status) {
+  // The static table has 200, 204, 206, 304, 400, 404 and 500.
+  static constexpr unsigned int indexed[] = {200, 204, 206, 304, 400, 404, 500};
+  constexpr std::size_t first = 8;
+  auto it = std::find(std::begin(indexed), std::end(indexed), status);
+  if (it != std::end(indexed)) {
+    begin(out);
+    write_integer(out, 0x80, 7, first + (it - std::begin(indexed)));
+    return;
+  }
+  char digits[3] = {static_cast<char>('0' + status / 100 % 10),
+                    static_cast<char>('0' + status / 10 % 10),
+                    static_cast<char>('0' + status % 10)};
+  encode(out, ":status", std::string_view(digits, sizeof(digits)));
+}
+
+void HpackEncoder::encode(std::string &out,
+                          std::string_view name,
+                          std::string_view value) {
+  begin(out);
+  m_name.assign(name);
+  std::transform(m_name.begin(), m_name.end(), m_name.begin(), [](char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+  });
+  std::size_t name_index = 0;
+  for (std::size_t i = 0; i < m_table.count(); ++i) {
+    auto entry = m_table[i];
+    if (entry.name == m_name) {
+      if (entry.value == value) {
+        write_integer(out, 0x80, 7, dynamic_base + i);
+        return;
+      }
+      if (name_index == 0) {
+        name_index = dynamic_base + i;
+      }
+    }
+  }
+  if (auto index = static_name(m_name)) {
+    for (auto i = index;
+         i <= static_count && static_table[i - 1].name == m_name;
+         ++i) {
+      if (static_table[i - 1].value == value) {
+        write_integer(out, 0x80, 7, i);
+        return;
+      }
+    }
+    name_index = index;
+  }
+  // Values that differ from response to response are not worth a place in
+  // the table, cookies are kept out of it and of any intermediary's.
+  bool never = m_name == "set-cookie";
+  bool add = !never && m_name != "content-length" &&
+             m_name != "content-range" && m_name != "etag" &&
+             m_name != "last-modified" && m_name != "location" &&
+             m_name.size() + value.size() + 32 <= m_table.max_size() / 2;
+  std::uint8_t flags = add ? 0x40 : never ? 0x10 : 0;
+  unsigned int bits = add ? 6 : 4;
+  if (name_index > 0) {
+    write_integer(out, flags, bits, name_index);
+  } else {
+    out.push_back(static_cast<char>(flags));
+    write_string(out, m_name);
+  }
+  write_string(out, value);
+  if (add) {
+    m_table.add(m_name, value);
+  }
+}
+
+void huffman_encode(std::string &out, std::string_view text) {
+  std::uint64_t bits = 0;
+  unsigned int count = 0;
+  for (auto c : text) {
+    auto symbol = static_cast<std::uint8_t>(c);
+    bits = bits << huffman_lengths[symbol] | huffman_table.codes[symbol];
+    count += huffman_lengths[symbol];
+    while (count >= 8) {
+      count -= 8;
+      out.push_back(static_cast<char>(bits >> count));
+    }
+  }
+  if (count > 0) {
+    // Padded with the most significant bits of EOS, which are all ones.
+    out.push_back(static_cast<char>(bits << (8 - count) | 0xff >> count));
+  }
+}
+
+std::size_t huffman_size(std::string_view text) {
+  std::size_t bits = 0;
+  for (auto c : text) {
+    bits += huffman_lengths[static_cast<std::uint8_t>(c)];
+  }
+  return (bits + 7) / 8;
+}
+
+bool huffman_decode(std::string &out, std::string_view data) {
+  // The next bits of `data`, most significant first.
+  std::uint64_t bits = 0;
+  unsigned int available = 0;
+  std::size_t next = 0;
+  for (;;) {
+    while (available <= 56 && next < data.size()) {
+      auto byte = static_cast<std::uint8_t>(data[next++]);
+      bits |= static_cast<std::uint64_t>(byte) << (56 - available);
+      available += 8;
+    }
+    if (available == 0) {
+      return true;
+    }
+    // Past the end of the data the code is padded with ones.
+    auto peek = static_cast<std::uint32_t>(bits >> 32);
+    if (available < 32) {
+      peek |= UINT32_MAX >> available;
+    }
+    std::size_t length = 5;
+    while (length < max_code_length &&
+           peek >> (32 - length) >= huffman_table.limit[length]) {
+      ++length;
+    }
+    if (length > available) {
+      // Only the padding is left: at most 7 bits, all of them ones.
+      return available <= 7 && peek >> (32 - available) ==
+                                   (std::uint32_t{1} << available) - 1;
+    }
+    auto code = peek >> (32 - length);
+    auto symbol = huffman_table.sorted[huffman_table.offset[length] + code -
+                                       huffman_table.first[length]];
+    if (symbol == huffman_symbols - 1) {
+      // EOS must not appear in a string.
+      return false;
+    }
+    out.push_back(static_cast<char>(symbol));
+    bits <<= length;
+    available -= static_cast<unsigned int>(length);
+  }
+}
+
+}  // namespace detail
+}  // namespace apee
@@ -0,0 +1,1170 @@
+#include "http2.hpp"
+
+#include <algorithm>
+
+namespace apee {
+namespace detail {
+
+namespace {
+
+// Frame types (RFC 9113, section 6).
+enum : std::uint8_t {
+  data_frame = 0x0,
+  headers_frame = 0x1,
+  priority_frame = 0x2,
+  rst_stream_frame = 0x3,
+  settings_frame = 0x4,
+  push_promise_frame = 0x5,
+  ping_frame = 0x6,
+  goaway_frame = 0x7,
+  window_update_frame = 0x8,
+  continuation_frame = 0x9
+};
+
+// Frame flags.
+enum : std::uint8_t {
+  end_stream_flag = 0x1,
+  ack_flag = 0x1,
+  end_headers_flag = 0x4,
+  padded_flag = 0x8,
+  priority_flag = 0x20
+};
+
+// Setting identifiers (RFC 9113, section 6.5.2).
+enum : std::uint16_t {
+  header_table_size_setting = 0x1,
+  enable_push_setting = 0x2,
+  max_concurrent_streams_setting = 0x3,
+  initial_window_size_setting = 0x4,
+  max_frame_size_setting = 0x5,
+  max_header_list_size_setting = 0x6
+};
+
+constexpr std::int64_t max_window = 0x7fffffff;
+constexpr std::uint32_t default_window = 65535;
+constexpr std::uint32_t default_frame_size = 16384;
+
+std::uint32_t read32(char const *data) {
+  auto bytes = reinterpret_cast<unsigned char const *>(data);
+  return std::uint32_t(bytes[0]) << 24 | std::uint32_t(bytes[1]) << 16 |
+         std::uint32_t(bytes[2]) << 8 | bytes[3];
+}
+
+void write32(std::string &out, std::uint32_t value) {
+  out.push_back(char(value >> 24));
+  out.push_back(char(value >> 16));
+  out.push_back(char(value >> 8));
+  out.push_back(char(value));
+}
+
+// Whether `name` may name a regular field of a request: a lower-case token
+// that does not only apply to one HTTP/1 connection (RFC 9113, section
+// 8.2).
+bool valid_field_name(std::string_view name) {
+  for (char c : name) {
+    if (c <= ' ' || c >= '\x7f' || (c >= 'A' && c <= 'Z') || c == ':') {
+      return false;
+    }
+  }
+  return name != "connection" && name != "keep-alive" &&
+         name != "proxy-connection" && name != "transfer-encoding" &&
+         name != "upgrade";
+}
+
+bool valid_field_value(std::string_view value) {
+  return value.find_first_of(std::string_view("\0\r\n", 3)) ==
+         std::string_view::npos;
+}
+
+}  // namespace
+
+struct Http2Session::Stream {
+  std::uint32_t id = 0;
+  // Opened by a request, otherwise an idle stream that only anchors others
+  // in the priority tree.
+  bool opened = false;
+  bool remote_closed = false;
+  bool local_closed = false;
+  // The final response header has been sent.
+  bool final_sent = false;
+
+  std::int64_t send_window = 0;
+  std::int64_t receive_window = 0;
+  // Bytes consumed and not yet given back in a WINDOW_UPDATE.
+  std::uint64_t unacked = 0;
+  std::int64_t content_length = -1;
+  std::uint64_t received = 0;
+
+  // The body data passed to send_data() and not yet framed.
+  std::string_view pending;
+  bool has_data = false;
+  bool end = false;
+
+  // The node in the priority tree. Siblings share their parent's bandwidth
+  // in proportion to their weights: each has a pass, advanced by the bytes
+  // it sends divided by its weight, and the active one with the lowest pass
+  // goes next. `vtime` is the pass of the child that went last, from which
+  // a child that becomes active starts. `active` counts the ready streams
+  // in the subtree.
+  Stream *parent = nullptr;
+  std::vector<Stream *> children;
+  std::uint16_t weight = 16;
+  std::uint64_t pass = 0;
+  std::uint64_t vtime = 0;
+  std::ptrdiff_t active = 0;
+  // Has a frame to send.
+  bool ready = false;
+};
+
+Http2Session::Http2Session() : m_root{std::make_unique<Stream>()} {}
+
+Http2Session::~Http2Session() = default;
+
+void Http2Session::start(Handler &handler,
+                         Http2Settings const &settings,
+                         std::string_view preface) {
+  m_handler = &handler;
+  m_settings = settings;
+  m_decoder.reset(settings.header_table_size);
+  m_encoder.reset();
+  m_input = preface.empty() ? Input::Header : Input::Preface;
+  m_preface = preface;
+  m_head_size = 0;
+  m_block_stream = 0;
+  m_out_stream = 0;
+  m_output.clear();
+  m_finished.clear();
+  while (!m_streams.empty()) {
+    m_free.push_back(std::move(m_streams.back()));
+    m_streams.pop_back();
+  }
+  m_root->children.clear();
+  m_root->active = 0;
+  m_root->vtime = 0;
+  m_open = 0;
+  m_idle = 0;
+  m_last_stream = 0;
+  m_send_window = default_window;
+  m_receive_window = settings.connection_window_size;
+  m_unacked = 0;
+  m_peer_window = default_window;
+  m_peer_max_frame = default_frame_size;
+  m_settings_received = false;
+  m_goaway_sent = false;
+  m_goaway_received = false;
+  m_failed = false;
+
+  std::pair<std::uint16_t, std::uint32_t> values[5];
+  std::size_t count = 0;
+  values[count++] = {max_concurrent_streams_setting,
+                     settings.max_concurrent_streams};
+  values[count++] = {max_header_list_size_setting,
+                     settings.max_header_list_size};
+  if (settings.initial_window_size != default_window) {
+    values[count++] = {initial_window_size_setting,
+                       settings.initial_window_size};
+  }
+  if (settings.max_frame_size != default_frame_size) {
+    values[count++] = {max_frame_size_setting, settings.max_frame_size};
+  }
+  if (settings.header_table_size != 4096) {
+    values[count++] = {header_table_size_setting, settings.header_table_size};
+  }
+  write_frame_header(count * 6, settings_frame, 0, 0);
+  for (std::size_t i = 0; i < count; ++i) {
+    m_output.push_back(char(values[i].first >> 8));
+    m_output.push_back(char(values[i].first));
+    write32(m_output, values[i].second);
+  }
+  if (settings.connection_window_size > default_window) {
+    write_window_update(0, settings.connection_window_size - default_window);
+  }
+}
+
+bool Http2Session::upgrade(std::string_view settings) {
+  if (settings.size() % 6 != 0 || !apply_settings(settings)) {
+    return false;
+  }
+  // The request that asked for the upgrade is stream 1, whose response
+  // goes out as HTTP/2 (RFC 7540, section 3.2).
+  auto &stream = create(1);
+  stream.opened = true;
+  stream.remote_closed = true;
+  stream.send_window = m_peer_window;
+  ++m_open;
+  m_last_stream = 1;
+  return true;
+}
+
+void Http2Session::receive(std::string_view data) {
+  while (!data.empty() && !m_failed) {
+    switch (m_input) {
+      case Input::Preface: {
+        auto size = std::min(data.size(), m_preface.size());
+        if (data.substr(0, size) != m_preface.substr(0, size)) {
+          fail(Http2Error::ProtocolError);
+          return;
+        }
+        data.remove_prefix(size);
+        m_preface.remove_prefix(size);
+        if (m_preface.empty()) {
+          m_input = Input::Header;
+        }
+        break;
+      }
+      case Input::Header: {
+        auto size = std::min(data.size(), sizeof m_head - m_head_size);
+        std::copy_n(data.data(), size, m_head + m_head_size);
+        m_head_size += size;
+        data.remove_prefix(size);
+        if (m_head_size == sizeof m_head) {
+          m_head_size = 0;
+          on_frame_header();
+        }
+        break;
+      }
+      case Input::Payload: {
+        auto size = std::min<std::size_t>(data.size(),
+                                          m_length - m_payload.size());
+        m_payload.append(data.data(), size);
+        data.remove_prefix(size);
+        if (m_payload.size() == m_length) {
+          m_input = Input::Header;
+          on_frame();
+        }
+        break;
+      }
+      case Input::Data:
+        on_data_payload(data);
+        break;
+      case Input::Discard: {
+        auto size = std::min(data.size(), m_remaining);
+        data.remove_prefix(size);
+        m_remaining -= size;
+        if (m_remaining == 0) {
+          m_input = Input::Header;
+        }
+        break;
+      }
+    }
+  }
+}
+
+void Http2Session::begin_headers(std::uint32_t stream, unsigned int status) {
+  m_out_block.clear();
+  m_out_stream = 0;
+  auto s = find(stream);
+  if (!s || !s->opened || s->local_closed || s->final_sent) {
+    return;
+  }
+  m_out_stream = stream;
+  m_out_final = status >= 200;
+  m_encoder.encode_status(m_out_block, status);
+}
+
+void Http2Session::add_header(std::string_view name, std::string_view value) {
+  if (m_out_stream != 0) {
+    m_encoder.encode(m_out_block, name, value);
+  }
+}
+
+void Http2Session::end_headers(bool end_stream) {
+  if (m_out_stream == 0) {
+    return;
+  }
+  auto id = m_out_stream;
+  m_out_stream = 0;
+  auto &stream = *find(id);
+  bool end = end_stream && m_out_final;
+  stream.final_sent = stream.final_sent || m_out_final;
+  // A block larger than a frame continues in CONTINUATION frames, which
+  // nothing may come between.
+  std::string_view block = m_out_block;
+  std::uint8_t type = headers_frame;
+  std::uint8_t flags = end ? end_stream_flag : 0;
+  do {
+    auto size = std::min<std::size_t>(block.size(), m_peer_max_frame);
+    if (size == block.size()) {
+      flags |= end_headers_flag;
+    }
+    write_frame_header(size, type, flags, id);
+    m_output.append(block.data(), size);
+    block.remove_prefix(size);
+    type = continuation_frame;
+    flags = 0;
+  } while (!block.empty());
+  if (end) {
+    stream.local_closed = true;
+    m_finished.push_back(id);
+  }
+}
+
+void Http2Session::send_data(std::uint32_t stream,
+                             std::string_view data,
+                             bool end_stream) {
+  auto s = find(stream);
+  if (!s || !s->opened || s->local_closed || !s->final_sent) {
+    return;
+  }
+  s->pending = data;
+  s->has_data = true;
+  s->end = end_stream;
+  update_ready(*s);
+}
+
+void Http2Session::reset(std::uint32_t stream, Http2Error error) {
+  auto s = find(stream);
+  if (s && s->opened) {
+    write_rst_stream(stream, error);
+    close(*s, error, false);
+  }
+}
+
+void Http2Session::consume(std::uint32_t stream, std::size_t size) {
+  auto s = find(stream);
+  if (!s || !s->opened || s->remote_closed) {
+    return;
+  }
+  // Updates are batched until half the window is consumed.
+  s->unacked += size;
+  if (s->unacked >= m_settings.initial_window_size / 2) {
+    write_window_update(stream, std::uint32_t(s->unacked));
+    s->receive_window += s->unacked;
+    s->unacked = 0;
+  }
+}
+
+void Http2Session::shutdown() {
+  if (m_goaway_sent) {
+    return;
+  }
+  m_goaway_sent = true;
+  write_frame_header(8, goaway_frame, 0, 0);
+  write32(m_output, m_last_stream);
+  write32(m_output, std::uint32_t(Http2Error::NoError));
+}
+
+void Http2Session::produce(std::size_t budget) {
+  // The vector may grow from the callbacks.
+  for (std::size_t i = 0; i < m_finished.size(); ++i) {
+    if (auto s = find(m_finished[i])) {
+      finish(*s);
+    }
+  }
+  m_finished.clear();
+  while (m_output.size() < budget && !m_failed) {
+    auto stream = schedule();
+    if (!stream) {
+      break;
+    }
+    auto window = std::min(stream->send_window, m_send_window);
+    auto size = std::min<std::size_t>(
+        {stream->pending.size(),
+         m_peer_max_frame,
+         std::size_t(std::max<std::int64_t>(window, 0))});
+    if (size == 0 && !stream->pending.empty()) {
+      // The connection window is used up.
+      break;
+    }
+    bool last = stream->end && size == stream->pending.size();
+    write_frame_header(
+        size, data_frame, last ? end_stream_flag : 0, stream->id);
+    m_output.append(stream->pending.data(), size);
+    stream->pending.remove_prefix(size);
+    stream->send_window -= size;
+    m_send_window -= size;
+    charge(*stream, size);
+    if (!stream->pending.empty()) {
+      update_ready(*stream);
+      continue;
+    }
+    stream->has_data = false;
+    update_ready(*stream);
+    if (last) {
+      stream->local_closed = true;
+      finish(*stream);
+    } else {
+      m_handler->on_sent(stream->id);
+    }
+  }
+}
+
+bool Http2Session::finished() const {
+  return m_failed || ((m_goaway_sent || m_goaway_received) && m_open == 0);
+}
+
+bool Http2Session::blocked() const {
+  for (auto const &stream : m_streams) {
+    if (stream->has_data && !stream->pending.empty() &&
+        (stream->send_window <= 0 || m_send_window <= 0)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Http2Session::Stream *Http2Session::find(std::uint32_t id) const {
+  auto it = std::lower_bound(
+      m_streams.begin(), m_streams.end(), id, [](auto const &stream, auto id) {
+        return stream->id < id;
+      });
+  return it != m_streams.end() && (*it)->id == id ? it->get() : nullptr;
+}
+
+Http2Session::Stream &Http2Session::create(std::uint32_t id) {
+  std::unique_ptr<Stream> stream;
+  if (m_free.empty()) {
+    stream = std::make_unique<Stream>();
+  } else {
+    stream = std::move(m_free.back());
+    m_free.pop_back();
+    auto children = std::move(stream->children);
+    children.clear();
+    *stream = Stream{};
+    stream->children = std::move(children);
+  }
+  stream->id = id;
+  auto &result = *stream;
+  // Clients open streams in increasing order.
+  auto it = m_streams.end();
+  if (!m_streams.empty() && m_streams.back()->id > id) {
+    it = std::lower_bound(m_streams.begin(),
+                          m_streams.end(),
+                          id,
+                          [](auto const &stream, auto id) {
+                            return stream->id < id;
+                          });
+  }
+  m_streams.insert(it, std::move(stream));
+  attach(result, *m_root);
+  return result;
+}
+
+void Http2Session::close(Stream &stream, Http2Error error, bool notify) {
+  auto id = stream.id;
+  bool opened = stream.opened;
+  set_ready(stream, false);
+  // The children take its place, sharing its weight (RFC 7540, section
+  // 5.3.4).
+  unsigned int total = 0;
+  for (auto child : stream.children) {
+    total += child->weight;
+  }
+  while (!stream.children.empty()) {
+    auto &child = *stream.children.back();
+    detach(child);
+    child.weight = std::uint16_t(
+        std::max(1u, stream.weight * child.weight / total));
+    attach(child, *stream.parent);
+  }
+  detach(stream);
+  --(opened ? m_open : m_idle);
+  auto it = std::lower_bound(
+      m_streams.begin(), m_streams.end(), id, [](auto const &stream, auto id) {
+        return stream->id < id;
+      });
+  m_free.push_back(std::move(*it));
+  m_streams.erase(it);
+  if (opened && notify) {
+    m_handler->on_close(id, error);
+  }
+}
+
+void Http2Session::finish(Stream &stream) {
+  // The response is complete: a client still sending the request is asked
+  // to stop (RFC 9113, section 8.1).
+  if (!stream.remote_closed) {
+    write_rst_stream(stream.id, Http2Error::NoError);
+  }
+  close(stream, Http2Error::NoError);
+}
+
+void Http2Session::stream_error(std::uint32_t id, Http2Error error) {
+  write_rst_stream(id, error);
+  auto s = find(id);
+  if (s && s->opened) {
+    close(*s, error);
+  }
+}
+
+void Http2Session::fail(Http2Error error) {
+  if (m_failed) {
+    return;
+  }
+  m_failed = true;
+  m_goaway_sent = true;
+  write_frame_header(8, goaway_frame, 0, 0);
+  write32(m_output, m_last_stream);
+  write32(m_output, std::uint32_t(error));
+}
+
+void Http2Session::on_frame_header() {
+  m_length = std::uint32_t(m_head[0]) << 16 | std::uint32_t(m_head[1]) << 8 |
+             m_head[2];
+  m_type = m_head[3];
+  m_flags = m_head[4];
+  m_stream = read32(reinterpret_cast<char const *>(m_head + 5)) & 0x7fffffff;
+  if (m_length > m_settings.max_frame_size) {
+    return fail(Http2Error::FrameSizeError);
+  }
+  if (m_block_stream != 0 &&
+      (m_type != continuation_frame || m_stream != m_block_stream)) {
+    return fail(Http2Error::ProtocolError);
+  }
+  if (!m_settings_received && m_type != settings_frame) {
+    return fail(Http2Error::ProtocolError);
+  }
+  switch (m_type) {
+    case data_frame:
+      return on_data_header();
+    case headers_frame:
+    case priority_frame:
+    case rst_stream_frame:
+    case settings_frame:
+    case ping_frame:
+    case goaway_frame:
+    case window_update_frame:
+    case continuation_frame:
+      m_payload.clear();
+      if (m_length == 0) {
+        return on_frame();
+      }
+      m_input = Input::Payload;
+      return;
+    case push_promise_frame:
+      return fail(Http2Error::ProtocolError);
+    default:
+      // Unknown frames are ignored (RFC 9113, section 4.1).
+      m_remaining = m_length;
+      m_input = m_length == 0 ? Input::Header : Input::Discard;
+  }
+}
+
+void Http2Session::on_data_header() {
+  if (m_stream == 0) {
+    return fail(Http2Error::ProtocolError);
+  }
+  if (m_length > m_receive_window) {
+    return fail(Http2Error::FlowControlError);
+  }
+  if ((m_flags & padded_flag) && m_length == 0) {
+    return fail(Http2Error::FrameSizeError);
+  }
+  // The window of the connection is opened again right away, the streams
+  // hold the client back with their own.
+  m_receive_window -= m_length;
+  m_unacked += m_length;
+  if (m_unacked >= m_settings.connection_window_size / 2) {
+    write_window_update(0, std::uint32_t(m_unacked));
+    m_receive_window += m_unacked;
+    m_unacked = 0;
+  }
+  m_remaining = m_length;
+  m_padding = 0;
+  m_pad_pending = m_flags & padded_flag;
+  m_input = m_length == 0 ? Input::Header : Input::Discard;
+  auto s = find(m_stream);
+  if (!s || !s->opened) {
+    // Frames that were in flight when a stream was closed are ignored.
+    if (m_stream > m_last_stream) {
+      fail(Http2Error::ProtocolError);
+    }
+    return;
+  }
+  if (s->remote_closed) {
+    return stream_error(m_stream, Http2Error::StreamClosed);
+  }
+  if (m_length > s->receive_window) {
+    return stream_error(m_stream, Http2Error::FlowControlError);
+  }
+  s->receive_window -= m_length;
+  if (m_length == 0) {
+    return on_data_end();
+  }
+  m_input = Input::Data;
+}
+
+void Http2Session::on_data_payload(std::string_view &data) {
+  if (m_pad_pending) {
+    m_pad_pending = false;
+    m_padding = static_cast<unsigned char>(data[0]);
+    data.remove_prefix(1);
+    --m_remaining;
+    if (m_padding > m_remaining) {
+      return fail(Http2Error::ProtocolError);
+    }
+    // Padding counts against the window but is not passed on.
+    consume(m_stream, m_padding + 1);
+  }
+  auto body = m_remaining - m_padding;
+  auto size = std::min(data.size(), body);
+  if (size > 0) {
+    auto piece = data.substr(0, size);
+    data.remove_prefix(size);
+    m_remaining -= size;
+    auto s = find(m_stream);
+    if (s && s->opened) {
+      s->received += size;
+      if (s->content_length >= 0 &&
+          s->received > std::uint64_t(s->content_length)) {
+        stream_error(m_stream, Http2Error::ProtocolError);
+      } else {
+        m_handler->on_data(m_stream, piece, false);
+      }
+    }
+  }
+  if (m_remaining <= m_padding) {
+    auto skip = std::min(data.size(), m_remaining);
+    data.remove_prefix(skip);
+    m_remaining -= skip;
+    m_padding = m_remaining;
+  }
+  if (m_remaining == 0) {
+    m_input = Input::Header;
+    on_data_end();
+  }
+}
+
+void Http2Session::on_data_end() {
+  auto s = find(m_stream);
+  if (!(m_flags & end_stream_flag) || !s || !s->opened) {
+    return;
+  }
+  if (s->content_length >= 0 &&
+      s->received != std::uint64_t(s->content_length)) {
+    return stream_error(m_stream, Http2Error::ProtocolError);
+  }
+  s->remote_closed = true;
+  m_handler->on_data(m_stream, {}, true);
+}
+
+void Http2Session::on_frame() {
+  switch (m_type) {
+    case headers_frame:
+      return on_headers();
+    case priority_frame:
+      return on_priority();
+    case rst_stream_frame:
+      return on_rst_stream();
+    case settings_frame:
+      return on_settings();
+    case ping_frame:
+      return on_ping();
+    case goaway_frame:
+      return on_goaway();
+    case window_update_frame:
+      return on_window_update();
+    case continuation_frame:
+      return on_continuation();
+  }
+}
+
+void Http2Session::on_headers() {
+  if (m_stream == 0) {
+    return fail(Http2Error::ProtocolError);
+  }
+  std::string_view payload = m_payload;
+  std::size_t padding = 0;
+  if (m_flags & padded_flag) {
+    if (payload.empty()) {
+      return fail(Http2Error::FrameSizeError);
+    }
+    padding = static_cast<unsigned char>(payload[0]);
+    payload.remove_prefix(1);
+  }
+  m_block_priority = m_flags & priority_flag;
+  if (m_block_priority) {
+    if (payload.size() < 5) {
+      return fail(Http2Error::FrameSizeError);
+    }
+    auto dependency = read32(payload.data());
+    m_block_exclusive = dependency >> 31;
+    m_block_dependency = dependency & 0x7fffffff;
+    m_block_weight = static_cast<unsigned char>(payload[4]) + 1;
+    payload.remove_prefix(5);
+  }
+  if (padding > payload.size()) {
+    return fail(Http2Error::ProtocolError);
+  }
+  payload.remove_suffix(padding);
+  m_block.assign(payload.data(), payload.size());
+  m_block_stream = m_stream;
+  m_block_end_stream = m_flags & end_stream_flag;
+  if (m_flags & end_headers_flag) {
+    on_header_block();
+  }
+}
+
+void Http2Session::on_continuation() {
+  if (m_block_stream == 0) {
+    return fail(Http2Error::ProtocolError);
+  }
+  // Bounds what a client can make the session hold on to.
+  auto max_block = std::max<std::size_t>(
+      64 * 1024, 2 * std::size_t(m_settings.max_header_list_size));
+  if (m_block.size() + m_payload.size() > max_block) {
+    return fail(Http2Error::EnhanceYourCalm);
+  }
+  m_block += m_payload;
+  if (m_flags & end_headers_flag) {
+    on_header_block();
+  }
+}
+
+void Http2Session::on_header_block() {
+  auto id = m_block_stream;
+  m_block_stream = 0;
+  // The block is decoded whatever becomes of it, the decoder's table has
+  // to follow the encoder's.
+  if (!decode_header()) {
+    return;
+  }
+  auto s = find(id);
+  if (s && s->opened) {
+    // Trailers, which end the body. Their fields are not passed on.
+    if (s->remote_closed) {
+      return stream_error(id, Http2Error::StreamClosed);
+    }
+    if (!m_block_end_stream || !validate_header(true) ||
+        (s->content_length >= 0 &&
+         s->received != std::uint64_t(s->content_length))) {
+      return stream_error(id, Http2Error::ProtocolError);
+    }
+    s->remote_closed = true;
+    m_handler->on_data(id, {}, true);
+    return;
+  }
+  if (id % 2 == 0) {
+    return fail(Http2Error::ProtocolError);
+  }
+  if (id <= m_last_stream || m_goaway_sent) {
+    // A stream closed already, or one opened after GOAWAY.
+    return;
+  }
+  m_last_stream = id;
+  if (m_open >= m_settings.max_concurrent_streams) {
+    return write_rst_stream(id, Http2Error::RefusedStream);
+  }
+  if (!validate_header(false) ||
+      (m_block_priority && m_block_dependency == id) ||
+      (m_block_end_stream && m_content_length > 0)) {
+    return stream_error(id, Http2Error::ProtocolError);
+  }
+  if (s) {
+    --m_idle;
+  } else {
+    s = &create(id);
+  }
+  s->opened = true;
+  s->remote_closed = m_block_end_stream;
+  s->send_window = m_peer_window;
+  s->receive_window = m_settings.initial_window_size;
+  s->content_length = m_content_length;
+  ++m_open;
+  if (m_block_priority) {
+    prioritize(*s, m_block_dependency, m_block_weight, m_block_exclusive);
+  }
+  m_handler->on_request(id, m_header, m_block_end_stream);
+}
+
+bool Http2Session::decode_header() {
+  m_header_data.clear();
+  m_spans.clear();
+  m_header_size = 0;
+  m_header.too_large = false;
+  bool valid = m_decoder.decode(
+      m_block, [this](std::string_view name, std::string_view value) {
+        // Sizes are counted as in SETTINGS_MAX_HEADER_LIST_SIZE, fields
+        // beyond it are dropped.
+        m_header_size += name.size() + value.size() + 32;
+        if (m_header_size > m_settings.max_header_list_size) {
+          m_header.too_large = true;
+          return;
+        }
+        m_spans.push_back({std::uint32_t(m_header_data.size()),
+                           std::uint32_t(name.size()),
+                           std::uint32_t(value.size())});
+        m_header_data += name;
+        m_header_data += value;
+      });
+  if (!valid) {
+    fail(Http2Error::CompressionError);
+  }
+  return valid;
+}
+
+bool Http2Session::validate_header(bool trailers) {
+  // Pseudo-header fields that were not received keep a null view.
+  m_header.method = {};
+  m_header.scheme = {};
+  m_header.authority = {};
+  m_header.path = {};
+  m_header.fields.clear();
+  m_cookie.clear();
+  m_content_length = -1;
+  bool cookie = false;
+  bool regular = false;
+  for (auto const &span : m_spans) {
+    std::string_view name(m_header_data.data() + span.offset, span.name_size);
+    std::string_view value(name.data() + name.size(), span.value_size);
+    if (name.empty() || !valid_field_value(value)) {
+      return false;
+    }
+    if (name[0] == ':') {
+      // Pseudo-header fields come first and only once (RFC 9113, section
+      // 8.3).
+      auto pseudo = name == ":method"      ? &m_header.method
+                    : name == ":scheme"    ? &m_header.scheme
+                    : name == ":authority" ? &m_header.authority
+                    : name == ":path"      ? &m_header.path
+                                           : nullptr;
+      if (trailers || regular || !pseudo || pseudo->data()) {
+        return false;
+      }
+      *pseudo = value;
+      continue;
+    }
+    regular = true;
+    if (!valid_field_name(name) || (name == "te" && value != "trailers")) {
+      return false;
+    }
+    if (name == "content-length") {
+      std::int64_t length = 0;
+      for (char c : value) {
+        if (c < '0' || c > '9' || length > (max_window << 16)) {
+          return false;
+        }
+        length = length * 10 + (c - '0');
+      }
+      if (value.empty() ||
+          (m_content_length >= 0 && m_content_length != length)) {
+        return false;
+      }
+      m_content_length = length;
+    }
+    if (name == "cookie") {
+      if (cookie) {
+        m_cookie += "; ";
+      }
+      m_cookie += value;
+      cookie = true;
+      continue;
+    }
+    m_header.fields.push_back({name, value});
+  }
+  if (cookie) {
+    m_header.fields.push_back({"cookie", m_cookie});
+  }
+  if (trailers) {
+    return true;
+  }
+  if (!m_header.method.data()) {
+    return false;
+  }
+  if (m_header.method == "CONNECT") {
+    return !m_header.scheme.data() && !m_header.path.data() &&
+           !m_header.authority.empty();
+  }
+  return m_header.scheme.data() && !m_header.path.empty();
+}
+
+void Http2Session::on_priority() {
+  if (m_stream == 0) {
+    return fail(Http2Error::ProtocolError);
+  }
+  if (m_payload.size() != 5) {
+    return stream_error(m_stream, Http2Error::FrameSizeError);
+  }
+  auto dependency = read32(m_payload.data());
+  bool exclusive = dependency >> 31;
+  dependency &= 0x7fffffff;
+  std::uint16_t weight = static_cast<unsigned char>(m_payload[4]) + 1;
+  if (dependency == m_stream) {
+    return stream_error(m_stream, Http2Error::ProtocolError);
+  }
+  auto s = find(m_stream);
+  if (!s) {
+    // An idle stream, which clients use as anchors of their trees. Their
+    // number is bounded like that of open ones.
+    if (m_stream <= m_last_stream ||
+        m_idle >= m_settings.max_concurrent_streams) {
+      return;
+    }
+    s = &create(m_stream);
+    ++m_idle;
+  }
+  prioritize(*s, dependency, weight, exclusive);
+}
+
+void Http2Session::on_rst_stream() {
+  if (m_stream == 0) {
+    return fail(Http2Error::ProtocolError);
+  }
+  if (m_payload.size() != 4) {
+    return fail(Http2Error::FrameSizeError);
+  }
+  auto s = find(m_stream);
+  if (!s || !s->opened) {
+    if (m_stream > m_last_stream) {
+      fail(Http2Error::ProtocolError);
+    }
+    return;
+  }
+  close(*s, Http2Error(read32(m_payload.data())));
+}
+
+bool Http2Session::apply_settings(std::string_view payload) {
+  for (std::size_t i = 0; i + 6 <= payload.size(); i += 6) {
+    auto id = std::uint16_t(static_cast<unsigned char>(payload[i]) << 8 |
+                            static_cast<unsigned char>(payload[i + 1]));
+    auto value = read32(payload.data() + i + 2);
+    switch (id) {
+      case header_table_size_setting:
+        m_encoder.set_max_table_size(value);
+        break;
+      case enable_push_setting:
+        if (value > 1) {
+          fail(Http2Error::ProtocolError);
+          return false;
+        }
+        break;
+      case initial_window_size_setting: {
+        if (value > max_window) {
+          fail(Http2Error::FlowControlError);
+          return false;
+        }
+        // Applies to the windows of open streams as well (RFC 9113,
+        // section 6.9.2).
+        auto delta = std::int64_t(value) - m_peer_window;
+        m_peer_window = value;
+        for (auto const &stream : m_streams) {
+          if (!stream->opened) {
+            continue;
+          }
+          stream->send_window += delta;
+          if (stream->send_window > max_window) {
+            fail(Http2Error::FlowControlError);
+            return false;
+          }
+          update_ready(*stream);
+        }
+        break;
+      }
+      case max_frame_size_setting:
+        if (value < default_frame_size || value > 0xffffff) {
+          fail(Http2Error::ProtocolError);
+          return false;
+        }
+        m_peer_max_frame = value;
+        break;
+    }
+  }
+  return true;
+}
+
+void Http2Session::on_settings() {
+  if (m_stream != 0) {
+    return fail(Http2Error::ProtocolError);
+  }
+  if (m_flags & ack_flag) {
+    if (!m_payload.empty()) {
+      fail(Http2Error::FrameSizeError);
+    }
+    return;
+  }
+  if (m_payload.size() % 6 != 0) {
+    return fail(Http2Error::FrameSizeError);
+  }
+  if (apply_settings(m_payload)) {
+    m_settings_received = true;
+    write_frame_header(0, settings_frame, ack_flag, 0);
+  }
+}
+
+void Http2Session::on_ping() {
+  if (m_stream != 0) {
+    return fail(Http2Error::ProtocolError);
+  }
+  if (m_payload.size() != 8) {
+    return fail(Http2Error::FrameSizeError);
+  }
+  if (!(m_flags & ack_flag)) {
+    write_frame_header(8, ping_frame, ack_flag, 0);
+    m_output += m_payload;
+  }
+}
+
+void Http2Session::on_goaway() {
+  if (m_stream != 0) {
+    return fail(Http2Error::ProtocolError);
+  }
+  if (m_payload.size() < 8) {
+    return fail(Http2Error::FrameSizeError);
+  }
+  m_goaway_received = true;
+}
+
+void Http2Session::on_window_update() {
+  if (m_payload.size() != 4) {
+    return fail(Http2Error::FrameSizeError);
+  }
+  auto increment = read32(m_payload.data()) & 0x7fffffff;
+  if (m_stream == 0) {
+    if (increment == 0) {
+      return fail(Http2Error::ProtocolError);
+    }
+    m_send_window += increment;
+    if (m_send_window > max_window) {
+      fail(Http2Error::FlowControlError);
+    }
+    return;
+  }
+  auto s = find(m_stream);
+  if (!s || !s->opened) {
+    if (m_stream > m_last_stream) {
+      fail(Http2Error::ProtocolError);
+    }
+    return;
+  }
+  if (increment == 0) {
+    return stream_error(m_stream, Http2Error::ProtocolError);
+  }
+  s->send_window += increment;
+  if (s->send_window > max_window) {
+    return stream_error(m_stream, Http2Error::FlowControlError);
+  }
+  update_ready(*s);
+}
+
+void Http2Session::write_frame_header(std::size_t length,
+                                      std::uint8_t type,
+                                      std::uint8_t flags,
+                                      std::uint32_t stream) {
+  m_output.push_back(char(length >> 16));
+  m_output.push_back(char(length >> 8));
+  m_output.push_back(char(length));
+  m_output.push_back(char(type));
+  m_output.push_back(char(flags));
+  write32(m_output, stream);
+}
+
+void Http2Session::write_window_update(std::uint32_t stream,
+                                       std::uint32_t increment) {
+  write_frame_header(4, window_update_frame, 0, stream);
+  write32(m_output, increment);
+}
+
+void Http2Session::write_rst_stream(std::uint32_t stream, Http2Error error) {
+  write_frame_header(4, rst_stream_frame, 0, stream);
+  write32(m_output, std::uint32_t(error));
+}
+
+void Http2Session::update_ready(Stream &stream) {
+  set_ready(stream,
+            stream.has_data &&
+                (stream.pending.empty() || stream.send_window > 0));
+}
+
+void Http2Session::set_ready(Stream &stream, bool ready) {
+  if (stream.ready != ready) {
+    stream.ready = ready;
+    add_active(stream, ready ? 1 : -1);
+  }
+}
+
+void Http2Session::add_active(Stream &node, std::ptrdiff_t count) {
+  for (auto n = &node; n; n = n->parent) {
+    // A node becoming active does not make up for the time it was idle.
+    if (count > 0 && n->active == 0 && n->parent) {
+      n->pass = std::max(n->pass, n->parent->vtime);
+    }
+    n->active += count;
+  }
+}
+
+void Http2Session::attach(Stream &stream, Stream &parent) {
+  stream.parent = &parent;
+  parent.children.push_back(&stream);
+  if (stream.active > 0) {
+    stream.pass = std::max(stream.pass, parent.vtime);
+    add_active(parent, stream.active);
+  }
+}
+
+void Http2Session::detach(Stream &stream) {
+  auto parent = stream.parent;
+  if (!parent) {
+    return;
+  }
+  auto &siblings = parent->children;
+  siblings.erase(std::find(siblings.begin(), siblings.end(), &stream));
+  if (stream.active > 0) {
+    add_active(*parent, -stream.active);
+  }
+  stream.parent = nullptr;
+}
+
+void Http2Session::prioritize(Stream &stream,
+                              std::uint32_t dependency,
+                              std::uint16_t weight,
+                              bool exclusive) {
+  auto parent = dependency == 0 ? m_root.get() : find(dependency);
+  if (!parent) {
+    // Depending on a stream that is gone gives the default priority (RFC
+    // 7540, section 5.3.1).
+    parent = m_root.get();
+    weight = 16;
+    exclusive = false;
+  }
+  // A stream made to depend on one of its descendants swaps places with it
+  // (RFC 7540, section 5.3.3).
+  for (auto node = parent; node; node = node->parent) {
+    if (node == &stream) {
+      auto &moved = *parent;
+      detach(moved);
+      attach(moved, *stream.parent);
+      break;
+    }
+  }
+  detach(stream);
+  stream.weight = weight;
+  if (exclusive) {
+    while (!parent->children.empty()) {
+      auto &child = *parent->children.back();
+      detach(child);
+      attach(child, stream);
+    }
+  }
+  attach(stream, *parent);
+}
+
+Http2Session::Stream *Http2Session::schedule() {
+  // Down the tree from the root: a ready stream goes before those that
+  // depend on it, among siblings the one with the lowest pass.
+  auto node = m_root.get();
+  while (node->active > 0) {
+    if (node->ready) {
+      return node;
+    }
+    Stream *next = nullptr;
+    for (auto child : node->children) {
+      if (child->active > 0 && (!next || child->pass < next->pass)) {
+        next = child;
+      }
+    }
+    node = next;
+  }
+  return nullptr;
+}
+
+void Http2Session::charge(Stream &stream, std::size_t size) {
+  // Frame headers count too, so that empty frames are not free.
+  auto cost = std::uint64_t(size + 9) * 256;
+  for (auto node = &stream; node->parent; node = node->parent) {
+    node->parent->vtime = node->pass;
+    node->pass += cost / node->weight;
+  }
+}
+
+}  // namespace detail
+}  // namespace apee
@@ -1,39 +1,320 @@
 #include "log.hpp"
 
-std::ostream &logger::operator<<(std::ostream &strm,
-                                 logger::severity_level level) {
-  static const char *strings[] = {
-      "trace", "debug", "info", "warning", "error", "critical"};
-  if (static_cast<std::size_t>(level) < sizeof(strings) / sizeof(*strings))
-    strm << strings[level];
-  else
-    strm << static_cast<int>(level);
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
 
-  return strm;
+namespace {
+
+const char *severity_strings[] = {
+    "trace", "debug", "info", "warning", "error", "critical"};
+
+// Message bytes kept per record in async mode, longer messages are cut.
+constexpr std::size_t message_capacity = 480;
+
+struct entry {
+  std::chrono::system_clock::time_point time;
+  logger::severity_level severity;
+  std::uint16_t size;
+  char channel[16];
+  char message[message_capacity];
+};
+
+// Single-producer single-consumer queue of records written by one thread
+// and drained by the writer thread.
+class ring {
+  std::vector<entry> m_entries;
+  std::size_t m_mask;
+  alignas(64) std::atomic<std::size_t> m_head{0};
+  alignas(64) std::atomic<std::size_t> m_tail{0};
+
+ public:
+  std::atomic<std::uint64_t> dropped{0};
+  // Set when the producing thread exits, the writer then drops the ring
+  // once it is drained.
+  std::atomic<bool> orphaned{false};
+
+  explicit ring(std::size_t size) {
+    std::size_t capacity = 1;
+    while (capacity < size) {
+      capacity <<= 1;
+    }
+    m_entries.resize(capacity);
+    m_mask = capacity - 1;
+  }
+
+  entry *reserve() {
+    auto head = m_head.load(std::memory_order_relaxed);
+    if (head - m_tail.load(std::memory_order_acquire) == m_entries.size()) {
+      return nullptr;
+    }
+    return &m_entries[head & m_mask];
+  }
+
+  // Returns whether the ring was empty, so the writer may be waiting. The
+  // fence pairs with the one in async_writer::park(): either the writer
+  // sees the record or the producer sees the writer idle.
+  bool commit() {
+    auto head = m_head.load(std::memory_order_relaxed);
+    m_head.store(head + 1, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return m_tail.load(std::memory_order_relaxed) == head;
+  }
+
+  entry const *front() {
+    auto tail = m_tail.load(std::memory_order_relaxed);
+    if (tail == m_head.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &m_entries[tail & m_mask];
+  }
+
+  void pop() {
+    m_tail.store(m_tail.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_release);
+  }
+};
+
+// Drains all rings into std::clog, using the format of the console sinks.
+// While there is nothing to write the thread waits on m_wake, woken by the
+// first record committed to an empty ring.
+class async_writer {
+  // Guards m_rings, m_wakeup and clearing m_running.
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::vector<std::shared_ptr<ring>> m_rings;
+  // Set by attach(), the writer then takes a new snapshot of m_rings.
+  std::atomic<bool> m_attached{false};
+  // Set while the writer waits or is about to.
+  std::atomic<bool> m_idle{false};
+  bool m_wakeup = false;
+  std::atomic<bool> m_running{false};
+  std::thread m_thread;
+  std::size_t m_queue_size = 1024;
+  std::time_t m_second = 0;
+  std::string m_timestamp;
+
+  void format(entry const &e, std::string &out) {
+    auto time = std::chrono::system_clock::to_time_t(e.time);
+    if (time != m_second || m_timestamp.empty()) {
+      std::tm tm;
+      localtime_r(&time, &tm);
+      char buffer[32];
+      auto size =
+          std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S ", &tm);
+      m_timestamp.assign(buffer, size);
+      m_second = time;
+    }
+    static const std::string *colors[] = {&ansiCode::green,
+                                          &ansiCode::cyan,
+                                          nullptr,
+                                          &ansiCode::yellow,
+                                          &ansiCode::red,
+                                          &ansiCode::red};
+    std::string_view channel(e.channel,
+                             strnlen(e.channel, sizeof(e.channel)));
+    std::string_view severity = severity_strings[e.severity];
+    out.append(m_timestamp).append("|").append(channel);
+    out.append(channel.size() < 16 ? 16 - channel.size() : 0, ' ');
+    out.append("|");
+    if (colors[e.severity]) {
+      out.append(*colors[e.severity]);
+    }
+    out.append(severity).append(severity.size() < 8 ? 8 - severity.size() : 0,
+                                ' ');
+    out.append(ansiCode::reset).append("|");
+    out.append(e.message, e.size).append("\n");
+  }
+
+  // Waits until woken, unless a ring has records that arrived before
+  // m_idle was set.
+  void park(std::vector<std::shared_ptr<ring>> const &rings) {
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_idle.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool pending = std::any_of(rings.begin(), rings.end(), [](auto &queue) {
+      return queue->front() != nullptr;
+    });
+    if (!pending) {
+      m_wake.wait(lock, [this] { return m_wakeup || !m_running; });
+    }
+    m_wakeup = false;
+    m_idle.store(false, std::memory_order_relaxed);
+  }
+
+  void run() {
+    std::string out;
+    std::vector<std::shared_ptr<ring>> rings;
+    while (true) {
+      bool running = m_running.load();
+      if (m_attached.exchange(false)) {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        rings = m_rings;
+      }
+      for (auto it = rings.begin(); it != rings.end();) {
+        auto &queue = *it;
+        bool orphaned = queue->orphaned.load();
+        while (auto e = queue->front()) {
+          format(*e, out);
+          queue->pop();
+        }
+        if (auto dropped = queue->dropped.exchange(0)) {
+          out.append("Dropped ")
+              .append(std::to_string(dropped))
+              .append(" log records\n");
+        }
+        if (orphaned) {
+          std::lock_guard<std::mutex> lock{m_mutex};
+          m_rings.erase(std::find(m_rings.begin(), m_rings.end(), queue));
+          it = rings.erase(it);
+        } else {
+          ++it;
+        }
+      }
+      if (!out.empty()) {
+        std::clog.write(out.data(), static_cast<std::streamsize>(out.size()));
+        std::clog.flush();
+        out.clear();
+      } else if (!running) {
+        return;
+      } else {
+        park(rings);
+      }
+    }
+  }
+
+ public:
+  logger::options::overflow on_overflow = logger::options::overflow::drop;
+
+  ~async_writer() {
+    if (m_thread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_running = false;
+      }
+      m_wake.notify_one();
+      m_thread.join();
+    }
+  }
+
+  bool running() const { return m_running.load(std::memory_order_relaxed); }
+
+  void start(logger::options const &opts) {
+    on_overflow = opts.on_overflow;
+    m_queue_size = opts.queue_size;
+    m_running = true;
+    m_thread = std::thread([this] { run(); });
+  }
+
+  std::shared_ptr<ring> attach() {
+    auto queue = std::make_shared<ring>(m_queue_size);
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_rings.push_back(queue);
+    m_attached = true;
+    return queue;
+  }
+
+  // Called after a record was committed to an empty ring, and when a ring
+  // is orphaned with `always` set.
+  void wake(bool always = false) {
+    if (always || m_idle.load(std::memory_order_relaxed)) {
+      {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_wakeup = true;
+      }
+      m_wake.notify_one();
+    }
+  }
+};
+
+async_writer &writer() {
+  static async_writer instance;
+  return instance;
 }
 
-void logger::init() {
+// Growable buffer the records of a thread are formatted into. It keeps its
+// capacity, so formatting does not allocate once it has grown.
+class line_buffer : public std::streambuf {
+  std::string m_data = std::string(512, '\0');
+
+ public:
+  line_buffer() { reset(); }
+
+  void reset() { setp(&m_data[0], &m_data[0] + m_data.size()); }
+
+  std::string_view view() const {
+    return std::string_view(pbase(),
+                            static_cast<std::size_t>(pptr() - pbase()));
+  }
+
+ protected:
+  int_type overflow(int_type ch) override {
+    if (traits_type::eq_int_type(ch, traits_type::eof())) {
+      return traits_type::not_eof(ch);
+    }
+    auto used = pptr() - pbase();
+    m_data.resize(m_data.size() * 2);
+    reset();
+    pbump(static_cast<int>(used));
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+    return ch;
+  }
+};
+
+struct thread_state {
+  line_buffer buffer;
+  std::ostream stream{&buffer};
+  std::shared_ptr<ring> queue;
+
+  ~thread_state() {
+    if (queue) {
+      queue->orphaned = true;
+      writer().wake(true);
+    }
+  }
+};
+
+thread_state &local_state() {
+  thread_local thread_state state;
+  return state;
+}
+
+void setup(logger::options opts) {
+  using namespace logger;
   boost::shared_ptr<logging::core> core = logging::core::get();
 
   auto env = std::getenv("LOG");
   if (env) {
     auto log_level_env = std::string(env);
-    if (log_level_env == "debug") {
-      core->set_filter(expr::attr<severity_level>("Severity") >= debug);
-    }
-    if (log_level_env == "info") {
-      core->set_filter(expr::attr<severity_level>("Severity") >= info);
-    }
-    if (log_level_env == "warning") {
-      core->set_filter(expr::attr<severity_level>("Severity") >= warning);
-    }
-    if (log_level_env == "error") {
-      core->set_filter(expr::attr<severity_level>("Severity") >= error);
-    }
-    if (log_level_env == "critical") {
-      core->set_filter(expr::attr<severity_level>("Severity") >= critical);
+    for (int level = debug; level <= critical; ++level) {
+      if (log_level_env == severity_strings[level]) {
+        runtime_level = level;
+        core->set_filter(expr::attr<severity_level>("Severity") >=
+                         static_cast<severity_level>(level));
+      }
     }
   }
+  if (auto mode = std::getenv("LOG_MODE")) {
+    opts.log_mode = std::string(mode) == "async" ? options::mode::async
+                                                 : options::mode::sync;
+  }
+  if (auto overflow = std::getenv("LOG_OVERFLOW")) {
+    opts.on_overflow = std::string(overflow) == "block"
+                           ? options::overflow::block
+                           : options::overflow::drop;
+  }
+
+  if (opts.log_mode == options::mode::async) {
+    writer().start(opts);
+    return;
+  }
 
   std::string timestamp = "%Y-%m-%d %H:%M:%S ";
 
@@ -94,3 +375,64 @@ void logger::init() {
                          << ansiCode::reset << "|" << expr::message);
   logging::add_common_attributes();
 }
+
+}  // namespace
+
+std::atomic<int> logger::runtime_level{logger::trace};
+
+std::ostream &logger::operator<<(std::ostream &strm,
+                                 logger::severity_level level) {
+  if (static_cast<std::size_t>(level) <
+      sizeof(severity_strings) / sizeof(*severity_strings))
+    strm << severity_strings[level];
+  else
+    strm << static_cast<int>(level);
+
+  return strm;
+}
+
+logger::record::record(char const *channel, severity_level severity)
+    : m_channel{channel}, m_severity{severity} {
+  auto &state = local_state();
+  state.buffer.reset();
+  state.stream.clear();
+}
+
+logger::record::~record() {
+  auto &state = local_state();
+  auto message = state.buffer.view();
+  if (!writer().running()) {
+    thread_local src::severity_channel_logger<severity_level, std::string> lg;
+    BOOST_LOG_CHANNEL_SEV(lg, m_channel, m_severity) << message;
+    return;
+  }
+  if (!state.queue) {
+    state.queue = writer().attach();
+  }
+  entry *e;
+  while (!(e = state.queue->reserve())) {
+    if (writer().on_overflow == options::overflow::drop) {
+      ++state.queue->dropped;
+      return;
+    }
+    std::this_thread::yield();
+  }
+  e->time = std::chrono::system_clock::now();
+  e->severity = m_severity;
+  std::strncpy(e->channel, m_channel, sizeof(e->channel));
+  e->size = static_cast<std::uint16_t>(
+      std::min(message.size(), sizeof(e->message)));
+  std::memcpy(e->message, message.data(), e->size);
+  if (state.queue->commit()) {
+    writer().wake();
+  }
+}
+
+std::ostream &logger::record::stream() { return local_state().stream; }
+
+void logger::init() { init(options()); }
+
+void logger::init(options const &opts) {
+  static std::once_flag once;
+  std::call_once(once, [&] { setup(opts); });
+}
@@ -0,0 +1,216 @@
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+namespace apee {
+
+namespace {
+
+thread_local unsigned int current_thread = 0;
+
+StageMetrics summarize(Histogram const &histogram) {
+  using std::chrono::nanoseconds;
+  StageMetrics stage;
+  stage.count = histogram.count();
+  stage.sum = nanoseconds(histogram.sum());
+  stage.p50 = nanoseconds(histogram.percentile(0.5));
+  stage.p90 = nanoseconds(histogram.percentile(0.9));
+  stage.p99 = nanoseconds(histogram.percentile(0.99));
+  stage.p999 = nanoseconds(histogram.percentile(0.999));
+  stage.max = nanoseconds(histogram.max());
+  return stage;
+}
+
+// Escapes a label value for the Prometheus text format.
+std::string label(std::string const &value) {
+  std::string escaped;
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      escaped += '\\';
+      escaped += c;
+    } else if (c == '\n') {
+      escaped += "\\n";
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+double seconds(std::chrono::nanoseconds duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+}  // namespace
+
+void Histogram::merge(Histogram const &other) {
+  for (std::size_t i = 0; i < m_counts.size(); ++i) {
+    m_counts[i] += other.m_counts[i];
+  }
+  m_count += other.m_count;
+  m_sum += other.m_sum;
+  m_max = std::max(m_max, other.m_max);
+}
+
+void Histogram::clear() {
+  std::fill(m_counts.begin(), m_counts.end(), 0);
+  m_count = m_sum = m_max = 0;
+}
+
+std::uint64_t Histogram::percentile(double q) const {
+  if (m_count == 0) {
+    return 0;
+  }
+  auto rank = static_cast<std::uint64_t>(
+      std::ceil(std::clamp(q, 0.0, 1.0) * static_cast<double>(m_count)));
+  rank = std::max<std::uint64_t>(rank, 1);
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i < m_counts.size(); ++i) {
+    seen += m_counts[i];
+    if (seen >= rank) {
+      return std::min(HistogramBuckets::value(i), m_max);
+    }
+  }
+  return m_max;
+}
+
+void ConcurrentHistogram::add_to(Histogram &histogram) const {
+  std::uint64_t count = 0;
+  for (std::size_t i = 0; i < m_counts.size(); ++i) {
+    auto n = m_counts[i].load(std::memory_order_relaxed);
+    histogram.m_counts[i] += n;
+    count += n;
+  }
+  histogram.m_count += count;
+  histogram.m_sum += m_sum.load(std::memory_order_relaxed);
+  histogram.m_max =
+      std::max(histogram.m_max, m_max.load(std::memory_order_relaxed));
+}
+
+Metrics::Metrics(unsigned int threads) {
+  for (unsigned int i = 0; i < std::max(1u, threads); ++i) {
+    m_shards.push_back(std::make_unique<Shard>());
+  }
+}
+
+void Metrics::set_thread(unsigned int thread) { current_thread = thread; }
+
+Metrics::Shard &Metrics::local() {
+  return *m_shards[current_thread % m_shards.size()];
+}
+
+void Metrics::record_error(char const *stage, std::error_code const &ec) {
+  auto &shard = local();
+  std::lock_guard<std::mutex> lock{shard.errors_mutex};
+  ++shard.errors[std::string(stage) + ": " + ec.message()];
+}
+
+MetricsSnapshot Metrics::snapshot() const {
+  MetricsSnapshot snapshot;
+  std::array<Histogram, stage_count> stages;
+  for (auto const &shard : m_shards) {
+    for (std::size_t i = 0; i < stage_count; ++i) {
+      shard->stages[i].add_to(stages[i]);
+    }
+    for (unsigned int status = 0; status < status_count; ++status) {
+      if (auto n = shard->statuses[status].load(std::memory_order_relaxed)) {
+        snapshot.responses[status] += n;
+      }
+    }
+    snapshot.connections_accepted +=
+        shard->accepted.load(std::memory_order_relaxed);
+    snapshot.bytes_received +=
+        shard->bytes_received.load(std::memory_order_relaxed);
+    snapshot.bytes_sent += shard->bytes_sent.load(std::memory_order_relaxed);
+    snapshot.timeouts += shard->timeouts.load(std::memory_order_relaxed);
+    snapshot.cache_hits += shard->cache_hits.load(std::memory_order_relaxed);
+    snapshot.cache_misses +=
+        shard->cache_misses.load(std::memory_order_relaxed);
+    snapshot.requests_rejected +=
+        shard->rejected.load(std::memory_order_relaxed);
+    snapshot.requests_rate_limited +=
+        shard->rate_limited.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock{shard->errors_mutex};
+    for (auto const &error : shard->errors) {
+      snapshot.errors[error.first] += error.second;
+    }
+  }
+  snapshot.accept = summarize(stages[static_cast<std::size_t>(Stage::Accept)]);
+  snapshot.read = summarize(stages[static_cast<std::size_t>(Stage::Read)]);
+  snapshot.handler =
+      summarize(stages[static_cast<std::size_t>(Stage::Handler)]);
+  snapshot.write = summarize(stages[static_cast<std::size_t>(Stage::Write)]);
+  snapshot.connections_active = m_active.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+std::string Metrics::prometheus(MetricsSnapshot const &snapshot) {
+  std::ostringstream out;
+  out << "# TYPE apee_stage_duration_seconds summary\n";
+  std::pair<char const *, StageMetrics const *> stages[] = {
+      {"accept", &snapshot.accept},
+      {"read", &snapshot.read},
+      {"handler", &snapshot.handler},
+      {"write", &snapshot.write}};
+  for (auto const &stage : stages) {
+    auto const &m = *stage.second;
+    std::pair<char const *, std::chrono::nanoseconds> quantiles[] = {
+        {"0.5", m.p50}, {"0.9", m.p90}, {"0.99", m.p99}, {"0.999", m.p999}};
+    for (auto const &quantile : quantiles) {
+      out << "apee_stage_duration_seconds{stage=\"" << stage.first
+          << "\",quantile=\"" << quantile.first << "\"} "
+          << seconds(quantile.second) << "\n";
+    }
+    out << "apee_stage_duration_seconds_sum{stage=\"" << stage.first << "\"} "
+        << seconds(m.sum) << "\n";
+    out << "apee_stage_duration_seconds_count{stage=\"" << stage.first
+        << "\"} " << m.count << "\n";
+  }
+  out << "# TYPE apee_responses_total counter\n";
+  for (auto const &response : snapshot.responses) {
+    out << "apee_responses_total{code=\"" << response.first << "\"} "
+        << response.second << "\n";
+  }
+  out << "# TYPE apee_errors_total counter\n";
+  for (auto const &error : snapshot.errors) {
+    out << "apee_errors_total{error=\"" << label(error.first) << "\"} "
+        << error.second << "\n";
+  }
+  out << "# TYPE apee_connections_accepted_total counter\n"
+      << "apee_connections_accepted_total " << snapshot.connections_accepted
+      << "\n"
+      << "# TYPE apee_connections_active gauge\n"
+      << "apee_connections_active " << snapshot.connections_active << "\n"
+      << "# TYPE apee_received_bytes_total counter\n"
+      << "apee_received_bytes_total " << snapshot.bytes_received << "\n"
+      << "# TYPE apee_sent_bytes_total counter\n"
+      << "apee_sent_bytes_total " << snapshot.bytes_sent << "\n"
+      << "# TYPE apee_timeouts_total counter\n"
+      << "apee_timeouts_total " << snapshot.timeouts << "\n"
+      << "# TYPE apee_cache_hits_total counter\n"
+      << "apee_cache_hits_total " << snapshot.cache_hits << "\n"
+      << "# TYPE apee_cache_misses_total counter\n"
+      << "apee_cache_misses_total " << snapshot.cache_misses << "\n"
+      << "# TYPE apee_requests_rejected_total counter\n"
+      << "apee_requests_rejected_total " << snapshot.requests_rejected << "\n"
+      << "# TYPE apee_requests_in_flight gauge\n"
+      << "apee_requests_in_flight " << snapshot.requests_in_flight << "\n"
+      << "# TYPE apee_concurrency_limit gauge\n"
+      << "apee_concurrency_limit " << snapshot.concurrency_limit << "\n"
+      << "# TYPE apee_requests_rate_limited_total counter\n"
+      << "apee_requests_rate_limited_total " << snapshot.requests_rate_limited
+      << "\n"
+      << "# TYPE apee_rate_limit_keys gauge\n"
+      << "apee_rate_limit_keys " << snapshot.rate_limit_keys << "\n"
+      << "# TYPE apee_worker_queue_depth gauge\n"
+      << "apee_worker_queue_depth " << snapshot.worker_queue_depth << "\n"
+      << "# TYPE apee_worker_steals_total counter\n"
+      << "apee_worker_steals_total " << snapshot.worker_steals << "\n"
+      << "# TYPE apee_worker_tasks_total counter\n"
+      << "apee_worker_tasks_total " << snapshot.worker_tasks << "\n";
+  return out.str();
+}
+
+}  // namespace apee
@@ -0,0 +1,60 @@
+#include "rate_limiter.hpp"
+
+#include <algorithm>
+#include <functional>
+
+namespace apee {
+
+RateLimiter::RateLimiter(RateLimit const &options)
+    : m_rate{options.rate},
+      m_burst{std::max(1.0, options.burst)},
+      m_shard_keys{std::max<std::size_t>(
+          1, options.max_keys / std::max(1u, options.shards))} {
+  for (unsigned int i = 0; i < std::max(1u, options.shards); ++i) {
+    m_shards.push_back(std::make_unique<Shard>());
+  }
+}
+
+RateLimiter::Shard &RateLimiter::shard(std::string_view key) {
+  return *m_shards[std::hash<std::string_view>()(key) % m_shards.size()];
+}
+
+RateLimiter::Clock::duration RateLimiter::acquire(std::string_view key,
+                                                  Clock::time_point now) {
+  auto &shard = this->shard(key);
+  std::lock_guard<std::mutex> lock{shard.mutex};
+  auto it = shard.index.find(key);
+  if (it == shard.index.end()) {
+    if (shard.lru.size() < m_shard_keys) {
+      shard.lru.emplace_front();
+      m_keys.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      // The bucket of the longest idle key is reused for the new one.
+      shard.index.erase(shard.lru.back().key);
+      shard.lru.splice(
+          shard.lru.begin(), shard.lru, std::prev(shard.lru.end()));
+    }
+    auto &bucket = shard.lru.front();
+    bucket.key.assign(key);
+    bucket.tokens = m_burst - 1;
+    bucket.updated = now;
+    shard.index.emplace(bucket.key, shard.lru.begin());
+    return Clock::duration::zero();
+  }
+  auto bucket = it->second;
+  shard.lru.splice(shard.lru.begin(), shard.lru, bucket);
+  if (now > bucket->updated) {
+    auto elapsed = std::chrono::duration<double>(now - bucket->updated);
+    bucket->tokens =
+        std::min(m_burst, bucket->tokens + elapsed.count() * m_rate);
+    bucket->updated = now;
+  }
+  if (bucket->tokens >= 1) {
+    bucket->tokens -= 1;
+    return Clock::duration::zero();
+  }
+  return std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>((1 - bucket->tokens) / m_rate));
+}
+
+}  // namespace apee
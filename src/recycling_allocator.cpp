@@ -0,0 +1,89 @@
+#include "recycling_allocator.hpp"
+
+#include <array>
+#include <new>
+
+namespace apee {
+namespace detail {
+
+namespace {
+
+constexpr std::size_t min_shift = 6;
+constexpr std::size_t class_count = 7;
+constexpr std::size_t max_size = std::size_t{1}
+                                 << (min_shift + class_count - 1);
+// Blocks kept per size class and thread.
+constexpr std::size_t max_cached = 1024;
+
+std::size_t size_class(std::size_t size) {
+  std::size_t index = 0;
+  while ((std::size_t{1} << (min_shift + index)) < size) {
+    ++index;
+  }
+  return index;
+}
+
+struct FreeBlock {
+  FreeBlock *next;
+};
+
+struct Cache {
+  std::array<FreeBlock *, class_count> free{};
+  std::array<std::size_t, class_count> count{};
+
+  ~Cache();
+};
+
+// Blocks freed after the cache of the thread was destroyed (during thread
+// exit) go straight to ::operator delete.
+thread_local bool cache_destroyed = false;
+
+Cache &local_cache() {
+  thread_local Cache cache;
+  return cache;
+}
+
+Cache::~Cache() {
+  cache_destroyed = true;
+  for (auto block : free) {
+    while (block) {
+      auto next = block->next;
+      ::operator delete(block);
+      block = next;
+    }
+  }
+}
+
+}  // namespace
+
+void *BlockCache::allocate(std::size_t size) {
+  if (size > max_size) {
+    return ::operator new(size);
+  }
+  auto index = size_class(size);
+  auto &cache = local_cache();
+  if (auto block = cache.free[index]) {
+    cache.free[index] = block->next;
+    --cache.count[index];
+    return block;
+  }
+  return ::operator new(std::size_t{1} << (min_shift + index));
+}
+
+void BlockCache::deallocate(void *p, std::size_t size) noexcept {
+  if (size > max_size || cache_destroyed) {
+    ::operator delete(p);
+    return;
+  }
+  auto index = size_class(size);
+  auto &cache = local_cache();
+  if (cache.count[index] == max_cached) {
+    ::operator delete(p);
+    return;
+  }
+  cache.free[index] = new (p) FreeBlock{cache.free[index]};
+  ++cache.count[index];
+}
+
+}  // namespace detail
+}  // namespace apee
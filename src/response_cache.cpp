@@ -0,0 +1,354 @@
+#include "response_cache.hpp"
+#include "response_head.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <functional>
+#include <iterator>
+
+namespace http = boost::beast::http;
+
+namespace apee {
+
+namespace {
+
+// Bookkeeping per entry counted against the budget besides its strings.
+constexpr std::size_t entry_overhead = 256;
+
+// Cache-Control lifetimes are capped, so adding them to a time_point
+// cannot overflow.
+constexpr std::uint64_t max_ttl_seconds = 365 * 24 * 3600;
+
+std::string_view view(boost::beast::string_view value) {
+  return std::string_view(value.data(), value.size());
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+  return boost::beast::iequals(boost::beast::string_view(a.data(), a.size()),
+                               boost::beast::string_view(b.data(), b.size()));
+}
+
+std::string_view trim(std::string_view value) {
+  while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+    value.remove_prefix(1);
+  }
+  while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) {
+    value.remove_suffix(1);
+  }
+  return value;
+}
+
+// Calls `f(name, value)` for the elements of a comma-separated list of
+// `name[=value]` tokens until it returns true.
+template <typename F>
+bool any_token(std::string_view list, F f) {
+  std::size_t pos = 0;
+  while (pos < list.size()) {
+    auto end = std::min(list.find(',', pos), list.size());
+    auto token = trim(list.substr(pos, end - pos));
+    auto equals = token.find('=');
+    auto name = trim(token.substr(0, equals));
+    auto value = equals == std::string_view::npos
+                     ? std::string_view()
+                     : trim(token.substr(equals + 1));
+    if (!name.empty() && f(name, value)) {
+      return true;
+    }
+    pos = end + 1;
+  }
+  return false;
+}
+
+bool has_directive(std::string_view cache_control, std::string_view directive) {
+  return any_token(cache_control, [&](std::string_view name, std::string_view) {
+    return iequals(name, directive);
+  });
+}
+
+bool directive_seconds(std::string_view cache_control,
+                       std::string_view directive,
+                       std::uint64_t &seconds) {
+  return any_token(cache_control,
+                   [&](std::string_view name, std::string_view value) {
+                     if (!iequals(name, directive)) {
+                       return false;
+                     }
+                     if (value.size() >= 2 && value.front() == '"' &&
+                         value.back() == '"') {
+                       value = value.substr(1, value.size() - 2);
+                     }
+                     auto result = std::from_chars(
+                         value.data(), value.data() + value.size(), seconds);
+                     return result.ec == std::errc() &&
+                            result.ptr == value.data() + value.size();
+                   });
+}
+
+bool cacheable(unsigned int status) {
+  switch (status) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 404:
+    case 405:
+    case 410:
+    case 414:
+    case 501:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Strong validator of a body, the 64 bit FNV-1a hash of its bytes.
+std::string etag(std::string const &body) {
+  std::uint64_t hash = 14695981039346656037ull;
+  for (unsigned char c : body) {
+    hash = (hash ^ c) * 1099511628211ull;
+  }
+  char buffer[24];
+  auto size = std::snprintf(buffer,
+                            sizeof(buffer),
+                            "\"%016llx\"",
+                            static_cast<unsigned long long>(hash));
+  return std::string(buffer, static_cast<std::size_t>(size));
+}
+
+// Fields sent along with NotModified, see RFC 7232 section 4.1.
+bool not_modified_field(http::field field) {
+  switch (field) {
+    case http::field::cache_control:
+    case http::field::content_location:
+    case http::field::date:
+    case http::field::etag:
+    case http::field::expires:
+    case http::field::vary:
+    case http::field::server:
+    case http::field::access_control_allow_origin:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Fields that are written per request or replaced when serialising.
+bool connection_field(http::field field) {
+  switch (field) {
+    case http::field::connection:
+    case http::field::date:
+    case http::field::keep_alive:
+    case http::field::content_length:
+    case http::field::transfer_encoding:
+      return true;
+    default:
+      return false;
+  }
+}
+
+using detail::append_field;
+
+std::size_t cost(std::string const &key, CachedResponse const &entry) {
+  return key.size() + entry.head.size() + entry.not_modified_head.size() +
+         entry.body.size() + entry.etag.size() + entry_overhead;
+}
+
+}  // namespace
+
+ResponseCache::ResponseCache(Caching const &options, bool encoding_in_key)
+    : m_options{options},
+      m_encoding_in_key{encoding_in_key},
+      m_shard_budget{options.memory_budget / std::max(1u, options.shards)} {
+  for (unsigned int i = 0; i < std::max(1u, options.shards); ++i) {
+    m_shards.push_back(std::make_unique<Shard>());
+  }
+}
+
+bool ResponseCache::key(detail::BeastRequest const &request,
+                        std::string_view encoding,
+                        std::string &key) const {
+  if ((request.method() != http::verb::get &&
+       request.method() != http::verb::head) ||
+      request.count(http::field::authorization) > 0 ||
+      has_directive(view(request[http::field::cache_control]), "no-store")) {
+    return false;
+  }
+  key.assign(request.target().data(), request.target().size());
+  // Neither the target nor field values can contain a line feed.
+  for (auto const &name : m_options.key_headers) {
+    key += '\n';
+    key += view(request[name]);
+  }
+  if (m_encoding_in_key) {
+    key += '\n';
+    key += encoding;
+  }
+  return true;
+}
+
+ResponseCache::Shard &ResponseCache::shard(std::string_view key) {
+  return *m_shards[std::hash<std::string_view>()(key) % m_shards.size()];
+}
+
+void ResponseCache::erase(Shard &shard, decltype(Shard::lru)::iterator entry) {
+  shard.size -= cost(entry->first, *entry->second);
+  shard.index.erase(entry->first);
+  shard.lru.erase(entry);
+}
+
+std::shared_ptr<CachedResponse const> ResponseCache::find(
+    std::string_view key, Clock::time_point now) {
+  auto &shard = this->shard(key);
+  std::lock_guard<std::mutex> lock{shard.mutex};
+  auto it = shard.index.find(key);
+  if (it == shard.index.end()) {
+    return nullptr;
+  }
+  auto entry = it->second;
+  if (entry->second->expires <= now) {
+    erase(shard, entry);
+    return nullptr;
+  }
+  shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+  return entry->second;
+}
+
+std::shared_ptr<CachedResponse const> ResponseCache::store(
+    std::string_view key,
+    detail::BeastResponse const &response,
+    std::chrono::milliseconds ttl,
+    Clock::time_point now) {
+  auto status = response.result_int();
+  if (!cacheable(status) || response.count(http::field::set_cookie) > 0) {
+    return nullptr;
+  }
+  auto cache_control = view(response[http::field::cache_control]);
+  if (ttl.count() < 0) {
+    if (has_directive(cache_control, "no-store") ||
+        has_directive(cache_control, "no-cache") ||
+        has_directive(cache_control, "private")) {
+      return nullptr;
+    }
+    std::uint64_t seconds;
+    if (directive_seconds(cache_control, "s-maxage", seconds) ||
+        directive_seconds(cache_control, "max-age", seconds)) {
+      ttl = std::chrono::seconds(std::min(seconds, max_ttl_seconds));
+    } else {
+      ttl = m_options.default_ttl;
+    }
+  }
+  if (ttl.count() <= 0) {
+    return nullptr;
+  }
+  // The key has to tell apart all variants the response varies on.
+  if (any_token(view(response[http::field::vary]),
+                [&](std::string_view name, std::string_view) {
+                  if (m_encoding_in_key && iequals(name, "Accept-Encoding")) {
+                    return false;
+                  }
+                  return std::none_of(
+                      m_options.key_headers.begin(),
+                      m_options.key_headers.end(),
+                      [&](std::string const &header) {
+                        return iequals(name, header);
+                      });
+                })) {
+    return nullptr;
+  }
+
+  auto entry = std::make_shared<CachedResponse>();
+  entry->status = status;
+  entry->body = response.body();
+  entry->expires = now + ttl;
+  bool generated = false;
+  if (response.count(http::field::etag) > 0) {
+    entry->etag = std::string(view(response[http::field::etag]));
+  } else if (m_options.etags && status == 200) {
+    entry->etag = etag(entry->body);
+    generated = true;
+  }
+  auto &head = entry->head;
+  head.append(" ")
+      .append(std::to_string(status))
+      .append(" ")
+      .append(view(response.reason()))
+      .append("\r\n");
+  if (!entry->etag.empty()) {
+    entry->not_modified_head = " 304 Not Modified\r\n";
+  }
+  for (auto const &field : response) {
+    if (connection_field(field.name())) {
+      continue;
+    }
+    append_field(head, view(field.name_string()), view(field.value()));
+    if (!entry->etag.empty() && not_modified_field(field.name())) {
+      append_field(entry->not_modified_head,
+                   view(field.name_string()),
+                   view(field.value()));
+    }
+  }
+  if (generated) {
+    append_field(head, "ETag", entry->etag);
+    append_field(entry->not_modified_head, "ETag", entry->etag);
+  }
+  if (status != 204) {
+    append_field(head, "Content-Length", std::to_string(entry->body.size()));
+  }
+  if (head.size() + entry->body.size() > m_options.max_entry_size) {
+    return nullptr;
+  }
+
+  auto &shard = this->shard(key);
+  std::lock_guard<std::mutex> lock{shard.mutex};
+  auto it = shard.index.find(key);
+  if (it != shard.index.end()) {
+    erase(shard, it->second);
+  }
+  shard.lru.emplace_front(std::string(key), entry);
+  auto size = cost(shard.lru.front().first, *entry);
+  if (size > m_shard_budget) {
+    shard.lru.pop_front();
+    return nullptr;
+  }
+  shard.index.emplace(shard.lru.front().first, shard.lru.begin());
+  shard.size += size;
+  while (shard.size > m_shard_budget) {
+    erase(shard, std::prev(shard.lru.end()));
+  }
+  return entry;
+}
+
+namespace detail {
+
+bool etag_matches(std::string_view header, std::string_view etag) {
+  if (header == "*") {
+    return true;
+  }
+  if (etag.substr(0, 2) == "W/") {
+    etag.remove_prefix(2);
+  }
+  std::size_t pos = 0;
+  while (pos < header.size()) {
+    auto end = header.find(',', pos);
+    if (end == std::string_view::npos) {
+      end = header.size();
+    }
+    auto tag = header.substr(pos, end - pos);
+    while (!tag.empty() && tag.front() == ' ') tag.remove_prefix(1);
+    while (!tag.empty() && tag.back() == ' ') tag.remove_suffix(1);
+    if (tag.substr(0, 2) == "W/") {
+      tag.remove_prefix(2);
+    }
+    if (tag == etag) {
+      return true;
+    }
+    pos = end + 1;
+  }
+  return false;
+}
+
+}  // namespace detail
+
+}  // namespace apee
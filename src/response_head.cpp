@@ -0,0 +1,127 @@
+#include "response_head.hpp"
+
+#include <boost/beast/http.hpp>
+
+#include <array>
+#include <cstdio>
+#include <ctime>
+
+namespace http = boost::beast::http;
+
+namespace apee {
+namespace detail {
+
+namespace {
+
+constexpr unsigned int first_status = 100;
+constexpr unsigned int last_status = 599;
+
+using StatusLines = std::array<std::string, last_status - first_status + 1>;
+
+// The status lines of HTTP/1.0 and HTTP/1.1, rendered on first use.
+struct StatusTable {
+  StatusTable() {
+    for (auto status = first_status; status <= last_status; ++status) {
+      auto reason = http::obsolete_reason(static_cast<http::status>(status));
+      auto line = " " + std::to_string(status) + " " +
+                  std::string(reason.data(), reason.size()) + "\r\n";
+      http10[status - first_status] = "HTTP/1.0" + line;
+      http11[status - first_status] = "HTTP/1.1" + line;
+    }
+  }
+
+  StatusLines http10;
+  StatusLines http11;
+};
+
+StatusTable const &status_table() {
+  static StatusTable const table;
+  return table;
+}
+
+// The cached Date field of this thread.
+struct DateField {
+  static constexpr std::size_t prefix = sizeof("Date: ") - 1;
+  static constexpr std::size_t size =
+      sizeof("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n") - 1;
+
+  std::time_t rendered = -1;
+  // Room for any year snprintf() might have to print.
+  char text[64];
+
+  void render(std::time_t now) {
+    static constexpr char const *days[] = {
+        "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static constexpr char const *months[] = {"Jan",
+                                             "Feb",
+                                             "Mar",
+                                             "Apr",
+                                             "May",
+                                             "Jun",
+                                             "Jul",
+                                             "Aug",
+                                             "Sep",
+                                             "Oct",
+                                             "Nov",
+                                             "Dec"};
+    std::tm tm;
+    gmtime_r(&now, &tm);
+    std::snprintf(text,
+                  sizeof(text),
+                  "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n",
+                  days[tm.tm_wday],
+                  tm.tm_mday,
+                  months[tm.tm_mon],
+                  tm.tm_year + 1900,
+                  tm.tm_hour,
+                  tm.tm_min,
+                  tm.tm_sec);
+    rendered = now;
+  }
+};
+
+DateField &current_date() {
+  thread_local DateField field;
+  auto now = std::time(nullptr);
+  if (now != field.rendered) {
+    field.render(now);
+  }
+  return field;
+}
+
+}  // namespace
+
+void append_status_line(std::string &head,
+                        unsigned int status,
+                        unsigned int version) {
+  if (status >= first_status && status <= last_status) {
+    auto const &table = status_table();
+    head.append((version >= 11 ? table.http11
+                               : table.http10)[status - first_status]);
+    return;
+  }
+  auto reason = http::obsolete_reason(static_cast<http::status>(status));
+  head.append(version >= 11 ? "HTTP/1.1 " : "HTTP/1.0 ")
+      .append(std::to_string(status))
+      .append(" ")
+      .append(reason.data(), reason.size())
+      .append("\r\n");
+}
+
+void append_field(std::string &head,
+                  std::string_view name,
+                  std::string_view value) {
+  head.append(name).append(": ").append(value).append("\r\n");
+}
+
+std::string_view date_field() {
+  return std::string_view(current_date().text, DateField::size);
+}
+
+std::string_view http_date() {
+  return date_field().substr(DateField::prefix,
+                             DateField::size - DateField::prefix - 2);
+}
+
+}  // namespace detail
+}  // namespace apee
@@ -0,0 +1,196 @@
+#include "apee.hpp"
+
+#include <boost/beast/core/string.hpp>
+#include <boost/beast/http/rfc7230.hpp>
+
+#include <charconv>
+#include <optional>
+
+namespace apee {
+
+namespace {
+
+// Upstream responses with a Content-Length up to this size are read whole
+// and sent in one write, larger ones and those of unknown length are
+// streamed.
+constexpr std::uint64_t max_buffered_size = 64 * 1024;
+
+boost::beast::string_view to_beast(std::string_view text) {
+  return boost::beast::string_view(text.data(), text.size());
+}
+
+// Whether a field is passed on: not one that only applies to a single
+// connection (RFC 9110, section 7.6.1), including those named by the
+// Connection field.
+bool forwarded(std::string_view name, std::string_view connection) {
+  static constexpr std::string_view hop_by_hop[] = {"Connection",
+                                                    "Keep-Alive",
+                                                    "Proxy-Connection",
+                                                    "Proxy-Authenticate",
+                                                    "Proxy-Authorization",
+                                                    "TE",
+                                                    "Trailer",
+                                                    "Transfer-Encoding",
+                                                    "Upgrade"};
+  for (auto field : hop_by_hop) {
+    if (boost::beast::iequals(to_beast(name), to_beast(field))) {
+      return false;
+    }
+  }
+  return connection.empty() ||
+         !boost::beast::http::token_list(to_beast(connection))
+              .exists(to_beast(name));
+}
+
+Response error_response(std::error_code const &ec) {
+  bool timeout = ec == std::errc::timed_out;
+  Response error(timeout ? StatusCode::GatewayTimeOut : StatusCode::BadGateway,
+                 std::string(timeout ? "Gateway timeout\r\n"
+                                     : "Bad gateway\r\n"));
+  error.set_header(Field::ContentType, "text/plain");
+  return error;
+}
+
+// The Content-Length of `headers` if it is at most max_buffered_size.
+std::optional<std::uint64_t> buffered_size(ResponseHeaders const &headers) {
+  auto length = headers[Field::ContentLength];
+  std::uint64_t size = 0;
+  auto end = length.data() + length.size();
+  if (length.empty() ||
+      std::from_chars(length.data(), end, size).ptr != end ||
+      size > max_buffered_size) {
+    return std::nullopt;
+  }
+  return size;
+}
+
+// A response whose body is read into memory before it is sent.
+struct Buffered {
+  std::shared_ptr<Responder> responder;
+  Response response;
+  AsyncStreamBody source;
+  std::string body;
+
+  static void read(std::shared_ptr<Buffered> const &buffered) {
+    buffered->source([buffered](std::error_code const &ec,
+                                std::string_view piece) {
+      if (ec) {
+        (*buffered->responder)(error_response(ec));
+      } else if (piece.empty()) {
+        buffered->response.payload() = std::move(buffered->body);
+        (*buffered->responder)(std::move(buffered->response));
+      } else {
+        buffered->body.append(piece);
+        read(buffered);
+      }
+    });
+  }
+};
+
+}  // namespace
+
+class ReverseProxy::impl {
+ public:
+  impl(std::string host, unsigned short port, ClientOptions const &options)
+      : m_host{std::move(host)}, m_port{port}, m_client{options} {}
+
+  // Sends `request` upstream with `body`, or the body of the request if it
+  // is not streamed, and answers with the upstream's response.
+  void forward(Request const &request,
+               AsyncStreamBody body,
+               Responder responder) {
+    ClientRequest upstream;
+    upstream.method = request.request_line().method();
+    upstream.target = std::string(request.request_line().uri());
+    auto const &headers = request.headers();
+    auto connection = headers[Field::Connection];
+    headers.for_each([&](std::string_view name, std::string_view value) {
+      // The Client sets the Host of the upstream, the Service answered any
+      // Expect already.
+      if (forwarded(name, connection) &&
+          !boost::beast::iequals(to_beast(name), "Host") &&
+          !boost::beast::iequals(to_beast(name), "Expect")) {
+        upstream.headers.add(name, value);
+      }
+    });
+    if (body) {
+      upstream.body_stream = std::move(body);
+    } else {
+      upstream.body = std::string(request.body().str());
+    }
+    bool head = upstream.method == Method::HEAD;
+    // The callback has to be copyable.
+    auto shared = std::make_shared<Responder>(std::move(responder));
+    m_client.stream(
+        m_host,
+        m_port,
+        std::move(upstream),
+        [shared, head](std::error_code const &ec,
+                       ClientResponse response,
+                       AsyncStreamBody body) {
+          if (ec) {
+            (*shared)(error_response(ec));
+            return;
+          }
+          auto status = response.status;
+          bool empty = head || status == StatusCode::NoContent ||
+                       status == StatusCode::NotModified;
+          auto size = buffered_size(response.headers);
+          auto answer = empty || size ? Response(status, std::string())
+                                      : Response(status, std::move(body));
+          auto const &fields = response.headers;
+          auto connection = fields[Field::Connection];
+          for (std::size_t i = 0; i < fields.size(); ++i) {
+            auto field = fields.entry(i);
+            // The Service sets the length of the body it sends. Answers to
+            // HEAD and NotModified keep that of the upstream, which is the
+            // length of its body for a GET.
+            if ((field.field != Field::ContentLength || head ||
+                 status == StatusCode::NotModified) &&
+                forwarded(field.name, connection)) {
+              answer.add_header(field.name, field.value);
+            }
+          }
+          if (empty || !size) {
+            (*shared)(std::move(answer));
+            return;
+          }
+          auto buffered = std::make_shared<Buffered>(
+              Buffered{shared, std::move(answer), std::move(body), {}});
+          buffered->body.reserve(*size);
+          Buffered::read(buffered);
+        });
+  }
+
+ private:
+  std::string m_host;
+  unsigned short m_port;
+  Client m_client;
+};
+
+ReverseProxy::ReverseProxy(std::string host,
+                           unsigned short port,
+                           ClientOptions const &options)
+    : d_ptr{std::make_unique<impl>(std::move(host), port, options)} {}
+
+ReverseProxy::~ReverseProxy() = default;
+
+void ReverseProxy::on_request_async(Request const &request,
+                                    Responder responder) {
+  d_ptr->forward(request, nullptr, std::move(responder));
+}
+
+bool ReverseProxy::stream_body(Request const &) { return true; }
+
+void ReverseProxy::on_request_stream(Request const &request,
+                                     BodyReader body,
+                                     Responder responder) {
+  d_ptr->forward(request,
+                 [body](std::function<void(std::error_code const &,
+                                           std::string_view)> next) mutable {
+                   body.read(std::move(next));
+                 },
+                 std::move(responder));
+}
+
+}  // namespace apee
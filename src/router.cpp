@@ -0,0 +1,287 @@
+#include "apee.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace apee {
+
+namespace {
+
+constexpr std::size_t method_count =
+    static_cast<std::size_t>(Method::TRACE) + 1;
+
+using Handlers = std::array<Router::Handler, method_count>;
+
+constexpr std::string_view method_names[method_count] = {
+    "", "DELETE", "GET", "HEAD", "POST", "PUT", "CONNECT", "OPTIONS", "TRACE"};
+
+bool any(Handlers const &handlers) {
+  return std::any_of(handlers.begin(),
+                     handlers.end(),
+                     [](Router::Handler const &h) { return bool(h); });
+}
+
+// The handler of `method`. HEAD falls back to GET, the connection drops the
+// body of the response.
+Router::Handler const *handler_for(Handlers const &handlers,
+                                   std::size_t method) {
+  constexpr auto get = static_cast<std::size_t>(Method::GET);
+  constexpr auto head = static_cast<std::size_t>(Method::HEAD);
+  if (handlers[method]) {
+    return &handlers[method];
+  }
+  if (method == head && handlers[get]) {
+    return &handlers[get];
+  }
+  return nullptr;
+}
+
+// Adds the methods of `handlers` to `allowed`, one bit per Method.
+void allow(Handlers const &handlers, unsigned int &allowed) {
+  for (std::size_t method = 0; method < method_count; ++method) {
+    if (handlers[method]) {
+      allowed |= 1u << method;
+    }
+  }
+}
+
+// The value of the Allow field of a MethodNotAllowed response.
+std::string allow_field(unsigned int allowed) {
+  if (allowed & 1u << static_cast<std::size_t>(Method::GET)) {
+    allowed |= 1u << static_cast<std::size_t>(Method::HEAD);
+  }
+  std::string field;
+  for (std::size_t method = 1; method < method_count; ++method) {
+    if (allowed & 1u << method) {
+      if (!field.empty()) {
+        field += ", ";
+      }
+      field += method_names[method];
+    }
+  }
+  return field;
+}
+
+// Splits `path` into segments. `pos` is the index where the next segment
+// begins, or npos once the path is exhausted.
+std::size_t first_segment(std::string_view path) {
+  return path.size() <= 1 ? std::string_view::npos : 1;
+}
+
+std::string_view segment(std::string_view path,
+                         std::size_t pos,
+                         std::size_t &next) {
+  auto end = path.find('/', pos);
+  next = end == std::string_view::npos ? end : end + 1;
+  return path.substr(pos, end - pos);
+}
+
+struct Node {
+  // Sorted by segment, searched with std::lower_bound.
+  std::vector<std::pair<std::string, std::unique_ptr<Node>>> literals;
+  std::unique_ptr<Node> param;
+  std::string param_name;
+  Handlers handlers;
+  Handlers wildcard;
+  std::string wildcard_name;
+
+  Node *literal(std::string_view segment) const {
+    auto it = std::lower_bound(
+        literals.begin(),
+        literals.end(),
+        segment,
+        [](auto const &child, std::string_view s) { return child.first < s; });
+    return it != literals.end() && it->first == segment ? it->second.get()
+                                                        : nullptr;
+  }
+};
+
+}  // namespace
+
+std::string_view RouteParams::operator[](std::string_view name) const {
+  for (auto const &param : *this) {
+    if (param.first == name) {
+      return param.second;
+    }
+  }
+  return {};
+}
+
+class Router::impl {
+  Node m_root;
+
+  // Depth-first search preferring literals over captures over wildcards.
+  // Collects in `allowed` the methods the path exists for otherwise. add()
+  // keeps routes within RouteParams::max_params captures, the checks of
+  // m_size only keep a capture from ever writing past them.
+  Handler const *find(Node const &node,
+                      std::string_view path,
+                      std::size_t pos,
+                      std::size_t method,
+                      RouteParams &params,
+                      unsigned int &allowed) const {
+    if (pos == std::string_view::npos) {
+      if (auto handler = handler_for(node.handlers, method)) {
+        return handler;
+      }
+      allow(node.handlers, allowed);
+    } else {
+      std::size_t next;
+      auto seg = segment(path, pos, next);
+      if (auto child = node.literal(seg)) {
+        if (auto handler =
+                find(*child, path, next, method, params, allowed)) {
+          return handler;
+        }
+      }
+      if (node.param && !seg.empty() &&
+          params.m_size < RouteParams::max_params) {
+        auto size = params.m_size;
+        params.m_params[params.m_size++] = {node.param_name, seg};
+        if (auto handler =
+                find(*node.param, path, next, method, params, allowed)) {
+          return handler;
+        }
+        params.m_size = size;
+      }
+    }
+    auto handler = params.m_size < RouteParams::max_params
+                       ? handler_for(node.wildcard, method)
+                       : nullptr;
+    if (handler) {
+      params.m_params[params.m_size++] = {
+          node.wildcard_name,
+          pos == std::string_view::npos ? std::string_view()
+                                        : path.substr(pos)};
+      return handler;
+    }
+    allow(node.wildcard, allowed);
+    return nullptr;
+  }
+
+ public:
+  void add(Method method, std::string_view pattern, Handler handler) {
+    if (pattern.empty() || pattern.front() != '/') {
+      throw std::invalid_argument("Route must start with '/': " +
+                                  std::string(pattern));
+    }
+    // The whole pattern is checked before the trie changes, a rejected
+    // route leaves no nodes behind.
+    auto index = static_cast<std::size_t>(method);
+    auto handlers = route(pattern, false);
+    if (handlers && (*handlers)[index]) {
+      throw std::invalid_argument("Duplicate route: " + std::string(pattern));
+    }
+    (*route(pattern, true))[index] = std::move(handler);
+  }
+
+  // The handlers of the node `pattern` leads to, null if that node does not
+  // exist and `create` is false. Throws for invalid patterns without
+  // changing the trie; with `create` the missing nodes are added.
+  Handlers *route(std::string_view pattern, bool create) {
+    Node *node = &m_root;
+    std::size_t captures = 0;
+    auto capture = [&] {
+      if (++captures > RouteParams::max_params) {
+        throw std::invalid_argument("Too many parameters in route: " +
+                                    std::string(pattern));
+      }
+    };
+    for (auto pos = first_segment(pattern); pos != std::string_view::npos;) {
+      std::size_t next;
+      auto seg = segment(pattern, pos, next);
+      if (!seg.empty() && seg.front() == '*') {
+        if (next != std::string_view::npos) {
+          throw std::invalid_argument("Wildcard must be the last segment: " +
+                                      std::string(pattern));
+        }
+        capture();
+        if (!node) {
+          return nullptr;
+        }
+        auto name = seg.substr(1);
+        if (any(node->wildcard) && node->wildcard_name != name) {
+          throw std::invalid_argument("Conflicting wildcard name in route: " +
+                                      std::string(pattern));
+        }
+        if (create) {
+          node->wildcard_name = name;
+        }
+        return &node->wildcard;
+      }
+      if (seg.size() > 1 && seg.front() == '{' && seg.back() == '}') {
+        capture();
+        auto name = seg.substr(1, seg.size() - 2);
+        if (node && node->param && node->param_name != name) {
+          throw std::invalid_argument("Conflicting parameter name in route: " +
+                                      std::string(pattern));
+        }
+        if (node && !node->param && create) {
+          node->param = std::make_unique<Node>();
+          node->param_name = name;
+        }
+        node = node ? node->param.get() : nullptr;
+      } else {
+        auto child = node ? node->literal(seg) : nullptr;
+        if (!child && node && create) {
+          auto it = std::lower_bound(node->literals.begin(),
+                                     node->literals.end(),
+                                     seg,
+                                     [](auto const &c, std::string_view s) {
+                                       return c.first < s;
+                                     });
+          child = node->literals
+                      .emplace(it, std::string(seg), std::make_unique<Node>())
+                      ->second.get();
+        }
+        node = child;
+      }
+      pos = next;
+    }
+    return node ? &node->handlers : nullptr;
+  }
+
+  Response dispatch(Request const &request) const {
+    auto const &line = request.request_line();
+    auto path = line.uri().substr(0, line.uri().find('?'));
+    RouteParams params;
+    unsigned int allowed = 0;
+    auto handler = find(m_root,
+                        path,
+                        first_segment(path),
+                        static_cast<std::size_t>(line.method()),
+                        params,
+                        allowed);
+    if (handler) {
+      return (*handler)(request, params);
+    }
+    if (allowed != 0) {
+      Response response(StatusCode::MethodNotAllowed,
+                        MessageBody("Method not allowed\r\n"));
+      response.set_header(Field::Allow, allow_field(allowed));
+      return response;
+    }
+    return Response(StatusCode::NotFound, MessageBody("File not found\r\n"));
+  }
+};
+
+Router::Router() : d_ptr{std::make_unique<impl>()} {}
+
+Router::~Router() = default;
+
+Router::Router(Router &&) noexcept = default;
+
+Router &Router::operator=(Router &&) noexcept = default;
+
+Router &Router::add(Method method, std::string_view pattern, Handler handler) {
+  d_ptr->add(method, pattern, std::move(handler));
+  return *this;
+}
+
+Response Router::on_request(Request const &request) {
+  return d_ptr->dispatch(request);
+}
+
+}  // namespace apee
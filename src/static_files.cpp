@@ -0,0 +1,421 @@
+#include "apee.hpp"
+#include "response_cache.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace apee {
+
+namespace {
+
+std::string_view content_type(std::string_view path) {
+  static std::pair<std::string_view, std::string_view> const types[] = {
+      {".html", "text/html"},
+      {".htm", "text/html"},
+      {".css", "text/css"},
+      {".js", "application/javascript"},
+      {".json", "application/json"},
+      {".txt", "text/plain"},
+      {".xml", "application/xml"},
+      {".svg", "image/svg+xml"},
+      {".png", "image/png"},
+      {".jpg", "image/jpeg"},
+      {".jpeg", "image/jpeg"},
+      {".gif", "image/gif"},
+      {".ico", "image/vnd.microsoft.icon"},
+      {".webp", "image/webp"},
+      {".woff", "font/woff"},
+      {".woff2", "font/woff2"},
+      {".wasm", "application/wasm"},
+      {".pdf", "application/pdf"},
+  };
+  auto dot = path.rfind('.');
+  if (dot != std::string_view::npos) {
+    auto ext = path.substr(dot);
+    for (auto const &type : types) {
+      if (type.first == ext) {
+        return type.second;
+      }
+    }
+  }
+  return "application/octet-stream";
+}
+
+std::string http_date(std::time_t time) {
+  std::tm tm;
+  gmtime_r(&time, &tm);
+  char buffer[64];
+  auto size =
+      std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return std::string(buffer, size);
+}
+
+bool parse_http_date(std::string_view value, std::time_t &time) {
+  std::tm tm{};
+  std::string copy(value);
+  auto end = strptime(copy.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (!end || *end != '\0') {
+    return false;
+  }
+  time = timegm(&tm);
+  return true;
+}
+
+int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Percent-decodes `uri` into a path relative to the root. Empty and "."
+// segments are dropped; ".." segments and NUL bytes are rejected so the
+// result can never leave the root.
+bool relative_path(std::string_view uri, std::string &path) {
+  std::string decoded;
+  decoded.reserve(uri.size());
+  for (std::size_t i = 0; i < uri.size(); ++i) {
+    if (uri[i] == '%' && i + 2 < uri.size()) {
+      int high = hex_value(uri[i + 1]);
+      int low = hex_value(uri[i + 2]);
+      if (high < 0 || low < 0) {
+        return false;
+      }
+      decoded.push_back(static_cast<char>(high * 16 + low));
+      i += 2;
+    } else {
+      decoded.push_back(uri[i]);
+    }
+  }
+  path.clear();
+  std::size_t pos = 0;
+  while (pos <= decoded.size()) {
+    auto end = decoded.find('/', pos);
+    if (end == std::string::npos) {
+      end = decoded.size();
+    }
+    std::string_view segment(decoded.data() + pos, end - pos);
+    if (segment == ".." || segment.find('\0') != std::string_view::npos) {
+      return false;
+    }
+    if (!segment.empty() && segment != ".") {
+      path.append("/").append(segment);
+    }
+    pos = end + 1;
+  }
+  return true;
+}
+
+enum class RangeResult { None, Satisfiable, Unsatisfiable };
+
+// Parses a single "bytes=first-last", "bytes=first-" or "bytes=-suffix"
+// range. Multiple ranges are not supported and serve the whole file.
+RangeResult parse_range(std::string_view header,
+                        std::uint64_t size,
+                        std::uint64_t &offset,
+                        std::uint64_t &length) {
+  constexpr std::string_view unit = "bytes=";
+  if (header.substr(0, unit.size()) != unit) {
+    return RangeResult::None;
+  }
+  auto spec = header.substr(unit.size());
+  auto dash = spec.find('-');
+  if (dash == std::string_view::npos ||
+      spec.find(',') != std::string_view::npos) {
+    return RangeResult::None;
+  }
+  auto number = [](std::string_view digits, std::uint64_t &value) {
+    if (digits.empty() || digits.size() > 19) {
+      return false;
+    }
+    value = 0;
+    for (char c : digits) {
+      if (c < '0' || c > '9') {
+        return false;
+      }
+      value = value * 10 + static_cast<std::uint64_t>(c - '0');
+    }
+    return true;
+  };
+  std::uint64_t first, last;
+  auto first_digits = spec.substr(0, dash);
+  auto last_digits = spec.substr(dash + 1);
+  if (first_digits.empty()) {
+    if (!number(last_digits, last)) {
+      return RangeResult::None;
+    }
+    if (last == 0 || size == 0) {
+      return RangeResult::Unsatisfiable;
+    }
+    length = std::min(last, size);
+    offset = size - length;
+    return RangeResult::Satisfiable;
+  }
+  if (!number(first_digits, first)) {
+    return RangeResult::None;
+  }
+  if (last_digits.empty()) {
+    last = size - 1;
+  } else if (!number(last_digits, last) || last < first) {
+    return RangeResult::None;
+  }
+  if (first >= size) {
+    return RangeResult::Unsatisfiable;
+  }
+  offset = first;
+  length = std::min(last, size - 1) - first + 1;
+  return RangeResult::Satisfiable;
+}
+
+struct File {
+  std::shared_ptr<int const> fd;
+  std::uint64_t size;
+  std::time_t mtime;
+  ino_t inode;
+  std::string etag;
+  std::string last_modified;
+  std::string_view content_type;
+  char const *data = nullptr;
+  // steady_clock ticks of the last check against the file system.
+  std::atomic<std::chrono::steady_clock::rep> checked;
+
+  ~File() {
+    if (data) {
+      ::munmap(const_cast<char *>(data), size);
+    }
+  }
+
+  bool unchanged(struct stat const &st) const {
+    return st.st_ino == inode && st.st_mtime == mtime &&
+           static_cast<std::uint64_t>(st.st_size) == size;
+  }
+};
+
+}  // namespace
+
+class StaticFiles::impl {
+  std::string m_root;
+  Options m_options;
+  std::mutex m_mutex;
+  // Most recently used first.
+  std::list<std::pair<std::string, std::shared_ptr<File>>> m_lru;
+  std::unordered_map<std::string_view, decltype(m_lru)::iterator> m_index;
+
+  std::shared_ptr<File> open(std::string const &path, bool &directory) {
+    auto body = FileBody(::open(path.c_str(), O_RDONLY | O_CLOEXEC), 0, 0);
+    struct stat st;
+    if (body.fd() < 0 || ::fstat(body.fd(), &st) != 0) {
+      return nullptr;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      directory = true;
+      return nullptr;
+    }
+    if (!S_ISREG(st.st_mode)) {
+      return nullptr;
+    }
+    auto file = std::make_shared<File>();
+    file->fd = body.shared_fd();
+    file->size = static_cast<std::uint64_t>(st.st_size);
+    file->mtime = st.st_mtime;
+    file->inode = st.st_ino;
+    char etag[64];
+    std::snprintf(etag,
+                  sizeof(etag),
+                  "\"%llx-%llx\"",
+                  static_cast<unsigned long long>(st.st_mtime),
+                  static_cast<unsigned long long>(st.st_size));
+    file->etag = etag;
+    file->last_modified = http_date(st.st_mtime);
+    file->content_type = content_type(path);
+    if (file->size > 0 && file->size <= m_options.mmap_limit) {
+      auto data =
+          ::mmap(nullptr, file->size, PROT_READ, MAP_PRIVATE, body.fd(), 0);
+      if (data != MAP_FAILED) {
+        file->data = static_cast<char const *>(data);
+      }
+    }
+    file->checked = std::chrono::steady_clock::now().time_since_epoch().count();
+    return file;
+  }
+
+  std::shared_ptr<File> cached(std::string const &path) {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    auto it = m_index.find(path);
+    if (it == m_index.end()) {
+      return nullptr;
+    }
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    return it->second->second;
+  }
+
+  void insert(std::string const &path, std::shared_ptr<File> file) {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    auto it = m_index.find(path);
+    if (it != m_index.end()) {
+      it->second->second = std::move(file);
+      m_lru.splice(m_lru.begin(), m_lru, it->second);
+      return;
+    }
+    m_lru.emplace_front(path, std::move(file));
+    m_index.emplace(m_lru.front().first, m_lru.begin());
+    while (m_lru.size() > m_options.cache_entries) {
+      m_index.erase(m_lru.back().first);
+      m_lru.pop_back();
+    }
+  }
+
+  void erase(std::string const &path) {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    auto it = m_index.find(path);
+    if (it != m_index.end()) {
+      m_lru.erase(it->second);
+      m_index.erase(it);
+    }
+  }
+
+  std::shared_ptr<File> lookup(std::string const &path, bool &directory) {
+    auto now = std::chrono::steady_clock::now();
+    auto file = cached(path);
+    if (file) {
+      std::chrono::steady_clock::time_point checked{
+          std::chrono::steady_clock::duration(file->checked)};
+      if (now - checked < m_options.revalidate_after) {
+        return file;
+      }
+      struct stat st;
+      if (::stat(path.c_str(), &st) == 0 && file->unchanged(st)) {
+        file->checked = now.time_since_epoch().count();
+        return file;
+      }
+      erase(path);
+    }
+    file = open(path, directory);
+    if (file) {
+      insert(path, file);
+    }
+    return file;
+  }
+
+ public:
+  impl(std::string root, Options const &options)
+      : m_root{std::move(root)}, m_options{options} {
+    while (!m_root.empty() && m_root.back() == '/') {
+      m_root.pop_back();
+    }
+    if (m_options.cache_entries == 0) {
+      m_options.cache_entries = 1;
+    }
+  }
+
+  Response on_request(Request const &request) {
+    auto uri = request.request_line().uri();
+    uri = uri.substr(0, uri.find('?'));
+    std::string_view prefix = m_options.prefix;
+    if (uri.substr(0, prefix.size()) != prefix) {
+      return Response(StatusCode::NotFound, MessageBody("File not found\r\n"));
+    }
+    return serve(request, uri.substr(prefix.size()));
+  }
+
+  Response serve(Request const &request, std::string_view uri) {
+    auto method = request.request_line().method();
+    if (method != Method::GET && method != Method::HEAD) {
+      return Response(StatusCode::MethodNotAllowed,
+                      MessageBody("Method not allowed\r\n"))
+          .set_header(Field::Allow, "GET, HEAD");
+    }
+    std::string path;
+    if (!relative_path(uri.substr(0, uri.find('?')), path)) {
+      return Response(StatusCode::BadRequest, MessageBody("Invalid path\r\n"));
+    }
+    path.insert(0, m_root);
+    bool directory = false;
+    auto file = lookup(path, directory);
+    if (!file && directory && !m_options.index.empty()) {
+      path.append("/").append(m_options.index);
+      file = lookup(path, directory);
+    }
+    if (!file) {
+      return Response(StatusCode::NotFound, MessageBody("File not found\r\n"));
+    }
+    return respond(request.headers(), file);
+  }
+
+  Response respond(Headers const &headers,
+                   std::shared_ptr<File> const &shared) {
+    auto const &file = *shared;
+    auto if_none_match = headers[Field::IfNoneMatch];
+    std::time_t since;
+    if ((!if_none_match.empty() &&
+         detail::etag_matches(if_none_match, file.etag)) ||
+        (if_none_match.empty() &&
+         parse_http_date(headers[Field::IfModifiedSince], since) &&
+         file.mtime <= since)) {
+      return Response(StatusCode::NotModified, MessageBody(""))
+          .set_header(Field::ETag, file.etag)
+          .set_header(Field::LastModified, file.last_modified);
+    }
+
+    std::uint64_t offset = 0;
+    std::uint64_t length = file.size;
+    auto status = StatusCode::OK;
+    auto range = RangeResult::None;
+    auto if_range = headers[Field::IfRange];
+    if (if_range.empty() || if_range == file.etag ||
+        if_range == file.last_modified) {
+      range = parse_range(headers[Field::Range], file.size, offset, length);
+    }
+    if (range == RangeResult::Unsatisfiable) {
+      return Response(StatusCode::RequestedRangeNotSatisfiable, MessageBody(""))
+          .set_header(Field::ContentRange,
+                      "bytes */" + std::to_string(file.size));
+    }
+    if (range == RangeResult::Satisfiable) {
+      status = StatusCode::PartialContent;
+    }
+
+    // A mapped file is sent from the mapping, which the body keeps alive.
+    auto response =
+        file.data
+            ? Response(status, SharedBody(shared, {file.data + offset, length}))
+            : Response(status, FileBody(file.fd, offset, length));
+    response.set_header(Field::ContentType, file.content_type)
+        .set_header(Field::ETag, file.etag)
+        .set_header(Field::LastModified, file.last_modified)
+        .set_header(Field::AcceptRanges, "bytes");
+    if (range == RangeResult::Satisfiable) {
+      response.set_header(Field::ContentRange,
+                          "bytes " + std::to_string(offset) + "-" +
+                              std::to_string(offset + length - 1) + "/" +
+                              std::to_string(file.size));
+    }
+    return response;
+  }
+};
+
+StaticFiles::StaticFiles(std::string root)
+    : StaticFiles(std::move(root), Options()) {}
+
+StaticFiles::StaticFiles(std::string root, Options const &options)
+    : d_ptr{std::make_unique<impl>(std::move(root), options)} {}
+
+StaticFiles::~StaticFiles() = default;
+
+Response StaticFiles::on_request(Request const &request) {
+  return d_ptr->on_request(request);
+}
+
+Response StaticFiles::serve(Request const &request, std::string_view path) {
+  return d_ptr->serve(request, path);
+}
+
+}  // namespace apee
@@ -0,0 +1,113 @@
+#include "timer_wheel.hpp"
+
+namespace apee {
+
+boost::asio::execution_context::id TimerWheel::id;
+
+constexpr std::chrono::milliseconds TimerWheel::resolution;
+
+TimerWheel::TimerWheel(boost::asio::execution_context &context)
+    : boost::asio::execution_context::service(context),
+      m_slots(slot_count, nullptr),
+      m_ticker(static_cast<boost::asio::io_context &>(context)) {}
+
+void TimerWheel::shutdown() {
+  std::lock_guard<std::mutex> lock{m_mutex};
+  boost::system::error_code ec;
+  m_ticker.cancel(ec);
+}
+
+void TimerWheel::arm(Timer &timer, Clock::duration timeout) {
+  // One tick is added because the current tick is already partly over.
+  auto ticks = static_cast<std::size_t>(
+      (timeout + resolution - Clock::duration(1)) / resolution + 1);
+  std::lock_guard<std::mutex> lock{m_mutex};
+  if (timer.m_armed) {
+    unlink(timer);
+  }
+  ++timer.m_generation;
+  link(timer, ticks);
+  if (!m_ticking) {
+    m_ticking = true;
+    m_next_tick = Clock::now();
+    schedule_tick();
+  }
+}
+
+void TimerWheel::cancel(Timer &timer) {
+  std::lock_guard<std::mutex> lock{m_mutex};
+  ++timer.m_generation;
+  if (timer.m_armed) {
+    unlink(timer);
+  }
+}
+
+void TimerWheel::link(Timer &timer, std::size_t ticks) {
+  timer.m_slot = (m_current + ticks) % slot_count;
+  timer.m_rounds = (ticks - 1) / slot_count;
+  timer.m_prev = nullptr;
+  timer.m_next = m_slots[timer.m_slot];
+  if (timer.m_next) {
+    timer.m_next->m_prev = &timer;
+  }
+  m_slots[timer.m_slot] = &timer;
+  timer.m_armed = true;
+  ++m_armed;
+}
+
+void TimerWheel::unlink(Timer &timer) {
+  if (timer.m_prev) {
+    timer.m_prev->m_next = timer.m_next;
+  } else {
+    m_slots[timer.m_slot] = timer.m_next;
+  }
+  if (timer.m_next) {
+    timer.m_next->m_prev = timer.m_prev;
+  }
+  timer.m_prev = timer.m_next = nullptr;
+  timer.m_armed = false;
+  --m_armed;
+}
+
+void TimerWheel::schedule_tick() {
+  m_next_tick += resolution;
+  m_ticker.expires_at(m_next_tick);
+  m_ticker.async_wait([this](boost::system::error_code ec) {
+    if (!ec) {
+      tick();
+    }
+  });
+}
+
+void TimerWheel::tick() {
+  {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_current = (m_current + 1) % slot_count;
+    for (auto timer = m_slots[m_current]; timer;) {
+      auto next = timer->m_next;
+      if (timer->m_rounds > 0) {
+        --timer->m_rounds;
+      } else {
+        unlink(*timer);
+        // An owner that is being destroyed has no use for the expiry.
+        if (auto owner = timer->m_owner.lock()) {
+          m_expired.push_back(
+              {std::move(owner), timer->m_callback, timer->m_generation});
+        }
+      }
+      timer = next;
+    }
+  }
+  for (auto const &expiry : m_expired) {
+    expiry.callback(expiry.owner, expiry.generation);
+  }
+  m_expired.clear();
+  std::lock_guard<std::mutex> lock{m_mutex};
+  if (m_armed > 0) {
+    schedule_tick();
+  } else {
+    m_ticking = false;
+  }
+}
+
+}  // namespace apee
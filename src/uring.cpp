@@ -0,0 +1,550 @@
+#include "uring.hpp"
+#include "log.hpp"
+#include "recycling_allocator.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <utility>
+
+#ifdef APEE_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace apee {
+namespace detail {
+
+boost::asio::execution_context::id Ring::id;
+
+void RingStream::Slot::complete(int result, bool) {
+  boost::system::error_code ec;
+  std::size_t size = 0;
+  if (result == -ECANCELED) {
+    ec = boost::asio::error::operation_aborted;
+  } else if (result < 0) {
+    ec.assign(-result, boost::system::system_category());
+  } else if (m_read && result == 0) {
+    ec = boost::asio::error::eof;
+  } else {
+    size = static_cast<std::size_t>(result);
+  }
+  std::exchange(m_handler, nullptr)->invoke(ec, size);
+}
+
+Ring::Disposable *RingStream::Slot::abandon() {
+  return std::exchange(m_handler, nullptr);
+}
+
+Ring::Ring(boost::asio::execution_context &context)
+    : boost::asio::execution_context::service(context),
+      m_context(static_cast<boost::asio::io_context &>(context)),
+      m_descriptor(m_context) {}
+
+void Ring::link(Operation &operation) {
+  operation.m_prev = nullptr;
+  operation.m_next = m_pending;
+  if (m_pending) {
+    m_pending->m_prev = &operation;
+  }
+  m_pending = &operation;
+  operation.m_pending.store(true, std::memory_order_release);
+}
+
+void Ring::unlink(Operation &operation) {
+  if (operation.m_prev) {
+    operation.m_prev->m_next = operation.m_next;
+  } else {
+    m_pending = operation.m_next;
+  }
+  if (operation.m_next) {
+    operation.m_next->m_prev = operation.m_prev;
+  }
+  operation.m_prev = operation.m_next = nullptr;
+  operation.m_pending.store(false, std::memory_order_release);
+}
+
+void Ring::forget(Operation &operation) {
+  std::lock_guard<std::mutex> lock{m_mutex};
+  if (operation.pending()) {
+    unlink(operation);
+  }
+}
+
+char *Ring::acquire_buffer() {
+  std::lock_guard<std::mutex> lock{m_mutex};
+  if (m_free_buffers.empty()) {
+    return nullptr;
+  }
+  auto buffer = m_free_buffers.back();
+  m_free_buffers.pop_back();
+  return buffer;
+}
+
+void Ring::release_buffer(char *buffer) {
+  std::lock_guard<std::mutex> lock{m_mutex};
+  m_free_buffers.push_back(buffer);
+}
+
+void Ring::shutdown() {
+  // Disposing of a handler may release its connection, together with the
+  // other operations of that connection, so all are abandoned first.
+  std::vector<Disposable *> abandoned;
+  {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    while (m_pending) {
+      auto operation = m_pending;
+      unlink(*operation);
+      if (auto disposable = operation->abandon()) {
+        abandoned.push_back(disposable);
+      }
+    }
+  }
+  for (auto disposable : abandoned) {
+    disposable->dispose();
+  }
+  boost::system::error_code ec;
+  m_descriptor.cancel(ec);
+}
+
+#ifdef APEE_HAVE_IO_URING
+
+namespace {
+
+// Completions handed to their operations per round, the rest are reaped
+// in the next one.
+constexpr std::size_t reap_batch = 64;
+
+void *map(std::size_t size, int fd, off_t offset) {
+  auto p = ::mmap(nullptr,
+                  size,
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE,
+                  fd,
+                  offset);
+  return p == MAP_FAILED ? nullptr : p;
+}
+
+}  // namespace
+
+// The rings shared with the kernel.
+struct Ring::Queues {
+  void *sq_ring = nullptr;
+  std::size_t sq_ring_size = 0;
+  void *cq_ring = nullptr;
+  std::size_t cq_ring_size = 0;
+  io_uring_sqe *sqes = nullptr;
+  std::size_t sqes_size = 0;
+
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_flags;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  unsigned int *sq_array;
+  // Entries up to here are filled, those from *sq_head on not yet taken by
+  // the kernel.
+  unsigned int sq_local_tail;
+
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int cq_mask;
+  io_uring_cqe *cqes;
+
+  ~Queues() {
+    if (sqes) {
+      ::munmap(sqes, sqes_size);
+    }
+    if (cq_ring && cq_ring != sq_ring) {
+      ::munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring) {
+      ::munmap(sq_ring, sq_ring_size);
+    }
+  }
+
+  bool map(int fd, io_uring_params const &params) {
+    auto &sq = params.sq_off;
+    auto &cq = params.cq_off;
+    sq_ring_size = sq.array + params.sq_entries * sizeof(unsigned int);
+    cq_ring_size = cq.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+      sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = detail::map(sq_ring_size, fd, IORING_OFF_SQ_RING);
+    if (!sq_ring) {
+      return false;
+    }
+    cq_ring =
+        single ? sq_ring : detail::map(cq_ring_size, fd, IORING_OFF_CQ_RING);
+    if (!cq_ring) {
+      return false;
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(
+        detail::map(sqes_size, fd, IORING_OFF_SQES));
+    if (!sqes) {
+      return false;
+    }
+    auto sq_base = static_cast<char *>(sq_ring);
+    auto cq_base = static_cast<char *>(cq_ring);
+    sq_head = reinterpret_cast<unsigned int *>(sq_base + sq.head);
+    sq_tail = reinterpret_cast<unsigned int *>(sq_base + sq.tail);
+    sq_flags = reinterpret_cast<unsigned int *>(sq_base + sq.flags);
+    sq_mask = *reinterpret_cast<unsigned int *>(sq_base + sq.ring_mask);
+    sq_entries = *reinterpret_cast<unsigned int *>(sq_base + sq.ring_entries);
+    sq_array = reinterpret_cast<unsigned int *>(sq_base + sq.array);
+    sq_local_tail = *sq_tail;
+    cq_head = reinterpret_cast<unsigned int *>(cq_base + cq.head);
+    cq_tail = reinterpret_cast<unsigned int *>(cq_base + cq.tail);
+    cq_mask = *reinterpret_cast<unsigned int *>(cq_base + cq.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq_base + cq.cqes);
+    return true;
+  }
+};
+
+Ring::~Ring() {
+  if (m_fd < 0) {
+    return;
+  }
+  m_descriptor.release();
+  m_queues.reset();
+  // Closing the ring drops the registration of the buffers.
+  ::close(m_fd);
+  if (m_buffers) {
+    ::munmap(m_buffers, m_buffer_count * m_buffer_size);
+  }
+}
+
+bool Ring::start(unsigned int entries,
+                 std::size_t buffers,
+                 std::size_t buffer_size) {
+  io_uring_params params{};
+  params.flags = IORING_SETUP_CLAMP;
+  int fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+  if (fd < 0) {
+    return false;
+  }
+  auto queues = std::make_unique<Queues>();
+  if (!queues->map(fd, params)) {
+    int error = errno;
+    queues.reset();
+    ::close(fd);
+    errno = error;
+    return false;
+  }
+  m_fd = fd;
+  m_queues = std::move(queues);
+  m_descriptor.assign(fd);
+  m_buffer_size = buffer_size;
+  if (buffers > 0 && buffer_size > 0) {
+    // One region registered as buffer 0, reads into any part of it are
+    // fixed reads.
+    auto size = buffers * buffer_size;
+    auto p = ::mmap(nullptr,
+                    size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1,
+                    0);
+    iovec region{p, size};
+    if (p != MAP_FAILED &&
+        ::syscall(
+            __NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, &region, 1) ==
+            0) {
+      m_buffers = static_cast<char *>(p);
+      m_buffer_count = buffers;
+      m_free_buffers.reserve(buffers);
+      for (auto i = buffers; i > 0; --i) {
+        m_free_buffers.push_back(m_buffers + (i - 1) * buffer_size);
+      }
+    } else {
+      APEE_LOG("io_uring", warning)
+          << "Could not register " << buffers
+          << " read buffers: " << std::strerror(errno);
+      if (p != MAP_FAILED) {
+        ::munmap(p, size);
+      }
+    }
+  }
+  wait();
+  return true;
+}
+
+io_uring_sqe *Ring::next_entry(std::unique_lock<std::mutex> &lock,
+                               Operation *operation) {
+  auto &queues = *m_queues;
+  while (queues.sq_local_tail -
+             __atomic_load_n(queues.sq_head, __ATOMIC_ACQUIRE) ==
+         queues.sq_entries) {
+    if (submit(queues.sq_entries) >= 0) {
+      continue;
+    }
+    if (errno != EBUSY && errno != EAGAIN) {
+      auto error = errno;
+      APEE_LOG("io_uring", error) << "Submitting: " << std::strerror(error);
+      if (operation) {
+        link(*operation);
+        m_deferred.push_back({operation, -error, false});
+        boost::asio::post(m_context, recycling([this] { reap(); }));
+      }
+      return nullptr;
+    }
+    // The kernel takes more once there is room for completions. They are
+    // taken off the queue here, but handed to their operations by reap()
+    // rather than while one is being queued.
+    Completion completions[reap_batch];
+    auto count = take(completions, reap_batch);
+    if (count > 0) {
+      m_deferred.insert(m_deferred.end(), completions, completions + count);
+      boost::asio::post(m_context, recycling([this] { reap(); }));
+    } else if (!flush_overflow()) {
+      // Nothing to take, other threads get to submit and reap meanwhile.
+      lock.unlock();
+      std::this_thread::yield();
+      lock.lock();
+    }
+  }
+  auto entry = &queues.sqes[queues.sq_local_tail & queues.sq_mask];
+  std::memset(entry, 0, sizeof(*entry));
+  entry->user_data = reinterpret_cast<std::uintptr_t>(operation);
+  if (operation) {
+    link(*operation);
+  }
+  return entry;
+}
+
+void Ring::push() {
+  auto &queues = *m_queues;
+  auto index = queues.sq_local_tail & queues.sq_mask;
+  queues.sq_array[index] = index;
+  ++queues.sq_local_tail;
+  __atomic_store_n(queues.sq_tail, queues.sq_local_tail, __ATOMIC_RELEASE);
+  // The handlers that are ready run before the flush, so what they submit
+  // goes to the kernel together.
+  if (!m_flush_posted) {
+    m_flush_posted = true;
+    boost::asio::post(m_context, recycling([this] { flush(); }));
+  }
+}
+
+int Ring::submit(unsigned int count) {
+  int result;
+  do {
+    result = static_cast<int>(
+        ::syscall(__NR_io_uring_enter, m_fd, count, 0, 0, nullptr, 0));
+  } while (result < 0 && errno == EINTR);
+  return result;
+}
+
+void Ring::flush() {
+  {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_flush_posted = false;
+    auto &queues = *m_queues;
+    auto count = queues.sq_local_tail -
+                 __atomic_load_n(queues.sq_head, __ATOMIC_ACQUIRE);
+    if (count > 0) {
+      auto taken = submit(count);
+      if (taken < 0 && errno != EBUSY && errno != EAGAIN) {
+        APEE_LOG("io_uring", error) << "Submitting: " << std::strerror(errno);
+      } else if (taken < static_cast<int>(count)) {
+        // The kernel takes more once completions have been reaped.
+        m_flush_posted = true;
+        boost::asio::post(m_context, recycling([this] { flush(); }));
+      }
+    }
+  }
+  // Operations that completed right away, such as most sends, are handled
+  // without waiting for the descriptor.
+  if (ready()) {
+    reap();
+  }
+}
+
+bool Ring::ready() const {
+  auto &queues = *m_queues;
+  return __atomic_load_n(queues.cq_tail, __ATOMIC_ACQUIRE) !=
+         __atomic_load_n(queues.cq_head, __ATOMIC_RELAXED);
+}
+
+void Ring::wait() {
+  m_descriptor.async_wait(
+      boost::asio::posix::descriptor_base::wait_read,
+      recycling([this](boost::system::error_code ec) {
+        if (!ec) {
+          reap();
+          wait();
+        }
+      }));
+  // The descriptor is watched edge-triggered: completions that arrived
+  // since the last reap would not wake the wait.
+  if (ready()) {
+    boost::asio::post(m_context, recycling([this] { reap(); }));
+  }
+}
+
+void Ring::reap() {
+  Completion completions[reap_batch];
+  std::vector<Completion> deferred;
+  std::size_t count;
+  do {
+    {
+      std::lock_guard<std::mutex> lock{m_mutex};
+      deferred.swap(m_deferred);
+      count = take(completions, reap_batch);
+      for (auto const &completion : deferred) {
+        if (!completion.more) {
+          unlink(*completion.operation);
+        }
+      }
+      for (std::size_t i = 0; i < count; ++i) {
+        if (!completions[i].more) {
+          unlink(*completions[i].operation);
+        }
+      }
+    }
+    for (auto const &completion : deferred) {
+      completion.operation->complete(completion.result, completion.more);
+    }
+    deferred.clear();
+    for (std::size_t i = 0; i < count; ++i) {
+      auto const &completion = completions[i];
+      completion.operation->complete(completion.result, completion.more);
+    }
+  } while (count == reap_batch || flush_overflow());
+}
+
+bool Ring::flush_overflow() {
+  auto &queues = *m_queues;
+  if ((__atomic_load_n(queues.sq_flags, __ATOMIC_ACQUIRE) &
+       IORING_SQ_CQ_OVERFLOW) == 0) {
+    return false;
+  }
+  int result;
+  do {
+    result = static_cast<int>(::syscall(
+        __NR_io_uring_enter, m_fd, 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0));
+  } while (result < 0 && errno == EINTR);
+  return ready();
+}
+
+std::size_t Ring::take(Completion *out, std::size_t count) {
+  auto &queues = *m_queues;
+  auto head = *queues.cq_head;
+  auto tail = __atomic_load_n(queues.cq_tail, __ATOMIC_ACQUIRE);
+  std::size_t taken = 0;
+  for (; head != tail && taken < count; ++head) {
+    auto const &entry = queues.cqes[head & queues.cq_mask];
+    if (auto operation = reinterpret_cast<Operation *>(entry.user_data)) {
+      bool more = (entry.flags & IORING_CQE_F_MORE) != 0;
+      out[taken++] = {operation, entry.res, more};
+    }
+  }
+  __atomic_store_n(queues.cq_head, head, __ATOMIC_RELEASE);
+  return taken;
+}
+
+void Ring::read(Operation &operation, int fd, void *data, std::size_t size) {
+  std::unique_lock<std::mutex> lock{m_mutex};
+  auto entry = next_entry(lock, &operation);
+  if (!entry) {
+    return;
+  }
+  auto p = static_cast<char *>(data);
+  if (m_buffers && p >= m_buffers &&
+      p + size <= m_buffers + m_buffer_count * m_buffer_size) {
+    entry->opcode = IORING_OP_READ_FIXED;
+    entry->buf_index = 0;
+  } else {
+    entry->opcode = IORING_OP_RECV;
+  }
+  entry->fd = fd;
+  entry->addr = reinterpret_cast<std::uintptr_t>(data);
+  entry->len = static_cast<std::uint32_t>(size);
+  push();
+}
+
+void Ring::send(Operation &operation, int fd, msghdr const &message) {
+  std::unique_lock<std::mutex> lock{m_mutex};
+  auto entry = next_entry(lock, &operation);
+  if (!entry) {
+    return;
+  }
+  entry->opcode = IORING_OP_SENDMSG;
+  entry->fd = fd;
+  entry->addr = reinterpret_cast<std::uintptr_t>(&message);
+  entry->len = 1;
+  entry->msg_flags = MSG_NOSIGNAL;
+  push();
+}
+
+void Ring::poll(Operation &operation, int fd, short events) {
+  std::unique_lock<std::mutex> lock{m_mutex};
+  auto entry = next_entry(lock, &operation);
+  if (!entry) {
+    return;
+  }
+  entry->opcode = IORING_OP_POLL_ADD;
+  entry->fd = fd;
+  std::uint32_t mask = static_cast<std::uint16_t>(events);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  mask = (mask << 16) | (mask >> 16);
+#endif
+  entry->poll32_events = mask;
+  push();
+}
+
+void Ring::accept(Operation &operation, int fd, bool multishot) {
+  std::unique_lock<std::mutex> lock{m_mutex};
+  auto entry = next_entry(lock, &operation);
+  if (!entry) {
+    return;
+  }
+  entry->opcode = IORING_OP_ACCEPT;
+  entry->fd = fd;
+  entry->accept_flags = SOCK_CLOEXEC;
+  if (multishot) {
+    entry->ioprio |= IORING_ACCEPT_MULTISHOT;
+  }
+  push();
+}
+
+void Ring::cancel(Operation &operation) {
+  std::unique_lock<std::mutex> lock{m_mutex};
+  auto entry = next_entry(lock, nullptr);
+  if (!entry) {
+    return;
+  }
+  entry->opcode = IORING_OP_ASYNC_CANCEL;
+  entry->fd = -1;
+  entry->addr = reinterpret_cast<std::uintptr_t>(&operation);
+  push();
+}
+
+#else
+
+// Without io_uring support start() fails and nothing is ever submitted.
+struct Ring::Queues {};
+
+Ring::~Ring() = default;
+
+bool Ring::start(unsigned int, std::size_t, std::size_t) {
+  errno = ENOSYS;
+  return false;
+}
+
+void Ring::read(Operation &, int, void *, std::size_t) {}
+void Ring::send(Operation &, int, msghdr const &) {}
+void Ring::poll(Operation &, int, short) {}
+void Ring::accept(Operation &, int, bool) {}
+void Ring::cancel(Operation &) {}
+
+#endif
+
+}  // namespace detail
+}  // namespace apee
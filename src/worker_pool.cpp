@@ -0,0 +1,93 @@
+#include "worker_pool.hpp"
+
+#include <algorithm>
+
+namespace apee {
+
+WorkerPool::WorkerPool(unsigned int threads)
+    : m_size{std::max(1u, threads)}, m_queues{new Queue[m_size]} {
+  for (std::size_t i = 0; i < m_size; ++i) {
+    m_threads.emplace_back([this, i] { work(i); });
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_stopping = true;
+  }
+  m_ready.notify_all();
+  for (auto &thread : m_threads) {
+    thread.join();
+  }
+}
+
+void WorkerPool::submit(Task &task) {
+  // Counted first, so that the count never drops below zero when a worker
+  // takes the task right away.
+  m_queued.fetch_add(1);
+  auto &queue =
+      m_queues[m_next.fetch_add(1, std::memory_order_relaxed) % m_size];
+  {
+    std::lock_guard<std::mutex> lock{queue.mutex};
+    task.m_next_task = nullptr;
+    if (queue.tail) {
+      queue.tail->m_next_task = &task;
+    } else {
+      queue.head = &task;
+    }
+    queue.tail = &task;
+  }
+  // Sequentially consistent with the increment and load in work(), so that
+  // either the worker sees the task or this sees the worker asleep.
+  if (m_sleeping.load() > 0) {
+    // The lock waits out a worker between its check and its wait.
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_ready.notify_one();
+  }
+}
+
+void WorkerPool::work(std::size_t index) {
+  for (;;) {
+    if (auto task = take(index)) {
+      task->run();
+      m_completed.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_sleeping.fetch_add(1);
+    m_ready.wait(lock, [this] { return m_stopping || m_queued.load() > 0; });
+    m_sleeping.fetch_sub(1);
+    if (m_stopping && m_queued.load() == 0) {
+      return;
+    }
+  }
+}
+
+WorkerPool::Task *WorkerPool::take(std::size_t index) {
+  if (auto task = pop(m_queues[index])) {
+    return task;
+  }
+  for (std::size_t i = 1; i < m_size; ++i) {
+    if (auto task = pop(m_queues[(index + i) % m_size])) {
+      m_steals.fetch_add(1, std::memory_order_relaxed);
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+WorkerPool::Task *WorkerPool::pop(Queue &queue) {
+  std::lock_guard<std::mutex> lock{queue.mutex};
+  auto task = queue.head;
+  if (task) {
+    queue.head = task->m_next_task;
+    if (!queue.head) {
+      queue.tail = nullptr;
+    }
+    m_queued.fetch_sub(1, std::memory_order_relaxed);
+  }
+  return task;
+}
+
+}  // namespace apee